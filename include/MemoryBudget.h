@@ -0,0 +1,92 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+/*------------------------------------------------------------------------------------*/
+/* Memory Budget                                                                      */
+/*------------------------------------------------------------------------------------*/
+// Size of every buffer the firmware uses at run time. The libraries include this header
+// before their own defaults, so every translation unit sees the same sizes. Nothing is
+// taken from the heap once setup() is done (HEAP_CHECK=1 checks it, see HeapCheck): RAM
+// use is fixed at link time and the heap is left to the file system and the network
+// stack. The static RAM of each subsystem is listed after every build
+// (scripts/ram_report.py).
+
+// Zones and schedule
+#define MAX_ZONES 8
+#define MAX_START_TIMES 4
+#define DRIP_STATE_MAX_ZONES MAX_ZONES
+#define EVENT_SCHEDULER_CAPACITY 16        // Timed events pending at once
+
+// Persistent configuration and time zone
+#define CONFIG_JOURNAL_MAX_FIELDS 24
+#define CONFIG_JOURNAL_MAX_LENGTH 64       // Largest field value in bytes
+#define TIME_ZONE_MAX_LENGTH 48            // Longest POSIX TZ rule, terminator included
+#define BOOT_CHECKPOINT_SIZE 384           // RTC user memory after the 128 bytes OTA uses
+
+// Flow
+#define FLOW_SERIES_CAPACITY 180           // Seconds of samples kept while unpublished
+#define FLOW_HISTORY_CHUNK_RECORDS 1024    // 12 KB chunk files
+#define FLOW_HISTORY_MAX_CHUNKS 48         // About a year of daily drips
+#define PULSE_RATE_RING_SIZE 32            // Pulse timestamps waiting for loop(). Power of 2
+
+// Log and metrics
+#define LOG_RING_SIZE 2048                 // Bytes of RAM holding the most recent records
+#define LOG_RING_MAX_STRING 48             // String arguments are truncated to this length
+#define LOG_LINE_SIZE 160                  // Longer log lines are truncated
+#define LOOP_METRICS_MAX_STAGES 10
+#define INPUT_TRACE_SIZE 4096              // Bytes of RAM holding the most recent trace records
+
+// Fleet
+#define FLEET_GROUP_SIZE 17                // Group name, terminator included
+#define FLEET_MAX_PEERS 16                 // Other controllers of the group tracked at once
+
+// Outbox
+#define MQTT_OUTBOX_SLOTS 16               // Messages held in RAM
+#define MQTT_OUTBOX_MAX_SPILLED 256        // Messages held on flash once RAM is full
+#define MQTT_OUTBOX_PAYLOAD 90             // Longest payload
+
+// MQTT messages, composed on the stack. Each one must fit MQTT_MAX_PACKET_SIZE, the
+// buffer of the client, with the header and topic.
+#define MQTT_CLIENT_ID_SIZE 24
+#define MQTT_TOPIC_SIZE 64                 // Longest topic, terminator included
+#define STATE_MESSAGE_SIZE 192
+#define METRICS_MESSAGE_SIZE 400
+#define LOG_MESSAGE_SIZE 400
+#define FLOW_SERIES_MESSAGE_SIZE 256
+#define FLOW_HISTORY_MESSAGE_SIZE 200
+#define ALARM_MESSAGE_SIZE 20
+#define ERROR_MESSAGE_SIZE 40
+#define FLEET_CLAIM_MESSAGE_SIZE 80
+#define BOOT_MESSAGE_SIZE 160
+#define TRACE_MESSAGE_SIZE 256
+
+// Display
+#define LCD_LINE_SIZE 17                   // 16 columns and the terminator
+
+// Web server. One connection at a time, JSON bodies go out a chunk at a time.
+#define HTTP_LINE_SIZE 128                 // Request and header lines. Longer headers are skipped
+#define HTTP_PATH_SIZE 64                  // Path and query
+#define HTTP_BODY_SIZE 64                  // Largest request body, a command message
+#define HTTP_CHUNK_SIZE 256                // Response head, then each chunk of a body
+
+// TLS to the broker (MQTT_TLS=1). BearSSL takes these from the heap while connected,
+// see MqttTls. The largest MQTT message is a little under MQTT_MAX_PACKET_SIZE.
+#define MQTT_TLS_FRAGMENT_SIZE 512         // Record size asked of the broker
+#define MQTT_TLS_SEND_SIZE 512             // Records the client sends
+#define MQTT_TLS_CONTEXT_HEAP 7000         // Client and X.509 contexts, about
+#define MQTT_TLS_HEAP_RESERVE 6000         // Heap left to lwIP and the file system once connected
+
+#ifdef MQTT_MAX_PACKET_SIZE
+static_assert(STATE_MESSAGE_SIZE < MQTT_MAX_PACKET_SIZE - 64 &&
+  METRICS_MESSAGE_SIZE < MQTT_MAX_PACKET_SIZE - 64 &&
+  LOG_MESSAGE_SIZE < MQTT_MAX_PACKET_SIZE - 64 &&
+  FLOW_SERIES_MESSAGE_SIZE < MQTT_MAX_PACKET_SIZE - 64 &&
+  FLOW_HISTORY_MESSAGE_SIZE < MQTT_MAX_PACKET_SIZE - 64 &&
+  BOOT_MESSAGE_SIZE < MQTT_MAX_PACKET_SIZE - 64 &&
+  TRACE_MESSAGE_SIZE < MQTT_MAX_PACKET_SIZE - 64, "MQTT message larger than the client buffer");
+#endif
+// Bodies of the web API are the state and flow history messages, in one chunk each
+static_assert(STATE_MESSAGE_SIZE <= HTTP_CHUNK_SIZE - 8 && FLOW_HISTORY_MESSAGE_SIZE <= HTTP_CHUNK_SIZE - 8,
+  "Web API body larger than a chunk");
+
+#endif // MEMORY_BUDGET_H
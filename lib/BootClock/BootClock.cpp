@@ -0,0 +1,75 @@
+#include "BootClock.h"
+#include <Crc16.h>
+#include <string.h>
+
+BootClock::BootClock():
+  _source(Source::none),
+  _bootSource(Source::none),
+  _estimate(0),
+  _estimatedAtMs(0),
+  _bootStep(0),
+  _scheduledMs(0),
+  _networkMs(0),
+  _syncedMs(0) {
+}
+
+time_t BootClock::restore(time_t rtcTime, time_t flashTime, uint32_t nowMs) {
+  // RTC memory is written more often. Flash wins only if RTC memory is older, e.g. left
+  // from before an update that did not write it.
+  if (rtcTime && rtcTime >= flashTime) {
+    _source = Source::rtc;
+    _estimate = rtcTime;
+  } else if (flashTime) {
+    _source = Source::flash;
+    _estimate = flashTime;
+  } else {
+    return 0;
+  }
+  _bootSource = _source;
+  _estimatedAtMs = nowMs;
+  return _estimate;
+}
+
+int32_t BootClock::sync(time_t time, uint32_t nowMs) {
+  // Not set, the clock counted from 0 at reset
+  int32_t step = (int32_t) (time - _estimate - (time_t) ((nowMs - _estimatedAtMs) / 1000));
+  _estimate = time;
+  _estimatedAtMs = nowMs;
+  if (!_syncedMs) {
+    _syncedMs = nowMs ? nowMs : 1;
+    _bootStep = _bootSource != Source::none ? step : 0;
+  }
+  _source = Source::ntp;
+  return step;
+}
+
+const char *BootClock::toString(Source source) {
+  static const char *NAMES[] = { "none", "flash", "rtc", "ntp" };
+  return NAMES[(uint8_t) source];
+}
+
+size_t BootClock::encode(time_t time, const void *state, size_t size, uint32_t *words, size_t capacity) {
+  size_t count = (sizeof(Header) + size + 3) / 4;
+  if (count > capacity || size > 0xFFFF) {
+    return 0;
+  }
+  words[count - 1] = 0;   // Padding
+  Header *header = (Header *) words;
+  header->magic = MAGIC;
+  header->time = (uint32_t) time;
+  header->length = size;
+  memcpy(header + 1, state, size);
+  header->crc = crc16(crc16(CRC16_INIT, header, offsetof(Header, crc)), state, size);
+  return count;
+}
+
+bool BootClock::decode(const uint32_t *words, size_t capacity, time_t &time, void *state, size_t size) {
+  const Header *header = (const Header *) words;
+  if ((sizeof(Header) + size + 3) / 4 > capacity || header->magic != MAGIC || header->length != size ||
+      crc16(crc16(CRC16_INIT, header, offsetof(Header, crc)), header + 1, size) != header->crc) {
+    return false;
+  }
+  time = header->time;
+  memcpy(state, header + 1, size);
+  return true;
+}
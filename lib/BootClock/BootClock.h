@@ -0,0 +1,84 @@
+#ifndef BOOT_CLOCK_H
+#define BOOT_CLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*------------------------------------------------------------------------------------*/
+/* BootClock                                                                          */
+/*------------------------------------------------------------------------------------*/
+// Wall clock from reset until NTP answers, so irrigation resumes before the network is
+// up. The caller checkpoints the time to RTC user memory, which survives a reset or a
+// brownout but not a power loss, and at a lower rate to flash. At boot the newest
+// checkpoint that survived gives an estimate to set the clock to:
+//
+//   rtc    behind by at most the checkpoint interval and the reset
+//   flash  behind by the time the power was off, which is unknown
+//
+// When NTP answers, the step of the clock tells how far off the estimate was. Without
+// any checkpoint the caller waits for NTP as before.
+//
+// The RTC record is CRC protected and carries the state of the caller after the time,
+// e.g. the zones that were running. Time is passed in by the caller, which keeps the
+// class host-testable. It also keeps the milestones of the boot for a report.
+class BootClock {
+  public:
+    enum class Source : uint8_t {
+      none,     // Clock not set
+      flash,    // Estimated from the flash checkpoint
+      rtc,      // Estimated from the RTC memory checkpoint
+      ntp       // Set by NTP
+    };
+
+    BootClock();
+    ~BootClock() {};
+
+    // At boot: the checkpoint times that survived, 0 if missing. Returns the time to set
+    // the clock to, 0 to wait for NTP.
+    time_t restore(time_t rtcTime, time_t flashTime, uint32_t nowMs);
+    // NTP set the clock to time. Returns the step of the clock in seconds. The first
+    // one tells how far the estimate was off, if there was one.
+    int32_t sync(time_t time, uint32_t nowMs);
+    Source getSource(void) { return _source; }
+    Source getBootSource(void) { return _bootSource; }
+    bool isSet(void) { return _source != Source::none; }
+    bool isSynced(void) { return _source == Source::ntp; }
+    // Close enough to open drip windows. A flash estimate may be hours behind.
+    bool isSchedulable(void) { return _source == Source::rtc || _source == Source::ntp; }
+    int32_t getBootStep(void) { return _bootStep; }
+    static const char *toString(Source source);
+
+    // Milestones in milliseconds since reset, 0 until reached
+    void markScheduled(uint32_t nowMs) { if (!_scheduledMs) _scheduledMs = nowMs ? nowMs : 1; }
+    void markNetwork(uint32_t nowMs) { if (!_networkMs) _networkMs = nowMs ? nowMs : 1; }
+    uint32_t getScheduledMs(void) { return _scheduledMs; }
+    uint32_t getNetworkMs(void) { return _networkMs; }
+    uint32_t getSyncedMs(void) { return _syncedMs; }
+
+    // RTC memory record: magic, time, length and CRC, then size bytes of state. Returns
+    // the words to write, 0 if it does not fit.
+    static size_t encode(time_t time, const void *state, size_t size, uint32_t *words, size_t capacity);
+    // Returns false unless a record of exactly size bytes of state is intact
+    static bool decode(const uint32_t *words, size_t capacity, time_t &time, void *state, size_t size);
+
+  private:
+    static const uint32_t MAGIC = 0x4B4C4342;   // "BCLK"
+    struct Header {
+      uint32_t magic;
+      uint32_t time;
+      uint16_t length;
+      uint16_t crc;
+    };
+
+    Source _source;
+    Source _bootSource;
+    time_t _estimate;
+    uint32_t _estimatedAtMs;
+    int32_t _bootStep;
+    uint32_t _scheduledMs;
+    uint32_t _networkMs;
+    uint32_t _syncedMs;
+};
+
+#endif // BOOT_CLOCK_H
@@ -0,0 +1,223 @@
+#include "CommandParser.h"
+#include <stddef.h>
+
+static bool isDigit(uint8_t c) {
+  return c >= '0' && c <= '9';
+}
+
+static uint8_t hexValue(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return 0xFF;
+}
+
+uint32_t Command::number(uint8_t offset, uint8_t digits) const {
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < digits; i++) {
+    value = value * 10 + (args[offset + i] - '0');
+  }
+  return value;
+}
+
+uint32_t Command::hex(uint8_t offset, uint8_t digits) const {
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < digits; i++) {
+    value = (value << 4) | hexValue(args[offset + i]);
+  }
+  return value;
+}
+
+uint32_t Command::timeOfDay(uint8_t offset) const {
+  return number(offset, 2) * 3600UL + number(offset + 3, 2) * 60 + number(offset + 6, 2);
+}
+
+CommandParser::CommandParser(const Syntax *table, uint8_t tableSize, uint8_t zoneCount):
+  _table(table),
+  _tableSize(tableSize),
+  _zoneCount(zoneCount) {
+}
+
+CommandParser::Error CommandParser::parse(const uint8_t *payload, unsigned int length,
+  Command *commands, uint8_t maxCommands, uint8_t &count, uint16_t &errorOffset) {
+  count = 0;
+  errorOffset = 0;
+  if (payload == NULL || length == 0) {
+    return Error::empty;
+  }
+  unsigned int start = 0;
+  while (start <= length) {
+    unsigned int end = start;
+    while (end < length && payload[end] != SEPARATOR) {
+      end++;
+    }
+    // A trailing separator is tolerated
+    if (end == length && start == length && count > 0) {
+      break;
+    }
+    Error error = Error::none;
+    uint8_t errorAt = 0;
+    if (count >= maxCommands) {
+      error = Error::tooMany;
+    } else if (end - start > 0xFF) {
+      error = Error::badLength;
+    } else {
+      error = parseOne(payload + start, end - start, commands[count], errorAt);
+    }
+    if (error != Error::none) {
+      count = 0;
+      errorOffset = start + errorAt;
+      return error;
+    }
+    count++;
+    start = end + 1;
+  }
+  return Error::none;
+}
+
+const char *CommandParser::toString(Error error) {
+  switch (error) {
+    case Error::none: return "ok";
+    case Error::empty: return "empty";
+    case Error::unknownCommand: return "unknown command";
+    case Error::badZone: return "bad zone";
+    case Error::badLength: return "bad length";
+    case Error::badFormat: return "bad format";
+    case Error::tooMany: return "too many commands";
+  }
+  return "error";
+}
+
+const CommandParser::Syntax *CommandParser::find(char code) {
+  for (uint8_t i = 0; i < _tableSize; i++) {
+    if (_table[i].code == code) {
+      return &_table[i];
+    }
+  }
+  return NULL;
+}
+
+CommandParser::Error CommandParser::parseOne(const uint8_t *start, uint8_t length, Command &command, uint8_t &errorAt) {
+  uint8_t pos = 0;
+  errorAt = 0;
+  command.zone = 0;
+  bool zoned = false;
+  if (length == 0) {
+    return Error::empty;
+  }
+  if (start[0] == ZONE_PREFIX) {
+    if (length < 3 || !isDigit(start[1]) || (uint8_t)(start[1] - '0') >= _zoneCount) {
+      errorAt = 1;
+      return Error::badZone;
+    }
+    command.zone = start[1] - '0';
+    zoned = true;
+    pos = 2;
+  }
+  const Syntax *syntax = find((char) start[pos]);
+  if (syntax == NULL) {
+    errorAt = pos;
+    return Error::unknownCommand;
+  }
+  if (zoned && !syntax->zoned) {
+    errorAt = 0;
+    return Error::badZone;
+  }
+  command.code = syntax->code;
+  command.args = start + pos + 1;
+  command.length = length - pos - 1;
+
+  uint8_t at = 0;
+  int used = match(syntax->pattern, command.args, command.length, at);
+  if (used < 0) {
+    errorAt = pos + 1 + at;
+    return at >= command.length ? Error::badLength : Error::badFormat;
+  }
+  uint8_t repeats = 0;
+  while (syntax->repeat && used < command.length && repeats < syntax->maxRepeat) {
+    int more = match(syntax->repeat, command.args + used, command.length - used, at);
+    if (more <= 0) {
+      errorAt = pos + 1 + used + at;
+      return used + at >= command.length ? Error::badLength : Error::badFormat;
+    }
+    used += more;
+    repeats++;
+  }
+  if (syntax->repeat && repeats == 0) {
+    errorAt = pos + 1 + used;
+    return Error::badLength;
+  }
+  if (used != command.length) {
+    errorAt = pos + 1 + used;
+    return Error::badLength;
+  }
+  return Error::none;
+}
+
+int CommandParser::match(const char *pattern, const uint8_t *args, uint8_t length, uint8_t &errorAt) {
+  uint8_t pos = 0;
+  for (const char *token = pattern; *token; token++) {
+    switch (*token) {
+      case 'D':
+      case 'X':
+        if (pos >= length) {
+          errorAt = pos;
+          return -1;
+        }
+        if (*token == 'D' ? !isDigit(args[pos]) : hexValue(args[pos]) == 0xFF) {
+          errorAt = pos;
+          return -1;
+        }
+        pos++;
+        break;
+      case 'd':
+        // Optional digits only make sense at the end of a pattern
+        if (pos < length && isDigit(args[pos])) {
+          pos++;
+        }
+        break;
+      case 'S':
+        // Text up to the end of the command, printable characters only
+        if (pos >= length) {
+          errorAt = pos;
+          return -1;
+        }
+        for (; pos < length; pos++) {
+          if (args[pos] < ' ' || args[pos] > '~') {
+            errorAt = pos;
+            return -1;
+          }
+        }
+        break;
+      case 'T':
+        // HH:MM:SS with range checks
+        if (pos + 8 > length) {
+          errorAt = length;
+          return -1;
+        }
+        for (uint8_t i = 0; i < 8; i++) {
+          bool ok = (i == 2 || i == 5) ? args[pos + i] == ':' : isDigit(args[pos + i]);
+          if (!ok) {
+            errorAt = pos + i;
+            return -1;
+          }
+        }
+        if ((args[pos] - '0') * 10 + (args[pos + 1] - '0') > 23 ||
+            args[pos + 3] > '5' || args[pos + 6] > '5') {
+          errorAt = pos;
+          return -1;
+        }
+        pos += 8;
+        break;
+      default:
+        // Literal character
+        if (pos >= length || args[pos] != (uint8_t) *token) {
+          errorAt = pos;
+          return -1;
+        }
+        pos++;
+        break;
+    }
+  }
+  return pos;
+}
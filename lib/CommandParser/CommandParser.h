@@ -0,0 +1,84 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <stdint.h>
+
+/*------------------------------------------------------------------------------------*/
+/* Command                                                                            */
+/*------------------------------------------------------------------------------------*/
+// One parsed command. Arguments are not copied: they point into the payload, which must
+// outlive the command. Accessors do no checking, the parser already validated the
+// arguments against the command syntax.
+struct Command {
+  char code;
+  uint8_t zone;
+  const uint8_t *args;
+  uint8_t length;
+
+  // Decimal and hexadecimal number of `digits` characters at `offset`
+  uint32_t number(uint8_t offset, uint8_t digits) const;
+  uint32_t hex(uint8_t offset, uint8_t digits) const;
+  // Number made of every digit from offset to the end of the arguments
+  uint32_t number(uint8_t offset) const { return number(offset, length - offset); }
+  // HH:MM:SS at offset, in seconds after midnight
+  uint32_t timeOfDay(uint8_t offset) const;
+};
+
+/*------------------------------------------------------------------------------------*/
+/* CommandParser                                                                      */
+/*------------------------------------------------------------------------------------*/
+// Table-driven parser of MQTT command payloads. Works in place on the payload bytes,
+// checks every length and character before a command is accepted, and accepts several
+// commands in one message separated by ';' (e.g. "c07:00:004512;r24"). A message is all
+// or nothing: one malformed command rejects the whole batch.
+//
+// Each command is described by an argument pattern, one token per character:
+//   D  decimal digit          d  optional decimal digit (only at the end)
+//   X  hexadecimal digit      T  time of day HH:MM:SS
+//   S  text, the rest of the command (printable characters)
+// plus an optional repeated group appended 1 to maxRepeat times. Commands flagged as
+// zoned accept a zN prefix addressing zone N.
+class CommandParser {
+  public:
+    static const char SEPARATOR = ';';
+    static const char ZONE_PREFIX = 'z';
+
+    struct Syntax {
+      char code;
+      const char *pattern;
+      const char *repeat;     // Repeated group, or NULL
+      uint8_t maxRepeat;
+      bool zoned;
+    };
+    enum class Error : uint8_t {
+      none,
+      empty,           // Empty payload or empty command between separators
+      unknownCommand,
+      badZone,         // Unknown zone, or zone prefix on a command without zones
+      badLength,       // Too few or too many argument characters
+      badFormat,       // Character does not match the pattern, or value out of range
+      tooMany          // More commands than the caller can hold
+    };
+
+    CommandParser(const Syntax *table, uint8_t tableSize, uint8_t zoneCount);
+    ~CommandParser() {};
+
+    // Parse a payload into at most maxCommands commands. On error, count is 0 and
+    // errorOffset is the payload position where parsing stopped.
+    Error parse(const uint8_t *payload, unsigned int length, Command *commands, uint8_t maxCommands,
+      uint8_t &count, uint16_t &errorOffset);
+
+    static const char *toString(Error error);
+
+  private:
+    const Syntax *find(char code);
+    // Match one pattern against the arguments. Returns characters consumed or -1.
+    static int match(const char *pattern, const uint8_t *args, uint8_t length, uint8_t &errorAt);
+    Error parseOne(const uint8_t *start, uint8_t length, Command &command, uint8_t &errorAt);
+
+    const Syntax *_table;
+    uint8_t _tableSize;
+    uint8_t _zoneCount;
+};
+
+#endif // COMMAND_PARSER_H
@@ -0,0 +1,176 @@
+#include "ConfigJournal.h"
+#include <Crc16.h>
+#include <string.h>
+
+ConfigJournal::ConfigJournal(FlashBackend &flash):
+  _flash(flash),
+  _active(NO_SECTOR),
+  _generation(0),
+  _sequence(0),
+  _writeOffset(0),
+  _torn(false),
+  _appends(0),
+  _compactions(0) {
+  memset(_offset, 0, sizeof(_offset));
+}
+
+bool ConfigJournal::begin(void) {
+  memset(_offset, 0, sizeof(_offset));
+  _active = NO_SECTOR;
+  _torn = false;
+  // Newest sector with a complete header. Generations wrap around.
+  for (uint8_t sector = 0; sector < _flash.getSectorCount(); sector++) {
+    SectorHeader header;
+    if (!_flash.read(sectorBase(sector), (uint32_t *) &header, sizeof(header)) ||
+        header.magic != MAGIC || header.generation == 0xFFFFFFFF) {
+      continue;
+    }
+    if (_active == NO_SECTOR || (int32_t) (header.generation - _generation) > 0) {
+      _active = sector;
+      _generation = header.generation;
+    }
+  }
+  if (_active == NO_SECTOR) {
+    return false;
+  }
+  // Index the newest record of each field
+  uint32_t sectorSize = _flash.getSectorSize();
+  uint32_t offset = sizeof(SectorHeader);
+  uint32_t value[(CONFIG_JOURNAL_MAX_LENGTH + 3) / 4];
+  while (offset + sizeof(RecordHeader) <= sectorSize) {
+    RecordHeader header;
+    if (!_flash.read(sectorBase(_active) + offset, (uint32_t *) &header, sizeof(header))) {
+      _torn = true;
+      break;
+    }
+    if (header.sequence == 0xFFFFFFFF && header.field == 0xFF && header.length == 0xFF && header.crc == 0xFFFF) {
+      break;   // Erased: end of the log
+    }
+    if (header.field >= CONFIG_JOURNAL_MAX_FIELDS || header.length > CONFIG_JOURNAL_MAX_LENGTH ||
+        offset + recordSize(header.length) > sectorSize ||
+        !readRecord(_active, offset, header, value)) {
+      _torn = true;
+      break;
+    }
+    _offset[header.field] = offset;
+    _sequence = header.sequence;
+    offset += recordSize(header.length);
+  }
+  _writeOffset = offset;
+  return true;
+}
+
+size_t ConfigJournal::read(uint8_t field, void *data, size_t size) {
+  if (!contains(field)) {
+    return 0;
+  }
+  RecordHeader header;
+  uint32_t value[(CONFIG_JOURNAL_MAX_LENGTH + 3) / 4];
+  if (!readRecord(_active, _offset[field], header, value)) {
+    return 0;
+  }
+  memcpy(data, value, header.length < size ? header.length : size);
+  return header.length;
+}
+
+bool ConfigJournal::write(uint8_t field, const void *data, size_t length) {
+  if (field >= CONFIG_JOURNAL_MAX_FIELDS || length > CONFIG_JOURNAL_MAX_LENGTH) {
+    return false;
+  }
+  if (contains(field)) {
+    RecordHeader header;
+    uint32_t value[(CONFIG_JOURNAL_MAX_LENGTH + 3) / 4];
+    if (readRecord(_active, _offset[field], header, value) && header.length == length &&
+        memcmp(value, data, length) == 0) {
+      return true;   // Unchanged
+    }
+  }
+  if (_active != NO_SECTOR && !_torn && _writeOffset + recordSize(length) <= _flash.getSectorSize()) {
+    uint32_t offset = _writeOffset;
+    // The space is consumed even if the write fails half way
+    _writeOffset += recordSize(length);
+    if (append(_active, offset, field, data, length)) {
+      _offset[field] = offset;
+      return true;
+    }
+    _torn = true;
+  }
+  return compact(field, data, length);
+}
+
+bool ConfigJournal::clear(void) {
+  memset(_offset, 0, sizeof(_offset));
+  return compact(CONFIG_JOURNAL_MAX_FIELDS, NULL, 0);
+}
+
+uint32_t ConfigJournal::getFreeBytes(void) {
+  if (_active == NO_SECTOR) {
+    return _flash.getSectorSize() - sizeof(SectorHeader);
+  }
+  return _torn ? 0 : _flash.getSectorSize() - _writeOffset;
+}
+
+bool ConfigJournal::readRecord(uint8_t sector, uint16_t offset, RecordHeader &header, uint32_t *value) {
+  uint32_t base = sectorBase(sector) + offset;
+  if (!_flash.read(base, (uint32_t *) &header, sizeof(header)) || header.length > CONFIG_JOURNAL_MAX_LENGTH ||
+      !_flash.read(base + sizeof(header), value, (header.length + 3) & ~3)) {
+    return false;
+  }
+  uint16_t crc = crc16(CRC16_INIT, &header, offsetof(RecordHeader, crc));
+  crc = crc16(crc, value, header.length);
+  return crc == header.crc;
+}
+
+bool ConfigJournal::append(uint8_t sector, uint16_t offset, uint8_t field, const void *data, uint8_t length) {
+  uint32_t record[(sizeof(RecordHeader) + CONFIG_JOURNAL_MAX_LENGTH + 3) / 4];
+  RecordHeader *header = (RecordHeader *) record;
+  uint8_t *value = (uint8_t *) record + sizeof(RecordHeader);
+  header->sequence = ++_sequence;
+  header->field = field;
+  header->length = length;
+  memset(value, 0xFF, (length + 3) & ~3);
+  memcpy(value, data, length);
+  header->crc = crc16(crc16(CRC16_INIT, header, offsetof(RecordHeader, crc)), value, length);
+  _appends++;
+  return _flash.write(sectorBase(sector) + offset, record, recordSize(length));
+}
+
+bool ConfigJournal::compact(uint8_t field, const void *data, uint8_t length) {
+  uint8_t target = _active == NO_SECTOR ? 0 : (_active + 1) % _flash.getSectorCount();
+  uint16_t offsets[CONFIG_JOURNAL_MAX_FIELDS];
+  uint32_t offset = sizeof(SectorHeader);
+  memset(offsets, 0, sizeof(offsets));
+  _compactions++;
+  if (!_flash.erase(target)) {
+    return false;
+  }
+  // Newest value of every other field, then the new one
+  uint32_t value[(CONFIG_JOURNAL_MAX_LENGTH + 3) / 4];
+  for (uint8_t f = 0; f < CONFIG_JOURNAL_MAX_FIELDS; f++) {
+    RecordHeader header;
+    const void *source = value;
+    if (f == field) {
+      source = data;
+      header.length = length;
+    } else if (!contains(f) || !readRecord(_active, _offset[f], header, value)) {
+      continue;
+    }
+    if (offset + recordSize(header.length) > _flash.getSectorSize() ||
+        !append(target, offset, f, source, header.length)) {
+      return false;
+    }
+    offsets[f] = offset;
+    offset += recordSize(header.length);
+  }
+  // Header last: until it is written the previous sector stays the newest
+  SectorHeader header = { MAGIC, _generation + 1 };
+  if (!_flash.write(sectorBase(target), (const uint32_t *) &header, sizeof(header))) {
+    return false;
+  }
+  memcpy(_offset, offsets, sizeof(_offset));
+  _active = target;
+  _generation++;
+  _writeOffset = offset;
+  _torn = false;
+  return true;
+}
@@ -0,0 +1,97 @@
+#ifndef CONFIG_JOURNAL_H
+#define CONFIG_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "FlashBackend.h"
+#include <MemoryBudget.h>
+
+#ifndef CONFIG_JOURNAL_MAX_FIELDS
+#define CONFIG_JOURNAL_MAX_FIELDS 24
+#endif
+#ifndef CONFIG_JOURNAL_MAX_LENGTH
+#define CONFIG_JOURNAL_MAX_LENGTH 64    // Largest field value in bytes
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* ConfigJournal                                                                      */
+/*------------------------------------------------------------------------------------*/
+// Persistent configuration stored as a log of small records in a ring of flash sectors.
+// Each record holds the new value of one field:
+//
+//   Sector: magic (4 bytes), generation (4 bytes), then records up to the first erased
+//           word.
+//   Record: sequence (4 bytes), field (1), length (1), CRC-16 (2), value padded to 4.
+//
+// Writing a field appends a record to the active sector, and only if the value changed.
+// Nothing is erased until the sector is full: then the newest value of every field is
+// copied to the next sector of the ring, and its header is written last, so a power
+// loss during compaction leaves the previous sector active. Erases rotate over every
+// sector of the ring.
+//
+// At boot the sector with the newest generation is scanned and the last record of each
+// field wins. A record with a bad CRC (power lost while writing it) ends the scan and
+// forces a compaction on the next write.
+class ConfigJournal {
+  public:
+    ConfigJournal(FlashBackend &flash);
+    ~ConfigJournal() {};
+
+    // Find the active sector and index its fields. Returns false if there is no journal
+    // yet. It is formatted on the first write.
+    bool begin(void);
+
+    // Copy up to size bytes of the value of a field into data. Returns the stored
+    // length, 0 if never written.
+    size_t read(uint8_t field, void *data, size_t size);
+    // Fixed size field. Returns false if missing or of a different size.
+    template <typename T> bool read(uint8_t field, T &value) {
+      return read(field, &value, sizeof(T)) == sizeof(T);
+    }
+    bool contains(uint8_t field) { return field < CONFIG_JOURNAL_MAX_FIELDS && _offset[field]; }
+
+    // Store a field. Does nothing if the value did not change.
+    bool write(uint8_t field, const void *data, size_t length);
+    template <typename T> bool write(uint8_t field, const T &value) {
+      return write(field, &value, sizeof(T));
+    }
+
+    // Erase every field
+    bool clear(void);
+
+    uint32_t getFreeBytes(void);
+    uint32_t getAppends(void) { return _appends; }          // Since boot
+    uint32_t getCompactions(void) { return _compactions; }  // Since boot
+
+  private:
+    static const uint32_t MAGIC = 0x4C4E4A44;   // "DJNL"
+    static const uint8_t NO_SECTOR = 0xFF;
+    struct SectorHeader {
+      uint32_t magic;
+      uint32_t generation;
+    };
+    struct RecordHeader {
+      uint32_t sequence;
+      uint8_t field;
+      uint8_t length;
+      uint16_t crc;
+    };
+
+    static uint32_t recordSize(uint8_t length) { return sizeof(RecordHeader) + ((length + 3) & ~3); }
+    uint32_t sectorBase(uint8_t sector) { return sector * _flash.getSectorSize(); }
+    bool readRecord(uint8_t sector, uint16_t offset, RecordHeader &header, uint32_t *value);
+    bool append(uint8_t sector, uint16_t offset, uint8_t field, const void *data, uint8_t length);
+    bool compact(uint8_t field, const void *data, uint8_t length);
+
+    FlashBackend &_flash;
+    uint16_t _offset[CONFIG_JOURNAL_MAX_FIELDS];  // Newest record of each field. 0 none
+    uint8_t _active;                              // NO_SECTOR before the first write
+    uint32_t _generation;
+    uint32_t _sequence;
+    uint32_t _writeOffset;                        // First erased byte of the active sector
+    bool _torn;                                   // Active sector ends in a broken record
+    uint32_t _appends;
+    uint32_t _compactions;
+};
+
+#endif // CONFIG_JOURNAL_H
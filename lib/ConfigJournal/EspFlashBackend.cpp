@@ -0,0 +1,47 @@
+// Host unit tests (pio test -e test) build this library without the ESP8266 core or
+// NativeHal, and only use RamFlashBackend
+#if __has_include(<Arduino.h>)
+#include "EspFlashBackend.h"
+
+extern "C" {
+#include "spi_flash.h"
+}
+#ifdef ARDUINO_ARCH_ESP8266
+extern "C" uint32_t _EEPROM_start;
+#endif
+
+EspFlashBackend::EspFlashBackend(uint8_t sectorCount):
+  _firstSector(getEepromSector() + 1 - sectorCount),
+  _sectorCount(sectorCount) {
+}
+
+uint32_t EspFlashBackend::getSectorSize(void) {
+  return SPI_FLASH_SEC_SIZE;
+}
+
+bool EspFlashBackend::read(uint32_t offset, uint32_t *data, size_t size) {
+  return ESP.flashRead(_firstSector * SPI_FLASH_SEC_SIZE + offset, data, size);
+}
+
+bool EspFlashBackend::write(uint32_t offset, const uint32_t *data, size_t size) {
+  return ESP.flashWrite(_firstSector * SPI_FLASH_SEC_SIZE + offset, (uint32_t *) data, size);
+}
+
+bool EspFlashBackend::erase(uint8_t sector) {
+  if (sector >= _sectorCount) {
+    return false;
+  }
+  return ESP.flashEraseSector(_firstSector + sector);
+}
+
+uint32_t EspFlashBackend::getEepromSector(void) {
+#ifdef ARDUINO_ARCH_ESP8266
+  // Same computation as the EEPROM library
+  return ((uint32_t) &_EEPROM_start - 0x40200000) / SPI_FLASH_SEC_SIZE;
+#else
+  // Host simulation
+  return SPI_FLASH_EEPROM_SECTOR;
+#endif
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef ESP_FLASH_BACKEND_H
+#define ESP_FLASH_BACKEND_H
+
+#include <Arduino.h>
+#include "FlashBackend.h"
+
+/*------------------------------------------------------------------------------------*/
+/* EspFlashBackend                                                                    */
+/*------------------------------------------------------------------------------------*/
+// Sectors of the ESP8266 SPI flash. The region ends with the sector the EEPROM library
+// uses (right after the file system area and the spare sector that follows it), so a
+// legacy EEPROM image can be read before the region is first formatted.
+class EspFlashBackend : public FlashBackend {
+  public:
+    EspFlashBackend(uint8_t sectorCount);
+    ~EspFlashBackend() {};
+
+    uint32_t getSectorSize(void);
+    uint8_t getSectorCount(void) { return _sectorCount; }
+    bool read(uint32_t offset, uint32_t *data, size_t size);
+    bool write(uint32_t offset, const uint32_t *data, size_t size);
+    bool erase(uint8_t sector);
+
+    // Absolute flash sector of the EEPROM library
+    static uint32_t getEepromSector(void);
+
+  private:
+    uint32_t _firstSector;
+    uint8_t _sectorCount;
+};
+
+#endif // ESP_FLASH_BACKEND_H
@@ -0,0 +1,79 @@
+#ifndef FLASH_BACKEND_H
+#define FLASH_BACKEND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*------------------------------------------------------------------------------------*/
+/* FlashBackend                                                                       */
+/*------------------------------------------------------------------------------------*/
+// NOR flash region made of equal sectors. Offsets are relative to the region. Writes
+// can only clear bits and must be 4 byte aligned in offset and size; erasing a sector
+// sets all of its bytes to 0xFF.
+class FlashBackend {
+  public:
+    virtual ~FlashBackend() {};
+    virtual uint32_t getSectorSize(void) = 0;
+    virtual uint8_t getSectorCount(void) = 0;
+    virtual bool read(uint32_t offset, uint32_t *data, size_t size) = 0;
+    virtual bool write(uint32_t offset, const uint32_t *data, size_t size) = 0;
+    virtual bool erase(uint8_t sector) = 0;
+};
+
+/*------------------------------------------------------------------------------------*/
+/* RamFlashBackend                                                                    */
+/*------------------------------------------------------------------------------------*/
+// Flash simulated in RAM with NOR semantics, for host builds. Can be told to fail after
+// a number of written words to simulate a power loss in the middle of a write: from then
+// on every write and erase fails too, until failAfterWords(-1) powers it up again.
+class RamFlashBackend : public FlashBackend {
+  public:
+    RamFlashBackend(uint8_t *memory, uint32_t sectorSize, uint8_t sectorCount):
+      _memory(memory), _sectorSize(sectorSize), _sectorCount(sectorCount),
+      _wordsBeforeFailure(-1), _powerLost(false), _erases(0), _writes(0) {
+      memset(_memory, 0xFF, sectorSize * sectorCount);
+    }
+    uint32_t getSectorSize(void) { return _sectorSize; }
+    uint8_t getSectorCount(void) { return _sectorCount; }
+    bool read(uint32_t offset, uint32_t *data, size_t size) {
+      if (offset + size > _sectorSize * _sectorCount) return false;
+      memcpy(data, _memory + offset, size);
+      return true;
+    }
+    bool write(uint32_t offset, const uint32_t *data, size_t size) {
+      if (_powerLost || (offset | size) & 3 || offset + size > _sectorSize * _sectorCount) return false;
+      const uint8_t *bytes = (const uint8_t *) data;
+      for (size_t i = 0; i < size; i++) {
+        if (i % 4 == 0 && _wordsBeforeFailure >= 0 && _wordsBeforeFailure-- == 0) {
+          _powerLost = true;
+          return false;
+        }
+        _memory[offset + i] &= bytes[i];
+      }
+      _writes++;
+      return true;
+    }
+    bool erase(uint8_t sector) {
+      if (_powerLost || sector >= _sectorCount) return false;
+      memset(_memory + sector * _sectorSize, 0xFF, _sectorSize);
+      _erases++;
+      return true;
+    }
+    // Fail (power loss) after this many more words are written. -1 never fails.
+    void failAfterWords(int32_t words) { _wordsBeforeFailure = words; _powerLost = false; }
+    bool isPowerLost(void) { return _powerLost; }
+    uint32_t getEraseCount(void) { return _erases; }
+    uint32_t getWriteCount(void) { return _writes; }
+
+  private:
+    uint8_t *_memory;
+    uint32_t _sectorSize;
+    uint8_t _sectorCount;
+    int32_t _wordsBeforeFailure;
+    bool _powerLost;
+    uint32_t _erases;
+    uint32_t _writes;
+};
+
+#endif // FLASH_BACKEND_H
@@ -0,0 +1,12 @@
+#include "Crc16.h"
+
+uint16_t crc16(uint16_t crc, const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *) data;
+  while (size--) {
+    crc ^= (uint16_t) *bytes++ << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
@@ -0,0 +1,17 @@
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*------------------------------------------------------------------------------------*/
+/* Crc16                                                                              */
+/*------------------------------------------------------------------------------------*/
+// CRC-16/CCITT (polynomial 0x1021, not reflected) of the records kept in flash and RTC
+// memory. Bitwise: they are a few dozen bytes and rarely written. Start from
+// CRC16_INIT and feed the data in as many pieces as needed.
+const uint16_t CRC16_INIT = 0xFFFF;
+
+uint16_t crc16(uint16_t crc, const void *data, size_t size);
+
+#endif // CRC16_H
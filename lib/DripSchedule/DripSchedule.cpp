@@ -0,0 +1,162 @@
+#include "DripSchedule.h"
+#include <string.h>
+
+const uint32_t SECONDS_PER_DAY = 24 * 3600UL;
+
+void ZoneSchedule::clear(void) {
+  startCount = 0;
+  weekdays = ALL_WEEKDAYS;
+  everyDays = 1;
+  durationMinutes = 0;
+  anchorDay = 0;
+}
+
+bool ZoneSchedule::addStartTime(uint32_t second) {
+  if (second >= SECONDS_PER_DAY) {
+    return false;
+  }
+  for (uint8_t i = 0; i < startCount; i++) {
+    if (startSecond[i] == second) {
+      return true;
+    }
+  }
+  if (startCount >= MAX_START_TIMES) {
+    return false;
+  }
+  // Keep start times sorted
+  uint8_t pos = startCount++;
+  while (pos > 0 && startSecond[pos - 1] > second) {
+    startSecond[pos] = startSecond[pos - 1];
+    pos--;
+  }
+  startSecond[pos] = second;
+  return true;
+}
+
+bool ZoneSchedule::isDripDay(int32_t localDay) const {
+  if (!(weekdays & (1 << DripSchedule::weekday(localDay)))) {
+    return false;
+  }
+  if (everyDays <= 1) {
+    return true;
+  }
+  int32_t elapsed = localDay - anchorDay;
+  return elapsed >= 0 && elapsed % everyDays == 0;
+}
+
+DripSchedule::DripSchedule(uint8_t zoneCount, LocalToUtc toUtc):
+  _toUtc(toUtc),
+  _zoneCount(zoneCount > MAX_ZONES ? MAX_ZONES : zoneCount),
+  _active(0) {
+  for (uint8_t buffer = 0; buffer < 2; buffer++) {
+    for (uint8_t zone = 0; zone < MAX_ZONES; zone++) {
+      _specs[buffer][zone].clear();
+      _specs[buffer][zone].liters = 0;
+    }
+    _tables[buffer].count = 0;
+    _tables[buffer].firstDay = 0;
+    _tables[buffer].validUntil = 0;
+  }
+}
+
+ZoneSchedule &DripSchedule::edit(uint8_t zone) {
+  return _specs[_active ^ 1][zone < _zoneCount ? zone : 0];
+}
+
+void DripSchedule::commit(int32_t localDay) {
+  uint8_t staging = _active ^ 1;
+  compile(_specs[staging], localDay, _tables[staging]);
+  // Single assignment makes the new schedules and table visible together
+  _active = staging;
+  revert();
+}
+
+void DripSchedule::revert(void) {
+  memcpy(_specs[_active ^ 1], _specs[_active], sizeof(_specs[0]));
+}
+
+bool DripSchedule::refresh(int32_t localDay) {
+  if (_tables[_active].firstDay == localDay && _tables[_active].validUntil) {
+    return false;
+  }
+  uint8_t staging = _active ^ 1;
+  compile(_specs[_active], localDay, _tables[staging]);
+  memcpy(_specs[staging], _specs[_active], sizeof(_specs[0]));
+  _active = staging;
+  return true;
+}
+
+uint8_t DripSchedule::upperBound(time_t t) {
+  const Table &current = _tables[_active];
+  uint8_t low = 0;
+  uint8_t high = current.count;
+  while (low < high) {
+    uint8_t mid = (low + high) / 2;
+    if (current.events[mid].start <= t) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+uint8_t DripSchedule::getMaxDurationMinutes(void) {
+  uint8_t longest = 0;
+  for (uint8_t zone = 0; zone < _zoneCount; zone++) {
+    if (_specs[_active][zone].durationMinutes > longest) {
+      longest = _specs[_active][zone].durationMinutes;
+    }
+  }
+  return longest;
+}
+
+void DripSchedule::compile(const ZoneSchedule *specs, int32_t localDay, Table &table) {
+  table.count = 0;
+  table.firstDay = localDay;
+  table.validUntil = _toUtc(localDay + 1, 0);
+  for (uint8_t day = 0; day < SCHEDULE_DAYS; day++) {
+    for (uint8_t zone = 0; zone < _zoneCount; zone++) {
+      const ZoneSchedule &spec = specs[zone];
+      if (spec.durationMinutes == 0 || !spec.isDripDay(localDay + day)) {
+        continue;
+      }
+      for (uint8_t i = 0; i < spec.startCount && table.count < MAX_SCHEDULE_EVENTS; i++) {
+        Event event;
+        event.start = _toUtc(localDay + day, spec.startSecond[i]);
+        event.zone = zone;
+        event.durationMinutes = spec.durationMinutes;
+        event.liters = spec.liters;
+        // Insertion sort. Ties keep zone order.
+        uint8_t pos = table.count++;
+        while (pos > 0 && table.events[pos - 1].start > event.start) {
+          table.events[pos] = table.events[pos - 1];
+          pos--;
+        }
+        table.events[pos] = event;
+      }
+    }
+  }
+}
+
+// Howard Hinnant's days_from_civil / civil_from_days
+int32_t DripSchedule::dayNumber(int year, int month, int day) {
+  year -= month <= 2;
+  int32_t era = (year >= 0 ? year : year - 399) / 400;
+  uint32_t yoe = (uint32_t)(year - era * 400);
+  uint32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int32_t)doe - 719468;
+}
+
+void DripSchedule::civilDate(int32_t dayNumber, int &year, int &month, int &day) {
+  dayNumber += 719468;
+  int32_t era = (dayNumber >= 0 ? dayNumber : dayNumber - 146096) / 146097;
+  uint32_t doe = (uint32_t)(dayNumber - era * 146097);
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  day = doy - (153 * mp + 2) / 5 + 1;
+  month = mp < 10 ? mp + 3 : mp - 9;
+  year = (int)yoe + era * 400 + (month <= 2);
+}
@@ -0,0 +1,107 @@
+#ifndef DRIP_SCHEDULE_H
+#define DRIP_SCHEDULE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <MemoryBudget.h>
+
+#ifndef MAX_ZONES
+#define MAX_ZONES 8
+#endif
+#ifndef MAX_START_TIMES
+#define MAX_START_TIMES 4
+#endif
+// Today and tomorrow are compiled, so the next event is always in the table
+#define SCHEDULE_DAYS 2
+#define MAX_SCHEDULE_EVENTS (MAX_ZONES * MAX_START_TIMES * SCHEDULE_DAYS)
+
+/*------------------------------------------------------------------------------------*/
+/* ZoneSchedule                                                                       */
+/*------------------------------------------------------------------------------------*/
+// Compact schedule of one zone: up to MAX_START_TIMES start times a day, on the days
+// allowed by the weekday mask and, within those, every `everyDays` days counted from
+// `anchorDay`. A zone with a volume set drips until that many liters went through, with
+// the duration as a safety cap.
+struct ZoneSchedule {
+  static const uint8_t ALL_WEEKDAYS = 0x7F;   // Bit 0 Sunday ... bit 6 Saturday
+  static const uint8_t MAX_DURATION = 0xFF;   // Minutes
+
+  uint32_t startSecond[MAX_START_TIMES];      // Seconds after local midnight, ascending
+  uint8_t startCount;
+  uint8_t weekdays;
+  uint8_t everyDays;                          // 1 drips on every allowed day
+  uint8_t durationMinutes;                    // 0 disables the zone schedule. Cap of volume drips
+  int32_t anchorDay;                          // Local day number everyDays counts from
+  uint16_t liters;                            // Volume per drip, 0 drips for the duration
+
+  // Clears the drip windows. The volume is kept.
+  void clear(void);
+  bool addStartTime(uint32_t second);
+  bool isDripDay(int32_t localDay) const;
+};
+
+/*------------------------------------------------------------------------------------*/
+/* DripSchedule                                                                       */
+/*------------------------------------------------------------------------------------*/
+// Schedules of all zones compiled into a table of drip windows sorted by start time,
+// covering the local day it was compiled for and the next one. Finding what happens
+// next is a binary search in the table instead of re-deriving local time on each pass.
+// The table is compiled once per day and on every configuration change.
+//
+// Both the schedules and the compiled tables are double buffered: changes are staged
+// with edit() and only take effect, all together, on commit(), which compiles into the
+// inactive table and then swaps. A pass never sees a half-applied configuration.
+class DripSchedule {
+  public:
+    struct Event {
+      time_t start;
+      uint8_t zone;
+      uint8_t durationMinutes;
+      uint16_t liters;
+    };
+    struct Table {
+      Event events[MAX_SCHEDULE_EVENTS];
+      uint8_t count;
+      int32_t firstDay;   // Local day number of the first compiled day
+      time_t validUntil;  // Local midnight after the first day. Recompile from then on
+    };
+    // Converts a local day number and time of day to UTC
+    typedef time_t (*LocalToUtc)(int32_t localDay, uint32_t secondOfDay);
+
+    DripSchedule(uint8_t zoneCount, LocalToUtc toUtc);
+    ~DripSchedule() {};
+
+    // Staged copy of a zone schedule. Changes apply on commit()
+    ZoneSchedule &edit(uint8_t zone);
+    // Active schedule of a zone
+    const ZoneSchedule &get(uint8_t zone) { return _specs[_active][zone]; }
+    // Apply staged changes of every zone at once and compile them for localDay
+    void commit(int32_t localDay);
+    // Drop staged changes
+    void revert(void);
+    // Compile the active schedules for localDay if not done yet. Returns true if the
+    // table changed.
+    bool refresh(int32_t localDay);
+
+    const Table &table(void) { return _tables[_active]; }
+    // Index of the first event starting after t, or count if none
+    uint8_t upperBound(time_t t);
+    uint8_t getZoneCount(void) { return _zoneCount; }
+    uint8_t getMaxDurationMinutes(void);
+
+    // Days since 1970-01-01 of a civil date, and back
+    static int32_t dayNumber(int year, int month, int day);
+    static void civilDate(int32_t dayNumber, int &year, int &month, int &day);
+    static uint8_t weekday(int32_t dayNumber) { return (uint8_t)((dayNumber % 7 + 11) % 7); }
+
+  private:
+    void compile(const ZoneSchedule *specs, int32_t localDay, Table &table);
+
+    LocalToUtc _toUtc;
+    uint8_t _zoneCount;
+    uint8_t _active;
+    ZoneSchedule _specs[2][MAX_ZONES];
+    Table _tables[2];
+};
+
+#endif // DRIP_SCHEDULE_H
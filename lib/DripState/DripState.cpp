@@ -0,0 +1,70 @@
+#include "DripState.h"
+#include <stdio.h>
+#include <string.h>
+
+DripState::DripState(uint8_t zoneCount):
+  _zoneCount(zoneCount > DRIP_STATE_MAX_ZONES ? DRIP_STATE_MAX_ZONES : zoneCount),
+  _valves(0),
+  _mode(Mode::scheduled),
+  _next(0),
+  _rainDelay(0),
+  _alarm("none"),
+  _faults(0),
+  _changed(true),
+  _changes(0) {
+  memset(_liters, 0, sizeof(_liters));
+}
+
+void DripState::setAlarm(const char *alarm) {
+  if (strcmp(_alarm, alarm)) {
+    _alarm = alarm;
+    _changed = true;
+    _changes++;
+  }
+}
+
+void DripState::setLiters(uint8_t zone, uint32_t liters) {
+  if (zone < _zoneCount) {
+    update(_liters[zone], liters);
+  }
+}
+
+const char *DripState::toString(Mode mode) {
+  switch (mode) {
+    case Mode::scheduled: return "scheduled";
+    case Mode::done: return "done";
+    case Mode::dripping: return "dripping";
+    case Mode::rainDelay: return "rainDelay";
+  }
+  return "unknown";
+}
+
+size_t DripState::write(char *buffer, size_t size) {
+  int n = snprintf(buffer, size,
+    "{\"valves\":%u,\"mode\":\"%s\",\"next\":%ld,\"rainDelay\":%ld,\"alarm\":\"%s\",\"faults\":%u,\"liters\":[",
+    _valves, toString(_mode), (long) _next, (long) _rainDelay, _alarm, _faults);
+  if (n < 0 || (size_t) n >= size) {
+    return 0;
+  }
+  size_t len = n;
+  for (uint8_t zone = 0; zone < _zoneCount; zone++) {
+    n = snprintf(buffer + len, size - len, zone ? ",%u" : "%u", _liters[zone]);
+    if (n < 0 || len + n >= size) {
+      return 0;
+    }
+    len += n;
+  }
+  n = snprintf(buffer + len, size - len, "]}");
+  if (n < 0 || len + n >= size) {
+    return 0;
+  }
+  return len + n;
+}
+
+size_t DripState::encode(char *buffer, size_t size) {
+  size_t len = write(buffer, size);
+  if (len) {
+    _changed = false;
+  }
+  return len;
+}
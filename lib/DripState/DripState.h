@@ -0,0 +1,82 @@
+#ifndef DRIP_STATE_H
+#define DRIP_STATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <MemoryBudget.h>
+
+#ifndef DRIP_STATE_MAX_ZONES
+#define DRIP_STATE_MAX_ZONES 8
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* DripState                                                                          */
+/*------------------------------------------------------------------------------------*/
+// Snapshot of what the controller is doing, published as one retained message. Setters
+// only mark the snapshot changed when a field really changes, so the caller publishes
+// once per loop() pass at most, however many transitions the pass went through, and
+// nothing while the state holds still:
+//
+//   {"valves":1,"mode":"dripping","next":1767268800,"rainDelay":0,"alarm":"none",
+//    "faults":0,"liters":[52,0,0,0]}
+//
+// valves and faults are zone masks, next the time of the next start, stop or rain delay
+// end (0 when none is due), rainDelay its end (0 when not in effect) and liters what the
+// last drip of each zone measured.
+class DripState {
+  public:
+    enum class Mode : uint8_t {
+      scheduled,  // Waiting for the next window
+      done,       // No window left before the schedule is compiled again
+      dripping,
+      rainDelay
+    };
+
+    DripState(uint8_t zoneCount);
+    ~DripState() {};
+
+    void setValves(uint8_t mask) { update(_valves, mask); }
+    void setMode(Mode mode) { update(_mode, mode); }
+    void setNextEvent(time_t when) { update(_next, when); }
+    void setRainDelayUntil(time_t when) { update(_rainDelay, when); }
+    // Alarm name as published on the alarm topic ("none" when cleared). Kept by pointer.
+    void setAlarm(const char *alarm);
+    void setFaults(uint8_t mask) { update(_faults, mask); }
+    void setLiters(uint8_t zone, uint32_t liters);
+
+    // Force the next publish, e.g. after connecting to the broker
+    void invalidate(void) { _changed = true; }
+    bool isChanged(void) { return _changed; }
+    // Writes the JSON message and clears the change mark. Returns its length, 0 if it
+    // does not fit.
+    size_t encode(char *buffer, size_t size);
+    // The same message, leaving the change mark, e.g. for the web API
+    size_t write(char *buffer, size_t size);
+    uint32_t getChanges(void) { return _changes; }
+
+    static const char *toString(Mode mode);
+
+  private:
+    template <typename T>
+    void update(T &field, T value) {
+      if (field != value) {
+        field = value;
+        _changed = true;
+        _changes++;
+      }
+    }
+
+    uint8_t _zoneCount;
+    uint8_t _valves;
+    Mode _mode;
+    time_t _next;
+    time_t _rainDelay;
+    const char *_alarm;
+    uint8_t _faults;
+    uint32_t _liters[DRIP_STATE_MAX_ZONES];
+    bool _changed;
+    uint32_t _changes;     // Field changes so far
+};
+
+#endif // DRIP_STATE_H
@@ -0,0 +1,179 @@
+#include "EventScheduler.h"
+
+EventScheduler::EventScheduler(Clock clock):
+  _clock(clock),
+  _size(0),
+  _sequence(0) {
+  for (uint8_t i = 0; i < EVENT_SCHEDULER_CAPACITY; i++) {
+    _slots[i].heapPos = FREE_SLOT;
+    _slots[i].generation = 1;
+    _slots[i].callback = 0;
+  }
+}
+
+EventScheduler::Handle EventScheduler::at(time_t when, Callback callback) {
+  return add(when, 0, callback);
+}
+
+EventScheduler::Handle EventScheduler::in(uint32_t seconds, Callback callback) {
+  return add(_clock() + seconds, 0, callback);
+}
+
+EventScheduler::Handle EventScheduler::every(uint32_t seconds, Callback callback) {
+  if (seconds == 0) {
+    return NO_EVENT;
+  }
+  return add(_clock() + seconds, seconds, callback);
+}
+
+bool EventScheduler::cancel(Handle &handle) {
+  Slot *slot = slotFor(handle);
+  handle = NO_EVENT;
+  if (!slot) {
+    return false;
+  }
+  removeAt(slot->heapPos);
+  return true;
+}
+
+bool EventScheduler::isPending(Handle handle) {
+  return slotFor(handle) != 0;
+}
+
+time_t EventScheduler::getDeadline(Handle handle) {
+  Slot *slot = slotFor(handle);
+  return slot ? slot->deadline : 0;
+}
+
+time_t EventScheduler::nextDeadline(void) {
+  return _size ? _slots[_heap[0]].deadline : 0;
+}
+
+void EventScheduler::shift(int32_t seconds) {
+  // Every deadline moves alike, so the heap order holds
+  for (uint8_t pos = 0; pos < _size; pos++) {
+    _slots[_heap[pos]].deadline += seconds;
+  }
+}
+
+uint8_t EventScheduler::run(uint8_t maxEvents) {
+  uint8_t executed = 0;
+  time_t now = _clock();
+  while (_size && executed < maxEvents) {
+    uint8_t index = _heap[0];
+    Slot &slot = _slots[index];
+    if (slot.deadline > now) {
+      break;
+    }
+    Callback callback = slot.callback;
+    if (slot.period) {
+      // Re-arm before running so the callback may cancel its own handle. Catch up
+      // from now rather than firing a burst after a long stall.
+      slot.deadline += slot.period;
+      if (slot.deadline <= now) {
+        slot.deadline = now + slot.period;
+      }
+      slot.sequence = _sequence++;
+      siftDown(0);
+    } else {
+      removeAt(0);
+    }
+    executed++;
+    callback();
+  }
+  return executed;
+}
+
+EventScheduler::Handle EventScheduler::add(time_t when, uint32_t period, Callback callback) {
+  if (!callback || _size >= EVENT_SCHEDULER_CAPACITY) {
+    return NO_EVENT;
+  }
+  uint8_t index = 0;
+  while (_slots[index].heapPos != FREE_SLOT) {
+    index++;
+  }
+  Slot &slot = _slots[index];
+  slot.deadline = when;
+  slot.period = period;
+  slot.sequence = _sequence++;
+  slot.callback = callback;
+  slot.heapPos = _size;
+  _heap[_size++] = index;
+  siftUp(slot.heapPos);
+  return (Handle)(((uint16_t)slot.generation << 8) | index);
+}
+
+EventScheduler::Slot *EventScheduler::slotFor(Handle handle) {
+  uint8_t index = handle & 0xFF;
+  if (handle == NO_EVENT || index >= EVENT_SCHEDULER_CAPACITY) {
+    return 0;
+  }
+  Slot *slot = &_slots[index];
+  if (slot->heapPos == FREE_SLOT || slot->generation != (handle >> 8)) {
+    return 0;
+  }
+  return slot;
+}
+
+bool EventScheduler::before(uint8_t a, uint8_t b) {
+  const Slot &x = _slots[_heap[a]];
+  const Slot &y = _slots[_heap[b]];
+  if (x.deadline != y.deadline) {
+    return x.deadline < y.deadline;
+  }
+  return (int32_t)(x.sequence - y.sequence) < 0;
+}
+
+void EventScheduler::swap(uint8_t i, uint8_t j) {
+  uint8_t aux = _heap[i];
+  _heap[i] = _heap[j];
+  _heap[j] = aux;
+  _slots[_heap[i]].heapPos = i;
+  _slots[_heap[j]].heapPos = j;
+}
+
+void EventScheduler::siftUp(uint8_t pos) {
+  while (pos > 0) {
+    uint8_t parent = (pos - 1) / 2;
+    if (!before(pos, parent)) {
+      break;
+    }
+    swap(pos, parent);
+    pos = parent;
+  }
+}
+
+void EventScheduler::siftDown(uint8_t pos) {
+  for (;;) {
+    uint8_t left = 2 * pos + 1;
+    uint8_t right = left + 1;
+    uint8_t smallest = pos;
+    if (left < _size && before(left, smallest)) {
+      smallest = left;
+    }
+    if (right < _size && before(right, smallest)) {
+      smallest = right;
+    }
+    if (smallest == pos) {
+      break;
+    }
+    swap(pos, smallest);
+    pos = smallest;
+  }
+}
+
+void EventScheduler::removeAt(uint8_t pos) {
+  uint8_t index = _heap[pos];
+  _size--;
+  if (pos != _size) {
+    _heap[pos] = _heap[_size];
+    _slots[_heap[pos]].heapPos = pos;
+    siftDown(pos);
+    siftUp(pos);
+  }
+  Slot &slot = _slots[index];
+  slot.heapPos = FREE_SLOT;
+  slot.callback = 0;
+  // Generation 0 would let a handle collide with NO_EVENT for slot 0
+  slot.generation = slot.generation == 0xFF ? 1 : slot.generation + 1;
+}
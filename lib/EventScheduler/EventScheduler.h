@@ -0,0 +1,83 @@
+#ifndef EVENT_SCHEDULER_H
+#define EVENT_SCHEDULER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <MemoryBudget.h>
+
+#ifndef EVENT_SCHEDULER_CAPACITY
+#define EVENT_SCHEDULER_CAPACITY 16
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* EventScheduler                                                                     */
+/*------------------------------------------------------------------------------------*/
+// Single deadline-ordered timer queue with one second precision. Pending events live
+// in a fixed-size indexed binary min-heap, so scheduling and cancelling cost O(log n)
+// and nothing is allocated at runtime. Callbacks are never run from timer context:
+// run() executes the due ones from loop(). The clock is injected so the queue can be
+// driven by a virtual clock on the host.
+class EventScheduler {
+  public:
+    typedef void (*Callback)(void);
+    typedef time_t (*Clock)(void);
+    // Opaque event handle. Encodes slot and generation so stale handles never cancel
+    // a newer event that reused the slot. 0 is never a valid handle.
+    typedef uint16_t Handle;
+    static const Handle NO_EVENT = 0;
+
+    EventScheduler(Clock clock);
+    ~EventScheduler() {};
+
+    // One-shot event at an absolute time, or after a delay in seconds
+    Handle at(time_t when, Callback callback);
+    Handle in(uint32_t seconds, Callback callback);
+    // Periodic event. First run one interval from now
+    Handle every(uint32_t seconds, Callback callback);
+
+    // Cancel a pending event. The handle is reset to NO_EVENT. Returns false when the
+    // event already ran or was cancelled.
+    bool cancel(Handle &handle);
+    bool isPending(Handle handle);
+    time_t getDeadline(Handle handle);
+
+    // Earliest pending deadline, or 0 when the queue is empty
+    time_t nextDeadline(void);
+    uint8_t size(void) { return _size; }
+    time_t now(void) { return _clock(); }
+
+    // The clock stepped by seconds (e.g. set by NTP). Moves every deadline along, so
+    // periodic events keep their pace.
+    void shift(int32_t seconds);
+
+    // Run due events in deadline order. At most maxEvents per call keeps loop() latency
+    // bounded; the rest run on the next pass. Returns the number of events executed.
+    uint8_t run(uint8_t maxEvents = 4);
+
+  private:
+    struct Slot {
+      time_t deadline;
+      uint32_t period;    // 0 for one-shot events
+      uint32_t sequence;  // Keeps FIFO order among equal deadlines
+      Callback callback;
+      uint8_t heapPos;    // Position in _heap, or FREE_SLOT
+      uint8_t generation;
+    };
+    static const uint8_t FREE_SLOT = 0xFF;
+
+    Handle add(time_t when, uint32_t period, Callback callback);
+    Slot *slotFor(Handle handle);
+    bool before(uint8_t a, uint8_t b);
+    void swap(uint8_t i, uint8_t j);
+    void siftUp(uint8_t pos);
+    void siftDown(uint8_t pos);
+    void removeAt(uint8_t pos);
+
+    Clock _clock;
+    Slot _slots[EVENT_SCHEDULER_CAPACITY];
+    uint8_t _heap[EVENT_SCHEDULER_CAPACITY];   // Slot indexes ordered as a min-heap
+    uint8_t _size;
+    uint32_t _sequence;
+};
+
+#endif // EVENT_SCHEDULER_H
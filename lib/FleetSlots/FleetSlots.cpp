@@ -0,0 +1,127 @@
+#include "FleetSlots.h"
+#include <stdio.h>
+#include <string.h>
+
+FleetSlots::FleetSlots(uint32_t device, uint16_t settleSeconds):
+  _peerCount(0),
+  _budget(0),
+  _settleSeconds(settleSeconds) {
+  memset(&_own, 0, sizeof(_own));
+  _own.device = device;
+}
+
+bool FleetSlots::update(const Claim &claim, time_t now) {
+  if (claim.device == _own.device) {
+    return true;
+  }
+  // Drop claims that are over, and the previous claim of this device
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < _peerCount; i++) {
+    if (_peers[i].end > now && _peers[i].device != claim.device) {
+      _peers[kept++] = _peers[i];
+    }
+  }
+  _peerCount = kept;
+  if (claim.end <= now) {
+    return true;
+  }
+  if (_peerCount >= FLEET_MAX_PEERS) {
+    return false;
+  }
+  _peers[_peerCount++] = claim;
+  return true;
+}
+
+const FleetSlots::Claim &FleetSlots::plan(time_t now, uint32_t seconds, uint16_t flow) {
+  _own.at = now;
+  _own.flow = flow;
+  _own.start = findSlot(now + _settleSeconds, seconds, flow, now);
+  _own.end = _own.start + seconds;
+  return _own;
+}
+
+bool FleetSlots::check(time_t now) {
+  if (!hasClaim() || isStarted(now) || fits(_own.start, _own.end, _own.flow, now)) {
+    return false;
+  }
+  uint32_t seconds = _own.end - _own.start;
+  time_t from = now + _settleSeconds;
+  _own.start = findSlot(from > _own.start ? from : _own.start, seconds, _own.flow, now);
+  _own.end = _own.start + seconds;
+  return true;
+}
+
+bool FleetSlots::ranksBefore(const Claim &a, const Claim &b) {
+  return a.at < b.at || (a.at == b.at && a.device < b.device);
+}
+
+// Claims the own claim has to work around
+bool FleetSlots::isAdmitted(const Claim &peer, time_t now) {
+  return peer.end > now && (peer.start <= now || ranksBefore(peer, _own));
+}
+
+bool FleetSlots::fits(time_t start, time_t end, uint16_t flow, time_t now) {
+  // The load only rises where a claim starts: check the slot start and those points
+  for (uint8_t i = 0; i <= _peerCount; i++) {
+    time_t point = i == _peerCount ? start : _peers[i].start;
+    if (point < start || point >= end) {
+      continue;
+    }
+    uint32_t load = 0;
+    for (uint8_t j = 0; j < _peerCount; j++) {
+      const Claim &peer = _peers[j];
+      if (isAdmitted(peer, now) && peer.start <= point && point < peer.end) {
+        load += peer.flow;
+      }
+    }
+    if (load > 0 && load + flow > _budget) {
+      return false;
+    }
+  }
+  return true;
+}
+
+time_t FleetSlots::findSlot(time_t from, uint32_t seconds, uint16_t flow, time_t now) {
+  // The earliest slot starts at from or where an admitted claim ends
+  time_t best = 0;
+  for (uint8_t i = 0; i <= _peerCount; i++) {
+    time_t candidate = i == _peerCount ? from : _peers[i].end;
+    if (candidate < from || (best && candidate >= best)) {
+      continue;
+    }
+    if (i < _peerCount && !isAdmitted(_peers[i], now)) {
+      continue;
+    }
+    if (fits(candidate, candidate + seconds, flow, now)) {
+      best = candidate;
+    }
+  }
+  // Nothing admitted flows after the last end, so best is always found
+  return best ? best : from;
+}
+
+size_t FleetSlots::encode(const Claim &claim, char *buffer, size_t size) {
+  int len = snprintf(buffer, size, "{\"start\":%ld,\"end\":%ld,\"lpm\":%u.%u,\"at\":%ld}",
+    (long) claim.start, (long) claim.end, claim.flow / 10, claim.flow % 10, (long) claim.at);
+  return len > 0 && (size_t) len < size ? len : 0;
+}
+
+bool FleetSlots::decode(const char *payload, size_t length, Claim &claim) {
+  char text[FLEET_CLAIM_MESSAGE_SIZE];
+  if (length >= sizeof(text)) {
+    return false;
+  }
+  memcpy(text, payload, length);
+  text[length] = 0;
+  long start, end, at;
+  unsigned int liters, tenths;
+  if (sscanf(text, "{\"start\":%ld,\"end\":%ld,\"lpm\":%u.%1u,\"at\":%ld}", &start, &end, &liters, &tenths, &at) != 5 ||
+      end < start || liters * 10 + tenths > 0xFFFF) {
+    return false;
+  }
+  claim.start = start;
+  claim.end = end;
+  claim.at = at;
+  claim.flow = liters * 10 + tenths;
+  return true;
+}
@@ -0,0 +1,86 @@
+#ifndef FLEET_SLOTS_H
+#define FLEET_SLOTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <MemoryBudget.h>
+
+#ifndef FLEET_MAX_PEERS
+#define FLEET_MAX_PEERS 16          // Other controllers of the group tracked at once
+#endif
+#ifndef FLEET_CLAIM_MESSAGE_SIZE
+#define FLEET_CLAIM_MESSAGE_SIZE 80
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* FleetSlots                                                                         */
+/*------------------------------------------------------------------------------------*/
+// Staggered starts of several controllers on one water main. Each controller of a group
+// claims a time slot for its next drip, with the flow it expects, as a retained message:
+//
+//   {"start":1767268805,"end":1767271505,"lpm":6.5,"at":1767268800}
+//
+// A slot is granted when the flow of the claims overlapping it plus its own stays within
+// the group's flow budget, or when nothing else flows then. Claims rank by the time they
+// were made, then by device id. A claim only has to give way to claims ranked before it
+// and to slots already running. Every controller sees the same claims and so comes to
+// the same ranking: when two claims collide, the one ranked after moves to the earliest
+// slot that fits. Slots start a settle time after they are claimed, long enough for the
+// claims of the others to arrive, and never move once started.
+//
+// Flows are in deciliters per minute. Time is passed in by the caller.
+class FleetSlots {
+  public:
+    struct Claim {
+      uint32_t device;
+      time_t start;
+      time_t end;       // 0 no claim
+      time_t at;        // When the claim was made. Ranks the claims
+      uint16_t flow;
+    };
+
+    FleetSlots(uint32_t device, uint16_t settleSeconds);
+    ~FleetSlots() {};
+
+    // Flow budget of the group. 0 turns coordination off.
+    void setBudget(uint16_t flow) { _budget = flow; }
+    uint16_t getBudget(void) { return _budget; }
+    bool isEnabled(void) { return _budget != 0; }
+    uint32_t getDevice(void) { return _own.device; }
+
+    // Claims of the other controllers. A claim with no end removes the device. Returns
+    // false if the table is full.
+    bool update(const Claim &claim, time_t now);
+    // Forget every other controller, e.g. after changing group
+    void clear(void) { _peerCount = 0; }
+    uint8_t getPeerCount(void) { return _peerCount; }
+
+    // Claim the earliest slot of the given length that fits. Returns the claim.
+    const Claim &plan(time_t now, uint32_t seconds, uint16_t flow);
+    // After other claims changed: move the claim if it has to give way. Returns true if
+    // it moved.
+    bool check(time_t now);
+    void release(void) { _own.end = 0; }
+    bool hasClaim(void) { return _own.end != 0; }
+    bool isStarted(time_t now) { return hasClaim() && _own.start <= now; }
+    const Claim &getClaim(void) { return _own; }
+
+    // Retained message payload of a claim, and back
+    static size_t encode(const Claim &claim, char *buffer, size_t size);
+    static bool decode(const char *payload, size_t length, Claim &claim);
+
+  private:
+    bool ranksBefore(const Claim &a, const Claim &b);
+    bool isAdmitted(const Claim &peer, time_t now);
+    bool fits(time_t start, time_t end, uint16_t flow, time_t now);
+    time_t findSlot(time_t from, uint32_t seconds, uint16_t flow, time_t now);
+
+    Claim _own;
+    Claim _peers[FLEET_MAX_PEERS];
+    uint8_t _peerCount;
+    uint16_t _budget;
+    uint16_t _settleSeconds;
+};
+
+#endif // FLEET_SLOTS_H
@@ -0,0 +1,324 @@
+#include "FlowHistory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void FlowHistory::Totals::clear(void) {
+  memset(this, 0, sizeof(*this));
+}
+
+void FlowHistory::Totals::add(const Record &record) {
+  if (!first || record.time < first) {
+    first = record.time;
+  }
+  if (record.time > last) {
+    last = record.time;
+  }
+  if (record.type == Type::flow) {
+    minPulses = minutes && minPulses < record.value ? minPulses : record.value;
+    maxPulses = maxPulses > record.value ? maxPulses : record.value;
+    pulses += record.value;
+    minutes++;
+  } else if (record.type == Type::drip) {
+    drips++;
+    dripSeconds += record.seconds;
+    dripLiters += record.value;
+  }
+}
+
+void FlowHistory::Totals::add(const Totals &totals) {
+  if (!totals.first) {
+    return;
+  }
+  if (!first || totals.first < first) {
+    first = totals.first;
+  }
+  if (totals.last > last) {
+    last = totals.last;
+  }
+  if (totals.minutes) {
+    minPulses = minutes && minPulses < totals.minPulses ? minPulses : totals.minPulses;
+    maxPulses = maxPulses > totals.maxPulses ? maxPulses : totals.maxPulses;
+  }
+  pulses += totals.pulses;
+  minutes += totals.minutes;
+  drips += totals.drips;
+  dripSeconds += totals.dripSeconds;
+  dripLiters += totals.dripLiters;
+}
+
+FlowHistory::FlowHistory(fs::FS &fs, const char *dir):
+  _fs(fs),
+  _dir(dir),
+  _chunkCount(0),
+  _lastTime(0),
+  _minute(0),
+  _minutePulses(0) {
+}
+
+bool FlowHistory::begin(void) {
+  char name[32];
+  _chunkCount = 0;
+  _fs.mkdir(_dir);
+  // Totals of sealed chunks from the index
+  snprintf(name, sizeof(name), "%s/index", _dir);
+  File index = _fs.open(name, "r");
+  if (index) {
+    uint32_t magic = 0;
+    if (index.read((uint8_t *) &magic, sizeof(magic)) == sizeof(magic) && magic == INDEX_MAGIC) {
+      while (_chunkCount < FLOW_HISTORY_MAX_CHUNKS &&
+             index.read((uint8_t *) &_chunks[_chunkCount], sizeof(Chunk)) == sizeof(Chunk)) {
+        _chunks[_chunkCount].sealed = 1;
+        _chunkCount++;
+      }
+    }
+    index.close();
+  }
+  // Chunk files. Those missing from the index (the open chunk, or a chunk sealed just
+  // before a power loss) are scanned. Index entries without a file are dropped.
+  uint64_t present = 0;
+  uint8_t indexed = _chunkCount;
+  bool changed = false;
+  Dir dir = _fs.openDir(_dir);
+  while (dir.next()) {
+    String fileName = dir.fileName();
+    char *end;
+    uint32_t sequence = strtoul(fileName.c_str(), &end, 10);
+    if (*end || !sequence) {
+      continue;   // Not a chunk
+    }
+    uint8_t i = 0;
+    while (i < indexed && _chunks[i].sequence != sequence) {
+      i++;
+    }
+    if (i == indexed) {
+      if (_chunkCount == FLOW_HISTORY_MAX_CHUNKS) {
+        continue;
+      }
+      i = _chunkCount++;
+      memset(&_chunks[i], 0, sizeof(Chunk));
+      _chunks[i].sequence = sequence;
+      scanChunk(_chunks[i]);
+      changed = true;
+    }
+    present |= 1ULL << i;
+  }
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < _chunkCount; i++) {
+    if (present & (1ULL << i)) {
+      _chunks[kept++] = _chunks[i];
+    }
+  }
+  changed = changed || kept != _chunkCount;
+  _chunkCount = kept;
+  // Oldest first
+  for (uint8_t i = 1; i < _chunkCount; i++) {
+    Chunk chunk = _chunks[i];
+    uint8_t j = i;
+    for (; j > 0 && _chunks[j - 1].sequence > chunk.sequence; j--) {
+      _chunks[j] = _chunks[j - 1];
+    }
+    _chunks[j] = chunk;
+  }
+  // Only the newest chunk may take more records
+  for (uint8_t i = 0; i + 1 < _chunkCount; i++) {
+    _chunks[i].sealed = 1;
+  }
+  if (_chunkCount) {
+    _lastTime = _chunks[_chunkCount - 1].totals.last;
+  }
+  return changed ? saveIndex() : true;
+}
+
+void FlowHistory::sample(time_t now, uint32_t pulses) {
+  if (now < (time_t) MIN_VALID_TIME) {
+    return;
+  }
+  uint32_t minute = now / 60;
+  if (minute != _minute) {
+    if (_minutePulses) {
+      Record record = { _minute * 60, _minutePulses, 60, Type::flow, 0 };
+      append(record);
+    }
+    _minute = minute;
+    _minutePulses = 0;
+  }
+  _minutePulses += pulses;
+}
+
+bool FlowHistory::logDrip(time_t end, uint8_t zone, uint8_t outcome, uint32_t seconds, uint32_t liters) {
+  if (end < (time_t) MIN_VALID_TIME) {
+    return false;
+  }
+  Record record = { (uint32_t) end, liters, (uint16_t) (seconds > 0xFFFF ? 0xFFFF : seconds), Type::drip,
+    (uint8_t) ((zone & 0x0F) | outcome << 4) };
+  return append(record);
+}
+
+bool FlowHistory::query(time_t from, time_t to, Totals &totals) {
+  totals.clear();
+  if (to < from) {
+    return false;
+  }
+  for (uint8_t i = 0; i < _chunkCount; i++) {
+    const Chunk &chunk = _chunks[i];
+    if (!chunk.count || chunk.totals.last < (uint32_t) from || chunk.totals.first > (uint32_t) to) {
+      continue;
+    }
+    if ((uint32_t) from <= chunk.totals.first && chunk.totals.last <= (uint32_t) to) {
+      totals.add(chunk.totals);
+    } else {
+      queryChunk(chunk, from, to, totals);
+    }
+  }
+  return true;
+}
+
+uint32_t FlowHistory::getRecordCount(void) {
+  uint32_t count = 0;
+  for (uint8_t i = 0; i < _chunkCount; i++) {
+    count += _chunks[i].count;
+  }
+  return count;
+}
+
+bool FlowHistory::append(Record &record) {
+  if (record.time < _lastTime) {
+    record.time = _lastTime;   // Clock stepped back. Keep the log in time order.
+  }
+  if (!_chunkCount || _chunks[_chunkCount - 1].sealed || _chunks[_chunkCount - 1].count >= FLOW_HISTORY_CHUNK_RECORDS) {
+    if (!openChunk()) {
+      return false;
+    }
+  }
+  Chunk &chunk = _chunks[_chunkCount - 1];
+  char name[32];
+  path(name, sizeof(name), chunk.sequence);
+  File file = _fs.open(name, "a");
+  size_t written = file ? file.write((const uint8_t *) &record, sizeof(record)) : 0;
+  if (file) {
+    file.close();
+  }
+  if (written != sizeof(record)) {
+    // A partial record would misalign the chunk. Start a new one on the next record.
+    chunk.sealed = 1;
+    saveIndex();
+    return false;
+  }
+  chunk.count++;
+  chunk.totals.add(record);
+  _lastTime = record.time;
+  return true;
+}
+
+bool FlowHistory::openChunk(void) {
+  uint32_t sequence = _chunkCount ? _chunks[_chunkCount - 1].sequence + 1 : 1;
+  if (_chunkCount) {
+    _chunks[_chunkCount - 1].sealed = 1;
+  }
+  // Room for the new chunk: roll off the oldest ones
+  FSInfo info;
+  const uint32_t chunkBytes = FLOW_HISTORY_CHUNK_RECORDS * sizeof(Record);
+  while (_chunkCount >= FLOW_HISTORY_MAX_CHUNKS ||
+         (_chunkCount && _fs.info(info) && info.totalBytes - info.usedBytes < 2 * chunkBytes)) {
+    dropOldest();
+  }
+  Chunk &chunk = _chunks[_chunkCount++];
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.sequence = sequence;
+  return saveIndex();
+}
+
+void FlowHistory::dropOldest(void) {
+  char name[32];
+  path(name, sizeof(name), _chunks[0].sequence);
+  _fs.remove(name);
+  _chunkCount--;
+  memmove(&_chunks[0], &_chunks[1], _chunkCount * sizeof(Chunk));
+}
+
+bool FlowHistory::saveIndex(void) {
+  // Rewritten when a chunk is sealed or dropped, a few times a month
+  char name[32];
+  snprintf(name, sizeof(name), "%s/index", _dir);
+  File index = _fs.open(name, "w");
+  if (!index) {
+    return false;
+  }
+  uint32_t magic = INDEX_MAGIC;
+  bool saved = index.write((const uint8_t *) &magic, sizeof(magic)) == sizeof(magic);
+  for (uint8_t i = 0; i < _chunkCount && saved; i++) {
+    if (_chunks[i].sealed) {
+      saved = index.write((const uint8_t *) &_chunks[i], sizeof(Chunk)) == sizeof(Chunk);
+    }
+  }
+  index.close();
+  return saved;
+}
+
+bool FlowHistory::scanChunk(Chunk &chunk) {
+  char name[32];
+  path(name, sizeof(name), chunk.sequence);
+  File file = _fs.open(name, "r");
+  if (!file) {
+    return false;
+  }
+  size_t size = file.size();
+  chunk.count = size / sizeof(Record);
+  // A partial record at the end was cut by a power loss
+  chunk.sealed = size % sizeof(Record) != 0 || chunk.count >= FLOW_HISTORY_CHUNK_RECORDS;
+  chunk.totals.clear();
+  Record records[16];
+  for (uint16_t i = 0; i < chunk.count; ) {
+    uint16_t n = chunk.count - i < 16 ? chunk.count - i : 16;
+    if (file.read((uint8_t *) records, n * sizeof(Record)) != n * sizeof(Record)) {
+      chunk.count = i;
+      chunk.sealed = 1;
+      break;
+    }
+    for (uint16_t j = 0; j < n; j++) {
+      chunk.totals.add(records[j]);
+    }
+    i += n;
+  }
+  file.close();
+  return true;
+}
+
+void FlowHistory::queryChunk(const Chunk &chunk, uint32_t from, uint32_t to, Totals &totals) {
+  char name[32];
+  path(name, sizeof(name), chunk.sequence);
+  File file = _fs.open(name, "r");
+  if (!file) {
+    return;
+  }
+  // First record at or after from. Records are in time order.
+  Record record;
+  uint16_t low = 0;
+  uint16_t high = chunk.count;
+  while (low < high) {
+    uint16_t mid = (low + high) / 2;
+    if (!file.seek(mid * sizeof(Record), SeekSet) ||
+        file.read((uint8_t *) &record, sizeof(record)) != sizeof(record)) {
+      file.close();
+      return;
+    }
+    if (record.time < from) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  file.seek(low * sizeof(Record), SeekSet);
+  for (uint16_t i = low; i < chunk.count; i++) {
+    if (file.read((uint8_t *) &record, sizeof(record)) != sizeof(record) || record.time > to) {
+      break;
+    }
+    totals.add(record);
+  }
+  file.close();
+}
+
+void FlowHistory::path(char *buffer, size_t size, uint32_t sequence) {
+  snprintf(buffer, size, "%s/%u", _dir, sequence);
+}
@@ -0,0 +1,105 @@
+#ifndef FLOW_HISTORY_H
+#define FLOW_HISTORY_H
+
+#include <stdint.h>
+#include <time.h>
+#include <FS.h>
+#include <MemoryBudget.h>
+
+#ifndef FLOW_HISTORY_CHUNK_RECORDS
+#define FLOW_HISTORY_CHUNK_RECORDS 1024   // 12 KB chunk files
+#endif
+#ifndef FLOW_HISTORY_MAX_CHUNKS
+#define FLOW_HISTORY_MAX_CHUNKS 48        // About a year of daily drips
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* FlowHistory                                                                        */
+/*------------------------------------------------------------------------------------*/
+// Append-only log of per-minute flow and drip sessions kept on the file system, so the
+// history survives the broker or its consumers being down.
+//
+// The log is a sequence of chunk files (<dir>/<sequence>) of fixed-size records in time
+// order. Only minutes with flow are logged. When a chunk is full it is sealed and its
+// totals are added to the index file (<dir>/index), the sparse time index: one entry per
+// chunk with its time range and aggregates, kept in RAM. A range query adds up the
+// entries of the chunks fully inside the range and reads only the records of the two
+// chunks at its ends, found by binary search. Its cost does not grow with the log.
+//
+// The oldest chunk is deleted when there are FLOW_HISTORY_MAX_CHUNKS or the file system
+// runs low on space.
+class FlowHistory {
+  public:
+    enum class Type : uint8_t {
+      flow = 1,   // value: pulses in the minute starting at time
+      drip = 2    // value: liters of a drip that ended at time, info: zone | outcome << 4
+    };
+    static const uint32_t MIN_VALID_TIME = 1577836800;   // 2020-01-01. Clock not set before
+    struct Record {
+      uint32_t time;
+      uint32_t value;
+      uint16_t seconds;
+      Type type;
+      uint8_t info;
+    };
+    // Aggregates of a time range
+    struct Totals {
+      uint32_t first;         // Time of the first and last record. 0 if empty
+      uint32_t last;
+      uint32_t pulses;        // Flow
+      uint32_t minutes;       // Minutes with flow
+      uint32_t minPulses;     // Per minute, over minutes with flow
+      uint32_t maxPulses;
+      uint32_t drips;
+      uint32_t dripSeconds;
+      uint32_t dripLiters;
+
+      void clear(void);
+      void add(const Record &record);
+      void add(const Totals &totals);
+    };
+
+    FlowHistory(fs::FS &fs, const char *dir);
+    ~FlowHistory() {};
+
+    // Load the index. Call once the file system is mounted.
+    bool begin(void);
+
+    // Call with the pulses counted since the previous call. A flow record is logged for
+    // every minute with flow once the minute is over.
+    void sample(time_t now, uint32_t pulses);
+    bool logDrip(time_t end, uint8_t zone, uint8_t outcome, uint32_t seconds, uint32_t liters);
+
+    // Aggregates of the records with from <= time <= to
+    bool query(time_t from, time_t to, Totals &totals);
+
+    uint8_t getChunkCount(void) { return _chunkCount; }
+    uint32_t getRecordCount(void);
+
+  private:
+    static const uint32_t INDEX_MAGIC = 0x58444946;   // "FIDX"
+    struct Chunk {
+      uint32_t sequence;
+      uint16_t count;       // Records
+      uint16_t sealed;      // No more records go to this chunk
+      Totals totals;
+    };
+
+    bool append(Record &record);
+    bool openChunk(void);
+    void dropOldest(void);
+    bool saveIndex(void);
+    bool scanChunk(Chunk &chunk);
+    void queryChunk(const Chunk &chunk, uint32_t from, uint32_t to, Totals &totals);
+    void path(char *buffer, size_t size, uint32_t sequence);
+
+    fs::FS &_fs;
+    const char *_dir;
+    Chunk _chunks[FLOW_HISTORY_MAX_CHUNKS];   // Oldest first. The last one is open
+    uint8_t _chunkCount;
+    uint32_t _lastTime;       // Records never go back in time
+    uint32_t _minute;         // Minute being accumulated
+    uint32_t _minutePulses;
+};
+
+#endif // FLOW_HISTORY_H
@@ -0,0 +1,144 @@
+#include "FlowMonitor.h"
+#include <math.h>
+
+const FlowMonitor::Config FlowMonitor::DEFAULT_CONFIG = {
+  20,     // graceSeconds
+  10,     // leakSeconds
+  2,      // leakMinPulses
+  30,     // noFlowSeconds
+  5,      // burstSeconds
+  4,      // burstSigmas
+  50,     // burstMarginPercent
+  60,     // minSamples
+  3600    // maxSamples
+};
+
+FlowMonitor::FlowMonitor(uint8_t zoneCount, const Config &config):
+  _config(config),
+  _zoneCount(zoneCount > MAX_ZONES ? MAX_ZONES : zoneCount),
+  _openMask(0),
+  _settle(config.graceSeconds),
+  _leakRun(0),
+  _noFlowRun(0),
+  _burstRun(0),
+  _active(Alarm::none),
+  _lastAlarm(Alarm::none),
+  _alarmZones(0) {
+  for (uint8_t zone = 0; zone < MAX_ZONES; zone++) {
+    resetBaseline(zone);
+  }
+}
+
+FlowMonitor::Alarm FlowMonitor::sample(uint16_t pulses, uint8_t openMask) {
+  if (openMask != _openMask) {
+    // Valves changed: pipes fill or drain for a while. Start a new episode.
+    _openMask = openMask;
+    _settle = _config.graceSeconds;
+    _leakRun = _noFlowRun = _burstRun = 0;
+    _active = Alarm::none;
+  }
+  if (_settle) {
+    _settle--;
+    return Alarm::none;
+  }
+
+  if (openMask == 0) {
+    // Every valve closed: any sustained flow is a leak
+    _leakRun = pulses >= _config.leakMinPulses ? _leakRun + 1 : 0;
+    if (_leakRun >= _config.leakSeconds) {
+      return raise(Alarm::leak, 0);
+    }
+    if (_leakRun == 0) {
+      _active = Alarm::none;
+    }
+    return Alarm::none;
+  }
+
+  // Some valve open: expected flow is the sum of the open zones' baselines
+  _noFlowRun = pulses == 0 ? _noFlowRun + 1 : 0;
+  if (_noFlowRun >= _config.noFlowSeconds) {
+    return raise(Alarm::noFlow, openMask);
+  }
+  float expected = 0;
+  float variance = 0;
+  bool trusted = true;
+  uint8_t open = 0;
+  uint8_t onlyZone = 0;
+  for (uint8_t zone = 0; zone < _zoneCount; zone++) {
+    if (openMask & (1 << zone)) {
+      open++;
+      onlyZone = zone;
+      trusted = trusted && _samples[zone] >= _config.minSamples;
+      expected += _mean[zone];
+      variance += _samples[zone] > 1 ? _m2[zone] / (_samples[zone] - 1) : 0;
+    }
+  }
+  bool burst = false;
+  if (trusted) {
+    float limit = expected + _config.burstSigmas * sqrtf(variance);
+    float margin = expected * (100 + _config.burstMarginPercent) / 100;
+    burst = pulses > (limit > margin ? limit : margin) && pulses > _config.leakMinPulses;
+  }
+  _burstRun = burst ? _burstRun + 1 : 0;
+  if (_burstRun >= _config.burstSeconds) {
+    return raise(Alarm::burst, openMask);
+  }
+  if (!burst && pulses > 0) {
+    // Normal sample. Only single-zone runs can be attributed to a baseline.
+    _active = Alarm::none;
+    if (open == 1) {
+      learn(onlyZone, pulses);
+    }
+  }
+  return Alarm::none;
+}
+
+const char *FlowMonitor::toString(Alarm alarm) {
+  switch (alarm) {
+    case Alarm::leak: return "leak";
+    case Alarm::noFlow: return "noflow";
+    case Alarm::burst: return "burst";
+    default: return "none";
+  }
+}
+
+float FlowMonitor::getBaselineStdDev(uint8_t zone) {
+  if (zone >= _zoneCount || _samples[zone] < 2) {
+    return 0;
+  }
+  return sqrtf(_m2[zone] / (_samples[zone] - 1));
+}
+
+void FlowMonitor::resetBaseline(uint8_t zone) {
+  if (zone >= MAX_ZONES) {
+    return;
+  }
+  _samples[zone] = 0;
+  _mean[zone] = 0;
+  _m2[zone] = 0;
+}
+
+void FlowMonitor::learn(uint8_t zone, uint16_t pulses) {
+  if (_samples[zone] < _config.maxSamples) {
+    _samples[zone]++;
+  } else {
+    // Keep the weight of the history constant so the baseline follows slow changes
+    // (e.g. emitters clogging over a season)
+    _m2[zone] *= (float)(_samples[zone] - 1) / _samples[zone];
+  }
+  float delta = pulses - _mean[zone];
+  _mean[zone] += delta / _samples[zone];
+  _m2[zone] += delta * (pulses - _mean[zone]);
+}
+
+FlowMonitor::Alarm FlowMonitor::raise(Alarm alarm, uint8_t zones) {
+  if (_active == alarm) {
+    // Already raised in this episode
+    return Alarm::none;
+  }
+  _active = alarm;
+  _lastAlarm = alarm;
+  _alarmZones = zones;
+  _leakRun = _noFlowRun = _burstRun = 0;
+  return alarm;
+}
@@ -0,0 +1,80 @@
+#ifndef FLOW_MONITOR_H
+#define FLOW_MONITOR_H
+
+#include <stdint.h>
+#include <MemoryBudget.h>
+
+#ifndef MAX_ZONES
+#define MAX_ZONES 8
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* FlowMonitor                                                                        */
+/*------------------------------------------------------------------------------------*/
+// Streaming analytics over the per-second flow meter pulse counts. Keeps a running
+// mean and variance of each zone's flow (its baseline) in constant memory and detects:
+//   - leak:   flow while every valve is closed (leaking pipe or stuck valve)
+//   - noFlow: no flow while a valve is open (dry supply or failed solenoid)
+//   - burst:  flow far above the learned baseline of the open zones (burst line)
+// Each condition must persist for a few seconds, after a grace period following any
+// valve change, before the alarm is raised. An alarm is raised once per episode.
+class FlowMonitor {
+  public:
+    enum class Alarm : uint8_t {
+      none,
+      leak,
+      noFlow,
+      burst
+    };
+    struct Config {
+      uint8_t graceSeconds;       // Ignore samples after valves change (fill / drain)
+      uint8_t leakSeconds;        // Consecutive seconds of flow with valves closed
+      uint8_t leakMinPulses;      // Pulses per second counted as flow
+      uint8_t noFlowSeconds;      // Consecutive seconds without flow with a valve open
+      uint8_t burstSeconds;       // Consecutive seconds above baseline
+      uint8_t burstSigmas;        // Deviation counted as burst, in standard deviations
+      uint8_t burstMarginPercent; // ... and at least this much above the mean
+      uint16_t minSamples;        // Samples needed before a baseline is trusted
+      uint16_t maxSamples;        // Weight cap. Older samples fade out past this count
+    };
+    static const Config DEFAULT_CONFIG;
+
+    FlowMonitor(uint8_t zoneCount, const Config &config = DEFAULT_CONFIG);
+    ~FlowMonitor() {};
+
+    // Feed one second worth of pulses and the mask of zones open during that second.
+    // Returns the alarm raised by this sample, if any.
+    Alarm sample(uint16_t pulses, uint8_t openMask);
+
+    // Zones involved in the last alarm (open zones for noFlow and burst)
+    uint8_t getAlarmZones(void) { return _alarmZones; }
+    Alarm getLastAlarm(void) { return _lastAlarm; }
+    static const char *toString(Alarm alarm);
+
+    float getBaselineMean(uint8_t zone) { return zone < _zoneCount ? _mean[zone] : 0; }
+    float getBaselineStdDev(uint8_t zone);
+    uint16_t getBaselineSamples(uint8_t zone) { return zone < _zoneCount ? _samples[zone] : 0; }
+    void resetBaseline(uint8_t zone);
+
+  private:
+    void learn(uint8_t zone, uint16_t pulses);
+    Alarm raise(Alarm alarm, uint8_t zones);
+
+    Config _config;
+    uint8_t _zoneCount;
+    // Baseline per zone (Welford's online algorithm)
+    uint16_t _samples[MAX_ZONES];
+    float _mean[MAX_ZONES];
+    float _m2[MAX_ZONES];
+    // Detection state
+    uint8_t _openMask;
+    uint8_t _settle;          // Seconds left in the grace period
+    uint8_t _leakRun;
+    uint8_t _noFlowRun;
+    uint8_t _burstRun;
+    Alarm _active;            // Alarm of the current episode
+    Alarm _lastAlarm;
+    uint8_t _alarmZones;
+};
+
+#endif // FLOW_MONITOR_H
@@ -0,0 +1,113 @@
+#include "FlowSensor.h"
+#include <LogRing.h>
+
+volatile uint32_t FlowSensor::_pulses = 0;
+volatile bool FlowSensor::_woken = false;
+volatile uint32_t FlowSensor::_threshold = 0;
+volatile bool FlowSensor::_thresholdArmed = false;
+volatile bool FlowSensor::_thresholdReached = false;
+PulseRate *FlowSensor::_rate = NULL;
+uint8_t FlowSensor::_wakePin = 0;
+bool FlowSensor::_wakeOnHigh = false;
+
+FlowSensor::FlowSensor(uint8_t pin, uint16_t pulsesPerLiter):
+  _pin(pin),
+  _pulsesPerLiter(pulsesPerLiter ? pulsesPerLiter : 1),
+  _resetPulses(0),
+  _lastRunPulses(0),
+  _lastRunMillis(0),
+  _flowing(false) {
+}
+
+void FlowSensor::start(void) {
+  pinMode(_pin, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(_pin), onPulse, FALLING);
+  _lastRunMillis = millis();
+  LOG_INFO("[FLOW]: Counting pulses on GPIO %d, %d pulses per liter", _pin, _pulsesPerLiter);
+}
+
+void FlowSensor::run(void) {
+  uint32_t now = millis();
+  if (now - _lastRunMillis < 1000) {
+    return;
+  }
+  uint32_t pulses = getPulseCount();
+  _flowing = pulses != _lastRunPulses;
+  _lastRunPulses = pulses;
+  _lastRunMillis = now;
+}
+
+uint32_t FlowSensor::getPulseCount(void) {
+  // 32 bit aligned reads are atomic on the ESP8266
+  return _pulses;
+}
+
+uint32_t FlowSensor::getCountedLiters(bool reset) {
+  uint32_t pulses = getPulseCount();
+  uint32_t liters = (pulses - _resetPulses) / _pulsesPerLiter;
+  if (reset) {
+    _resetPulses = pulses;
+  }
+  return liters;
+}
+
+void FlowSensor::enableWakeup(void) {
+#ifdef ARDUINO_ARCH_ESP8266
+  _wakePin = _pin;
+  _wakeOnHigh = !digitalRead(_pin);
+  _woken = false;
+  attachInterrupt(digitalPinToInterrupt(_pin), onWake, _wakeOnHigh ? ONHIGH_WE : ONLOW_WE);
+#endif
+}
+
+void FlowSensor::disableWakeup(void) {
+#ifdef ARDUINO_ARCH_ESP8266
+  attachInterrupt(digitalPinToInterrupt(_pin), onPulse, FALLING);
+  if (_woken && !_wakeOnHigh) {
+    noInterrupts();
+    countPulse();   // The falling edge that woke the chip
+    interrupts();
+  }
+#endif
+}
+
+void FlowSensor::setThreshold(uint32_t pulseCount) {
+  noInterrupts();
+  _threshold = pulseCount;
+  _thresholdReached = (int32_t) (_pulses - pulseCount) >= 0;
+  _thresholdArmed = !_thresholdReached;
+  interrupts();
+}
+
+bool FlowSensor::takeThresholdReached(void) {
+  if (!_thresholdReached) {
+    return false;
+  }
+  _thresholdReached = false;
+  return true;
+}
+
+void ICACHE_RAM_ATTR FlowSensor::onPulse(void) {
+  countPulse();
+}
+
+void ICACHE_RAM_ATTR FlowSensor::countPulse(void) {
+  if (_rate) {
+    _rate->push(ESP.getCycleCount());
+  }
+  uint32_t pulses = _pulses + 1;
+  _pulses = pulses;
+  // Compared as a difference so the count may wrap around
+  if (_thresholdArmed && (int32_t) (pulses - _threshold) >= 0) {
+    _thresholdArmed = false;
+    _thresholdReached = true;
+  }
+}
+
+void ICACHE_RAM_ATTR FlowSensor::onWake(void) {
+#ifdef ARDUINO_ARCH_ESP8266
+  // A level interrupt fires until the level changes. Once is enough to wake up.
+  GPC(_wakePin) &= ~(0xF << GPCI);
+#endif
+  _woken = true;
+}
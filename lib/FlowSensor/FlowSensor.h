@@ -0,0 +1,70 @@
+#ifndef FLOW_SENSOR_H
+#define FLOW_SENSOR_H
+
+#include <Arduino.h>
+#include <PulseRate.h>
+
+/*------------------------------------------------------------------------------------*/
+/* FlowSensor                                                                         */
+/*------------------------------------------------------------------------------------*/
+// Hall effect flow sensor counted from a GPIO interrupt. Unlike the liters-only
+// FlowMeter it exposes the raw, monotonic pulse count, which the flow time series and
+// the analytics stages sample at full resolution. Only one instance is supported since
+// the interrupt handler is static. The handler can also timestamp each pulse for a
+// PulseRate.
+class FlowSensor {
+  public:
+    FlowSensor(uint8_t pin, uint16_t pulsesPerLiter);
+    ~FlowSensor() {};
+
+    // Timestamp every pulse into rate. Call before start().
+    void setPulseRate(PulseRate *rate) { _rate = rate; }
+    void start(void);
+    // Updates the flowing state once a second. Call from loop()
+    void run(void);
+
+    // Pulses counted since start(). Wraps around after 2^32 pulses.
+    uint32_t getPulseCount(void);
+    // Liters counted since start() or the last reset
+    uint32_t getCountedLiters(bool reset);
+    uint16_t getPulsesPerLiter(void) { return _pulsesPerLiter; }
+    // True if pulses were counted during the last second
+    bool isFlowing(void) { return _flowing; }
+
+    // Light sleep: the chip wakes on a GPIO level, not an edge. enableWakeup() arms a
+    // wake on the level the pin is not at, so the next pulse wakes the chip.
+    // disableWakeup() goes back to counting edges and counts the pulse that woke it.
+    void enableWakeup(void);
+    void disableWakeup(void);
+
+    // Pulse count threshold, checked by the interrupt handler on every pulse so loop()
+    // learns on its next pass that a volume went through, not on the next timer tick.
+    // setThreshold() arms it for an absolute pulse count, takeThresholdReached() tells
+    // once that the count got there.
+    void setThreshold(uint32_t pulseCount);
+    void clearThreshold(void) { _thresholdArmed = false; }
+    bool isThresholdArmed(void) { return _thresholdArmed; }
+    bool takeThresholdReached(void);
+
+  private:
+    static void ICACHE_RAM_ATTR onPulse(void);
+    static void ICACHE_RAM_ATTR countPulse(void);
+    static void ICACHE_RAM_ATTR onWake(void);
+    static volatile uint32_t _pulses;
+    static volatile bool _woken;
+    static volatile uint32_t _threshold;
+    static volatile bool _thresholdArmed;
+    static volatile bool _thresholdReached;
+    static PulseRate *_rate;
+    static uint8_t _wakePin;
+    static bool _wakeOnHigh;
+
+    uint8_t _pin;
+    uint16_t _pulsesPerLiter;
+    uint32_t _resetPulses;      // Pulse count at the last liters reset
+    uint32_t _lastRunPulses;
+    uint32_t _lastRunMillis;
+    bool _flowing;
+};
+
+#endif // FLOW_SENSOR_H
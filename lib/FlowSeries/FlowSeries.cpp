@@ -0,0 +1,134 @@
+#include "FlowSeries.h"
+#include <stdio.h>
+
+FlowSeries::FlowSeries():
+  _tail(0),
+  _count(0),
+  _tailTime(0),
+  _lastSampleTime(0),
+  _lastPulses(0),
+  _dropped(0),
+  _started(false) {
+}
+
+void FlowSeries::sample(time_t now, uint32_t totalPulses) {
+  if (!_started) {
+    _started = true;
+    _lastPulses = totalPulses;
+    _lastSampleTime = now;
+    _tailTime = now + 1;
+    return;
+  }
+  if (now <= _lastSampleTime) {
+    return;
+  }
+  // A late sample (loop stalled or clock stepped) spreads over the missed seconds
+  uint32_t seconds = now - _lastSampleTime;
+  uint32_t pulses = totalPulses - _lastPulses;
+  _lastPulses = totalPulses;
+  _lastSampleTime = now;
+  if (seconds > FLOW_SERIES_CAPACITY) {
+    // Clock stepped. Restart the series.
+    _count = 0;
+    _tailTime = now;
+    seconds = 1;
+  }
+  for (uint32_t i = 0; i < seconds; i++) {
+    uint32_t share = pulses / (seconds - i);
+    pulses -= share;
+    if (_count == FLOW_SERIES_CAPACITY) {
+      _tail = (_tail + 1) % FLOW_SERIES_CAPACITY;
+      _tailTime++;
+      _count--;
+      _dropped++;
+    }
+    if (_count == 0) {
+      _tailTime = now - seconds + 1 + i;
+    }
+    _samples[(_tail + _count) % FLOW_SERIES_CAPACITY] = share > 0xFFFF ? 0xFFFF : share;
+    _count++;
+  }
+}
+
+bool FlowSeries::isIdle(void) {
+  for (uint16_t i = 0; i < _count; i++) {
+    if (at(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t FlowSeries::encode(uint8_t *buffer, size_t size, bool json, uint16_t &samples) {
+  samples = 0;
+  if (_count == 0) {
+    return 0;
+  }
+  size_t len = 0;
+  if (json) {
+    int n = snprintf((char *) buffer, size, "{\"t\":%ld,\"dt\":1,\"p\":[", (long) _tailTime);
+    if (n < 0 || (size_t) n >= size) {
+      return 0;
+    }
+    len = n;
+    for (uint16_t i = 0; i < _count; i++) {
+      // Leave room for the closing "]}" and the terminator
+      n = snprintf((char *) buffer + len, size - len, i ? ",%u" : "%u", at(i));
+      if (n < 0 || len + n + 3 > size) {
+        break;
+      }
+      len += n;
+      samples++;
+    }
+    len += snprintf((char *) buffer + len, size - len, "]}");
+    return len;
+  }
+  // Header: version, start time, sample count. The count is written last, once known,
+  // so reserve its maximum varint size (3 bytes for a uint16).
+  if (size < 1 + 5 + 3) {
+    return 0;
+  }
+  buffer[len++] = FORMAT_VERSION;
+  len += putVarint(buffer + len, size - len, (uint32_t) _tailTime);
+  size_t countPos = len;
+  len += 3;
+  int32_t previous = 0;
+  for (uint16_t i = 0; i < _count; i++) {
+    int32_t delta = (int32_t) at(i) - previous;
+    uint32_t zigzag = (uint32_t)((delta << 1) ^ (delta >> 31));
+    size_t n = putVarint(buffer + len, size - len, zigzag);
+    if (n == 0) {
+      break;
+    }
+    len += n;
+    previous = at(i);
+    samples++;
+  }
+  // Fixed 3 byte varint for the count
+  buffer[countPos] = (samples & 0x7F) | 0x80;
+  buffer[countPos + 1] = ((samples >> 7) & 0x7F) | 0x80;
+  buffer[countPos + 2] = (samples >> 14) & 0x7F;
+  return len;
+}
+
+void FlowSeries::consume(uint16_t samples) {
+  if (samples > _count) {
+    samples = _count;
+  }
+  _tail = (_tail + samples) % FLOW_SERIES_CAPACITY;
+  _tailTime += samples;
+  _count -= samples;
+}
+
+size_t FlowSeries::putVarint(uint8_t *buffer, size_t size, uint32_t value) {
+  size_t len = 0;
+  do {
+    if (len >= size) {
+      return 0;
+    }
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    buffer[len++] = value ? byte | 0x80 : byte;
+  } while (value);
+  return len;
+}
@@ -0,0 +1,59 @@
+#ifndef FLOW_SERIES_H
+#define FLOW_SERIES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <MemoryBudget.h>
+
+#ifndef FLOW_SERIES_CAPACITY
+#define FLOW_SERIES_CAPACITY 180    // Seconds of samples kept while unpublished
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* FlowSeries                                                                         */
+/*------------------------------------------------------------------------------------*/
+// Per-second flow pulse counts kept in a fixed-size RAM ring until published. Samples
+// are published in batches as one compact message:
+//
+//   Binary: version (1 byte), start time (varint), sample count (varint), then one
+//           zigzag varint per sample holding the difference to the previous sample.
+//           A steady flow costs one byte per second.
+//   JSON (debug): {"t":<start time>,"dt":1,"p":[<pulses>,...]}
+//
+// When the ring is full the oldest samples are dropped and counted.
+class FlowSeries {
+  public:
+    static const uint8_t FORMAT_VERSION = 1;
+
+    FlowSeries();
+    ~FlowSeries() {};
+
+    // Call once a second with the sensor's monotonic pulse count
+    void sample(time_t now, uint32_t totalPulses);
+
+    // Encode as many unpublished samples as fit in buffer. Returns the message length
+    // (0 if nothing to send) and the number of samples it holds.
+    size_t encode(uint8_t *buffer, size_t size, bool json, uint16_t &samples);
+    // Drop samples once their message was published
+    void consume(uint16_t samples);
+
+    uint16_t size(void) { return _count; }
+    bool isIdle(void);   // All unpublished samples are zero
+    uint32_t getDroppedSamples(void) { return _dropped; }
+
+  private:
+    static size_t putVarint(uint8_t *buffer, size_t size, uint32_t value);
+    uint16_t at(uint16_t i) { return _samples[(_tail + i) % FLOW_SERIES_CAPACITY]; }
+
+    uint16_t _samples[FLOW_SERIES_CAPACITY];
+    uint16_t _tail;            // Oldest unpublished sample
+    uint16_t _count;
+    time_t _tailTime;          // Time of the oldest unpublished sample
+    time_t _lastSampleTime;
+    uint32_t _lastPulses;
+    uint32_t _dropped;
+    bool _started;
+};
+
+#endif // FLOW_SERIES_H
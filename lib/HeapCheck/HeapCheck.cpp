@@ -0,0 +1,61 @@
+#include "HeapCheck.h"
+
+#if HEAP_CHECK
+#include <stdlib.h>
+#include <new>
+
+bool HeapCheck::_armed = false;
+bool HeapCheck::_allowed = false;
+volatile uint32_t HeapCheck::_count = 0;
+size_t HeapCheck::_lastSize = 0;
+
+// Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc: calls to these land
+// here and the originals are reached as __real_*.
+extern "C" {
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+
+  void *__wrap_malloc(size_t size) {
+    HeapCheck::record(size);
+    return __real_malloc(size);
+  }
+
+  void *__wrap_calloc(size_t count, size_t size) {
+    HeapCheck::record(count * size);
+    return __real_calloc(count, size);
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size) {
+    HeapCheck::record(size);
+    return __real_realloc(ptr, size);
+  }
+}
+
+#ifndef ARDUINO_ARCH_ESP8266
+// The core's operator new calls malloc and is wrapped with it. On the host it lives
+// in the C++ runtime, out of reach of the linker, so it is replaced.
+void *operator new(size_t size) {
+  HeapCheck::record(size);
+  void *ptr = __real_malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  free(ptr);
+}
+#endif
+
+#endif // HEAP_CHECK
+
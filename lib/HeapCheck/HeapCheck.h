@@ -0,0 +1,61 @@
+#ifndef HEAP_CHECK_H
+#define HEAP_CHECK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef HEAP_CHECK
+#define HEAP_CHECK 0                // 1 counts heap allocations made after setup()
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* HeapCheck                                                                          */
+/*------------------------------------------------------------------------------------*/
+// Debug check that the firmware runs without the heap once setup() is done. With
+// HEAP_CHECK 1 and the linker wrapping malloc, calloc and realloc (see platformio.ini)
+// every allocation made after arm() is counted. operator new is counted on the host,
+// where it does not go through the wrapped malloc.
+//
+// The file system and the network stack allocate by design. Calls into them are made
+// in an allowed Scope; firmware code they call back runs in a checked Scope again.
+// With HEAP_CHECK 0 the hooks are gone and Scope is empty.
+class HeapCheck {
+  public:
+    class Scope {
+      public:
+#if HEAP_CHECK
+        explicit Scope(bool allowed): _saved(_allowed) { _allowed = allowed; }
+        ~Scope() { _allowed = _saved; }
+      private:
+        bool _saved;
+#else
+        explicit Scope(bool) {}
+#endif
+    };
+
+#if HEAP_CHECK
+    static void arm(void) { _armed = true; }
+    // Called by the allocation hooks
+    static void record(size_t size) {
+      if (_armed && !_allowed) {
+        _count++;
+        _lastSize = size;
+      }
+    }
+    // Allocations counted since the last call
+    static uint32_t takeCount(void) { uint32_t count = _count; _count = 0; return count; }
+    static size_t getLastSize(void) { return _lastSize; }
+
+  private:
+    static bool _armed;
+    static bool _allowed;
+    static volatile uint32_t _count;
+    static size_t _lastSize;
+#else
+    static void arm(void) {}
+    static uint32_t takeCount(void) { return 0; }
+    static size_t getLastSize(void) { return 0; }
+#endif
+};
+
+#endif // HEAP_CHECK_H
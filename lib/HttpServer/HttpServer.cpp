@@ -0,0 +1,314 @@
+#include "HttpServer.h"
+#include <stdarg.h>
+#include <strings.h>
+
+HttpServer::HttpServer(uint16_t port):
+  _server(port),
+  _routes(NULL),
+  _routeCount(0),
+  _assets(NULL),
+  _assetCount(0),
+  _state(State::idle),
+  _startMs(0),
+  _asset(NULL),
+  _writer(NULL),
+  _requests(0) {
+}
+
+void HttpServer::begin(const Route *routes, uint8_t routeCount, const Asset *assets, uint8_t assetCount) {
+  _routes = routes;
+  _routeCount = routeCount;
+  _assets = assets;
+  _assetCount = assetCount;
+  _server.begin();
+  _server.setNoDelay(true);
+}
+
+void HttpServer::run(uint32_t nowMs) {
+  if (_state == State::idle) {
+    _client = _server.available();
+    if (!_client) {
+      return;
+    }
+    _client.setNoDelay(true);
+    _state = State::requestLine;
+    _startMs = nowMs;
+    _lineLength = 0;
+    _lineCut = false;
+    _path[0] = 0;
+    _method = Method::other;
+    _contentLength = 0;
+    _ifNoneMatch[0] = 0;
+    _bodyLength = 0;
+    _error = 0;
+    _bufferStart = _bufferEnd = 0;
+    _asset = NULL;
+    _assetSent = 0;
+    _writer = NULL;
+    _part = 0;
+  }
+  if (_state != State::response) {
+    readRequest();
+  }
+  // The timeout holds while responding too: a client that stops reading would keep the
+  // server busy for good
+  if (!_client.connected() || nowMs - _startMs > TIMEOUT_MS) {
+    close();
+  } else if (_state == State::response) {
+    writeResponse();
+  }
+}
+
+void HttpServer::close(void) {
+  _client.stop();
+  _state = State::idle;
+  _asset = NULL;
+  _writer = NULL;
+}
+
+void HttpServer::readRequest(void) {
+  uint8_t data[READ_SIZE];
+  for (uint8_t i = 0; i < READS_PER_PASS && _state != State::response; i++) {
+    int count = _client.available();
+    if (count <= 0) {
+      return;
+    }
+    count = _client.read(data, count < READ_SIZE ? count : READ_SIZE);
+    for (int j = 0; j < count && _state != State::response; j++) {
+      parse((char) data[j]);
+    }
+  }
+}
+
+void HttpServer::parse(char c) {
+  if (_state == State::body) {
+    _body[_bodyLength++] = c;
+    if (_bodyLength == _contentLength) {
+      dispatch();
+    }
+    return;
+  }
+  if (c != '\n') {
+    if (_lineLength < HTTP_LINE_SIZE - 1) {
+      _line[_lineLength++] = c;
+    } else {
+      _lineCut = true;
+    }
+    return;
+  }
+  if (_lineLength && _line[_lineLength - 1] == '\r') {
+    _lineLength--;
+  }
+  _line[_lineLength] = 0;
+  parseLine();
+  _lineLength = 0;
+  _lineCut = false;
+}
+
+void HttpServer::parseLine(void) {
+  if (_state == State::requestLine) {
+    if (!_lineLength) {
+      return;   // Blank lines before the request are allowed
+    }
+    // METHOD SP target SP version
+    char *target = strchr(_line, ' ');
+    char *end = target ? strchr(target + 1, ' ') : NULL;
+    if (!end) {
+      _error = 400;
+    } else if (_lineCut || end - target - 1 >= HTTP_PATH_SIZE) {
+      _error = 414;
+    } else {
+      *target++ = 0;
+      *end = 0;
+      strcpy(_path, target);
+      _method = !strcmp(_line, "GET") ? Method::get : !strcmp(_line, "HEAD") ? Method::head :
+        !strcmp(_line, "POST") ? Method::post : Method::other;
+    }
+    _state = State::headers;
+    return;
+  }
+  if (_lineLength) {
+    // Only two headers matter. Others, cut or not, are skipped.
+    if (!strncasecmp(_line, "Content-Length:", 15)) {
+      long length = atol(_line + 15);
+      _contentLength = length < 0 ? 0 : length > HTTP_BODY_SIZE ? HTTP_BODY_SIZE + 1 : length;
+    } else if (!strncasecmp(_line, "If-None-Match:", 14) && !_lineCut) {
+      const char *value = _line + 14 + strspn(_line + 14, " \t");
+      strncpy(_ifNoneMatch, value, sizeof(_ifNoneMatch) - 1);
+      _ifNoneMatch[sizeof(_ifNoneMatch) - 1] = 0;
+    }
+    return;
+  }
+  // End of the headers
+  if (!_error && _contentLength > HTTP_BODY_SIZE) {
+    _error = 413;
+  }
+  if (!_error && _contentLength) {
+    _state = State::body;
+  } else {
+    dispatch();
+  }
+}
+
+void HttpServer::dispatch(void) {
+  _state = State::response;
+  _requests++;
+  if (_error) {
+    sendText(_error, reason(_error));
+    return;
+  }
+  Request request;
+  char *query = strchr(_path, '?');
+  if (query) {
+    *query++ = 0;
+  }
+  _body[_bodyLength] = 0;
+  request.method = _method;
+  request.path = _path;
+  request.query = query ? query : "";
+  request.body = _body;
+  request.bodyLength = _bodyLength;
+  for (uint8_t i = 0; i < _assetCount; i++) {
+    if (!strcmp(_path, _assets[i].path)) {
+      if (_method == Method::get || _method == Method::head) {
+        sendAsset(_assets[i]);
+      } else {
+        sendText(405, reason(405));
+      }
+      return;
+    }
+  }
+  bool found = false;
+  for (uint8_t i = 0; i < _routeCount; i++) {
+    if (!strcmp(_path, _routes[i].path)) {
+      found = true;
+      if (_routes[i].method == _method) {
+        _routes[i].handler(*this, request);
+        if (!_bufferEnd) {
+          sendText(500, reason(500));   // The handler did not answer
+        }
+        return;
+      }
+    }
+  }
+  sendText(found ? 405 : 404, reason(found ? 405 : 404));
+}
+
+void HttpServer::sendHead(uint16_t status, const char *type, const char *format, ...) {
+  int n = snprintf(_buffer, sizeof(_buffer), "HTTP/1.1 %u %s\r\n", status, reason(status));
+  if (type) {
+    n += snprintf(_buffer + n, sizeof(_buffer) - n, "Content-Type: %s\r\n", type);
+  }
+  va_list args;
+  va_start(args, format);
+  n += vsnprintf(_buffer + n, sizeof(_buffer) - n, format, args);
+  va_end(args);
+  n += snprintf(_buffer + n, sizeof(_buffer) - n, "Connection: close\r\n\r\n");
+  _bufferStart = 0;
+  _bufferEnd = (size_t) n < sizeof(_buffer) ? n : sizeof(_buffer) - 1;
+}
+
+void HttpServer::sendAsset(const Asset &asset) {
+  // The ETag changes with the content. no-cache: kept, but checked on every use.
+  if (strstr(_ifNoneMatch, asset.etag)) {
+    sendHead(304, NULL, "ETag: %s\r\n", asset.etag);
+    return;
+  }
+  sendHead(200, asset.type, "Content-Encoding: gzip\r\nContent-Length: %u\r\nETag: %s\r\nCache-Control: no-cache\r\n",
+    (unsigned int) asset.size, asset.etag);
+  if (_method != Method::head) {
+    _asset = &asset;
+    _assetSent = 0;
+  }
+}
+
+void HttpServer::sendJson(Writer writer) {
+  sendHead(200, "application/json", "Transfer-Encoding: chunked\r\nCache-Control: no-store\r\n");
+  _writer = writer;
+  _part = 0;
+}
+
+void HttpServer::sendText(uint16_t status, const char *text) {
+  size_t length = strlen(text);
+  sendHead(status, "text/plain", "Content-Length: %u\r\n", (unsigned int) length + 1);
+  if (_bufferEnd + length + 1 < sizeof(_buffer)) {
+    memcpy(_buffer + _bufferEnd, text, length);
+    _bufferEnd += length;
+    _buffer[_bufferEnd++] = '\n';
+  }
+}
+
+void HttpServer::nextChunk(void) {
+  size_t length = _writer(_buffer + CHUNK_HEAD, sizeof(_buffer) - CHUNK_HEAD - CHUNK_TAIL, _part++);
+  if (!length || length >= sizeof(_buffer) - CHUNK_HEAD - CHUNK_TAIL) {
+    // The last chunk, with no trailers
+    memcpy(_buffer, "0\r\n\r\n", 5);
+    _bufferEnd = 5;
+    _writer = NULL;
+  } else {
+    char head[CHUNK_HEAD + 1];
+    snprintf(head, sizeof(head), "%03x\r\n", (unsigned int) length);
+    memcpy(_buffer, head, CHUNK_HEAD);
+    memcpy(_buffer + CHUNK_HEAD + length, "\r\n", CHUNK_TAIL);
+    _bufferEnd = CHUNK_HEAD + length + CHUNK_TAIL;
+  }
+  _bufferStart = 0;
+}
+
+void HttpServer::writeResponse(void) {
+  bool chunkWritten = false;
+  size_t room = _client.availableForWrite();
+  while (room) {
+    size_t sent;
+    if (_bufferStart < _bufferEnd) {
+      size_t length = _bufferEnd - _bufferStart;
+      sent = _client.write((const uint8_t *) _buffer + _bufferStart, length < room ? length : room);
+      _bufferStart += sent;
+    } else if (_asset && _assetSent < _asset->size) {
+      // Straight from flash
+      size_t length = _asset->size - _assetSent;
+      sent = _client.write_P((PGM_P) _asset->data + _assetSent, length < room ? length : room);
+      _assetSent += sent;
+    } else if (_writer && !chunkWritten) {
+      nextChunk();
+      chunkWritten = true;
+      continue;
+    } else if (_writer) {
+      return;   // The next part on the next pass
+    } else {
+      close();
+      return;
+    }
+    if (!sent) {
+      return;
+    }
+    room -= sent;
+  }
+}
+
+bool HttpServer::getParam(const char *query, const char *name, long &value) {
+  size_t length = strlen(name);
+  while (query) {
+    if (!strncmp(query, name, length) && query[length] == '=') {
+      char *end;
+      value = strtol(query + length + 1, &end, 10);
+      return end != query + length + 1 && (*end == '&' || !*end);
+    }
+    query = strchr(query, '&');
+    query = query ? query + 1 : NULL;
+  }
+  return false;
+}
+
+const char *HttpServer::reason(uint16_t status) {
+  switch (status) {
+    case 200: return "OK";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 414: return "URI Too Long";
+    default: return "Internal Server Error";
+  }
+}
@@ -0,0 +1,145 @@
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <MemoryBudget.h>
+
+#ifndef HTTP_LINE_SIZE
+#define HTTP_LINE_SIZE 128          // Request and header lines, terminator included
+#endif
+#ifndef HTTP_PATH_SIZE
+#define HTTP_PATH_SIZE 64           // Path and query, terminator included
+#endif
+#ifndef HTTP_BODY_SIZE
+#define HTTP_BODY_SIZE 64           // Largest request body
+#endif
+#ifndef HTTP_CHUNK_SIZE
+#define HTTP_CHUNK_SIZE 256         // Response head, then each chunk of a generated body
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* HttpServer                                                                         */
+/*------------------------------------------------------------------------------------*/
+// Small HTTP/1.1 server for the status page and the JSON API, stepped from loop() like
+// the MQTT client. It serves one connection at a time and takes nothing from the heap:
+// the request is parsed a byte at a time as it arrives, and the response goes out as
+// far as the TCP send buffer takes it on each pass. Every response closes the
+// connection.
+//
+// Static assets are gzipped at build time (scripts/web_assets.py) and sent from flash
+// as they are, with Content-Encoding gzip and their ETag. A request whose If-None-Match
+// has the ETag gets 304 and no body. Routes answer with a generated body: a Writer
+// fills one part at a time into a small buffer, sent with chunked transfer encoding so
+// the length need not be known up front. One part is written per pass, which bounds the
+// time a pass spends in the server.
+class HttpServer {
+  public:
+    enum class Method : uint8_t { get, head, post, other };
+
+    // Static file, gzipped in flash (PROGMEM)
+    struct Asset {
+      const char *path;
+      const char *type;
+      const uint8_t *data;
+      uint32_t size;
+      const char *etag;     // Quoted, as sent
+    };
+
+    struct Request {
+      Method method;
+      const char *path;
+      const char *query;    // After '?', empty if none
+      const char *body;     // Terminated, bodyLength bytes
+      uint16_t bodyLength;
+    };
+
+    // Answers a request by calling one of the send methods
+    typedef void (*Handler)(HttpServer &server, const Request &request);
+    struct Route {
+      Method method;
+      const char *path;
+      Handler handler;
+    };
+
+    // Writes part number part of a body into buffer. Returns its length, 0 when the body
+    // is complete.
+    typedef size_t (*Writer)(char *buffer, size_t size, uint16_t part);
+
+    HttpServer(uint16_t port);
+    ~HttpServer() {};
+
+    void begin(const Route *routes, uint8_t routeCount, const Asset *assets, uint8_t assetCount);
+    // Once per loop() pass
+    void run(uint32_t nowMs);
+    // A connection is open
+    bool isBusy(void) { return _state != State::idle; }
+
+    // Responses, from a Handler
+    void sendAsset(const Asset &asset);
+    void sendJson(Writer writer);
+    void sendText(uint16_t status, const char *text);
+
+    // Number value of a query parameter, e.g. from in "from=1767225600&to=1767312000"
+    static bool getParam(const char *query, const char *name, long &value);
+
+    uint32_t getRequests(void) { return _requests; }
+
+  private:
+    static const uint16_t TIMEOUT_MS = 5000;   // For the whole exchange
+    static const uint8_t READ_SIZE = 64;       // Bytes read at once
+    static const uint8_t READS_PER_PASS = 8;
+    static const uint8_t CHUNK_HEAD = 5;       // "FFF\r\n", a chunk is less than 4 KB
+    static const uint8_t CHUNK_TAIL = 2;       // "\r\n"
+
+    enum class State : uint8_t {
+      idle,
+      requestLine,
+      headers,
+      body,
+      response
+    };
+
+    void close(void);
+    void readRequest(void);
+    void parse(char c);
+    void parseLine(void);
+    void dispatch(void);
+    void sendHead(uint16_t status, const char *type, const char *format, ...) __attribute__((format(printf, 4, 5)));
+    void nextChunk(void);
+    void writeResponse(void);
+    static const char *reason(uint16_t status);
+
+    WiFiServer _server;
+    WiFiClient _client;
+    const Route *_routes;
+    uint8_t _routeCount;
+    const Asset *_assets;
+    uint8_t _assetCount;
+    State _state;
+    uint32_t _startMs;
+
+    // Request
+    char _line[HTTP_LINE_SIZE];
+    uint16_t _lineLength;
+    bool _lineCut;
+    char _path[HTTP_PATH_SIZE];
+    Method _method;
+    uint16_t _contentLength;
+    char _ifNoneMatch[24];
+    char _body[HTTP_BODY_SIZE + 1];
+    uint16_t _bodyLength;
+    uint16_t _error;          // Status to answer with once the request is read, 0 none
+
+    // Response
+    char _buffer[HTTP_CHUNK_SIZE];
+    uint16_t _bufferStart;    // Bytes from here to _bufferEnd wait to be written
+    uint16_t _bufferEnd;
+    const Asset *_asset;      // Body from flash
+    uint32_t _assetSent;
+    Writer _writer;           // Body in chunks
+    uint16_t _part;
+    uint32_t _requests;
+};
+
+#endif // HTTP_SERVER_H
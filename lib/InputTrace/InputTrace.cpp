@@ -0,0 +1,265 @@
+#include "InputTrace.h"
+#include <string.h>
+
+InputTrace::Observer InputTrace::_observer = 0;
+
+InputTrace::InputTrace(uint32_t device):
+  _head(0),
+  _tail(0),
+  _tailMs(0),
+  _lastMs(0),
+  _passMs(0),
+  _pulses(0),
+  _recordedPulses(0),
+  _dropped(0),
+  _device(device),
+  _links(0),
+  _knownLinks(0),
+  _recording(true),
+  _fromBoot(true) {
+}
+
+void InputTrace::start(void) {
+  _head = _tail = 0;
+  _tailMs = _lastMs;
+  _recording = true;
+  _fromBoot = false;
+  // The next records state where things are
+  _knownLinks = 0;
+  _recordedPulses = _pulses;
+}
+
+void InputTrace::syncPulses(void) {
+  if (_pulses == _recordedPulses) {
+    return;
+  }
+  Record record;
+  if (begin(record, Kind::pulses)) {
+    putVarint(record, _pulses - _recordedPulses);
+    _recordedPulses = _pulses;
+    commit(record);
+  }
+}
+
+void InputTrace::clock(time_t time) {
+  Record record;
+  syncPulses();
+  if (begin(record, Kind::clock)) {
+    putVarint(record, (uint32_t) time);
+    commit(record);
+  }
+}
+
+void InputTrace::message(const char *topic, const uint8_t *payload, size_t length) {
+  Record record;
+  syncPulses();
+  size_t topicLength = strlen(topic);
+  // Size, kind, time and topic length take up to 9 bytes
+  bool lost = topicLength + length + 9 > MAX_RECORD;
+  if (!begin(record, lost ? Kind::lost : Kind::message)) {
+    return;
+  }
+  if (!lost) {
+    putVarint(record, topicLength);
+    put(record, topic, topicLength);
+    put(record, payload, length);
+  }
+  commit(record);
+}
+
+void InputTrace::command(const uint8_t *payload, size_t length) {
+  Record record;
+  syncPulses();
+  // Size, kind and time take up to 7 bytes
+  bool lost = length + 7 > MAX_RECORD;
+  if (!begin(record, lost ? Kind::lost : Kind::command)) {
+    return;
+  }
+  if (!lost) {
+    put(record, payload, length);
+  }
+  commit(record);
+}
+
+void InputTrace::button(uint8_t press) {
+  Record record;
+  syncPulses();
+  if (begin(record, Kind::button)) {
+    put(record, &press, 1);
+    commit(record);
+  }
+}
+
+void InputTrace::link(Kind kind, bool up) {
+  uint8_t bit = 1 << ((uint8_t) kind - (uint8_t) Kind::wifi);
+  if ((_knownLinks & bit) && ((_links & bit) != 0) == up) {
+    return;
+  }
+  Record record;
+  if (begin(record, kind)) {
+    _knownLinks |= bit;
+    _links = up ? _links | bit : _links & ~bit;
+    uint8_t value = up;
+    put(record, &value, 1);
+    commit(record);
+  }
+}
+
+void InputTrace::valve(uint8_t zone, bool open) {
+  Record record;
+  if (begin(record, Kind::valve)) {
+    uint8_t data[2] = { zone, open };
+    put(record, data, sizeof(data));
+    commit(record);
+  }
+}
+
+void InputTrace::publish(const char *topic, const uint8_t *payload, size_t length, bool retained) {
+  Record record;
+  if (begin(record, Kind::publish)) {
+    uint8_t flag = retained;
+    uint32_t crc = crc32(0, topic, strlen(topic) + 1);
+    crc = crc32(crc, payload, length);
+    crc = crc32(crc, &flag, 1);
+    put(record, &crc, sizeof(crc));
+    commit(record);
+  }
+}
+
+bool InputTrace::begin(Record &record, Kind kind) {
+  if (!_recording) {
+    return false;
+  }
+  record.size = 1;    // Size byte, written by commit()
+  record.data[record.size++] = (uint8_t) kind;
+  putVarint(record, _passMs - _lastMs);
+  return true;
+}
+
+void InputTrace::put(Record &record, const void *data, size_t size) {
+  memcpy(record.data + record.size, data, size);
+  record.size += size;
+}
+
+void InputTrace::putVarint(Record &record, uint32_t value) {
+  while (value >= 0x80) {
+    record.data[record.size++] = (uint8_t) value | 0x80;
+    value >>= 7;
+  }
+  record.data[record.size++] = (uint8_t) value;
+}
+
+void InputTrace::commit(Record &record) {
+  record.data[0] = record.size;
+  // Make room by dropping the oldest records
+  while (_head + record.size - _tail > INPUT_TRACE_SIZE) {
+    _tail += byteAt(_tail);
+    _tailMs += deltaAt(_tail);
+    _dropped++;
+    _fromBoot = false;
+  }
+  if (_head == _tail) {
+    _tailMs = _passMs;
+  }
+  for (uint16_t i = 0; i < record.size; i++) {
+    _ring[(_head + i) % INPUT_TRACE_SIZE] = record.data[i];
+  }
+  _head += record.size;
+  _lastMs = _passMs;
+  if (_observer) {
+    _observer(record.data, record.size);
+  }
+}
+
+uint32_t InputTrace::deltaAt(uint32_t position) {
+  if (position == _head) {
+    return 0;
+  }
+  uint32_t value = 0;
+  uint8_t byte;
+  position += 2;
+  for (uint8_t shift = 0; shift < 32; shift += 7) {
+    byte = byteAt(position++);
+    value |= (uint32_t) (byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  return value;
+}
+
+size_t InputTrace::read(size_t offset, uint8_t *data, size_t size) {
+  Header header;
+  header.magic = MAGIC;
+  header.version = VERSION;
+  header.flags = _fromBoot ? FROM_BOOT : 0;
+  header.reserved = 0;
+  header.device = _device;
+  header.baseMs = _tailMs - deltaAt(_tail);
+  header.length = _head - _tail;
+  size_t count = 0;
+  while (count < size && offset < sizeof(header)) {
+    data[count++] = ((const uint8_t *) &header)[offset++];
+  }
+  while (count < size && offset - sizeof(header) < header.length) {
+    data[count++] = byteAt(_tail + offset++ - sizeof(header));
+  }
+  return count;
+}
+
+InputTrace::Reader::Reader(const uint8_t *data, size_t size):
+  _data(data + sizeof(Header)),
+  _end(data + size),
+  _ms(0),
+  _valid(false) {
+  if (size < sizeof(Header)) {
+    return;
+  }
+  memcpy(&_header, data, sizeof(Header));
+  _valid = _header.magic == MAGIC && _header.version == VERSION && sizeof(Header) + _header.length <= size;
+  _end = _valid ? _data + _header.length : _data;
+  _ms = _header.baseMs;
+}
+
+bool InputTrace::Reader::next(Kind &kind, uint32_t &ms, const uint8_t *&data, size_t &size) {
+  uint32_t delta;
+  if (_end - _data < 3 || _data[0] < 3 || _data[0] > _end - _data) {
+    return false;
+  }
+  const uint8_t *end = _data + _data[0];
+  kind = (Kind) _data[1];
+  data = _data + 2;
+  if (!getVarint(data, end, delta)) {
+    return false;
+  }
+  _ms += delta;
+  ms = _ms;
+  size = end - data;
+  _data = end;
+  return true;
+}
+
+bool InputTrace::getVarint(const uint8_t *&data, const uint8_t *end, uint32_t &value) {
+  value = 0;
+  for (uint8_t shift = 0; data < end && shift < 35; shift += 7) {
+    uint8_t byte = *data++;
+    value |= (uint32_t) (byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t InputTrace::crc32(uint32_t crc, const void *data, size_t size) {
+  // CRC-32 (IEEE), bitwise: a few messages a minute
+  const uint8_t *bytes = (const uint8_t *) data;
+  crc = ~crc;
+  while (size--) {
+    crc ^= *bytes++;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
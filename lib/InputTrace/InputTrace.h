@@ -0,0 +1,148 @@
+#ifndef INPUT_TRACE_H
+#define INPUT_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <MemoryBudget.h>
+
+#ifndef INPUT_TRACE_SIZE
+#define INPUT_TRACE_SIZE 4096       // Bytes of RAM holding the most recent records
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* InputTrace                                                                         */
+/*------------------------------------------------------------------------------------*/
+// Recorder of everything from outside the firmware that steers the control logic, and of
+// what the logic did, so a run can be replayed on the host (see the simulator's
+// --replay) and checked to open the same valves and publish the same messages.
+//
+// Inputs are MQTT messages, commands posted to the web server, push button presses, flow
+// meter pulses, the Wi-Fi and broker link and the clock set by NTP. Every record carries
+// the time of the loop() pass it was made in, which is all the firmware reads millis()
+// and the clock for. Pulses are not recorded one by one: the count is recorded only where
+// the logic looks at it (due timed events, a volume threshold, any other input), so a
+// drip costs a few bytes a second. Outputs are the valve actions and a CRC-32 of each
+// message published.
+//
+// Record: size (1 byte), kind (1 byte), milliseconds since the previous record
+// (varint), then the data of the kind. When the ring is full the oldest records are
+// dropped. The saved form is a Header followed by the records, oldest first. Time is
+// passed in by the caller, which keeps the class host-testable.
+class InputTrace {
+  public:
+    enum class Kind : uint8_t {
+      // Inputs
+      clock = 1,    // NTP set the clock. Time (varint)
+      message,      // MQTT message. Topic length (varint), topic, payload
+      button,       // Push button press. 1 very short, 2 short, 3 long
+      pulses,       // Flow meter pulses since the last pulses record (varint)
+      wifi,         // Station connected, 0 or 1, at the start of the pass
+      broker,       // MQTT session up, 0 or 1, at the start of the pass or after an attempt
+      // Outputs
+      valve,        // Zone, then 1 open or 0 closed
+      publish,      // CRC-32 of the topic, the payload and the retained flag (4 bytes)
+      // Marker
+      lost,         // An input too large for a record. Replay is not exact past it
+      // Input
+      command       // Command message posted to the web server. Payload
+    };
+
+    static const uint32_t MAGIC = 0x43525444;   // "DTRC"
+    static const uint8_t VERSION = 1;
+    static const uint8_t FROM_BOOT = 0x01;      // Nothing dropped since reset
+    struct Header {
+      uint32_t magic;
+      uint8_t version;
+      uint8_t flags;
+      uint16_t reserved;
+      uint32_t device;      // Chip id. Seeds the reconnect jitter
+      uint32_t baseMs;      // The first record is relative to it
+      uint32_t length;      // Bytes of records after the header
+    };
+
+    // Sees every record as it is made, e.g. to write it to a host file
+    typedef void (*Observer)(const uint8_t *record, size_t size);
+
+    InputTrace(uint32_t device);
+    ~InputTrace() {};
+
+    // Recording is on from reset. start() clears the ring.
+    void start(void);
+    void stop(void) { _recording = false; }
+    bool isRecording(void) { return _recording; }
+
+    // Once per loop() pass, with millis() and the pulse count at its start
+    void beginPass(uint32_t nowMs, uint32_t pulses) { _passMs = nowMs; _pulses = pulses; }
+    // The logic is about to look at the pulse count: record it if it changed
+    void syncPulses(void);
+
+    void clock(time_t time);
+    void message(const char *topic, const uint8_t *payload, size_t length);
+    void command(const uint8_t *payload, size_t length);
+    void button(uint8_t press);
+    // Only changes are recorded
+    void link(Kind kind, bool up);
+    void valve(uint8_t zone, bool open);
+    void publish(const char *topic, const uint8_t *payload, size_t length, bool retained);
+
+    // Saved form, header included
+    size_t size(void) { return sizeof(Header) + (_head - _tail); }
+    size_t read(size_t offset, uint8_t *data, size_t size);
+    uint32_t getDropped(void) { return _dropped; }
+
+    static void setObserver(Observer observer) { _observer = observer; }
+
+    // Walks a saved trace
+    class Reader {
+      public:
+        Reader(const uint8_t *data, size_t size);
+        bool isValid(void) { return _valid; }
+        const Header &getHeader(void) { return _header; }
+        // Data of the next record. Returns false at the end or at a damaged record.
+        bool next(Kind &kind, uint32_t &ms, const uint8_t *&data, size_t &size);
+      private:
+        Header _header;
+        const uint8_t *_data;
+        const uint8_t *_end;
+        uint32_t _ms;
+        bool _valid;
+    };
+
+    static bool getVarint(const uint8_t *&data, const uint8_t *end, uint32_t &value);
+    static uint32_t crc32(uint32_t crc, const void *data, size_t size);
+
+  private:
+    static const uint8_t MAX_RECORD = 255;
+
+    // Record under construction
+    struct Record {
+      uint8_t data[MAX_RECORD];
+      uint16_t size;
+    };
+
+    bool begin(Record &record, Kind kind);
+    void put(Record &record, const void *data, size_t size);
+    void putVarint(Record &record, uint32_t value);
+    void commit(Record &record);
+    uint8_t byteAt(uint32_t position) { return _ring[position % INPUT_TRACE_SIZE]; }
+    uint32_t deltaAt(uint32_t position);
+
+    uint8_t _ring[INPUT_TRACE_SIZE];
+    uint32_t _head;         // Where the next record goes
+    uint32_t _tail;         // Oldest record
+    uint32_t _tailMs;       // Time of the oldest record
+    uint32_t _lastMs;       // Time of the newest record
+    uint32_t _passMs;
+    uint32_t _pulses;
+    uint32_t _recordedPulses;
+    uint32_t _dropped;      // Records dropped to make room
+    uint32_t _device;
+    uint8_t _links;         // Last recorded link state, a bit per kind
+    uint8_t _knownLinks;    // Link kinds recorded at least once
+    bool _recording;
+    bool _fromBoot;
+    static Observer _observer;
+};
+
+#endif // INPUT_TRACE_H
@@ -0,0 +1,32 @@
+#include "LcdFrame.h"
+#include <string.h>
+
+LcdFrame::LcdFrame():
+  _cursor(NO_CURSOR),
+  _cellWrites(0),
+  _cursorMoves(0) {
+  memset(_frame, ' ', sizeof(_frame));
+  // The display is blank after init()
+  memset(_shown, ' ', sizeof(_shown));
+}
+
+void LcdFrame::print(uint8_t row, const char *text) {
+  if (row >= ROWS) {
+    return;
+  }
+  uint8_t column = 0;
+  while (column < COLUMNS && text[column]) {
+    _frame[row][column] = text[column];
+    column++;
+  }
+  memset(&_frame[row][column], ' ', COLUMNS - column);
+}
+
+void LcdFrame::invalidate(void) {
+  memset(_shown, 0, sizeof(_shown));
+  _cursor = NO_CURSOR;
+}
+
+bool LcdFrame::isDirty(void) {
+  return memcmp(_frame, _shown, sizeof(_frame)) != 0;
+}
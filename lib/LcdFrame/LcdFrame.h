@@ -0,0 +1,76 @@
+#ifndef LCD_FRAME_H
+#define LCD_FRAME_H
+
+#include <stdint.h>
+
+/*------------------------------------------------------------------------------------*/
+/* LcdFrame                                                                           */
+/*------------------------------------------------------------------------------------*/
+// Shadow framebuffer for a 16x2 character display. Text is composed in RAM and compared
+// cell by cell with what the display already shows; flush() sends only the cells that
+// differ. Every character costs several slow I2C transactions on a PCF8574 backpack,
+// so the display is never cleared, and the cursor is only moved when the next changed
+// cell does not follow the last one written (the display advances it by itself).
+//
+// flush() takes a budget of cells per call so it can run from loop() and spread a full
+// redraw over a few passes.
+class LcdFrame {
+  public:
+    static const uint8_t COLUMNS = 16;
+    static const uint8_t ROWS = 2;
+
+    LcdFrame();
+    ~LcdFrame() {};
+
+    // Replace a row. Shorter text is padded with spaces, longer text truncated.
+    void print(uint8_t row, const char *text);
+    // What the display shows is unknown (e.g. written around the frame). Next flush()
+    // rewrites every cell.
+    void invalidate(void);
+    bool isDirty(void);
+
+    // Write up to maxCells changed cells to the display (any class with setCursor(column,
+    // row) and write(char)). Returns the number of cells written.
+    template <class Display>
+    uint8_t flush(Display &display, uint8_t maxCells = ROWS * COLUMNS);
+
+    // Statistics
+    uint32_t getCellWrites(void) { return _cellWrites; }
+    uint32_t getCursorMoves(void) { return _cursorMoves; }
+
+  private:
+    static const uint8_t NO_CURSOR = 0xFF;
+
+    char _frame[ROWS][COLUMNS];   // Wanted content
+    char _shown[ROWS][COLUMNS];   // Content of the display. 0 where unknown
+    uint8_t _cursor;              // Display address as row * COLUMNS + column, or NO_CURSOR
+    uint32_t _cellWrites;
+    uint32_t _cursorMoves;
+};
+
+template <class Display>
+uint8_t LcdFrame::flush(Display &display, uint8_t maxCells) {
+  uint8_t written = 0;
+  for (uint8_t cell = 0; cell < ROWS * COLUMNS && written < maxCells; cell++) {
+    uint8_t row = cell / COLUMNS;
+    uint8_t column = cell % COLUMNS;
+    char c = _frame[row][column];
+    if (_shown[row][column] == c) {
+      continue;
+    }
+    if (_cursor != cell) {
+      display.setCursor(column, row);
+      _cursorMoves++;
+    }
+    display.write(c);
+    _shown[row][column] = c;
+    _cellWrites++;
+    written++;
+    // The display address runs on past the last column instead of wrapping to the
+    // next row
+    _cursor = column + 1 < COLUMNS ? cell + 1 : NO_CURSOR;
+  }
+  return written;
+}
+
+#endif // LCD_FRAME_H
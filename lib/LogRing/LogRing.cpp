@@ -0,0 +1,238 @@
+#include "LogRing.h"
+#include <stdio.h>
+#include <string.h>
+
+LogRing logRing;
+
+// Append snprintf() output, keeping len within the buffer
+static void advance(size_t &len, size_t size, int n) {
+  if (n > 0) {
+    len = len + n < size ? len + n : size - 1;
+  }
+}
+
+LogRing::LogRing():
+  _head(0),
+  _tail(0),
+  _records(0),
+  _overwritten(0),
+  _clock(0) {
+}
+
+void LogRing::begin(Record &record, Level level, const char *format) {
+  uint32_t ms = _clock ? (uint32_t) _clock() : 0;
+  record.size = 1;    // Size byte, written by commit()
+  record.data[record.size++] = (uint8_t) level;
+  put(record, &ms, sizeof(ms));
+  put(record, &format, sizeof(format));
+}
+
+void LogRing::put(Record &record, const void *data, uint8_t size) {
+  memcpy(record.data + record.size, data, size);
+  record.size += size;
+}
+
+void LogRing::putInteger(Record &record, int64_t value, bool wide) {
+  if (record.size + 1 + 8 > MAX_RECORD) {
+    return;
+  }
+  if (wide) {
+    record.data[record.size++] = TAG_INT64;
+    put(record, &value, 8);
+  } else {
+    int32_t narrow = (int32_t) value;
+    record.data[record.size++] = TAG_INT32;
+    put(record, &narrow, 4);
+  }
+}
+
+void LogRing::putArg(Record &record, double value) {
+  if (record.size + 1 + 8 > MAX_RECORD) {
+    return;
+  }
+  record.data[record.size++] = TAG_DOUBLE;
+  put(record, &value, 8);
+}
+
+void LogRing::putArg(Record &record, const char *text) {
+  putString(record, text ? text : "(null)", text ? strnlen(text, LOG_RING_MAX_STRING) : 6);
+}
+
+void LogRing::putString(Record &record, const char *text, size_t length) {
+  if (length > LOG_RING_MAX_STRING) {
+    length = LOG_RING_MAX_STRING;
+  }
+  if (record.size + 2 + length > MAX_RECORD) {
+    if (record.size + 2 >= MAX_RECORD) {
+      return;
+    }
+    length = MAX_RECORD - record.size - 2;
+  }
+  record.data[record.size++] = TAG_STRING;
+  record.data[record.size++] = length;
+  put(record, text, length);
+}
+
+void LogRing::commit(Record &record) {
+  record.data[0] = record.size;
+  // Make room by dropping the oldest records
+  while (_head + record.size - _tail > LOG_RING_SIZE) {
+    _tail += byteAt(_tail);
+    _overwritten++;
+  }
+  for (uint8_t i = 0; i < record.size; i++) {
+    _ring[(_head + i) % LOG_RING_SIZE] = record.data[i];
+  }
+  _head += record.size;
+  _records++;
+}
+
+void LogRing::copyOut(uint32_t position, uint8_t *data, uint8_t size) {
+  for (uint8_t i = 0; i < size; i++) {
+    data[i] = byteAt(position + i);
+  }
+}
+
+void LogRing::oldest(Cursor &cursor) {
+  cursor.position = _tail;
+  cursor.record = _overwritten;
+  cursor.lost = 0;
+}
+
+void LogRing::newest(Cursor &cursor) {
+  cursor.position = _head;
+  cursor.record = _records;
+  cursor.lost = 0;
+}
+
+size_t LogRing::read(Cursor &cursor, char *text, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  if ((int32_t) (cursor.record - _overwritten) < 0) {
+    // Overtaken by the writer. Report the gap in place of the missing records.
+    uint32_t lost = _overwritten - cursor.record;
+    cursor.lost += lost;
+    cursor.position = _tail;
+    cursor.record = _overwritten;
+    size_t len = 0;
+    advance(len, size, snprintf(text, size, "%lu records lost\n", (unsigned long) lost));
+    return len;
+  }
+  if (cursor.position == _head) {
+    return 0;
+  }
+  Record record;
+  record.size = byteAt(cursor.position);
+  copyOut(cursor.position, record.data, record.size);
+  cursor.position += record.size;
+  cursor.record++;
+  return format(record.data, record.size, text, size);
+}
+
+char LogRing::toChar(Level level) {
+  switch (level) {
+    case Level::error: return 'E';
+    case Level::warn: return 'W';
+    case Level::info: return 'I';
+    case Level::debug: return 'D';
+  }
+  return '?';
+}
+
+size_t LogRing::format(const uint8_t *record, uint8_t size, char *text, size_t length) {
+  uint32_t ms;
+  const char *format;
+  memcpy(&ms, record + 2, sizeof(ms));
+  memcpy(&format, record + 6, sizeof(format));
+  uint8_t pos = HEADER_SIZE;
+  // Keep room for the newline
+  size_t room = length - 1;
+  size_t len = 0;
+  text[0] = 0;
+  advance(len, room, snprintf(text, room, "%lu.%03lu %c ", (unsigned long) (ms / 1000),
+    (unsigned long) (ms % 1000), toChar((Level) record[1])));
+  const char *p = format;
+  while (*p && len + 1 < room) {
+    if (*p != '%') {
+      text[len++] = *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      text[len++] = '%';
+      p += 2;
+      continue;
+    }
+    // Conversion specification, copied to be handed to snprintf() on its own
+    char spec[16];
+    uint8_t n = 0;
+    spec[n++] = *p++;
+    while (*p && strchr("-+ #0123456789.", *p) && n < sizeof(spec) - 4) {
+      spec[n++] = *p++;
+    }
+    uint8_t longs = 0;
+    while (*p == 'l' || *p == 'h' || *p == 'z') {
+      longs += *p == 'l' || *p == 'z';
+      if (n < sizeof(spec) - 2) {
+        spec[n++] = *p;
+      }
+      p++;
+    }
+    char conversion = *p;
+    if (!conversion) {
+      break;
+    }
+    p++;
+    spec[n++] = conversion;
+    spec[n] = 0;
+    char *out = text + len;
+    size_t left = room - len;
+    if (pos >= size) {
+      // Argument missing or dropped because the record was full
+      advance(len, room, snprintf(out, left, "?"));
+      continue;
+    }
+    uint8_t tag = record[pos++];
+    int64_t integer = 0;
+    double real = 0;
+    if (tag == TAG_INT32) {
+      int32_t value;
+      memcpy(&value, record + pos, 4);
+      integer = value;
+      real = value;
+      pos += 4;
+    } else if (tag == TAG_INT64 || tag == TAG_DOUBLE) {
+      memcpy(tag == TAG_INT64 ? (void *) &integer : (void *) &real, record + pos, 8);
+      if (tag == TAG_INT64) {
+        real = (double) integer;
+      } else {
+        integer = (int64_t) real;
+      }
+      pos += 8;
+    } else if (tag == TAG_STRING) {
+      char string[LOG_RING_MAX_STRING + 1];
+      uint8_t count = record[pos++];
+      memcpy(string, record + pos, count);
+      string[count] = 0;
+      pos += count;
+      advance(len, room, snprintf(out, left, conversion == 's' ? spec : "%s", string));
+      continue;
+    }
+    if (strchr("diouxXc", conversion)) {
+      if (longs >= 2) {
+        advance(len, room, snprintf(out, left, spec, (long long) integer));
+      } else if (longs == 1) {
+        advance(len, room, snprintf(out, left, spec, (long) integer));
+      } else {
+        advance(len, room, snprintf(out, left, spec, (int) integer));
+      }
+    } else if (strchr("fFeEgG", conversion)) {
+      advance(len, room, snprintf(out, left, spec, real));
+    } else {
+      advance(len, room, snprintf(out, left, "?"));
+    }
+  }
+  text[len++] = '\n';
+  text[len] = 0;
+  return len;
+}
@@ -0,0 +1,163 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <MemoryBudget.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 2048          // Bytes of RAM holding the most recent records
+#endif
+
+#ifndef LOG_RING_MAX_STRING
+#define LOG_RING_MAX_STRING 48      // String arguments are truncated to this length
+#endif
+
+// Log macros. Levels above LOG_LEVEL compile to nothing: neither the format string nor
+// the arguments are evaluated. The format is printf-like (flags, width, precision and
+// the h, l and ll modifiers of d, i, u, x, X, o and c, plus s, f, g, e and %%), without
+// trailing newline.
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logRing.add(LogRing::Level::error, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logRing.add(LogRing::Level::warn, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logRing.add(LogRing::Level::info, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logRing.add(LogRing::Level::debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* LogRing                                                                            */
+/*------------------------------------------------------------------------------------*/
+// Deferred logging. Logging a record only copies the address of its format string, a
+// timestamp and the raw arguments into a fixed-size RAM ring; formatting and output
+// happen later, a little at a time, from loop(). When the ring is full the oldest
+// records are overwritten.
+//
+// Record: size (1 byte), level (1 byte), time in ms (4 bytes), format address, then
+// each argument as a type tag followed by 4 or 8 bytes, or by a length byte and the
+// characters of a string.
+//
+// Any number of readers (Serial, MQTT) walk the ring independently, each with its own
+// cursor. A reader overtaken by the writer skips to the oldest record and gets a
+// "<n> records lost" line instead of the records it missed.
+class LogRing {
+  public:
+    enum class Level : uint8_t {
+      error = LOG_LEVEL_ERROR,
+      warn = LOG_LEVEL_WARN,
+      info = LOG_LEVEL_INFO,
+      debug = LOG_LEVEL_DEBUG
+    };
+    typedef unsigned long (*Clock)(void);
+
+    // Position of a reader
+    struct Cursor {
+      uint32_t position;    // Byte offset since the ring was created
+      uint32_t record;      // Number of the record at position
+      uint32_t lost;        // Records overwritten before this reader got to them
+    };
+
+    // String argument that is not null terminated
+    struct Chars {
+      const char *text;
+      size_t length;
+    };
+
+    LogRing();
+    ~LogRing() {};
+
+    // Timestamps are 0 until a clock is set
+    void setClock(Clock clock) { _clock = clock; }
+
+    template <typename... Args>
+    void add(Level level, const char *format, Args... args);
+
+    // Reader at the oldest record, or at the end to get only new records
+    void oldest(Cursor &cursor);
+    void newest(Cursor &cursor);
+    bool available(const Cursor &cursor) { return cursor.position != _head; }
+    // Format the record at the cursor as "<ms> <level letter> <text>\n" and move past it.
+    // Returns the text length, 0 when the reader is at the end. Text that does not fit
+    // in size is truncated.
+    size_t read(Cursor &cursor, char *text, size_t size);
+
+    static char toChar(Level level);
+    uint32_t getRecordCount(void) { return _records; }
+    uint32_t getOverwrittenCount(void) { return _overwritten; }
+
+  private:
+    enum Tag : uint8_t { TAG_INT32, TAG_INT64, TAG_DOUBLE, TAG_STRING };
+    static const uint8_t HEADER_SIZE = 2 + 4 + sizeof(const char *);
+    static const uint8_t MAX_RECORD = 128;
+
+    // Record under construction
+    struct Record {
+      uint8_t data[MAX_RECORD];
+      uint8_t size;
+    };
+
+    void begin(Record &record, Level level, const char *format);
+    void put(Record &record, const void *data, uint8_t size);
+    void putInteger(Record &record, int64_t value, bool wide);
+    void putString(Record &record, const char *text, size_t length);
+    void commit(Record &record);
+    uint8_t byteAt(uint32_t position) { return _ring[position % LOG_RING_SIZE]; }
+    void copyOut(uint32_t position, uint8_t *data, uint8_t size);
+    static size_t format(const uint8_t *record, uint8_t size, char *text, size_t length);
+
+    void putArg(Record &record, const char *text);
+    void putArg(Record &record, char *text) { putArg(record, (const char *) text); }
+    void putArg(Record &record, const Chars &chars) { putString(record, chars.text, chars.length); }
+    void putArg(Record &record, double value);
+    void putArg(Record &record, float value) { putArg(record, (double) value); }
+    template <typename T>
+    void putArg(Record &record, T value) { putInteger(record, (int64_t) value, sizeof(T) > 4); }
+    void putArgs(Record &) {}
+    template <typename T, typename... Rest>
+    void putArgs(Record &record, T first, Rest... rest) {
+      putArg(record, first);
+      putArgs(record, rest...);
+    }
+
+    uint8_t _ring[LOG_RING_SIZE];
+    uint32_t _head;         // Where the next record goes
+    uint32_t _tail;         // Oldest record
+    uint32_t _records;      // Records added. Also the number of the next record
+    uint32_t _overwritten;  // Records dropped. Also the number of the oldest record
+    Clock _clock;
+};
+
+template <typename... Args>
+void LogRing::add(Level level, const char *format, Args... args) {
+  Record record;
+  begin(record, level, format);
+  putArgs(record, args...);
+  commit(record);
+}
+
+extern LogRing logRing;
+
+#endif // LOG_RING_H
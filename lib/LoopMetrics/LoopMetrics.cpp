@@ -0,0 +1,133 @@
+#include "LoopMetrics.h"
+#include <string.h>
+
+LoopMetrics::LoopMetrics(uint8_t stageCount, Counter counter, uint8_t cpuMHz):
+  _stageCount(stageCount < LOOP_METRICS_MAX_STAGES ? stageCount : LOOP_METRICS_MAX_STAGES),
+  _counter(counter),
+  _cpuMHz(cpuMHz ? cpuMHz : 1) {
+#if LOOP_METRICS
+  _started = false;
+  _passStart = _passEnd = _markCycles = 0;
+  _passMaxCycles = 0;
+  _passMaxStage = 0;
+  reset();
+#endif
+}
+
+#if LOOP_METRICS
+void LoopMetrics::beginPass(void) {
+  uint32_t now = _counter();
+  if (_started) {
+    record(idleStage(), now - _passEnd);
+  }
+  _started = true;
+  _passStart = _markCycles = now;
+  _passMaxCycles = 0;
+  _passMaxStage = 0;
+}
+
+void LoopMetrics::endPass(void) {
+  uint32_t now = _counter();
+  uint32_t cycles = now - _passStart;
+  record(passStage(), cycles);
+  if (cycles > _stallCycles) {
+    _stallCycles = cycles;
+    _stallStage = _passMaxStage;
+  }
+  _passes++;
+  _passEnd = now;
+}
+
+void LoopMetrics::reset(void) {
+  memset(_stages, 0, sizeof(_stages));
+  _stallCycles = 0;
+  _stallStage = 0;
+  _passes = 0;
+}
+
+uint32_t LoopMetrics::getStallMicros(void) {
+  return _stallCycles / _cpuMHz;
+}
+
+uint8_t LoopMetrics::getStallStage(void) {
+  return _stallStage;
+}
+
+uint32_t LoopMetrics::getPasses(void) {
+  return _passes;
+}
+
+size_t LoopMetrics::encode(uint8_t *buffer, size_t size, uint32_t seconds, uint32_t freeHeap,
+  uint32_t maxFreeBlock, uint8_t fragmentation) {
+  // Header: at most 1 + 5 + 1 + 5 + 5 + 5 + 1 + 5 + 1 + 1 bytes
+  if (size < 30) {
+    return 0;
+  }
+  size_t len = 0;
+  buffer[len++] = FORMAT_VERSION;
+  len += putVarint(buffer + len, size - len, seconds);
+  buffer[len++] = _cpuMHz;
+  len += putVarint(buffer + len, size - len, _passes);
+  len += putVarint(buffer + len, size - len, freeHeap);
+  len += putVarint(buffer + len, size - len, maxFreeBlock);
+  buffer[len++] = fragmentation;
+  len += putVarint(buffer + len, size - len, getStallMicros());
+  buffer[len++] = _stallStage;
+  uint8_t stages = _stageCount + 2;
+  buffer[len++] = stages;
+  for (uint8_t i = 0; i < stages && len > 0; i++) {
+    const Stage &stage = _stages[i];
+    uint8_t count = BUCKETS;
+    while (count > 0 && stage.buckets[count - 1] == 0) {
+      count--;
+    }
+    size_t n = putVarint(buffer + len, size - len, stage.maxCycles / _cpuMHz);
+    if (n == 0 || len + n >= size) {
+      len = 0;
+      break;
+    }
+    len += n;
+    buffer[len++] = count;
+    for (uint8_t b = 0; b < count; b++) {
+      n = putVarint(buffer + len, size - len, stage.buckets[b]);
+      if (n == 0) {
+        len = 0;
+        break;
+      }
+      len += n;
+    }
+  }
+  // Start over even when the message did not fit
+  reset();
+  return len;
+}
+#else
+uint32_t LoopMetrics::getStallMicros(void) {
+  return 0;
+}
+
+uint8_t LoopMetrics::getStallStage(void) {
+  return 0;
+}
+
+uint32_t LoopMetrics::getPasses(void) {
+  return 0;
+}
+
+size_t LoopMetrics::encode(uint8_t *, size_t, uint32_t, uint32_t, uint32_t, uint8_t) {
+  return 0;
+}
+#endif
+
+size_t LoopMetrics::putVarint(uint8_t *buffer, size_t size, uint32_t value) {
+  size_t len = 0;
+  do {
+    if (len >= size) {
+      return 0;
+    }
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    buffer[len++] = value ? byte | 0x80 : byte;
+  } while (value);
+  return len;
+}
@@ -0,0 +1,118 @@
+#ifndef LOOP_METRICS_H
+#define LOOP_METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <MemoryBudget.h>
+
+#ifndef LOOP_METRICS
+#define LOOP_METRICS 1              // 0 compiles the instrumentation out
+#endif
+
+#ifndef LOOP_METRICS_MAX_STAGES
+#define LOOP_METRICS_MAX_STAGES 10
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* LoopMetrics                                                                        */
+/*------------------------------------------------------------------------------------*/
+// Time spent in each stage of loop(), measured with the CPU cycle counter. Every stage
+// keeps its longest run and a log2 histogram of its durations: bucket 0 counts runs
+// shorter than one tick (64 cycles, 0.8 us at 80 MHz), bucket b runs of 2^(b-1) up to
+// 2^b ticks, the last bucket everything longer. Two more histograms cover the whole
+// pass and the time between passes, spent in the Wi-Fi stack and the core. The pass
+// that took longest (the worst stall) is kept with the stage that took most of it.
+//
+// loop() calls beginPass(), mark(stage) after each stage and endPass(). mark() reads
+// the counter once and touches one bucket. With LOOP_METRICS 0 they are empty and the
+// tables are gone.
+//
+// encode() writes the figures gathered since the last call as one compact message and
+// starts over:
+//
+//   version (1 byte), seconds covered (varint), CPU MHz (1 byte), passes (varint),
+//   free heap (varint), largest free block (varint), heap fragmentation % (1 byte),
+//   longest pass in us (varint), stage that took most of it (1 byte, see below),
+//   stage count (1 byte), then per stage: longest run in us (varint), bucket count
+//   (1 byte, trailing empty buckets dropped) and the bucket counts (varints).
+//
+// Stages are the ones passed to mark() in order, then the whole pass, then the time
+// between passes.
+class LoopMetrics {
+  public:
+    typedef uint32_t (*Counter)(void);
+    static const uint8_t FORMAT_VERSION = 1;
+    static const uint8_t BUCKETS = 16;
+    static const uint8_t TICK_SHIFT = 6;     // One tick is 64 cycles
+
+    LoopMetrics(uint8_t stageCount, Counter counter, uint8_t cpuMHz);
+    ~LoopMetrics() {};
+
+#if LOOP_METRICS
+    void beginPass(void);
+    void mark(uint8_t stage) {
+      uint32_t now = _counter();
+      uint32_t cycles = now - _markCycles;
+      _markCycles = now;
+      record(stage, cycles);
+      if (cycles > _passMaxCycles) {
+        _passMaxCycles = cycles;
+        _passMaxStage = stage;
+      }
+    }
+    void endPass(void);
+#else
+    void beginPass(void) {}
+    void mark(uint8_t) {}
+    void endPass(void) {}
+#endif
+
+    // Returns the message length, 0 when compiled out or when it does not fit
+    size_t encode(uint8_t *buffer, size_t size, uint32_t seconds, uint32_t freeHeap,
+      uint32_t maxFreeBlock, uint8_t fragmentation);
+
+    // Longest pass since the last encode(), in us, and the stage that took most of it
+    uint32_t getStallMicros(void);
+    uint8_t getStallStage(void);
+    uint32_t getPasses(void);
+    // Stage numbers of the whole pass and of the time between passes
+    uint8_t passStage(void) { return _stageCount; }
+    uint8_t idleStage(void) { return _stageCount + 1; }
+
+  private:
+#if LOOP_METRICS
+    struct Stage {
+      uint32_t buckets[BUCKETS];
+      uint32_t maxCycles;
+    };
+
+    void record(uint8_t stage, uint32_t cycles) {
+      uint32_t ticks = cycles >> TICK_SHIFT;
+      uint8_t bucket = ticks ? 32 - __builtin_clz(ticks) : 0;
+      Stage &s = _stages[stage];
+      s.buckets[bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+      if (cycles > s.maxCycles) {
+        s.maxCycles = cycles;
+      }
+    }
+    void reset(void);
+
+    Stage _stages[LOOP_METRICS_MAX_STAGES + 2];
+    uint32_t _passStart;
+    uint32_t _passEnd;          // To measure the time between passes
+    uint32_t _markCycles;
+    uint32_t _passMaxCycles;    // Longest stage of the current pass
+    uint8_t _passMaxStage;
+    uint32_t _stallCycles;      // Longest pass
+    uint8_t _stallStage;
+    uint32_t _passes;
+    bool _started;
+#endif
+    static size_t putVarint(uint8_t *buffer, size_t size, uint32_t value);
+
+    uint8_t _stageCount;
+    Counter _counter;
+    uint8_t _cpuMHz;
+};
+
+#endif // LOOP_METRICS_H
@@ -0,0 +1,206 @@
+#include "MqttOutbox.h"
+#include <stdio.h>
+#include <string.h>
+
+MqttOutbox::MqttOutbox(fs::FS &fs, const char *dir, uint8_t topics):
+  _fs(fs),
+  _dir(dir),
+  _topics(topics),
+  _fsReady(false),
+  _tail(0),
+  _count(0),
+  _spilledCount(0),
+  _readOffset(0),
+  _fileInUse(false),
+  _queued(0),
+  _sent(0),
+  _spilled(0),
+  _dropped(0) {
+}
+
+void MqttOutbox::path(char *name, size_t size, const char *file) {
+  snprintf(name, size, "%s/%s", _dir, file);
+}
+
+bool MqttOutbox::begin(void) {
+  char name[32];
+  _fsReady = _fs.mkdir(_dir) || _fs.exists(_dir);
+  if (!_fsReady) {
+    return false;
+  }
+  // RAM ring saved before a reset
+  path(name, sizeof(name), "ram");
+  File ram = _fs.open(name, "r");
+  if (ram) {
+    while (_count < MQTT_OUTBOX_SLOTS &&
+           ram.read((uint8_t *) &_ring[(_tail + _count) % MQTT_OUTBOX_SLOTS], sizeof(Message)) == sizeof(Message)) {
+      if (isValid(_ring[(_tail + _count) % MQTT_OUTBOX_SLOTS])) {
+        _count++;
+      } else {
+        _dropped++;
+      }
+    }
+    ram.close();
+    _fs.remove(name);
+  }
+  // Spilled messages not delivered yet
+  path(name, sizeof(name), "queue");
+  File queue = _fs.open(name, "r");
+  if (queue) {
+    size_t size = queue.size();
+    queue.close();
+    path(name, sizeof(name), "head");
+    File head = _fs.open(name, "r");
+    _readOffset = 0;
+    if (head) {
+      if (head.read((uint8_t *) &_readOffset, sizeof(_readOffset)) != sizeof(_readOffset) || _readOffset > size ||
+          _readOffset % sizeof(Message)) {
+        _readOffset = 0;
+      }
+      head.close();
+    }
+    _spilledCount = (size - _readOffset) / sizeof(Message);
+    if ((size - _readOffset) % sizeof(Message)) {
+      // A torn last message is ignored. Appending behind it would misalign every later
+      // one, so nothing is spilled until the file is drained.
+      _fsReady = false;
+    }
+    _fileInUse = true;
+    if (_count == 0) {
+      refill();
+    }
+  }
+  return true;
+}
+
+bool MqttOutbox::push(uint8_t topic, time_t time, const char *payload) {
+  size_t length = strlen(payload);
+  if (length > MQTT_OUTBOX_PAYLOAD || topic >= _topics) {
+    _dropped++;
+    return false;
+  }
+  Message message;
+  message.time = time;
+  message.topic = topic;
+  message.length = length;
+  memcpy(message.payload, payload, length);
+  // Once messages are on file, new ones go behind them to keep the order
+  if (_spilledCount == 0 && _count < MQTT_OUTBOX_SLOTS) {
+    _ring[(_tail + _count) % MQTT_OUTBOX_SLOTS] = message;
+    _count++;
+  } else if (!spill(message)) {
+    _dropped++;
+    return false;
+  }
+  _queued++;
+  return true;
+}
+
+const MqttOutbox::Message *MqttOutbox::peek(void) {
+  return _count ? &_ring[_tail] : NULL;
+}
+
+void MqttOutbox::pop(void) {
+  if (_count == 0) {
+    return;
+  }
+  _tail = (_tail + 1) % MQTT_OUTBOX_SLOTS;
+  _count--;
+  _sent++;
+  if (_count == 0 && _fileInUse) {
+    refill();
+  }
+}
+
+void MqttOutbox::persist(void) {
+  if (!_fsReady || _count == 0) {
+    return;
+  }
+  char name[32];
+  path(name, sizeof(name), "ram");
+  File ram = _fs.open(name, "w");
+  if (!ram) {
+    return;
+  }
+  for (uint8_t i = 0; i < _count; i++) {
+    ram.write((const uint8_t *) &_ring[(_tail + i) % MQTT_OUTBOX_SLOTS], sizeof(Message));
+  }
+  ram.close();
+  // Messages read back from the file are in the RAM file now
+  if (_fileInUse) {
+    saveHead();
+  }
+}
+
+bool MqttOutbox::spill(const Message &message) {
+  if (!_fsReady || _spilledCount >= MQTT_OUTBOX_MAX_SPILLED) {
+    return false;
+  }
+  char name[32];
+  path(name, sizeof(name), "queue");
+  File queue = _fs.open(name, "a");
+  if (!queue) {
+    return false;
+  }
+  size_t written = queue.write((const uint8_t *) &message, sizeof(message));
+  queue.close();
+  if (written != sizeof(message)) {
+    // Later messages would be misaligned. Stop spilling until the file is drained.
+    _fsReady = false;
+    return false;
+  }
+  _spilledCount++;
+  _spilled++;
+  _fileInUse = true;
+  return true;
+}
+
+void MqttOutbox::refill(void) {
+  char name[32];
+  if (_spilledCount == 0) {
+    // Drained. Start a new file next time.
+    path(name, sizeof(name), "queue");
+    _fs.remove(name);
+    path(name, sizeof(name), "head");
+    _fs.remove(name);
+    _readOffset = 0;
+    _fileInUse = false;
+    _fsReady = true;
+    return;
+  }
+  // The ring load read back before was delivered
+  saveHead();
+  path(name, sizeof(name), "queue");
+  File queue = _fs.open(name, "r");
+  if (!queue || !queue.seek(_readOffset, SeekSet)) {
+    _spilledCount = 0;
+    return;
+  }
+  while (_count < MQTT_OUTBOX_SLOTS && _spilledCount) {
+    if (queue.read((uint8_t *) &_ring[(_tail + _count) % MQTT_OUTBOX_SLOTS], sizeof(Message)) != sizeof(Message)) {
+      _spilledCount = 0;
+      break;
+    }
+    if (isValid(_ring[(_tail + _count) % MQTT_OUTBOX_SLOTS])) {
+      _count++;
+    } else {
+      _dropped++;
+    }
+    _spilledCount--;
+    _readOffset += sizeof(Message);
+  }
+  queue.close();
+  if (_count == 0) {
+    refill();   // Nothing valid was left
+  }
+}
+
+void MqttOutbox::saveHead(void) {
+  char name[32];
+  path(name, sizeof(name), "head");
+  File head = _fs.open(name, "w");
+  if (head) {
+    head.write((const uint8_t *) &_readOffset, sizeof(_readOffset));
+    head.close();
+  }
+}
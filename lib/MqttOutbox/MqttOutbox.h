@@ -0,0 +1,92 @@
+#ifndef MQTT_OUTBOX_H
+#define MQTT_OUTBOX_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include <MemoryBudget.h>
+
+#ifndef MQTT_OUTBOX_SLOTS
+#define MQTT_OUTBOX_SLOTS 16          // Messages held in RAM
+#endif
+
+#ifndef MQTT_OUTBOX_MAX_SPILLED
+#define MQTT_OUTBOX_MAX_SPILLED 256   // Messages held on flash once RAM is full
+#endif
+
+#ifndef MQTT_OUTBOX_PAYLOAD
+#define MQTT_OUTBOX_PAYLOAD 90        // Longest payload
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* MqttOutbox                                                                         */
+/*------------------------------------------------------------------------------------*/
+// Store-and-forward queue for events that must reach the broker even when it or the
+// Wi-Fi is down. Messages are timestamped and kept in order in a RAM ring. When the
+// ring is full they spill to an append-only file (<dir>/queue) and come back to RAM,
+// a ring load at a time, as the ring empties. The file is removed once drained.
+//
+// Drop policy: when RAM and file are both full the new message is dropped and counted.
+// The oldest undelivered events are kept, so a gap starts where the counters say.
+//
+// Delivery is at least once for spilled messages: the read position (<dir>/head) is
+// saved when a ring load has been delivered, so a power loss may repeat up to one ring
+// load. persist() saves the RAM ring (<dir>/ram) before a planned reset; begin() puts
+// it back in front of the queue. Messages read back with a topic or length out of
+// range are dropped. A queue that ends in a torn message is drained but not appended
+// to, since the next message would be read back misaligned.
+class MqttOutbox {
+  public:
+    struct Message {
+      uint32_t time;      // When it was queued
+      uint8_t topic;      // Index into the caller's topic table
+      uint8_t length;
+      char payload[MQTT_OUTBOX_PAYLOAD];
+    };
+
+    // topics: size of the caller's topic table
+    MqttOutbox(fs::FS &fs, const char *dir, uint8_t topics);
+    ~MqttOutbox() {};
+
+    // Pick up messages left by a previous run. Without a usable file system the outbox
+    // keeps working from RAM only.
+    bool begin(void);
+
+    // Queue a message. Returns false when it was dropped (outbox full, payload too long
+    // or topic out of range).
+    bool push(uint8_t topic, time_t time, const char *payload);
+    // Oldest message, NULL when empty. pop() once it was delivered.
+    const Message *peek(void);
+    void pop(void);
+    void persist(void);
+
+    uint32_t size(void) { return _count + _spilledCount; }
+    uint32_t getQueued(void) { return _queued; }
+    uint32_t getSent(void) { return _sent; }
+    uint32_t getSpilled(void) { return _spilled; }
+    uint32_t getDropped(void) { return _dropped; }
+
+  private:
+    void path(char *name, size_t size, const char *file);
+    bool isValid(const Message &message) { return message.topic < _topics && message.length <= MQTT_OUTBOX_PAYLOAD; }
+    bool spill(const Message &message);
+    void refill(void);
+    void saveHead(void);
+
+    fs::FS &_fs;
+    const char *_dir;
+    uint8_t _topics;
+    bool _fsReady;
+    Message _ring[MQTT_OUTBOX_SLOTS];
+    uint8_t _tail;             // Oldest message in RAM
+    uint8_t _count;
+    uint32_t _spilledCount;    // Messages in the file not yet read back
+    uint32_t _readOffset;      // Next message in the file to read back
+    bool _fileInUse;           // The file holds messages, or messages from it are in RAM
+    // Statistics
+    uint32_t _queued;
+    uint32_t _sent;
+    uint32_t _spilled;
+    uint32_t _dropped;
+};
+
+#endif // MQTT_OUTBOX_H
@@ -0,0 +1,78 @@
+#include "MqttReconnect.h"
+
+MqttReconnect::MqttReconnect(uint32_t baseDelayMs, uint32_t maxDelayMs, uint32_t seed):
+  _baseDelayMs(baseDelayMs),
+  _maxDelayMs(maxDelayMs),
+  _currentDelayMs(0),
+  _lastAttemptMs(0),
+  _rng(seed ? seed : 1),
+  _failedAttempts(0),
+  _state(State::waiting) {
+}
+
+bool MqttReconnect::run(uint32_t nowMs, bool isConnected) {
+  if (isConnected) {
+    if (_state != State::connected) {
+      attemptSucceeded();
+    }
+    return false;
+  }
+  if (_state == State::connected) {
+    // Connection just dropped. First attempt is immediate.
+    _state = State::waiting;
+    _currentDelayMs = 0;
+    _lastAttemptMs = nowMs;
+  }
+  if (_state == State::attempting) {
+    // Outcome of the previous attempt was never reported. Treat it as a failure.
+    attemptFailed(nowMs);
+  }
+  // Unsigned subtraction keeps working across the millis() rollover
+  if ((uint32_t)(nowMs - _lastAttemptMs) < _currentDelayMs) {
+    return false;
+  }
+  _state = State::attempting;
+  _lastAttemptMs = nowMs;
+  return true;
+}
+
+void MqttReconnect::attemptSucceeded(void) {
+  _state = State::connected;
+  _failedAttempts = 0;
+  _currentDelayMs = 0;
+}
+
+void MqttReconnect::attemptFailed(uint32_t nowMs) {
+  _state = State::waiting;
+  _lastAttemptMs = nowMs;
+  if (_failedAttempts < 0xFFFF) {
+    _failedAttempts++;
+  }
+  // Exponential ceiling: base * 2^(failures - 1), capped at max
+  uint32_t ceiling = _baseDelayMs;
+  for (uint16_t i = 1; i < _failedAttempts && ceiling < _maxDelayMs; i++) {
+    ceiling <<= 1;
+  }
+  if (ceiling > _maxDelayMs) {
+    ceiling = _maxDelayMs;
+  }
+  // Jitter: uniformly between half the ceiling and the ceiling
+  uint32_t half = ceiling / 2;
+  _currentDelayMs = half + (half ? nextRandom() % (ceiling - half + 1) : 0);
+}
+
+uint32_t MqttReconnect::getMillisToNextAttempt(uint32_t nowMs) {
+  if (_state == State::connected) {
+    return 0;
+  }
+  uint32_t elapsed = nowMs - _lastAttemptMs;
+  return elapsed >= _currentDelayMs ? 0 : _currentDelayMs - elapsed;
+}
+
+uint32_t MqttReconnect::nextRandom(void) {
+  // xorshift32. Good enough for jitter and needs no platform RNG.
+  _rng ^= _rng << 13;
+  _rng ^= _rng >> 17;
+  _rng ^= _rng << 5;
+  return _rng;
+}
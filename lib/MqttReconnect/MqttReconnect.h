@@ -0,0 +1,49 @@
+#ifndef MQTT_RECONNECT_H
+#define MQTT_RECONNECT_H
+
+#include <stdint.h>
+
+/*------------------------------------------------------------------------------------*/
+/* MqttReconnect                                                                      */
+/*------------------------------------------------------------------------------------*/
+// Resumable MQTT reconnection state machine. It does not own the client: loop() asks
+// it whether a connection attempt is due, performs a single attempt and reports the
+// outcome back. Between attempts the wait grows exponentially (capped) with random
+// jitter, so a fleet of controllers does not hammer a restarting broker in lockstep.
+// Time is passed in by the caller (milliseconds), which keeps the class host-testable.
+class MqttReconnect {
+  public:
+    enum class State : uint8_t {
+      connected,   // Client is connected. Nothing to do
+      waiting,     // Disconnected. Waiting for the backoff interval to expire
+      attempting   // An attempt has been granted and its outcome not reported yet
+    };
+
+    MqttReconnect(uint32_t baseDelayMs, uint32_t maxDelayMs, uint32_t seed = 1);
+    ~MqttReconnect() {};
+
+    // Call on every loop() pass. Returns true when the caller should make one attempt
+    bool run(uint32_t nowMs, bool isConnected);
+
+    // Report the outcome of the attempt granted by run()
+    void attemptSucceeded(void);
+    void attemptFailed(uint32_t nowMs);
+
+    State getState(void) { return _state; }
+    uint16_t getFailedAttempts(void) { return _failedAttempts; }
+    uint32_t getCurrentDelayMs(void) { return _currentDelayMs; }
+    uint32_t getMillisToNextAttempt(uint32_t nowMs);
+
+  private:
+    uint32_t nextRandom(void);
+
+    uint32_t _baseDelayMs;
+    uint32_t _maxDelayMs;
+    uint32_t _currentDelayMs;
+    uint32_t _lastAttemptMs;
+    uint32_t _rng;
+    uint16_t _failedAttempts;
+    State _state;
+};
+
+#endif // MQTT_RECONNECT_H
@@ -0,0 +1,94 @@
+#include "MqttTls.h"
+#include <stdio.h>
+
+MqttTls::MqttTls(void):
+  _fragment(Fragment::unknown),
+  _startMs(0),
+  _startHeap(0),
+  _lastMs(0),
+  _lastHeap(0),
+  _full({ 0, 0, 0 }),
+  _resumed({ 0, 0, 0 }),
+  _failed(0),
+  _deferred(0) {
+}
+
+void MqttTls::probed(bool negotiated) {
+  _fragment = negotiated ? Fragment::negotiated : Fragment::refused;
+}
+
+uint16_t MqttTls::getReceiveSize(void) {
+  // Until the probe answered, assume the worst
+  return _fragment == Fragment::negotiated ? MQTT_TLS_FRAGMENT_SIZE : FULL_RECORD;
+}
+
+uint32_t MqttTls::getHeapNeeded(void) {
+  return (uint32_t) getReceiveSize() + RECEIVE_OVERHEAD + getSendSize() + SEND_OVERHEAD + MQTT_TLS_CONTEXT_HEAP;
+}
+
+bool MqttTls::fits(uint32_t freeHeap, uint32_t maxFreeBlock) {
+  // The receive buffer is the largest single allocation
+  if (maxFreeBlock >= (uint32_t) getReceiveSize() + RECEIVE_OVERHEAD &&
+    freeHeap >= getHeapNeeded() + MQTT_TLS_HEAP_RESERVE) {
+    return true;
+  }
+  if (_deferred < 0xFFFF) {
+    _deferred++;
+  }
+  forgetRefusal();
+  return false;
+}
+
+void MqttTls::attemptStarted(uint32_t nowMs, uint32_t freeHeap) {
+  _startMs = nowMs;
+  _startHeap = freeHeap;
+}
+
+MqttTls::Handshake MqttTls::attemptEnded(uint32_t nowMs, uint32_t freeHeap, bool connected, bool resumed) {
+  uint32_t elapsed = nowMs - _startMs;
+  if (!connected) {
+    if (_failed < 0xFFFF) {
+      _failed++;
+    }
+    forgetRefusal();
+    return Handshake::failed;
+  }
+  Figures &figures = resumed ? _resumed : _full;
+  if (figures.count < 0xFFFF) {
+    figures.count++;
+  }
+  figures.lastMs = elapsed;
+  if (elapsed > figures.maxMs) {
+    figures.maxMs = elapsed;
+  }
+  _lastMs = elapsed;
+  _lastHeap = _startHeap > freeHeap ? _startHeap - freeHeap : 0;
+  return resumed ? Handshake::resumed : Handshake::full;
+}
+
+void MqttTls::forgetRefusal(void) {
+  // Kept once a connection with full size buffers succeeded
+  if (_fragment == Fragment::refused && !_full.count && !_resumed.count) {
+    _fragment = Fragment::unknown;
+  }
+}
+
+size_t MqttTls::write(char *buffer, size_t size) {
+  static const char *FRAGMENTS[] = { "unknown", "negotiated", "refused" };
+  int n = snprintf(buffer, size,
+    "{\"fragment\":\"%s\",\"receive\":%u,\"heap\":%lu,\"full\":%u,\"fullMs\":%lu,\"fullMaxMs\":%lu,"
+    "\"resumed\":%u,\"resumedMs\":%lu,\"resumedMaxMs\":%lu,\"failed\":%u,\"deferred\":%u}",
+    FRAGMENTS[(uint8_t) _fragment], getReceiveSize(), (unsigned long) _lastHeap, _full.count,
+    (unsigned long) _full.lastMs, (unsigned long) _full.maxMs, _resumed.count, (unsigned long) _resumed.lastMs,
+    (unsigned long) _resumed.maxMs, _failed, _deferred);
+  return n > 0 && (size_t) n < size ? n : 0;
+}
+
+const char *MqttTls::toString(Handshake handshake) {
+  switch (handshake) {
+    case Handshake::full: return "full";
+    case Handshake::resumed: return "resumed";
+    case Handshake::failed: return "failed";
+    default: return "none";
+  }
+}
@@ -0,0 +1,101 @@
+#ifndef MQTT_TLS_H
+#define MQTT_TLS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <MemoryBudget.h>
+
+#ifndef MQTT_TLS
+#define MQTT_TLS 0                         // 1 connects to the broker over TLS
+#endif
+#ifndef MQTT_TLS_FRAGMENT_SIZE
+#define MQTT_TLS_FRAGMENT_SIZE 512         // Record size asked of the broker (max fragment length)
+#endif
+#ifndef MQTT_TLS_SEND_SIZE
+#define MQTT_TLS_SEND_SIZE 512             // Records the client sends
+#endif
+#ifndef MQTT_TLS_CONTEXT_HEAP
+#define MQTT_TLS_CONTEXT_HEAP 7000         // Client and X.509 contexts on top of the buffers
+#endif
+#ifndef MQTT_TLS_HEAP_RESERVE
+#define MQTT_TLS_HEAP_RESERVE 6000         // Heap left to lwIP and the file system once connected
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* MqttTls                                                                            */
+/*------------------------------------------------------------------------------------*/
+// Budget and measurements of the TLS connection to the broker. It does not own the
+// client: reconnect() asks it which buffer sizes to give BearSSL and whether the heap can
+// take a handshake now, then reports how the attempt went.
+//
+// A full TLS record is 16 KB, so by default BearSSL takes about 17 KB of receive buffer
+// from the heap on every connect, on top of its contexts. When the broker accepts the
+// max fragment length extension (RFC 6066) it sends records of at most
+// MQTT_TLS_FRAGMENT_SIZE and both buffers shrink to well under 1 KB. Whether it does is
+// probed before the first connection. A broker that refuses gets a full size receive
+// buffer, and attempts wait while the heap has no block that large. An unreachable
+// broker looks the same as one that refuses, so a refusal is probed again until a
+// connection succeeded.
+//
+// Each attempt is timed and the free heap measured before and after, split by handshake
+// kind: full (certificate check and key exchange, seconds of CPU on the ESP8266) or
+// resumed (the session of an earlier connection, a few round trips of symmetric crypto).
+// Time and heap figures are passed in by the caller, which keeps the class host-testable.
+class MqttTls {
+  public:
+    enum class Fragment : uint8_t { unknown, negotiated, refused };
+    enum class Handshake : uint8_t { none, full, resumed, failed };
+
+    MqttTls(void);
+    ~MqttTls() {};
+
+    // Max fragment length, probed once before the first connection
+    bool isProbeDue(void) { return _fragment == Fragment::unknown; }
+    void probed(bool negotiated);
+    Fragment getFragment(void) { return _fragment; }
+    uint16_t getReceiveSize(void);
+    uint16_t getSendSize(void) { return MQTT_TLS_SEND_SIZE; }
+
+    // Heap the connection takes, and whether it fits. A false answer counts as deferred.
+    uint32_t getHeapNeeded(void);
+    bool fits(uint32_t freeHeap, uint32_t maxFreeBlock);
+
+    // Around one connection attempt. resumed: the session of the last connection was used
+    void attemptStarted(uint32_t nowMs, uint32_t freeHeap);
+    Handshake attemptEnded(uint32_t nowMs, uint32_t freeHeap, bool connected, bool resumed);
+    // A connection succeeded, so the client holds a session to resume
+    bool hasSession(void) { return _full.count || _resumed.count; }
+
+    uint32_t getLastMs(void) { return _lastMs; }
+    uint32_t getLastHeap(void) { return _lastHeap; }
+    // JSON object of the figures since boot
+    size_t write(char *buffer, size_t size);
+
+    static const char *toString(Handshake handshake);
+
+  private:
+    // Size BearSSL adds to each buffer for record headers, MAC and padding
+    static const uint16_t RECEIVE_OVERHEAD = 325;
+    static const uint16_t SEND_OVERHEAD = 85;
+    static const uint16_t FULL_RECORD = 16384;
+
+    void forgetRefusal(void);
+
+    struct Figures {
+      uint16_t count;
+      uint32_t lastMs;
+      uint32_t maxMs;
+    };
+
+    Fragment _fragment;
+    uint32_t _startMs;
+    uint32_t _startHeap;
+    uint32_t _lastMs;
+    uint32_t _lastHeap;     // Heap the connection holds, measured after the last handshake
+    Figures _full;
+    Figures _resumed;
+    uint16_t _failed;
+    uint16_t _deferred;
+};
+
+#endif // MQTT_TLS_H
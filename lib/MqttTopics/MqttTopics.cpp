@@ -0,0 +1,58 @@
+#include "MqttTopics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Suffixes of the topics of one controller, in Topic order
+const char *DEVICE_TOPICS[] = { "request", "state", "flowseries", "alarm", "error", "history", "log", "metrics", "drip", "boot", "trace" };
+
+MqttTopics::MqttTopics(const char *root):
+  _root(root),
+  _perDevice(false) {
+  memset(_topics, 0, sizeof(_topics));
+}
+
+void MqttTopics::begin(uint32_t device, bool perDevice, const char *group) {
+  _perDevice = perDevice;
+  for (uint8_t topic = request; topic <= trace; topic++) {
+    if (perDevice) {
+      snprintf(_topics[topic], MQTT_TOPIC_SIZE, "%s/%06lx/%s", _root, (unsigned long) device, DEVICE_TOPICS[topic]);
+    } else {
+      snprintf(_topics[topic], MQTT_TOPIC_SIZE, "%s/%s", _root, DEVICE_TOPICS[topic]);
+    }
+  }
+  if (perDevice) {
+    snprintf(_topics[groupRequest], MQTT_TOPIC_SIZE, "%s/group/%s/request", _root, group);
+    snprintf(_topics[allRequest], MQTT_TOPIC_SIZE, "%s/all/request", _root);
+    snprintf(_topics[claims], MQTT_TOPIC_SIZE, "%s/group/%s/claim/+", _root, group);
+    snprintf(_topics[claim], MQTT_TOPIC_SIZE, "%s/group/%s/claim/%06lx", _root, group, (unsigned long) device);
+  } else {
+    _topics[groupRequest][0] = _topics[allRequest][0] = _topics[claims][0] = _topics[claim][0] = 0;
+  }
+}
+
+bool MqttTopics::parseClaim(const char *topic, uint32_t &device) {
+  // The claims wildcard without its final '+'
+  size_t prefix = strlen(_topics[claims]);
+  if (!_perDevice || prefix == 0 || strncmp(topic, _topics[claims], prefix - 1)) {
+    return false;
+  }
+  const char *id = topic + prefix - 1;
+  char *end;
+  device = strtoul(id, &end, 16);
+  return end != id && *end == 0;
+}
+
+bool MqttTopics::isValidGroup(const char *group) {
+  size_t length = strlen(group);
+  if (length == 0 || length >= FLEET_GROUP_SIZE) {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++) {
+    char c = group[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,68 @@
+#ifndef MQTT_TOPICS_H
+#define MQTT_TOPICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <MemoryBudget.h>
+
+#ifndef MQTT_TOPIC_SIZE
+#define MQTT_TOPIC_SIZE 64          // Longest topic, terminator included
+#endif
+#ifndef FLEET_GROUP_SIZE
+#define FLEET_GROUP_SIZE 17         // Group name, terminator included
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* MqttTopics                                                                         */
+/*------------------------------------------------------------------------------------*/
+// Topic names of a controller, composed once when the namespace changes. With the shared
+// namespace every controller uses <root>/request, <root>/state, ... as single controllers
+// always did. With per-device topics they live under <root>/<device id>/ and the
+// controller also takes commands sent to its group and to every controller:
+//
+//   /home-assistant/drip/c0ffee/request         this controller
+//   /home-assistant/drip/group/garden/request   every controller of group garden
+//   /home-assistant/drip/all/request            every controller
+//   /home-assistant/drip/group/garden/claim/c0ffee   retained slot claim (FleetSlots)
+//
+// The device id is the chip id in hex, stable across reboots.
+class MqttTopics {
+  public:
+    enum Topic : uint8_t {
+      request,
+      state,
+      flowSeries,
+      alarm,
+      error,
+      history,
+      log,
+      metrics,
+      drip,
+      boot,
+      trace,
+      groupRequest,     // Per-device topics only
+      allRequest,
+      claims,           // Wildcard over the claims of the group
+      claim,            // Claim of this controller
+      TOPIC_COUNT
+    };
+
+    MqttTopics(const char *root);
+    ~MqttTopics() {};
+
+    // Compose every topic. group is kept by the caller.
+    void begin(uint32_t device, bool perDevice, const char *group);
+    bool isPerDevice(void) { return _perDevice; }
+    const char *get(Topic topic) { return _topics[topic]; }
+    // Device id of a topic of the claims of the group
+    bool parseClaim(const char *topic, uint32_t &device);
+    // Group names are letters, digits, '-' and '_'
+    static bool isValidGroup(const char *group);
+
+  private:
+    const char *_root;
+    bool _perDevice;
+    char _topics[TOPIC_COUNT][MQTT_TOPIC_SIZE];
+};
+
+#endif // MQTT_TOPICS_H
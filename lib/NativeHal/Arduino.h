@@ -0,0 +1,106 @@
+#ifndef NATIVE_HAL_ARDUINO_H
+#define NATIVE_HAL_ARDUINO_H
+
+// Host stand-in for the parts of the ESP8266 Arduino core the firmware uses. Time comes
+// from the simulator's virtual clock.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <functional>
+#include <string>
+
+#ifndef F_CPU
+#define F_CPU 80000000L   // Cycle counter rate of the simulated CPU
+#endif
+#define ICACHE_RAM_ATTR
+#define PROGMEM
+#define PGM_P const char *
+#define HEX 16
+#define DEC 10
+#define INPUT 0x00
+#define OUTPUT 0x01
+#define INPUT_PULLUP 0x02
+#define LOW 0
+#define HIGH 1
+#define RISING 1
+#define FALLING 2
+#define CHANGE 3
+
+typedef uint8_t byte;
+
+class String : public std::string {
+  public:
+    String() {}
+    String(const char *s): std::string(s) {}
+    String(const std::string &s): std::string(s) {}
+    String(long value, int base = DEC);
+};
+
+class IPAddress {
+  public:
+    IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) { _a[0] = a; _a[1] = b; _a[2] = c; _a[3] = d; }
+    String toString(void) const;
+  private:
+    uint8_t _a[4];
+};
+
+class HardwareSerial {
+  public:
+    void begin(unsigned long) {}
+    void printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    void print(const char *s);
+    void print(const String &s) { print(s.c_str()); }
+    void print(const IPAddress &ip) { print(ip.toString()); }
+    void print(char c) { char s[2] = { c, 0 }; print(s); }
+    void print(long n) { printf("%ld", n); }
+    void println(void) { print("\n"); }
+    size_t write(const uint8_t *data, size_t size);
+    int availableForWrite(void) { return 128; }   // UART FIFO never fills
+    void flush(void) {}
+    template <typename T> void println(const T &value) { print(value); println(); }
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+  public:
+    void reset(void);
+    void restart(void) { reset(); }
+    uint32_t getChipId(void);   // 0xC0FFEE, or DRIPSIM_CHIP_ID to replay the trace of a controller
+    uint32_t getFreeHeap(void) { return 40000; }
+    uint32_t getMaxFreeBlockSize(void) { return 36000; }
+    uint8_t getHeapFragmentation(void) { return 10; }
+    uint32_t getCycleCount(void);
+    bool flashRead(uint32_t offset, uint32_t *data, size_t size);
+    bool flashWrite(uint32_t offset, uint32_t *data, size_t size);
+    bool flashEraseSector(uint32_t sector);
+    // 512 bytes of RTC user memory, offset in 4 byte blocks. Kept across runs with --state.
+    bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+    bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+    String getResetReason(void);
+};
+extern EspClass ESP;
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void yield(void);
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+inline int digitalPinToInterrupt(uint8_t pin) { return pin; }
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+inline void interrupts(void) {}
+inline void noInterrupts(void) {}
+
+// Starts SNTP. The simulator sets the clock --ntp seconds later.
+void configTime(long, int, const char *, const char * = NULL, const char * = NULL);
+
+#endif // NATIVE_HAL_ARDUINO_H
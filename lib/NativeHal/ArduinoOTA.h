@@ -0,0 +1,29 @@
+#ifndef NATIVE_HAL_ARDUINOOTA_H
+#define NATIVE_HAL_ARDUINOOTA_H
+
+#include <Arduino.h>
+
+typedef int ota_error_t;
+enum {
+  OTA_AUTH_ERROR,
+  OTA_BEGIN_ERROR,
+  OTA_CONNECT_ERROR,
+  OTA_RECEIVE_ERROR,
+  OTA_END_ERROR
+};
+
+// No updates arrive in the simulation
+class ArduinoOTAClass {
+  public:
+    void setHostname(const char *) {}
+    void setPassword(const char *) {}
+    void onStart(std::function<void(void)>) {}
+    void onEnd(std::function<void(void)>) {}
+    void onProgress(std::function<void(uint32_t, uint32_t)>) {}
+    void onError(std::function<void(ota_error_t)>) {}
+    void begin(void) {}
+    void handle(void) {}
+};
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif // NATIVE_HAL_ARDUINOOTA_H
@@ -0,0 +1,18 @@
+#ifndef NATIVE_HAL_EEPROM_H
+#define NATIVE_HAL_EEPROM_H
+
+#include <Arduino.h>
+
+// Reads the EEPROM sector of the simulated flash. Writes are not supported: the
+// firmware only reads it to migrate old images.
+class EEPROMClass {
+  public:
+    void begin(size_t size) { _size = size; }
+    uint8_t read(int address);
+    void end(void) { _size = 0; }
+  private:
+    size_t _size;
+};
+extern EEPROMClass EEPROM;
+
+#endif // NATIVE_HAL_EEPROM_H
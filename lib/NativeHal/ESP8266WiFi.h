@@ -0,0 +1,61 @@
+#ifndef NATIVE_HAL_ESP8266WIFI_H
+#define NATIVE_HAL_ESP8266WIFI_H
+
+#include <Arduino.h>
+
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+
+enum WiFiMode_t { WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3 };
+enum WiFiSleepType_t { WIFI_NONE_SLEEP = 0, WIFI_LIGHT_SLEEP = 1, WIFI_MODEM_SLEEP = 2 };
+
+// TCP connection. The MQTT client's only tells whether the simulated broker can be
+// reached: PubSubClient talks to the broker itself. A connection accepted by WiFiServer
+// is a socket on localhost (the simulator's --http) or an HTTP exchange of the scenario
+// script.
+class WiFiClient {
+  public:
+    WiFiClient(): _socket(-1), _exchange(-1) {}
+    virtual ~WiFiClient() {}
+    virtual int connect(const char *host, uint16_t port);
+    void setTimeout(unsigned long) {}
+    void setNoDelay(bool) {}
+    bool connected(void);
+    int available(void);
+    int read(uint8_t *data, size_t size);
+    size_t write(const uint8_t *data, size_t size);
+    size_t write_P(PGM_P data, size_t size) { return write((const uint8_t *) data, size); }
+    void stop(void);
+    size_t availableForWrite(void) { return 2920; }   // lwIP send buffer, always drained
+    operator bool(void) { return _socket >= 0 || _exchange >= 0; }
+
+  private:
+    friend class WiFiServer;
+    int _socket;
+    int _exchange;
+};
+
+class WiFiServer {
+  public:
+    WiFiServer(uint16_t port): _port(port), _socket(-1) {}
+    void begin(void);
+    void setNoDelay(bool) {}
+    WiFiClient available(void);   // The next connection, if any
+
+  private:
+    uint16_t _port;
+    int _socket;
+};
+
+class ESP8266WiFiClass {
+  public:
+    bool mode(WiFiMode_t) { return true; }
+    int begin(void) { return status(); }   // Saved network, the simulator's Wi-Fi
+    int status(void);
+    bool setSleepMode(WiFiSleepType_t type, uint8_t listenInterval = 0);
+    IPAddress softAPIP(void) { return IPAddress(192, 168, 4, 1); }
+    IPAddress localIP(void) { return IPAddress(192, 168, 1, 207); }
+};
+extern ESP8266WiFiClass WiFi;
+
+#endif // NATIVE_HAL_ESP8266WIFI_H
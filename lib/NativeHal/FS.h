@@ -0,0 +1,75 @@
+#ifndef NATIVE_HAL_FS_H
+#define NATIVE_HAL_FS_H
+
+#include <Arduino.h>
+#include <dirent.h>
+
+// File system backed by a directory of the host
+
+enum SeekMode {
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+struct FSInfo {
+  size_t totalBytes;
+  size_t usedBytes;
+  size_t blockSize;
+  size_t pageSize;
+  size_t maxOpenFiles;
+  size_t maxPathLength;
+};
+
+namespace fs {
+
+class File {
+  public:
+    File(FILE *file = NULL): _file(file) {}
+    operator bool() const { return _file != NULL; }
+    size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, _file); }
+    size_t read(uint8_t *buffer, size_t size) { return fread(buffer, 1, size, _file); }
+    bool seek(uint32_t position, SeekMode mode) { return fseek(_file, position, mode) == 0; }
+    size_t position(void) { return ftell(_file); }
+    size_t size(void);
+    void close(void) { if (_file) fclose(_file); _file = NULL; }
+  private:
+    FILE *_file;
+};
+
+class Dir {
+  public:
+    Dir(DIR *dir = NULL): _dir(dir) {}
+    bool next(void);
+    String fileName(void) { return _name; }
+  private:
+    DIR *_dir;
+    String _name;
+};
+
+class FS {
+  public:
+    FS(size_t totalBytes): _totalBytes(totalBytes) {}
+    void setRoot(const char *root) { _root = root; }
+    bool begin(void);
+    void end(void) {}
+    bool format(void);
+    bool info(FSInfo &info);
+    File open(const char *path, const char *mode);
+    bool exists(const char *path);
+    Dir openDir(const char *path);
+    bool mkdir(const char *path);
+    bool remove(const char *path);
+    bool rename(const char *from, const char *to);
+  private:
+    std::string hostPath(const char *path) { return _root + path; }
+    std::string _root;
+    size_t _totalBytes;
+};
+
+} // namespace fs
+
+using fs::File;
+using fs::Dir;
+
+#endif // NATIVE_HAL_FS_H
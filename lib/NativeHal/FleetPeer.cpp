@@ -0,0 +1,115 @@
+#include "FleetPeer.h"
+#include "Simulator.h"
+#include <string.h>
+
+const char *PEER_MQTT_ROOT = "/home-assistant/drip";   // MQTT_ROOT of the firmware
+const uint16_t PEER_SETTLE_SECONDS = 10;               // FLEET_SETTLE_SECONDS of the firmware
+
+FleetPeer::FleetPeer(uint32_t device, const char *group, double budget, uint32_t secondOfDay, uint32_t minutes, double flow):
+  _topics(PEER_MQTT_ROOT),
+  _slots(device, PEER_SETTLE_SECONDS),
+  _group(group),
+  _secondOfDay(secondOfDay),
+  _seconds(minutes * 60),
+  _flow((uint16_t) (flow * 10 + 0.5)),
+  _joined(false),
+  _state(State::idle),
+  _deadline(0) {
+  _slots.setBudget((uint16_t) (budget * 10 + 0.5));
+}
+
+void FleetPeer::join(time_t now) {
+  _topics.begin(_slots.getDevice(), true, _group.c_str());
+  _joined = true;
+  _deadline = getNextDrip(now);
+  sim.log("peer", "%06x joins group %s, drips daily at %s", _slots.getDevice(), _group.c_str(), formatTime(_deadline).c_str());
+}
+
+void FleetPeer::receive(const std::string &topic, const std::string &payload, time_t now) {
+  uint32_t device;
+  if (!_topics.parseClaim(topic.c_str(), device)) {
+    return;
+  }
+  FleetSlots::Claim claim;
+  memset(&claim, 0, sizeof(claim));
+  if (!payload.empty() && !FleetSlots::decode(payload.c_str(), payload.size(), claim)) {
+    return;
+  }
+  claim.device = device;
+  _slots.update(claim, now);
+  if (_state == State::claimed && _slots.check(now)) {
+    _deadline = _slots.getClaim().start;
+    sim.log("peer", "%06x moved to %s", _slots.getDevice(), formatTime(_deadline).c_str());
+    publishClaim();
+  }
+}
+
+void FleetPeer::run(time_t now) {
+  if (!_joined || now < _deadline) {
+    return;
+  }
+  switch (_state) {
+    case State::idle:
+      if (!_slots.isEnabled()) {
+        open(now);   // Uncoordinated, on time
+      } else {
+        const FleetSlots::Claim &claim = _slots.plan(now, _seconds, _flow);
+        _state = State::claimed;
+        _deadline = claim.start;
+        sim.log("peer", "%06x claims %s to %s, %.1f l/min", _slots.getDevice(), formatTime(claim.start).c_str(),
+          formatTime(claim.end).c_str(), getFlow());
+        publishClaim();
+      }
+      break;
+    case State::claimed:
+      open(now);
+      break;
+    case State::open:
+      _state = State::idle;
+      _deadline = getNextDrip(now);
+      sim.log("peer", "%06x closed", _slots.getDevice());
+      sim.notePeakFlow();
+      if (_slots.hasClaim()) {
+        _slots.release();
+        publishClaim();
+      }
+      break;
+  }
+}
+
+void FleetPeer::open(time_t now) {
+  _state = State::open;
+  _deadline = now + _seconds;
+  sim.log("peer", "%06x open, %.1f l/min", _slots.getDevice(), getFlow());
+  sim.notePeakFlow();
+}
+
+void FleetPeer::publishClaim(void) {
+  char payload[FLEET_CLAIM_MESSAGE_SIZE];
+  size_t len = _slots.hasClaim() ? FleetSlots::encode(_slots.getClaim(), payload, sizeof(payload)) : 0;
+  sim.publishPeer(_topics.get(MqttTopics::claim), std::string(payload, len), true);
+}
+
+std::string FleetPeer::formatTime(time_t time) {
+  char text[12];
+  struct tm local;
+  localtime_r(&time, &local);
+  strftime(text, sizeof(text), "%H:%M:%S", &local);
+  return text;
+}
+
+time_t FleetPeer::getNextDrip(time_t after) {
+  struct tm local;
+  localtime_r(&after, &local);
+  local.tm_hour = _secondOfDay / 3600;
+  local.tm_min = _secondOfDay / 60 % 60;
+  local.tm_sec = _secondOfDay % 60;
+  local.tm_isdst = -1;
+  time_t next = mktime(&local);
+  if (next <= after) {
+    local.tm_mday++;
+    local.tm_isdst = -1;
+    next = mktime(&local);
+  }
+  return next;
+}
@@ -0,0 +1,57 @@
+#ifndef NATIVE_HAL_FLEET_PEER_H
+#define NATIVE_HAL_FLEET_PEER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <FleetSlots.h>
+#include <MqttTopics.h>
+
+/*------------------------------------------------------------------------------------*/
+/* FleetPeer                                                                          */
+/*------------------------------------------------------------------------------------*/
+// Another controller on the same water main, modelled by the simulator. The firmware
+// keeps its state in globals, so a second copy can not run in the same process. A peer
+// drips once a day for a fixed time at a fixed flow and coordinates through the same
+// FleetSlots and MqttTopics as the firmware, over the simulated broker:
+//
+//   +0 peer 00beef garden 12 07:00:00 45 6.5   device, group, budget and flow in l/min
+//
+// Without a budget the peer starts on time and claims nothing.
+class FleetPeer {
+  public:
+    enum class State : uint8_t { idle, claimed, open };
+
+    FleetPeer(uint32_t device, const char *group, double budget, uint32_t secondOfDay, uint32_t minutes, double flow);
+
+    // Start dripping daily from now on
+    void join(time_t now);
+    bool isJoined(void) { return _joined; }
+    bool isOpen(void) { return _state == State::open; }
+    double getFlow(void) { return _flow / 10.0; }
+    const char *getClaimsFilter(void) { return _topics.get(MqttTopics::claims); }
+
+    // A message on a topic the peer subscribed to
+    void receive(const std::string &topic, const std::string &payload, time_t now);
+    // Next time run() has to be called
+    time_t getDeadline(void) { return _deadline; }
+    void run(time_t now);
+
+  private:
+    void open(time_t now);
+    void publishClaim(void);
+    time_t getNextDrip(time_t after);
+    static std::string formatTime(time_t time);
+
+    MqttTopics _topics;
+    FleetSlots _slots;
+    std::string _group;
+    uint32_t _secondOfDay;
+    uint32_t _seconds;
+    uint16_t _flow;            // Deciliters per minute
+    bool _joined;
+    State _state;
+    time_t _deadline;
+};
+
+#endif // NATIVE_HAL_FLEET_PEER_H
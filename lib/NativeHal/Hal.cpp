@@ -0,0 +1,546 @@
+// Stand-ins of the ESP8266 core and the device libraries. Everything with an effect
+// outside the firmware reports to the simulator.
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <FS.h>
+#include <LittleFS.h>
+#include <Wire.h>
+#include <ESP8266WiFi.h>
+#include <ArduinoOTA.h>
+#include <PubSubClient.h>
+#include <WiFiClientSecure.h>
+#include <TimeUtils.h>
+#include <StatusLED.h>
+#include <Valves.h>
+#include <PushButton.h>
+#include <LiquidCrystal_I2C.h>
+#include <spi_flash.h>
+#include <coredecls.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "Simulator.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+EEPROMClass EEPROM;
+TwoWire Wire;
+ESP8266WiFiClass WiFi;
+ArduinoOTAClass ArduinoOTA;
+fs::FS LittleFS(1024 * 1024);
+
+/*------------------------------------------------------------------------------------*/
+/* Core                                                                               */
+/*------------------------------------------------------------------------------------*/
+String::String(long value, int base) {
+  char text[24];
+  snprintf(text, sizeof(text), base == HEX ? "%lx" : "%ld", value);
+  assign(text);
+}
+
+String IPAddress::toString(void) const {
+  char text[16];
+  snprintf(text, sizeof(text), "%u.%u.%u.%u", _a[0], _a[1], _a[2], _a[3]);
+  return String(text);
+}
+
+void HardwareSerial::printf(const char *format, ...) {
+  if (!sim.isVerbose()) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+size_t HardwareSerial::write(const uint8_t *data, size_t size) {
+  if (sim.isVerbose()) {
+    fwrite(data, 1, size, stderr);
+  }
+  return size;
+}
+
+void HardwareSerial::print(const char *s) {
+  if (sim.isVerbose()) {
+    fputs(s, stderr);
+  }
+}
+
+void EspClass::reset(void) {
+  throw Simulator::Reset();
+}
+
+uint32_t EspClass::getChipId(void) {
+  // From the environment: globals of the firmware read it before main()
+  const char *id = getenv("DRIPSIM_CHIP_ID");
+  return id ? (uint32_t) strtoul(id, NULL, 16) : 0x00C0FFEE;
+}
+
+uint32_t EspClass::getCycleCount(void) {
+  return sim.getCycles();
+}
+
+bool EspClass::flashRead(uint32_t offset, uint32_t *data, size_t size) {
+  if (offset + size > SPI_FLASH_SIZE) {
+    return false;
+  }
+  memcpy(data, sim.getFlash() + offset, size);
+  return true;
+}
+
+bool EspClass::flashWrite(uint32_t offset, uint32_t *data, size_t size) {
+  // NOR flash: writes only clear bits, 4 byte aligned
+  if ((offset | size) & 3 || offset + size > SPI_FLASH_SIZE) {
+    return false;
+  }
+  uint8_t *flash = sim.getFlash() + offset;
+  const uint8_t *bytes = (const uint8_t *) data;
+  for (size_t i = 0; i < size; i++) {
+    flash[i] &= bytes[i];
+  }
+  return true;
+}
+
+bool EspClass::flashEraseSector(uint32_t sector) {
+  if ((sector + 1) * SPI_FLASH_SEC_SIZE > SPI_FLASH_SIZE) {
+    return false;
+  }
+  memset(sim.getFlash() + sector * SPI_FLASH_SEC_SIZE, 0xFF, SPI_FLASH_SEC_SIZE);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size) {
+  if (offset * 4 + size > Simulator::RTC_MEMORY_SIZE || !size) {
+    return false;
+  }
+  memcpy(data, sim.getRtcMemory() + offset * 4, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size) {
+  if (offset * 4 + size > Simulator::RTC_MEMORY_SIZE || !size) {
+    return false;
+  }
+  memcpy(sim.getRtcMemory() + offset * 4, data, size);
+  return true;
+}
+
+String EspClass::getResetReason(void) {
+  return sim.getResetReason();
+}
+
+void configTime(long, int, const char *, const char *, const char *) {
+  sim.requestNtp();
+}
+
+void settimeofday_cb(void (*callback)(void)) {
+  sim.setClockCallback(callback);
+}
+
+// The firmware setting the clock, with -Wl,--wrap=settimeofday
+extern "C" int __wrap_settimeofday(const struct timeval *tv, const struct timezone *tz) {
+  if (tv) {
+    sim.setClock(tv->tv_sec);
+  }
+  return 0;
+}
+
+unsigned long millis(void) {
+  return (uint32_t) sim.getMillis();
+}
+
+unsigned long micros(void) {
+  return (uint32_t) (sim.getMillis() * 1000);
+}
+
+void delay(unsigned long ms) {
+  sim.sleep(ms);
+}
+
+void yield(void) {
+}
+
+static uint32_t randomState = 1;
+
+long random(long max) {
+  // Deterministic, so runs can be compared
+  randomState = randomState * 1103515245 + 12345;
+  return max > 0 ? (long) ((randomState >> 8) % max) : 0;
+}
+
+long random(long min, long max) {
+  return max > min ? min + random(max - min) : min;
+}
+
+void randomSeed(unsigned long seed) {
+  randomState = seed;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+}
+
+int digitalRead(uint8_t pin) {
+  return HIGH;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode) {
+  // The only interrupt is the flow sensor
+  sim.attachPulseIsr(isr);
+}
+
+uint8_t EEPROMClass::read(int address) {
+  return address >= 0 && (size_t) address < _size ? sim.getFlash()[SPI_FLASH_EEPROM_SECTOR * SPI_FLASH_SEC_SIZE + address] : 0;
+}
+
+uint8_t TwoWire::endTransmission(void) {
+  sim.writeI2c(_address, _buffer, _count);
+  return 0;
+}
+
+int ESP8266WiFiClass::status(void) {
+  return sim.isWifiUp() ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+bool ESP8266WiFiClass::setSleepMode(WiFiSleepType_t type, uint8_t listenInterval) {
+  static const char *NAMES[] = { "none", "light", "modem" };
+  sim.setWifiSleep(NAMES[type]);
+  return true;
+}
+
+void WiFiServer::begin(void) {
+  _socket = sim.listenHttp(_port);
+}
+
+WiFiClient WiFiServer::available(void) {
+  WiFiClient client;
+  client._exchange = sim.takeHttpExchange();
+  if (client._exchange < 0 && _socket >= 0) {
+    client._socket = accept4(_socket, NULL, NULL, SOCK_NONBLOCK);
+  }
+  return client;
+}
+
+int WiFiClient::connect(const char *host, uint16_t port) {
+  return sim.isBrokerUp();
+}
+
+bool WiFiClient::connected(void) {
+  if (_exchange >= 0) {
+    return true;   // Until the firmware closes it
+  }
+  char c;
+  ssize_t n = _socket >= 0 ? recv(_socket, &c, 1, MSG_PEEK | MSG_DONTWAIT) : 0;
+  return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+int WiFiClient::available(void) {
+  int count = 0;
+  if (_exchange >= 0) {
+    return sim.httpAvailable(_exchange);
+  }
+  return _socket >= 0 && ioctl(_socket, FIONREAD, &count) == 0 ? count : 0;
+}
+
+int WiFiClient::read(uint8_t *data, size_t size) {
+  if (_exchange >= 0) {
+    return sim.httpRead(_exchange, data, size);
+  }
+  ssize_t n = _socket >= 0 ? recv(_socket, data, size, MSG_DONTWAIT) : -1;
+  return n > 0 ? n : 0;
+}
+
+size_t WiFiClient::write(const uint8_t *data, size_t size) {
+  if (_exchange >= 0) {
+    sim.httpWrite(_exchange, data, size);
+    return size;
+  }
+  ssize_t n = _socket >= 0 ? send(_socket, data, size, MSG_DONTWAIT | MSG_NOSIGNAL) : -1;
+  return n > 0 ? n : 0;
+}
+
+void WiFiClient::stop(void) {
+  if (_exchange >= 0) {
+    sim.closeHttp(_exchange);
+  }
+  if (_socket >= 0) {
+    close(_socket);
+  }
+  _socket = _exchange = -1;
+}
+
+namespace BearSSL {
+
+int WiFiClientSecure::connect(const char *host, uint16_t port) {
+  static uint32_t sessions = 0;
+  if (!sim.isBrokerUp()) {
+    return 0;
+  }
+  if (_session && _session->_id && _session->_restarts == sim.getBrokerRestarts()) {
+    sim.log("tls", "session %u resumed", _session->_id);
+  } else {
+    sessions++;
+    if (_session) {
+      _session->_id = sessions;
+      _session->_restarts = sim.getBrokerRestarts();
+    }
+    sim.log("tls", "full handshake, session %u", sessions);
+  }
+  return 1;
+}
+
+bool WiFiClientSecure::probeMaxFragmentLength(const char *host, uint16_t port, uint16_t length) {
+  return sim.isBrokerUp();
+}
+
+} // namespace BearSSL
+
+/*------------------------------------------------------------------------------------*/
+/* File System                                                                        */
+/*------------------------------------------------------------------------------------*/
+namespace fs {
+
+size_t File::size(void) {
+  struct stat info;
+  fflush(_file);
+  return fstat(fileno(_file), &info) == 0 ? info.st_size : 0;
+}
+
+bool Dir::next(void) {
+  while (_dir) {
+    struct dirent *entry = readdir(_dir);
+    if (!entry) {
+      closedir(_dir);
+      _dir = NULL;
+      break;
+    }
+    if (entry->d_name[0] != '.') {
+      _name = entry->d_name;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool FS::begin(void) {
+  std::string path;
+  // Create the root and its parents
+  for (size_t slash = _root.find('/', 1); ; slash = _root.find('/', slash + 1)) {
+    ::mkdir(_root.substr(0, slash).c_str(), 0755);
+    if (slash == std::string::npos) {
+      break;
+    }
+  }
+  return true;
+}
+
+bool FS::format(void) {
+  return Simulator::removeTree(_root) && begin();
+}
+
+static size_t usedBytes(const std::string &path) {
+  size_t used = 0;
+  DIR *dir = opendir(path.c_str());
+  if (!dir) {
+    return 0;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    std::string child = path + "/" + entry->d_name;
+    struct stat info;
+    if (stat(child.c_str(), &info) == 0) {
+      // Whole 4 KB blocks, like LittleFS
+      used += S_ISDIR(info.st_mode) ? usedBytes(child) : (info.st_size + 4095) / 4096 * 4096;
+    }
+  }
+  closedir(dir);
+  return used;
+}
+
+bool FS::info(FSInfo &info) {
+  memset(&info, 0, sizeof(info));
+  info.totalBytes = _totalBytes;
+  info.usedBytes = usedBytes(_root);
+  info.blockSize = 4096;
+  info.pageSize = 256;
+  info.maxOpenFiles = 5;
+  info.maxPathLength = 32;
+  return true;
+}
+
+File FS::open(const char *path, const char *mode) {
+  std::string hostMode = std::string(mode) + "b";
+  return File(fopen(hostPath(path).c_str(), hostMode.c_str()));
+}
+
+bool FS::exists(const char *path) {
+  struct stat info;
+  return stat(hostPath(path).c_str(), &info) == 0;
+}
+
+Dir FS::openDir(const char *path) {
+  return Dir(opendir(hostPath(path).c_str()));
+}
+
+bool FS::mkdir(const char *path) {
+  return ::mkdir(hostPath(path).c_str(), 0755) == 0;
+}
+
+bool FS::remove(const char *path) {
+  return ::remove(hostPath(path).c_str()) == 0;
+}
+
+bool FS::rename(const char *from, const char *to) {
+  return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+} // namespace fs
+
+/*------------------------------------------------------------------------------------*/
+/* Device Libraries                                                                   */
+/*------------------------------------------------------------------------------------*/
+bool PubSubClient::connect(const char *id, const char *user, const char *pass) {
+  return connect(id, user, pass, NULL, 0, false, NULL);
+}
+
+bool PubSubClient::connect(const char *id, const char *user, const char *pass, const char *willTopic,
+  uint8_t willQos, bool willRetain, const char *willMessage) {
+  if (!_client->connect(_host, _port)) {
+    _state = MQTT_CONNECTION_TIMEOUT;
+    return false;
+  }
+  _state = MQTT_CONNECTED;
+  sim.log("mqtt", "connected as %s", id);
+  return true;
+}
+
+void PubSubClient::disconnect(void) {
+  _state = MQTT_DISCONNECTED;
+  sim.unsubscribeAll();
+}
+
+bool PubSubClient::connected(void) {
+  if (_state == MQTT_CONNECTED && !sim.isBrokerUp()) {
+    _state = MQTT_CONNECTION_LOST;
+    sim.unsubscribeAll();
+    sim.log("mqtt", "%s", "connection lost");
+  }
+  return _state == MQTT_CONNECTED;
+}
+
+bool PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained) {
+  if (!connected()) {
+    return false;
+  }
+  sim.publish(topic, payload, length, retained);
+  return true;
+}
+
+bool PubSubClient::subscribe(const char *topic) {
+  if (!connected()) {
+    return false;
+  }
+  sim.subscribe(topic);
+  return true;
+}
+
+bool PubSubClient::loop(void) {
+  if (!connected()) {
+    return false;
+  }
+  std::string topic, payload;
+  while (sim.takeMessage(topic, payload)) {
+    if (_callback) {
+      // The real client hands over its receive buffer
+      std::vector<char> topicBuffer(topic.begin(), topic.end());
+      topicBuffer.push_back(0);
+      std::vector<uint8_t> payloadBuffer(payload.begin(), payload.end());
+      payloadBuffer.push_back(0);
+      _callback(&topicBuffer[0], &payloadBuffer[0], payload.size());
+    }
+  }
+  return true;
+}
+
+time_t TimeUtils::getCurrentTimeRaw(void) {
+  return sim.getClock();
+}
+
+struct tm *TimeUtils::getCurrentTime(void) {
+  static struct tm local;
+  time_t now = sim.getClock();
+  localtime_r(&now, &local);
+  return &local;
+}
+
+String TimeUtils::getTimeStr(time_t time) {
+  char text[16];
+  struct tm local;
+  localtime_r(&time, &local);
+  strftime(text, sizeof(text), "%H:%M:%S", &local);
+  return String(text);
+}
+
+void StatusLED::setStatus(Status status) {
+  static const char *NAMES[] = { "stable", "custom_1", "custom_2" };
+  if (!_known || status != _status) {
+    _known = true;
+    _status = status;
+    sim.setLed(NAMES[(uint8_t) status]);
+  }
+}
+
+void SolenoidValve::openValve(void) {
+  _open = true;
+  sim.setValve(true);
+}
+
+void SolenoidValve::closeValve(void) {
+  _open = false;
+  sim.setValve(false);
+}
+
+void PushButton::run(void) {
+  switch (sim.takeButtonPress()) {
+    case 1: if (_veryShort) _veryShort(); break;
+    case 2: if (_short) _short(); break;
+    case 3: if (_long) _long(); break;
+  }
+}
+
+LiquidCrystal_I2C::LiquidCrystal_I2C(uint8_t address, uint8_t columns, uint8_t rows):
+  _column(0),
+  _row(0) {
+}
+
+// Bytes on the bus per command or character sent to the display
+const uint8_t LCD_I2C_BYTES = 12;
+
+void LiquidCrystal_I2C::clear(void) {
+  sim.clearLcd();
+  sim.countLcdBytes(LCD_I2C_BYTES);
+  _column = 0;
+  _row = 0;
+}
+
+void LiquidCrystal_I2C::setCursor(uint8_t column, uint8_t row) {
+  sim.countLcdBytes(LCD_I2C_BYTES);
+  _column = column;
+  _row = row < 2 ? row : 1;
+}
+
+size_t LiquidCrystal_I2C::write(uint8_t c) {
+  sim.putLcd(_row, _column++, c);
+  sim.countLcdBytes(LCD_I2C_BYTES);
+  return 1;
+}
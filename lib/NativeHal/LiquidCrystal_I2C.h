@@ -0,0 +1,29 @@
+#ifndef NATIVE_HAL_LIQUIDCRYSTAL_I2C_H
+#define NATIVE_HAL_LIQUIDCRYSTAL_I2C_H
+
+#include <Arduino.h>
+
+// 16x2 character display. The simulator logs what it shows and counts the I2C bytes
+// the PCF8574 backpack would carry: every command or character goes out as two nibbles,
+// each latched by three one-byte expander writes (address byte included, 12 bytes).
+class LiquidCrystal_I2C {
+  public:
+    LiquidCrystal_I2C(uint8_t address, uint8_t columns, uint8_t rows);
+    void init(void) { clear(); }
+    void backlight(void) {}
+    void noBacklight(void) {}
+    void clear(void);
+    void home(void) { setCursor(0, 0); }
+    void setCursor(uint8_t column, uint8_t row);
+    size_t write(uint8_t c);
+    void print(const char *s) { while (*s) write(*s++); }
+    void print(const String &s) { print(s.c_str()); }
+    void print(const IPAddress &ip) { print(ip.toString()); }
+    void print(char c) { write(c); }
+    void print(long n) { char s[12]; snprintf(s, sizeof(s), "%ld", n); print(s); }
+  private:
+    uint8_t _column;
+    uint8_t _row;
+};
+
+#endif // NATIVE_HAL_LIQUIDCRYSTAL_I2C_H
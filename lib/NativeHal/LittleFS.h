@@ -0,0 +1,8 @@
+#ifndef NATIVE_HAL_LITTLEFS_H
+#define NATIVE_HAL_LITTLEFS_H
+
+#include <FS.h>
+
+extern fs::FS LittleFS;
+
+#endif // NATIVE_HAL_LITTLEFS_H
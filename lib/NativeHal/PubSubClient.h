@@ -0,0 +1,46 @@
+#ifndef NATIVE_HAL_PUBSUBCLIENT_H
+#define NATIVE_HAL_PUBSUBCLIENT_H
+
+#include <ESP8266WiFi.h>
+
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED               0
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char *, uint8_t *, unsigned int)> callback
+
+// MQTT client connected to the simulated broker. Published messages go to the timeline,
+// scripted messages are delivered from loop() like the real client does.
+class PubSubClient {
+  public:
+    PubSubClient(WiFiClient &client) : _client(&client), _host(NULL), _port(0), _state(MQTT_DISCONNECTED) {}
+    PubSubClient &setServer(const char *host, uint16_t port) { _host = host; _port = port; return *this; }
+    PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE) { _callback = callback; return *this; }
+    PubSubClient &setSocketTimeout(uint16_t) { return *this; }
+    bool setBufferSize(uint16_t) { return true; }
+
+    bool connect(const char *id, const char *user, const char *pass);
+    bool connect(const char *id, const char *user, const char *pass, const char *willTopic, uint8_t willQos,
+      bool willRetain, const char *willMessage);
+    void disconnect(void);
+    bool connected(void);
+    int state(void) { return _state; }
+
+    bool publish(const char *topic, const char *payload) { return publish(topic, (const uint8_t *) payload, strlen(payload), false); }
+    bool publish(const char *topic, const char *payload, bool retained) { return publish(topic, (const uint8_t *) payload, strlen(payload), retained); }
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length) { return publish(topic, payload, length, false); }
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained);
+    bool subscribe(const char *topic);
+    bool loop(void);
+
+  private:
+    std::function<void(char *, uint8_t *, unsigned int)> _callback;
+    WiFiClient *_client;
+    const char *_host;
+    uint16_t _port;
+    int _state;
+};
+
+#endif // NATIVE_HAL_PUBSUBCLIENT_H
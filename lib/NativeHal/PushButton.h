@@ -0,0 +1,24 @@
+#ifndef NATIVE_HAL_PUSHBUTTON_H
+#define NATIVE_HAL_PUSHBUTTON_H
+
+#include <Arduino.h>
+
+// Push button pressed by the scenario script. run() reports the press like the real
+// button does once it is released.
+class PushButton {
+  public:
+    typedef void (*Callback)(void);
+    PushButton(uint8_t pin, uint8_t shortSeconds, uint8_t longSeconds) : _veryShort(NULL), _short(NULL), _long(NULL) {}
+    void setup(Callback pressedOnStart, Callback veryShort, Callback shortly, Callback longPress) {
+      _veryShort = veryShort;
+      _short = shortly;
+      _long = longPress;
+    }
+    void run(void);
+  private:
+    Callback _veryShort;
+    Callback _short;
+    Callback _long;
+};
+
+#endif // NATIVE_HAL_PUSHBUTTON_H
@@ -0,0 +1,1092 @@
+#include "Simulator.h"
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <HeapCheck.h>
+#include <spi_flash.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <algorithm>
+
+// The firmware
+void setup(void);
+void loop(void);
+
+Simulator sim;
+
+Simulator::Simulator():
+  _scriptPath(NULL),
+  _tracePath(NULL),
+  _replayPath(NULL),
+  _statePath(NULL),
+  _startText("2026-01-01T00:00:00"),
+  _tz("EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00"),
+  _days(365),
+  _tickMs(1000),
+  _pulsesPerLiter(450),
+  _verbose(false),
+  _showLcd(false),
+  _cold(false),
+  _ntpDelayMs(0),
+  _httpPort(0),
+  _out(stdout),
+  _traceOut(NULL),
+  _traceLength(0),
+  _epoch(0),
+  _nowMs(0),
+  _endMs(0),
+  _nextEvent(0),
+  _clockSet(false),
+  _clockOffset(0),
+  _ntpAtMs(UINT64_MAX),
+  _clockCallback(NULL),
+  _flash(SPI_FLASH_SIZE, 0xFF),
+  _rtc(RTC_MEMORY_SIZE, 0),
+  _rtcKept(false),
+  _isr(NULL),
+  _inIsr(false),
+  _isrCycles(0),
+  _pulseFraction(0),
+  _pulses(0),
+  _valveOpen(false),
+  _onboardRate(4.0),
+  _leakRate(0),
+  _expanderAddress(-1),
+  _expanderIdle(0),
+  _expanderValue(0),
+  _button(0),
+  _brokerUp(true),
+  _wifiUp(true),
+  _brokerRestarts(0),
+  _httpListening(false),
+  _nextExchange(0),
+  _wallStartUs(0),
+  _loops(0),
+  _published(0),
+  _lcdBytes(0),
+  _sleptMs(0),
+  _peakFlow(0),
+  _matched(0),
+  _matchedValves(0),
+  _mismatch(false),
+  _lastPulseMs(0) {
+  for (uint8_t pin = 0; pin < 8; pin++) {
+    _pinRate[pin] = 2.0;
+  }
+  memset(_lcd, ' ', sizeof(_lcd));
+  _lcd[0][16] = _lcd[1][16] = 0;
+  memcpy(_lcdLogged, _lcd, sizeof(_lcd));
+}
+
+int Simulator::run(int argc, char **argv) {
+  if (!parseOptions(argc, argv)) {
+    fprintf(stderr,
+      "Usage: %s [options] [script]\n"
+      "  --start YYYY-MM-DDTHH:MM:SS  local start time (%s)\n"
+      "  --days N                     days to simulate (%u)\n"
+      "  --tick MS                    virtual time between loop() passes (%u)\n"
+      "  --tz TZ                      POSIX time zone until the firmware sets its own\n"
+      "  --ppl N                      flow sensor pulses per liter (%.0f)\n"
+      "  --state DIR                  keep flash, file system and RTC memory between runs\n"
+      "  --cold                       power was off: start with RTC memory cleared\n"
+      "  --ntp SECONDS                NTP answers SECONDS after it is started (%u)\n"
+      "  --out FILE                   timeline file (stdout)\n"
+      "  --trace FILE                 write the input trace of the firmware to FILE\n"
+      "  --replay FILE                replay a trace from reset instead of a script and check the outputs\n"
+      "  --http PORT                  web server on localhost:PORT, in real time\n"
+      "  --mute TOPIC                 do not log publishes on TOPIC\n"
+      "  --lcd                        log display changes\n"
+      "  --verbose                    firmware serial output to stderr\n",
+      argv[0], _startText, _days, _tickMs, _pulsesPerLiter, _ntpDelayMs / 1000);
+    return 2;
+  }
+  setenv("TZ", _tz, 1);
+  tzset();
+  uint64_t startMs;
+  if (!parseTime(_startText, startMs)) {
+    fprintf(stderr, "Bad start time %s\n", _startText);
+    return 2;
+  }
+  _endMs = (uint64_t) _days * 86400000ULL;
+  if (_replayPath && _scriptPath) {
+    fprintf(stderr, "A replay takes no script\n");
+    return 2;
+  }
+  if ((_scriptPath && !loadScript(_scriptPath)) || (_replayPath && !loadReplay(_replayPath))) {
+    return 2;
+  }
+  if (_tracePath) {
+    _traceOut = fopen(_tracePath, "wb");
+    if (!_traceOut) {
+      perror(_tracePath);
+      return 2;
+    }
+    writeTraceHeader();
+  }
+  InputTrace::setObserver(observeTrace);
+  loadState();
+  if (_httpPort) {
+    setvbuf(_out, NULL, _IOLBF, 0);   // Watched while it runs, and ended with Ctrl-C
+  }
+
+  struct timeval wallStart, wallEnd;
+  gettimeofday(&wallStart, NULL);
+  _wallStartUs = wallStart.tv_sec * 1000000ULL + wallStart.tv_usec;
+  int status = 0;
+  try {
+    log("boot", "%s", "setup()");
+    setup();
+    uint64_t nextTick = _nowMs;
+    while (_nowMs < _endMs) {
+      uint64_t next = nextTick;
+      if (_nextEvent < _events.size() && _events[_nextEvent].atMs < next) {
+        next = _events[_nextEvent].atMs;
+      }
+      uint64_t peerMs = getPeerDeadline();
+      next = peerMs < next ? peerMs : next;
+      next = _ntpAtMs < next ? _ntpAtMs : next;
+      advance(next);
+      bool replayed = false;
+      while (_nextEvent < _events.size() && _events[_nextEvent].atMs <= _nowMs && _nowMs < _endMs) {
+        replayed = _replayPath != NULL;
+        apply(_events[_nextEvent++]);
+      }
+      if (_ntpAtMs <= _nowMs) {
+        syncNtp();
+      }
+      runPeers();
+      // A replayed input was recorded in a loop() pass at its time
+      if ((_nowMs >= nextTick || replayed) && _nowMs < _endMs) {
+        loop();
+        _loops++;
+        nextTick = _nowMs + _tickMs;
+        if (_showLcd) {
+          logLcd();
+        }
+      }
+    }
+    log("end", "%s", "simulation ended");
+  } catch (const Reset &) {
+    log("reset", "%s", "ESP.reset(). Simulation ends");
+    status = 3;
+  }
+  gettimeofday(&wallEnd, NULL);
+  saveState();
+  if (_traceOut) {
+    writeTraceHeader();
+    fclose(_traceOut);
+  }
+  double wall = (wallEnd.tv_sec - wallStart.tv_sec) + (wallEnd.tv_usec - wallStart.tv_usec) / 1e6;
+  fprintf(stderr, "[SIM]: %.2f days in %.2f s, %llu loop() passes, %llu messages published, %.1f liters, "
+    "%llu LCD I2C bytes, %.1f%% of the time in delay()\n",
+    _nowMs / 86400000.0, wall, (unsigned long long) _loops, (unsigned long long) _published,
+    _pulses / _pulsesPerLiter, (unsigned long long) _lcdBytes, _nowMs ? 100.0 * _sleptMs / _nowMs : 0.0);
+  if (!_peers.empty()) {
+    fprintf(stderr, "[SIM]: %u other controllers, peak flow through the main %.1f liters per minute\n",
+      (unsigned int) _peers.size(), _peakFlow);
+  }
+  if (_replayPath) {
+    if (!_mismatch && _matched < _expected.size()) {
+      log("replay", "the firmware stopped short of %s at +%.3f s", describeOutput(_expected[_matched].kind,
+        _expected[_matched].data).c_str(), _expected[_matched].atMs / 1000.0);
+      _mismatch = true;
+    }
+    fprintf(stderr, "[SIM]: Replay %s: %u valve actions and %u publishes of %u outputs matched\n",
+      _mismatch ? "differs" : "matches", _matchedValves, (unsigned int) (_matched - _matchedValves),
+      (unsigned int) _expected.size());
+    status = _mismatch ? 4 : status;
+  }
+  if (_out != stdout) {
+    fclose(_out);
+  }
+  return status;
+}
+
+void Simulator::log(const char *kind, const char *format, ...) {
+  char stamp[40];
+  time_t now = getTime();
+  struct tm local;
+  localtime_r(&now, &local);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S %Z", &local);
+  fprintf(_out, "%s %s ", stamp, kind);
+  va_list args;
+  va_start(args, format);
+  vfprintf(_out, format, args);
+  va_end(args);
+  fputc('\n', _out);
+}
+
+void Simulator::setClock(time_t time) {
+  _clockSet = true;
+  _clockOffset = time - getTime();
+  log("clock", "set, %+ld s off", (long) _clockOffset);
+  // The core calls back for every set, not only for SNTP
+  if (_clockCallback) {
+    _clockCallback();
+  }
+}
+
+void Simulator::requestNtp(void) {
+  // A replay sets the clock when the trace does
+  if (_ntpAtMs == UINT64_MAX && !_replayPath) {
+    _ntpAtMs = _nowMs + _ntpDelayMs;
+  }
+}
+
+void Simulator::syncNtp(void) {
+  _ntpAtMs = UINT64_MAX;
+  if (!_wifiUp) {
+    _ntpAtMs = _nowMs + 15000;   // SNTP retries
+    return;
+  }
+  log("ntp", "clock %s, %+ld s off", _clockSet ? "stepped" : "set", (long) (_clockSet ? -_clockOffset : 0));
+  _clockSet = true;
+  _clockOffset = 0;
+  if (_clockCallback) {
+    _clockCallback();
+  }
+}
+
+void Simulator::setValve(bool open) {
+  if (open != _valveOpen) {
+    _valveOpen = open;
+    log("valve", "%s", open ? "open" : "closed");
+    notePeakFlow();
+  }
+}
+
+void Simulator::writeI2c(uint8_t address, const uint8_t *data, uint8_t count) {
+  if (!count) {
+    return;
+  }
+  // The first value written to the expander turns every output off
+  if (_expanderAddress < 0) {
+    _expanderAddress = address;
+    _expanderIdle = _expanderValue = data[count - 1];
+    log("expander", "0x%02x idle 0x%02x", address, _expanderIdle);
+    return;
+  }
+  if (address != _expanderAddress) {
+    return;
+  }
+  uint8_t value = data[count - 1];
+  for (uint8_t pin = 0; pin < 8; pin++) {
+    uint8_t bit = 1 << pin;
+    if ((value ^ _expanderValue) & bit) {
+      log("pin", "%u %s", pin, (value ^ _expanderIdle) & bit ? "open" : "closed");
+    }
+  }
+  _expanderValue = value;
+  notePeakFlow();
+}
+
+void Simulator::setWifiSleep(const char *type) {
+  log("wifi", "sleep %s", type);
+}
+
+void Simulator::setLed(const char *status) {
+  if (_led != status) {
+    _led = status;
+    log("led", "%s", status);
+  }
+}
+
+void Simulator::putLcd(uint8_t row, uint8_t column, char c) {
+  if (row < 2 && column < 16) {
+    _lcd[row][column] = c;
+  }
+}
+
+void Simulator::clearLcd(void) {
+  memset(_lcd[0], ' ', 16);
+  memset(_lcd[1], ' ', 16);
+}
+
+int Simulator::takeButtonPress(void) {
+  int press = _button;
+  _button = 0;
+  return press;
+}
+
+void Simulator::subscribe(const char *topic) {
+  if (std::find(_subscriptions.begin(), _subscriptions.end(), topic) == _subscriptions.end()) {
+    _subscriptions.push_back(topic);
+  }
+  log("sub", "%s", topic);
+  // The broker sends the retained messages matching a new subscription. A replay
+  // delivers what the trace has.
+  for (const auto &message : _retained) {
+    if (_replayPath) {
+      break;
+    }
+    if (matches(topic, message.first.c_str())) {
+      _inbox.push_back(message);
+    }
+  }
+}
+
+void Simulator::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained) {
+  _published++;
+  if (std::find(_muted.begin(), _muted.end(), topic) == _muted.end()) {
+    log("pub", "%s%s %s", topic, retained ? " (retained)" : "", formatPayload(payload, length).c_str());
+  }
+  std::string text((const char *) payload, length);
+  if (retained) {
+    retain(topic, text);
+  }
+  deliver(topic, text);
+}
+
+void Simulator::publishPeer(const char *topic, const std::string &payload, bool retained) {
+  HeapCheck::Scope world(true);
+  if (retained) {
+    retain(topic, payload);
+  }
+  deliver(topic, payload);
+}
+
+void Simulator::notePeakFlow(void) {
+  double flow = getFlowRate();
+  for (FleetPeer &peer : _peers) {
+    flow += peer.isOpen() ? peer.getFlow() : 0;
+  }
+  _peakFlow = flow > _peakFlow ? flow : _peakFlow;
+}
+
+void Simulator::retain(const std::string &topic, const std::string &payload) {
+  // An empty retained message removes the one kept
+  if (payload.empty()) {
+    _retained.erase(topic);
+  } else {
+    _retained[topic] = payload;
+  }
+}
+
+void Simulator::deliver(const std::string &topic, const std::string &payload) {
+  if (isBrokerUp() && isSubscribed(topic) && !_replayPath) {
+    _inbox.push_back(std::make_pair(topic, payload));
+  }
+  time_t now = getTime();
+  for (FleetPeer &peer : _peers) {
+    if (peer.isJoined() && matches(peer.getClaimsFilter(), topic.c_str())) {
+      peer.receive(topic, payload, now);
+    }
+  }
+}
+
+bool Simulator::isSubscribed(const std::string &topic) {
+  for (const std::string &filter : _subscriptions) {
+    if (matches(filter.c_str(), topic.c_str())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Simulator::matches(const char *filter, const char *topic) {
+  while (*filter) {
+    if (*filter == '#') {
+      return true;
+    }
+    if (*filter == '+') {
+      // One whole level
+      topic += strcspn(topic, "/");
+      filter++;
+    } else if (*filter++ != *topic++) {
+      return false;
+    }
+  }
+  return *topic == 0;
+}
+
+uint64_t Simulator::getPeerDeadline(void) {
+  uint64_t next = UINT64_MAX;
+  for (FleetPeer &peer : _peers) {
+    if (peer.isJoined()) {
+      uint64_t atMs = peer.getDeadline() > _epoch ? (uint64_t) (peer.getDeadline() - _epoch) * 1000 : 0;
+      next = atMs < next ? atMs : next;
+    }
+  }
+  return next;
+}
+
+void Simulator::runPeers(void) {
+  HeapCheck::Scope world(true);
+  time_t now = getTime();
+  for (FleetPeer &peer : _peers) {
+    peer.run(now);
+  }
+}
+
+bool Simulator::takeMessage(std::string &topic, std::string &payload) {
+  if (_inbox.empty()) {
+    return false;
+  }
+  topic = _inbox.front().first;
+  payload = _inbox.front().second;
+  _inbox.pop_front();
+  log("recv", "%s %s", topic.c_str(), payload.c_str());
+  return true;
+}
+
+bool Simulator::parseOptions(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!strcmp(arg, "--verbose")) {
+      _verbose = true;
+    } else if (!strcmp(arg, "--lcd")) {
+      _showLcd = true;
+    } else if (!strcmp(arg, "--cold")) {
+      _cold = true;
+    } else if (arg[0] == '-' && arg[1] == '-' && !value) {
+      return false;
+    } else if (!strcmp(arg, "--start")) {
+      _startText = argv[++i];
+    } else if (!strcmp(arg, "--days")) {
+      _days = atoi(argv[++i]);
+    } else if (!strcmp(arg, "--tick")) {
+      _tickMs = atoi(argv[++i]);
+      _tickMs = _tickMs ? _tickMs : 1;
+    } else if (!strcmp(arg, "--tz")) {
+      _tz = argv[++i];
+    } else if (!strcmp(arg, "--ppl")) {
+      _pulsesPerLiter = atof(argv[++i]);
+    } else if (!strcmp(arg, "--ntp")) {
+      _ntpDelayMs = atoi(argv[++i]) * 1000;
+    } else if (!strcmp(arg, "--state")) {
+      _statePath = argv[++i];
+    } else if (!strcmp(arg, "--trace")) {
+      _tracePath = argv[++i];
+    } else if (!strcmp(arg, "--replay")) {
+      _replayPath = argv[++i];
+    } else if (!strcmp(arg, "--http")) {
+      _httpPort = atoi(argv[++i]);
+      if (!_httpPort) {
+        return false;
+      }
+    } else if (!strcmp(arg, "--mute")) {
+      _muted.push_back(argv[++i]);
+    } else if (!strcmp(arg, "--out")) {
+      _out = fopen(argv[++i], "w+");
+      if (!_out) {
+        perror(argv[i]);
+        return false;
+      }
+    } else if (arg[0] != '-' && !_scriptPath) {
+      _scriptPath = arg;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Simulator::parseTime(const char *text, uint64_t &atMs) {
+  if (text[0] == '+') {
+    char *unit;
+    double amount = strtod(text + 1, &unit);
+    double scale = *unit == 'd' ? 86400 : *unit == 'h' ? 3600 : *unit == 'm' ? 60 : 1;
+    if (amount < 0 || (*unit && !strchr("smhd", *unit))) {
+      return false;
+    }
+    atMs = (uint64_t) (amount * scale * 1000);
+    return true;
+  }
+  struct tm local;
+  memset(&local, 0, sizeof(local));
+  const char *end = strptime(text, "%Y-%m-%dT%H:%M:%S", &local);
+  if (!end || *end) {
+    return false;
+  }
+  local.tm_isdst = -1;
+  time_t at = mktime(&local);
+  if (!_epoch) {
+    _epoch = at;   // The start time itself
+  }
+  if (at < _epoch) {
+    return false;
+  }
+  atMs = (uint64_t) (at - _epoch) * 1000;
+  return true;
+}
+
+bool Simulator::loadScript(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return false;
+  }
+  char line[512];
+  unsigned int number = 0;
+  bool valid = true;
+  while (fgets(line, sizeof(line), file)) {
+    number++;
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = 0;
+    }
+    line[strcspn(line, "\r\n")] = 0;
+    char when[32], action[16], arg1[256] = "", arg2[32] = "", arg3[32] = "";
+    int fields = sscanf(line, "%31s %15s %255s %31s %31s", when, action, arg1, arg2, arg3);
+    if (fields <= 0) {
+      continue;
+    }
+    Event event;
+    event.pin = 0;
+    event.value = 0;
+    bool ok = fields >= 2 && parseTime(when, event.atMs);
+    // Offset of the first argument, for actions that take the rest of the line
+    int rest = 0;
+    sscanf(line, "%*s %*s %n", &rest);
+    if (ok && !strcmp(action, "mqtt") && fields >= 3) {
+      // Payload is the rest of the line
+      event.action = Action::mqtt;
+      event.text = line + rest;
+    } else if (ok && !strcmp(action, "send") && fields >= 4) {
+      // Topic, then the payload as the rest of the line
+      event.action = Action::send;
+      event.text = line + rest;
+      event.pin = strlen(arg1);
+    } else if (ok && !strcmp(action, "peer")) {
+      unsigned int device, hours, minutes, seconds, dripMinutes;
+      char group[32];
+      double budget, flow;
+      event.action = Action::peer;
+      event.pin = _peers.size();
+      ok = sscanf(line, "%*s %*s %x %31s %lf %u:%u:%u %u %lf", &device, group, &budget, &hours, &minutes, &seconds,
+        &dripMinutes, &flow) == 8 && MqttTopics::isValidGroup(group) && hours < 24 && minutes < 60 && seconds < 60;
+      if (ok) {
+        _peers.push_back(FleetPeer(device, group, budget, hours * 3600 + minutes * 60 + seconds, dripMinutes, flow));
+      }
+    } else if (ok && !strcmp(action, "button") && fields == 3) {
+      event.action = Action::button;
+      event.pin = !strcmp(arg1, "veryshort") ? 1 : !strcmp(arg1, "short") ? 2 : !strcmp(arg1, "long") ? 3 : 0;
+      ok = event.pin != 0;
+    } else if (ok && !strcmp(action, "flow") && !strcmp(arg1, "onboard") && fields == 4) {
+      event.action = Action::flowOnboard;
+      event.value = atof(arg2);
+    } else if (ok && !strcmp(action, "flow") && !strcmp(arg1, "pin") && fields == 5) {
+      event.action = Action::flowPin;
+      event.pin = atoi(arg2);
+      event.value = atof(arg3);
+      ok = event.pin >= 0 && event.pin < 8;
+    } else if (ok && !strcmp(action, "leak") && fields == 3) {
+      event.action = Action::leak;
+      event.value = atof(arg1);
+    } else if (ok && (!strcmp(action, "broker") || !strcmp(action, "wifi")) && fields == 3) {
+      event.action = !strcmp(action, "broker") ? Action::broker : Action::wifi;
+      event.pin = !strcmp(arg1, "up");
+      ok = event.pin || !strcmp(arg1, "down");
+    } else if (ok && !strcmp(action, "http") && fields >= 4) {
+      // Method and path, then the body as the rest of the line
+      char method[8], target[256];
+      int end = 0;
+      ok = sscanf(line, "%*s %*s %7s %255s%n", method, target, &end) == 2;
+      event.action = Action::http;
+      event.text = formatHttpRequest(method, target, line + end + strspn(line + end, " "));
+    } else if (ok && !strcmp(action, "end") && fields == 2) {
+      event.action = Action::end;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "%s:%u: bad event: %s\n", path, number, line);
+      valid = false;
+      continue;
+    }
+    _events.push_back(event);
+  }
+  fclose(file);
+  std::stable_sort(_events.begin(), _events.end(), [](const Event &a, const Event &b) { return a.atMs < b.atMs; });
+  return valid;
+}
+
+bool Simulator::loadReplay(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return false;
+  }
+  std::vector<uint8_t> trace;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    trace.insert(trace.end(), buffer, buffer + n);
+  }
+  fclose(file);
+  InputTrace::Reader reader(trace.data(), trace.size());
+  if (!reader.isValid()) {
+    fprintf(stderr, "%s: not a trace\n", path);
+    return false;
+  }
+  const InputTrace::Header &header = reader.getHeader();
+  if (!(header.flags & InputTrace::FROM_BOOT)) {
+    fprintf(stderr, "%s: records from before were dropped, a replay needs every input since the reset\n", path);
+    return false;
+  }
+  if (header.device != ESP.getChipId()) {
+    fprintf(stderr, "%s: trace of controller %06x, replay it with DRIPSIM_CHIP_ID=%06x\n", path,
+      (unsigned int) header.device, (unsigned int) header.device);
+    return false;
+  }
+  InputTrace::Kind kind;
+  uint32_t ms;
+  uint32_t lastMs = header.baseMs;
+  uint64_t atMs = header.baseMs;
+  const uint8_t *data;
+  size_t size;
+  bool clockSeen = false;
+  while (reader.next(kind, ms, data, size)) {
+    const uint8_t *end = data + size;
+    uint32_t value = 0;
+    Event event;
+    atMs += ms - lastMs;
+    lastMs = ms;
+    event.atMs = atMs;
+    event.pin = 0;
+    event.value = 0;
+    bool ok = true;
+    switch (kind) {
+      case InputTrace::Kind::clock:
+        ok = InputTrace::getVarint(data, end, value);
+        event.action = Action::clock;
+        event.value = value;
+        if (ok && !clockSeen) {
+          // The virtual clock reads what the controller read, NTP being right
+          _epoch = (time_t) value - (time_t) (atMs / 1000);
+          clockSeen = true;
+        }
+        break;
+      case InputTrace::Kind::message:
+        ok = InputTrace::getVarint(data, end, value) && value <= (uint32_t) (end - data);
+        event.action = Action::inject;
+        event.pin = value;
+        event.text.assign((const char *) data, end - data);
+        break;
+      case InputTrace::Kind::button:
+        ok = size == 1 && *data >= 1 && *data <= 3;
+        event.action = Action::button;
+        event.pin = *data;
+        break;
+      case InputTrace::Kind::pulses:
+        ok = InputTrace::getVarint(data, end, value);
+        event.action = Action::pulses;
+        event.value = value;
+        break;
+      case InputTrace::Kind::wifi:
+      case InputTrace::Kind::broker:
+        ok = size == 1;
+        event.action = kind == InputTrace::Kind::wifi ? Action::wifi : Action::broker;
+        event.pin = *data;
+        break;
+      case InputTrace::Kind::valve:
+      case InputTrace::Kind::publish:
+        _expected.push_back(Output{ atMs, kind, std::string((const char *) data, size) });
+        continue;
+      case InputTrace::Kind::command:
+        event.action = Action::http;
+        event.text = formatHttpRequest("POST", "/api/command", std::string((const char *) data, size));
+        break;
+      case InputTrace::Kind::lost:
+        fprintf(stderr, "%s: an input at +%.3f s did not fit in the trace, the replay may differ after it\n", path,
+          atMs / 1000.0);
+        continue;
+      default:
+        ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "%s: bad record at +%.3f s\n", path, atMs / 1000.0);
+      return false;
+    }
+    _events.push_back(event);
+  }
+  // Links come up as the trace says
+  _wifiUp = false;
+  _brokerUp = false;
+  _endMs = atMs + 1;
+  fprintf(stderr, "[SIM]: Replaying %u inputs and checking %u outputs over %.3f s\n", (unsigned int) _events.size(),
+    (unsigned int) _expected.size(), atMs / 1000.0);
+  return true;
+}
+
+void Simulator::observeTrace(const uint8_t *record, size_t size) {
+  HeapCheck::Scope world(true);
+  if (sim._traceOut) {
+    fwrite(record, 1, size, sim._traceOut);
+    sim._traceLength += size;
+  }
+  InputTrace::Kind kind = (InputTrace::Kind) record[1];
+  const uint8_t *data = record + 2;
+  uint32_t delta;
+  if (sim._replayPath && (kind == InputTrace::Kind::valve || kind == InputTrace::Kind::publish) &&
+      InputTrace::getVarint(data, record + size, delta)) {
+    sim.checkOutput(kind, data, record + size - data);
+  }
+}
+
+void Simulator::writeTraceHeader(void) {
+  // Every record since the reset, however many
+  InputTrace::Header header = { InputTrace::MAGIC, InputTrace::VERSION, InputTrace::FROM_BOOT, 0, ESP.getChipId(), 0,
+    _traceLength };
+  fseek(_traceOut, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, _traceOut);
+  fseek(_traceOut, 0, SEEK_END);
+}
+
+void Simulator::checkOutput(InputTrace::Kind kind, const uint8_t *data, size_t size) {
+  if (_mismatch) {
+    return;   // Only the first difference is reported
+  }
+  std::string actual((const char *) data, size);
+  if (_matched >= _expected.size()) {
+    log("replay", "%s is not in the trace", describeOutput(kind, actual).c_str());
+    _mismatch = true;
+    return;
+  }
+  const Output &expected = _expected[_matched];
+  if (expected.kind != kind || expected.data != actual) {
+    log("replay", "differs: %s, the trace has %s at +%.3f s", describeOutput(kind, actual).c_str(),
+      describeOutput(expected.kind, expected.data).c_str(), expected.atMs / 1000.0);
+    _mismatch = true;
+    return;
+  }
+  _matched++;
+  _matchedValves += kind == InputTrace::Kind::valve;
+}
+
+std::string Simulator::describeOutput(InputTrace::Kind kind, const std::string &data) {
+  char text[48];
+  uint32_t crc = 0;
+  if (kind == InputTrace::Kind::valve && data.size() == 2) {
+    snprintf(text, sizeof(text), "zone %u %s", (uint8_t) data[0], data[1] ? "open" : "closed");
+  } else if (kind == InputTrace::Kind::publish && data.size() == sizeof(crc)) {
+    memcpy(&crc, data.data(), sizeof(crc));
+    snprintf(text, sizeof(text), "publish %08x", (unsigned int) crc);
+  } else {
+    snprintf(text, sizeof(text), "record of kind %u", (unsigned int) kind);
+  }
+  return text;
+}
+
+void Simulator::apply(const Event &event) {
+  HeapCheck::Scope world(true);   // Outside the firmware, not counted
+  switch (event.action) {
+    case Action::mqtt:
+      if (!isBrokerUp() || _subscriptions.empty()) {
+        log("drop", "%s (not subscribed)", event.text.c_str());
+      } else {
+        _inbox.push_back(std::make_pair(_subscriptions.front(), event.text));
+      }
+      break;
+    case Action::send:
+      {
+        std::string topic = event.text.substr(0, event.pin);
+        std::string payload = event.text.substr(event.text.find_first_not_of(' ', event.pin));
+        log("send", "%s %s", topic.c_str(), payload.c_str());
+        deliver(topic, payload);
+      }
+      break;
+    case Action::peer:
+      _peers[event.pin].join(getTime());
+      break;
+    case Action::button:
+      _button = event.pin;
+      log("button", "%s", event.pin == 1 ? "veryshort" : event.pin == 2 ? "short" : "long");
+      break;
+    case Action::flowOnboard:
+      _onboardRate = event.value;
+      notePeakFlow();
+      break;
+    case Action::flowPin:
+      _pinRate[event.pin] = event.value;
+      notePeakFlow();
+      break;
+    case Action::leak:
+      _leakRate = event.value;
+      log("leak", "%.2f l/min", event.value);
+      break;
+    case Action::broker:
+      if (_brokerUp && !event.pin) {
+        _brokerRestarts++;
+      }
+      _brokerUp = event.pin;
+      log("broker", "%s", _brokerUp ? "up" : "down");
+      break;
+    case Action::wifi:
+      _wifiUp = event.pin;
+      log("wifi", "%s", _wifiUp ? "up" : "down");
+      break;
+    case Action::http:
+      if (_httpListening && _wifiUp) {
+        _exchanges.push_back(HttpExchange{ event.text, 0, std::string() });
+      } else {
+        log("http", "%s refused", event.text.substr(0, event.text.find(" HTTP/")).c_str());
+      }
+      break;
+    case Action::end:
+      _endMs = _nowMs;
+      break;
+    case Action::inject:
+      _inbox.push_back(std::make_pair(event.text.substr(0, event.pin), event.text.substr(event.pin)));
+      break;
+    case Action::clock:
+      log("ntp", "clock %s, %+ld s off", _clockSet ? "stepped" : "set", (long) ((time_t) event.value - getClock()));
+      _clockSet = true;
+      _clockOffset = (time_t) event.value - getTime();
+      if (_clockCallback) {
+        _clockCallback();
+      }
+      break;
+    case Action::pulses:
+      injectPulses((uint32_t) event.value);
+      break;
+  }
+}
+
+double Simulator::getFlowRate(void) {
+  double rate = _leakRate + (_valveOpen ? _onboardRate : 0);
+  if (_expanderAddress >= 0) {
+    uint8_t open = _expanderValue ^ _expanderIdle;
+    for (uint8_t pin = 0; pin < 8; pin++) {
+      if (open & (1 << pin)) {
+        rate += _pinRate[pin];
+      }
+    }
+  }
+  return rate;
+}
+
+void Simulator::advance(uint64_t toMs) {
+  if (toMs <= _nowMs) {
+    return;
+  }
+  // A replay has the pulses of the trace instead
+  double rate = _replayPath ? 0 : getFlowRate();
+  if (rate > 0) {
+    double pulsesPerMs = rate * _pulsesPerLiter / 60000.0;
+    double first = 1 - _pulseFraction;   // Pulses, not ms, until the first pulse
+    _pulseFraction += pulsesPerMs * (toMs - _nowMs);
+    uint64_t pulses = (uint64_t) _pulseFraction;
+    _pulseFraction -= pulses;
+    _pulses += pulses;
+    _inIsr = true;
+    for (uint64_t i = 0; _isr && i < pulses; i++) {
+      // Pulses are evenly spaced over the interval
+      _isrCycles = _nowMs * CYCLES_PER_MS + (uint64_t) ((first + i) / pulsesPerMs * CYCLES_PER_MS);
+      _isr();
+    }
+    _inIsr = false;
+  }
+  _nowMs = toMs;
+  if (_httpPort) {
+    // No faster than the wall clock, for a browser
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t aheadUs = (int64_t) (_nowMs * 1000) - (int64_t) (now.tv_sec * 1000000ULL + now.tv_usec - _wallStartUs);
+    if (aheadUs > 0) {
+      usleep(aheadUs);
+    }
+  }
+}
+
+void Simulator::injectPulses(uint32_t count) {
+  // Counted where the firmware looked at them. Spread since the last count for the rate.
+  uint64_t spanCycles = (_nowMs - _lastPulseMs) * CYCLES_PER_MS;
+  _inIsr = true;
+  for (uint32_t i = 0; _isr && i < count; i++) {
+    _isrCycles = _lastPulseMs * CYCLES_PER_MS + spanCycles * (i + 1) / count;
+    _isr();
+  }
+  _inIsr = false;
+  _pulses += count;
+  _lastPulseMs = _nowMs;
+}
+
+int Simulator::listenHttp(uint16_t port) {
+  _httpListening = true;
+  if (!_httpPort) {
+    return -1;
+  }
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int on = 1;
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(_httpPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+      bind(listener, (struct sockaddr *) &address, sizeof(address)) || listen(listener, 4)) {
+    fprintf(stderr, "[SIM]: Cannot listen on port %u: %s\n", _httpPort, strerror(errno));
+    if (listener >= 0) {
+      close(listener);
+    }
+    return -1;
+  }
+  log("http", "port %u served on http://127.0.0.1:%u/", port, _httpPort);
+  return listener;
+}
+
+int Simulator::takeHttpExchange(void) {
+  return _nextExchange < _exchanges.size() ? (int) _nextExchange++ : -1;
+}
+
+int Simulator::httpAvailable(int exchange) {
+  const HttpExchange &http = _exchanges[exchange];
+  return http.request.size() - http.read;
+}
+
+int Simulator::httpRead(int exchange, uint8_t *data, size_t size) {
+  HttpExchange &http = _exchanges[exchange];
+  size = std::min(size, http.request.size() - http.read);
+  memcpy(data, http.request.data() + http.read, size);
+  http.read += size;
+  return size;
+}
+
+void Simulator::httpWrite(int exchange, const uint8_t *data, size_t size) {
+  HeapCheck::Scope world(true);
+  _exchanges[exchange].response.append((const char *) data, size);
+}
+
+void Simulator::closeHttp(int exchange) {
+  HeapCheck::Scope world(true);
+  HttpExchange &http = _exchanges[exchange];
+  // Request line and body, status and body of the answer
+  size_t end = http.request.find("\r\n\r\n");
+  std::string request = http.request.substr(0, http.request.find(" HTTP/"));
+  std::string requestBody = end == std::string::npos ? "" : http.request.substr(end + 4);
+  end = http.response.find("\r\n\r\n");
+  std::string head = http.response.substr(0, end);
+  std::string body = end == std::string::npos ? "" : http.response.substr(end + 4);
+  if (head.find("Transfer-Encoding: chunked") != std::string::npos) {
+    body = dechunk(body);
+  }
+  if (head.find("Content-Encoding: gzip") != std::string::npos) {
+    body = "(" + std::to_string(body.size()) + " bytes gzipped)";
+  } else if (!body.empty() && body.back() == '\n') {
+    body.pop_back();
+  }
+  log("http", "%s%s%s %d %s", request.c_str(), requestBody.empty() ? "" : " ", requestBody.c_str(),
+    http.response.size() > 9 ? atoi(http.response.c_str() + 9) : 0, body.c_str());
+  std::string().swap(http.request);
+  std::string().swap(http.response);
+  http.read = 0;
+}
+
+std::string Simulator::formatHttpRequest(const char *method, const char *target, const std::string &body) {
+  std::string request = std::string(method) + " " + target + " HTTP/1.1\r\nHost: dripsim\r\n";
+  if (!body.empty()) {
+    request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  }
+  return request + "\r\n" + body;
+}
+
+std::string Simulator::dechunk(const std::string &body) {
+  std::string data;
+  size_t position = 0;
+  while (position < body.size()) {
+    char *end;
+    unsigned long size = strtoul(body.c_str() + position, &end, 16);
+    position = body.find("\r\n", position);
+    if (!size || position == std::string::npos) {
+      break;
+    }
+    data += body.substr(position + 2, size);
+    position += 2 + size + 2;
+  }
+  return data;
+}
+
+void Simulator::logLcd(void) {
+  if (memcmp(_lcd, _lcdLogged, sizeof(_lcd))) {
+    memcpy(_lcdLogged, _lcd, sizeof(_lcd));
+    log("lcd", "|%s|%s|", _lcd[0], _lcd[1]);
+  }
+}
+
+void Simulator::loadState(void) {
+  std::string root;
+  if (_statePath) {
+    mkdir(_statePath, 0755);
+    std::string flash = std::string(_statePath) + "/flash.bin";
+    FILE *file = fopen(flash.c_str(), "rb");
+    if (file) {
+      if (fread(&_flash[0], 1, _flash.size(), file) != _flash.size()) {
+        fprintf(stderr, "[SIM]: Short flash image %s\n", flash.c_str());
+      }
+      fclose(file);
+    }
+    std::string rtc = std::string(_statePath) + "/rtc.bin";
+    file = _cold ? NULL : fopen(rtc.c_str(), "rb");
+    if (file) {
+      _rtcKept = fread(&_rtc[0], 1, _rtc.size(), file) == _rtc.size();
+      fclose(file);
+    }
+    root = std::string(_statePath) + "/fs";
+  } else {
+    char temp[] = "/tmp/dripsim.XXXXXX";
+    _tempRoot = mkdtemp(temp) ? temp : "";
+    root = _tempRoot.empty() ? "/tmp/dripsim.fs" : _tempRoot + "/fs";
+  }
+  LittleFS.setRoot(root.c_str());
+}
+
+static int removeEntry(const char *path, const struct stat *info, int type, struct FTW *walk) {
+  return remove(path);
+}
+
+bool Simulator::removeTree(const std::string &path) {
+  // Contents before their directory, links not followed
+  return nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS) == 0 || errno == ENOENT;
+}
+
+void Simulator::saveState(void) {
+  if (!_statePath) {
+    if (!_tempRoot.empty() && !removeTree(_tempRoot)) {
+      fprintf(stderr, "[SIM]: Could not delete %s\n", _tempRoot.c_str());
+    }
+    return;
+  }
+  std::string flash = std::string(_statePath) + "/flash.bin";
+  FILE *file = fopen(flash.c_str(), "wb");
+  if (file) {
+    fwrite(&_flash[0], 1, _flash.size(), file);
+    fclose(file);
+  }
+  std::string rtc = std::string(_statePath) + "/rtc.bin";
+  file = fopen(rtc.c_str(), "wb");
+  if (file) {
+    fwrite(&_rtc[0], 1, _rtc.size(), file);
+    fclose(file);
+  }
+}
+
+std::string Simulator::formatPayload(const uint8_t *payload, unsigned int length) {
+  // Text as is, binary in hex
+  bool text = true;
+  for (unsigned int i = 0; i < length && text; i++) {
+    text = payload[i] >= 0x20 && payload[i] < 0x7F;
+  }
+  if (text) {
+    return std::string((const char *) payload, length);
+  }
+  std::string hex;
+  char digits[3];
+  for (unsigned int i = 0; i < length; i++) {
+    snprintf(digits, sizeof(digits), "%02x", payload[i]);
+    hex += digits;
+  }
+  return hex;
+}
+
+int main(int argc, char **argv) {
+  return sim.run(argc, argv);
+}
@@ -0,0 +1,246 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <InputTrace.h>
+#include "FleetPeer.h"
+
+/*------------------------------------------------------------------------------------*/
+/* Simulator                                                                          */
+/*------------------------------------------------------------------------------------*/
+// Discrete-event simulation of the controller on the host. A virtual clock drives
+// setup() and loop(): time jumps straight to the next loop() pass or scripted event, so
+// a year of operation runs in seconds. The stand-ins of the core and device libraries
+// report to the simulator, which models the water flow through the open valves, the
+// broker, other controllers on the water main and the push button, and writes a timeline
+// of what the firmware did:
+//
+//   2026-03-08 07:00:00 EDT valve open
+//   2026-03-08 07:00:00 EDT pub /home-assistant/drip/state (retained) {"valves":1,...}
+//
+// Scenario script, one event per line, '#' starts a comment. Times are local
+// (YYYY-MM-DDTHH:MM:SS) or relative to the start (+N followed by s, m, h or d):
+//
+//   +1h mqtt c07:00:004512       message on the command topic
+//   +1h send /home-assistant/drip/all/request b12   message on any topic
+//   +2d button veryshort         veryshort, short or long press
+//   +3d flow onboard 6.5         liters per minute through the on-board valve
+//   +3d flow pin 2 1.5           ... through expander output 2
+//   +4d leak 0.3                 liters per minute with every valve closed
+//   +5d broker down              broker or Wi-Fi down and up
+//   +6d wifi up
+//   +0 peer 00beef garden 12 07:00:00 45 6.5   controller sharing the main (FleetPeer)
+//   +1d http GET /api/state      request to the web server, the answer goes to the timeline
+//   +1d http POST /api/command z1s10   ... with the rest of the line as the body
+//   +7d end                      stop the simulation
+//
+// --http serves the web server on a port of localhost, for a browser or curl. Virtual
+// time then runs no faster than the wall clock.
+//
+// --trace writes every record of the firmware's InputTrace to a file. --replay feeds the
+// inputs of a trace, recorded here or saved by a controller, back to the firmware instead
+// of a script and the flow model, and checks that it opens the same valves and publishes
+// the same messages, in the same order. It exits with 4 at the first difference.
+class Simulator {
+  public:
+    // Thrown by ESP.reset(). Ends the simulation.
+    struct Reset {};
+
+    Simulator();
+    int run(int argc, char **argv);
+
+    // Virtual clock
+    uint64_t getMillis(void) { return _nowMs; }
+    time_t getTime(void) { return _epoch + (time_t) (_nowMs / 1000); }
+    // Clock of the firmware: seconds since reset until it is set, then off from the
+    // virtual clock by what it was set to, until NTP answers
+    time_t getClock(void) { return _clockSet ? getTime() + _clockOffset : (time_t) (_nowMs / 1000); }
+    void setClock(time_t time);
+    void setClockCallback(void (*callback)(void)) { _clockCallback = callback; }
+    void requestNtp(void);
+    void sleep(uint32_t ms) { _sleptMs += ms; advance(_nowMs + ms); }   // delay(): time passes, loop() does not run
+    // CPU cycle counter. Inside the pulse interrupt handler it reads the time of the pulse.
+    uint32_t getCycles(void) { return (uint32_t) (_inIsr ? _isrCycles : _nowMs * CYCLES_PER_MS); }
+
+    // Timeline
+    void log(const char *kind, const char *format, ...) __attribute__((format(printf, 3, 4)));
+    bool isVerbose(void) { return _verbose; }
+
+    // Devices
+    void setValve(bool open);
+    void writeI2c(uint8_t address, const uint8_t *data, uint8_t count);
+    void setLed(const char *status);
+    void putLcd(uint8_t row, uint8_t column, char c);
+    void clearLcd(void);
+    void countLcdBytes(uint8_t bytes) { _lcdBytes += bytes; }
+    void attachPulseIsr(void (*isr)(void)) { _isr = isr; }
+    int takeButtonPress(void);   // 0 none, 1 very short, 2 short, 3 long
+    bool isWifiUp(void) { return _wifiUp; }
+    void setWifiSleep(const char *type);
+    uint8_t *getFlash(void) { return &_flash[0]; }
+    static const size_t RTC_MEMORY_SIZE = 512;
+    uint8_t *getRtcMemory(void) { return &_rtc[0]; }
+    const char *getResetReason(void) { return _rtcKept ? "External System" : "Power On"; }
+
+    // Broker. Keeps retained messages and matches the wildcards + and #.
+    bool isBrokerUp(void) { return _brokerUp && _wifiUp; }
+    uint32_t getBrokerRestarts(void) { return _brokerRestarts; }
+    void subscribe(const char *topic);
+    void unsubscribeAll(void) { _subscriptions.clear(); }
+    void publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained);
+    bool takeMessage(std::string &topic, std::string &payload);
+
+    // Web server. A scripted exchange is accepted before a connection to --http.
+    int listenHttp(uint16_t port);
+    int takeHttpExchange(void);   // -1 if none waits
+    int httpAvailable(int exchange);
+    int httpRead(int exchange, uint8_t *data, size_t size);
+    void httpWrite(int exchange, const uint8_t *data, size_t size);
+    void closeHttp(int exchange);
+
+    // Other controllers
+    void publishPeer(const char *topic, const std::string &payload, bool retained);
+    void notePeakFlow(void);
+
+    // Deletes a directory of the host and everything in it. True if nothing is left.
+    static bool removeTree(const std::string &path);
+
+  private:
+    static const uint32_t CYCLES_PER_MS = 80000;   // F_CPU of the stand-ins
+
+    enum class Action : uint8_t { mqtt, send, button, flowOnboard, flowPin, leak, broker, wifi, peer, http, end,
+      inject, clock, pulses };   // Replayed inputs
+    struct Event {
+      uint64_t atMs;
+      Action action;
+      int pin;
+      double value;
+      std::string text;
+    };
+    // Request to the web server and the answer so far
+    struct HttpExchange {
+      std::string request;
+      size_t read;
+      std::string response;
+    };
+    // Valve action or publish of a replayed trace
+    struct Output {
+      uint64_t atMs;
+      InputTrace::Kind kind;
+      std::string data;
+    };
+
+    bool parseOptions(int argc, char **argv);
+    bool loadScript(const char *path);
+    bool loadReplay(const char *path);
+    bool parseTime(const char *text, uint64_t &atMs);
+    void apply(const Event &event);
+    void advance(uint64_t toMs);
+    void injectPulses(uint32_t count);
+    static void observeTrace(const uint8_t *record, size_t size);
+    void writeTraceHeader(void);
+    void checkOutput(InputTrace::Kind kind, const uint8_t *data, size_t size);
+    static std::string describeOutput(InputTrace::Kind kind, const std::string &data);
+    double getFlowRate(void);
+    void retain(const std::string &topic, const std::string &payload);
+    void deliver(const std::string &topic, const std::string &payload);
+    bool isSubscribed(const std::string &topic);
+    uint64_t getPeerDeadline(void);
+    void runPeers(void);
+    void syncNtp(void);
+    static bool matches(const char *filter, const char *topic);
+    void logLcd(void);
+    void loadState(void);
+    void saveState(void);
+    static std::string formatPayload(const uint8_t *payload, unsigned int length);
+    static std::string formatHttpRequest(const char *method, const char *target, const std::string &body);
+    static std::string dechunk(const std::string &body);
+
+    // Options
+    const char *_scriptPath;
+    const char *_tracePath;
+    const char *_replayPath;
+    const char *_statePath;
+    const char *_startText;
+    const char *_tz;
+    uint32_t _days;
+    uint32_t _tickMs;
+    double _pulsesPerLiter;
+    bool _verbose;
+    bool _showLcd;
+    bool _cold;
+    std::string _tempRoot;        // Made without --state, deleted at the end
+    uint32_t _ntpDelayMs;
+    uint16_t _httpPort;           // 0 without --http
+    std::vector<std::string> _muted;
+    FILE *_out;
+    FILE *_traceOut;
+    uint32_t _traceLength;
+
+    // Clock and script
+    time_t _epoch;                // Start of the simulation
+    uint64_t _nowMs;              // Since _epoch
+    uint64_t _endMs;
+    std::vector<Event> _events;   // Sorted by time
+    size_t _nextEvent;
+    bool _clockSet;
+    time_t _clockOffset;          // Firmware clock minus virtual clock, once set
+    uint64_t _ntpAtMs;            // UINT64_MAX unless SNTP is waiting for an answer
+    void (*_clockCallback)(void);
+
+    // Devices
+    std::vector<uint8_t> _flash;
+    std::vector<uint8_t> _rtc;
+    bool _rtcKept;                // RTC memory survived from the last run
+    void (*_isr)(void);
+    bool _inIsr;
+    uint64_t _isrCycles;          // Time of the pulse being handled, in cycles since _epoch
+    double _pulseFraction;
+    uint64_t _pulses;
+    bool _valveOpen;
+    double _onboardRate;
+    double _pinRate[8];
+    double _leakRate;
+    int _expanderAddress;
+    uint8_t _expanderIdle;        // First value written: every output off
+    uint8_t _expanderValue;
+    int _button;
+    std::string _led;
+    char _lcd[2][17];
+    char _lcdLogged[2][17];
+    bool _brokerUp;
+    bool _wifiUp;
+    uint32_t _brokerRestarts;     // The TLS sessions of the broker go with each
+    std::vector<std::string> _subscriptions;
+    std::deque<std::pair<std::string, std::string> > _inbox;
+    std::map<std::string, std::string> _retained;
+    std::vector<FleetPeer> _peers;
+    bool _httpListening;
+    std::vector<HttpExchange> _exchanges;
+    size_t _nextExchange;         // Next one to accept
+    uint64_t _wallStartUs;        // Paces virtual time with --http
+
+    // Statistics
+    uint64_t _loops;
+    uint64_t _published;
+    uint64_t _lcdBytes;
+    uint64_t _sleptMs;            // In delay()
+    double _peakFlow;             // Liters per minute through the main, peers included
+
+    // Replay
+    std::vector<Output> _expected;
+    size_t _matched;              // Outputs of the trace the firmware made again
+    uint32_t _matchedValves;
+    bool _mismatch;
+    uint64_t _lastPulseMs;        // Replayed pulses are spread since then
+};
+
+extern Simulator sim;
+
+#endif // SIMULATOR_H
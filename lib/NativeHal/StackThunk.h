@@ -0,0 +1,7 @@
+#ifndef NATIVE_HAL_STACKTHUNK_H
+#define NATIVE_HAL_STACKTHUNK_H
+
+// The host has one stack for everything
+inline void stack_thunk_add_ref(void) {}
+
+#endif // NATIVE_HAL_STACKTHUNK_H
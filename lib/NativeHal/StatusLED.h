@@ -0,0 +1,21 @@
+#ifndef NATIVE_HAL_STATUSLED_H
+#define NATIVE_HAL_STATUSLED_H
+
+#include <Arduino.h>
+
+class StatusLED {
+  public:
+    enum class Status : uint8_t {
+      stable,
+      custom_1,
+      custom_2
+    };
+    StatusLED(uint8_t pin) : _known(false) {}
+    void setStatus(Status status);
+    void run(void) {}
+  private:
+    Status _status;
+    bool _known;
+};
+
+#endif // NATIVE_HAL_STATUSLED_H
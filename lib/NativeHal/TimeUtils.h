@@ -0,0 +1,14 @@
+#ifndef NATIVE_HAL_TIMEUTILS_H
+#define NATIVE_HAL_TIMEUTILS_H
+
+#include <Arduino.h>
+
+// Wall clock of the simulation. Local time follows the TZ environment variable.
+class TimeUtils {
+  public:
+    static time_t getCurrentTimeRaw(void);
+    static struct tm *getCurrentTime(void);
+    static String getTimeStr(time_t time);
+};
+
+#endif // NATIVE_HAL_TIMEUTILS_H
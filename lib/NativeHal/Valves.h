@@ -0,0 +1,18 @@
+#ifndef NATIVE_HAL_VALVES_H
+#define NATIVE_HAL_VALVES_H
+
+#include <Arduino.h>
+
+// On-board latching valve. Its state feeds the simulated water flow.
+class SolenoidValve {
+  public:
+    SolenoidValve(uint8_t enablePin, uint8_t signalPin) : _open(false) {}
+    void openValve(void);
+    void closeValve(void);
+    bool isValveOpen(void) { return _open; }
+    void run(void) {}
+  private:
+    bool _open;
+};
+
+#endif // NATIVE_HAL_VALVES_H
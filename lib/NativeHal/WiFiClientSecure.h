@@ -0,0 +1,43 @@
+#ifndef NATIVE_HAL_WIFICLIENTSECURE_H
+#define NATIVE_HAL_WIFICLIENTSECURE_H
+
+#include <ESP8266WiFi.h>
+
+namespace BearSSL {
+
+// TLS session the client may resume. The simulated broker keeps the sessions it handed
+// out until it restarts (broker down in the script).
+class Session {
+  public:
+    Session(): _id(0), _restarts(0) {}
+
+  private:
+    friend class WiFiClientSecure;
+    uint32_t _id;         // 0 none
+    uint32_t _restarts;   // Broker restarts when it was handed out
+};
+
+class X509List {
+  public:
+    X509List(const char *) {}
+};
+
+// The handshake only decides between a full and a resumed one and writes it to the
+// timeline. Certificates are taken as pinned.
+class WiFiClientSecure : public WiFiClient {
+  public:
+    WiFiClientSecure(): _session(NULL) {}
+    int connect(const char *host, uint16_t port) override;
+    void setSession(Session *session) { _session = session; }
+    void setFingerprint(const char *) {}
+    void setTrustAnchors(const X509List *) {}
+    void setBufferSizes(int, int) {}
+    static bool probeMaxFragmentLength(const char *host, uint16_t port, uint16_t length);
+
+  private:
+    Session *_session;
+};
+
+} // namespace BearSSL
+
+#endif // NATIVE_HAL_WIFICLIENTSECURE_H
@@ -0,0 +1,33 @@
+#ifndef NATIVE_HAL_WIFIMANAGER_H
+#define NATIVE_HAL_WIFIMANAGER_H
+
+#include <ESP8266WiFi.h>
+
+// The simulated station is always configured. The portal connects once Wi-Fi is up.
+class WiFiManager {
+  public:
+    WiFiManager(): _callback(NULL), _active(false) {}
+    void resetSettings(void) {}
+    void setAPCallback(void (*callback)(WiFiManager *)) { _callback = callback; }
+    void setConfigPortalTimeout(unsigned long) {}
+    void setConfigPortalBlocking(bool) {}
+    bool autoConnect(const char *, const char *) { return true; }
+    bool startConfigPortal(const char *, const char *) {
+      _active = true;
+      if (_callback) _callback(this);
+      return false;
+    }
+    bool process(void) {
+      bool connected = _active && WiFi.status() == WL_CONNECTED;
+      _active = _active && !connected;
+      return connected;
+    }
+    bool getConfigPortalActive(void) { return _active; }
+    String getConfigPortalSSID(void) { return "ESP8266"; }
+
+  private:
+    void (*_callback)(WiFiManager *);
+    bool _active;
+};
+
+#endif // NATIVE_HAL_WIFIMANAGER_H
@@ -0,0 +1,21 @@
+#ifndef NATIVE_HAL_WIRE_H
+#define NATIVE_HAL_WIRE_H
+
+#include <Arduino.h>
+
+// I2C bus. Every byte written reaches the simulator, which models the GPIO expander.
+class TwoWire {
+  public:
+    void begin(void) {}
+    void begin(int, int) {}
+    void beginTransmission(uint8_t address) { _address = address; _count = 0; }
+    size_t write(uint8_t value) { if (_count < sizeof(_buffer)) _buffer[_count++] = value; return 1; }
+    uint8_t endTransmission(void);
+  private:
+    uint8_t _address;
+    uint8_t _buffer[16];
+    uint8_t _count;
+};
+extern TwoWire Wire;
+
+#endif // NATIVE_HAL_WIRE_H
@@ -0,0 +1,8 @@
+#ifndef NATIVE_HAL_COREDECLS_H
+#define NATIVE_HAL_COREDECLS_H
+
+// Called whenever the clock is set: by SNTP or by settimeofday(). The native build wraps
+// settimeofday() (-Wl,--wrap=settimeofday) to set the simulator's clock instead.
+void settimeofday_cb(void (*callback)(void));
+
+#endif // NATIVE_HAL_COREDECLS_H
@@ -0,0 +1,10 @@
+#ifndef NATIVE_HAL_SECRET_H
+#define NATIVE_HAL_SECRET_H
+
+// Placeholders for the simulation. The device build uses the secret.h next to main.cpp.
+#define MQTT_USERNAME "sim"
+#define MQTT_PASSWORD "sim"
+#define MQTT_BROKER_ADDRESS "broker.sim"
+#define MQTT_TLS_FINGERPRINT "00 11 22 33 44 55 66 77 88 99 aa bb cc dd ee ff 00 11 22 33"   // MQTT_TLS=1
+
+#endif // NATIVE_HAL_SECRET_H
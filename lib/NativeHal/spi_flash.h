@@ -0,0 +1,9 @@
+#ifndef NATIVE_HAL_SPI_FLASH_H
+#define NATIVE_HAL_SPI_FLASH_H
+
+// Simulated 4 MB flash with the 1 MB file system layout
+#define SPI_FLASH_SEC_SIZE 4096
+#define SPI_FLASH_SIZE (4 * 1024 * 1024)
+#define SPI_FLASH_EEPROM_SECTOR 0x3FB
+
+#endif // NATIVE_HAL_SPI_FLASH_H
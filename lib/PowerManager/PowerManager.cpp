@@ -0,0 +1,78 @@
+#include "PowerManager.h"
+
+// Typical NodeMCU draw with the station associated: CPU and radio on; radio off
+// between DTIM beacons; CPU halted too. The LCD backlight and valves come on top.
+const uint32_t PowerManager::MICROAMPS[MODE_COUNT] = { 70000, 16000, 2000 };
+
+PowerManager::PowerManager(uint16_t maxSleepMs, uint16_t minSleepMs):
+  _maxSleepMs(maxSleepMs),
+  _minSleepMs(minSleepMs),
+  _mode(Mode::awake),
+  _second(0),
+  _secondMillis(0),
+  _lastPlanMs(0),
+  _lastSleepMs(0),
+  _lastSleepState(Mode::awake) {
+  resetStats();
+}
+
+uint32_t PowerManager::plan(uint32_t nowMs, time_t now, time_t deadline, bool pending, bool flowing) {
+  // Account the time since the last call: the sleep planned then, the rest running
+  uint32_t elapsed = nowMs - _lastPlanMs;
+  uint32_t slept = _lastSleepMs < elapsed ? _lastSleepMs : elapsed;
+  _stateMs[(uint8_t) _lastSleepState] += slept;
+  _stateMs[(uint8_t) (_mode == Mode::awake ? Mode::awake : Mode::modemSleep)] += elapsed - slept;
+  _lastPlanMs = nowMs;
+  _lastSleepMs = 0;
+
+  if (now != _second) {
+    // Seen right away unless the controller slept over the change. Then the phase known
+    // from before holds, as long as it does not put the change in the future.
+    uint32_t predicted = _secondMillis + (uint32_t) (now - _second) * 1000;
+    _secondMillis = slept && _second && (int32_t) (nowMs - predicted) >= 0 ? predicted : nowMs;
+    _second = now;
+  }
+  if (_mode == Mode::awake || pending || (_mode == Mode::lightSleep && flowing)) {
+    return 0;
+  }
+  uint32_t sleepMs = _maxSleepMs;
+  if (deadline) {
+    if (deadline <= now) {
+      return 0;
+    }
+    uint32_t intoSecond = nowMs - _secondMillis;
+    uint32_t untilMs = (uint32_t) (deadline - now) * 1000;
+    untilMs = untilMs > intoSecond ? untilMs - intoSecond : 0;
+    sleepMs = untilMs < sleepMs ? untilMs : sleepMs;
+  }
+  if (sleepMs < _minSleepMs) {
+    return 0;
+  }
+  _lastSleepMs = sleepMs;
+  _lastSleepState = _mode;
+  return sleepMs;
+}
+
+uint16_t PowerManager::getShare(Mode state) {
+  uint64_t total = 0;
+  for (uint8_t i = 0; i < MODE_COUNT; i++) {
+    total += _stateMs[i];
+  }
+  return total ? (uint16_t) (_stateMs[(uint8_t) state] * 1000ULL / total) : 0;
+}
+
+uint32_t PowerManager::getAverageMicroamps(void) {
+  uint64_t total = 0;
+  uint64_t charge = 0;
+  for (uint8_t i = 0; i < MODE_COUNT; i++) {
+    total += _stateMs[i];
+    charge += (uint64_t) _stateMs[i] * MICROAMPS[i];
+  }
+  return total ? (uint32_t) (charge / total) : MICROAMPS[(uint8_t) _mode];
+}
+
+void PowerManager::resetStats(void) {
+  for (uint8_t i = 0; i < MODE_COUNT; i++) {
+    _stateMs[i] = 0;
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef POWER_MANAGER_H
+#define POWER_MANAGER_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*------------------------------------------------------------------------------------*/
+/* PowerManager                                                                       */
+/*------------------------------------------------------------------------------------*/
+// Sleep policy for solar or battery installations. At the end of each loop() pass it
+// decides how long the controller may sleep: up to the next timed event, never longer
+// than maxSleepMs (the push button is polled and the MQTT keepalive must be served),
+// and not at all while output is waiting to go out. The caller does the sleeping.
+//
+// The event deadline has one second precision. The phase of the second is learned
+// from the millisecond clock whenever the second changes, so the controller wakes just
+// after the deadline and not up to a second late.
+//
+// Time is passed in by the caller, which keeps the class host-testable. Time spent in
+// each power state is kept for an estimate of the average current.
+class PowerManager {
+  public:
+    enum class Mode : uint8_t {
+      awake,        // Wi-Fi always on, loop() runs flat out
+      modemSleep,   // Radio sleeps between beacons. The CPU idles until the deadline
+      lightSleep    // CPU halted too, woken by the timer or a GPIO. Not while water flows
+    };
+    static const uint8_t MODE_COUNT = 3;
+
+    PowerManager(uint16_t maxSleepMs, uint16_t minSleepMs);
+    ~PowerManager() {};
+
+    void setMode(Mode mode) { _mode = mode; }
+    Mode getMode(void) { return _mode; }
+
+    // Call at the end of every loop() pass. deadline is the next timed event (epoch
+    // seconds, 0 for none), pending tells that output waits to go out and flowing that
+    // pulses must be counted. Returns the milliseconds to sleep, 0 to carry on.
+    uint32_t plan(uint32_t nowMs, time_t now, time_t deadline, bool pending, bool flowing);
+
+    // Share of the time in a power state since the last reset, per mille
+    uint16_t getShare(Mode state);
+    // Average supply current since the last reset, from typical ESP8266 figures
+    uint32_t getAverageMicroamps(void);
+    void resetStats(void);
+
+  private:
+    static const uint32_t MICROAMPS[MODE_COUNT];
+
+    uint16_t _maxSleepMs;
+    uint16_t _minSleepMs;
+    Mode _mode;
+    time_t _second;             // Last second seen ...
+    uint32_t _secondMillis;     // ... and the clock when it started
+    uint32_t _lastPlanMs;
+    uint32_t _lastSleepMs;      // Planned on the last call
+    Mode _lastSleepState;
+    uint32_t _stateMs[MODE_COUNT];
+};
+
+#endif // POWER_MANAGER_H
@@ -0,0 +1,91 @@
+#include "PulseRate.h"
+
+PulseRate::PulseRate(uint32_t cyclesPerSecond, uint32_t minPeriodCycles, uint32_t timeoutCycles):
+  _head(0),
+  _tail(0),
+  _overflows(0),
+  _cyclesPerSecond(cyclesPerSecond),
+  _minPeriod(minPeriodCycles),
+  _timeout(timeoutCycles),
+  _seenOverflows(0),
+  _lastStamp(0),
+  _glitches(0) {
+  restart();
+}
+
+void ICACHE_RAM_ATTR PulseRate::push(uint32_t cycles) {
+  uint8_t head = _head;
+  uint8_t next = (head + 1) & MASK;
+  if (next == _tail) {
+    _overflows++;
+    return;
+  }
+  _stamps[head] = cycles;
+  _head = next;   // Publish the slot once it is written
+}
+
+void PulseRate::run(uint32_t nowCycles) {
+  // Pulses are only dropped while the ring is full, so after the last one in the ring
+  uint32_t overflows = _overflows;
+  uint8_t tail = _tail;
+  uint8_t head = _head;
+  while (tail != head) {
+    uint32_t stamp = _stamps[tail];
+    tail = (tail + 1) & MASK;
+    if (!_chained) {
+      _lastStamp = stamp;
+      _started = true;
+      _chained = true;
+      continue;
+    }
+    uint32_t period = stamp - _lastStamp;
+    if (period < _minPeriod) {
+      _glitches++;
+      continue;
+    }
+    _lastStamp = stamp;
+    if (period > _timeout) {
+      // Flow stopped in between. Not a period of the flow now.
+      _windowCycles = 0;
+      _windowPeriods = 0;
+      continue;
+    }
+    _windowCycles += period;
+    _windowPeriods++;
+    if (_windowCycles >= _cyclesPerSecond) {
+      _rate = (float) _windowPeriods * _cyclesPerSecond / _windowCycles;
+      _windowCycles = 0;
+      _windowPeriods = 0;
+    }
+  }
+  _tail = tail;   // Free the slots once they are read
+  if (overflows != _seenOverflows) {
+    _seenOverflows = overflows;
+    _chained = false;
+  }
+  // The handler may have stamped a pulse after nowCycles was read
+  if (_started && (int32_t) (nowCycles - _lastStamp) > (int32_t) _timeout) {
+    restart();
+  }
+}
+
+float PulseRate::getPulsesPerSecond(uint32_t nowCycles) {
+  int32_t since = nowCycles - _lastStamp;
+  if (!_started || since > (int32_t) _timeout) {
+    return 0;
+  }
+  // No pulse for longer than a period: the flow slowed down at least this much. Unless
+  // the pulses since were dropped.
+  if (_chained && since > 0 && since * _rate > _cyclesPerSecond) {
+    return (float) _cyclesPerSecond / since;
+  }
+  return _rate;
+}
+
+void PulseRate::restart(void) {
+  _started = false;
+  _chained = false;
+  _windowCycles = 0;
+  _windowPeriods = 0;
+  _rate = 0;
+}
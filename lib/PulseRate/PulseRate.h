@@ -0,0 +1,69 @@
+#ifndef PULSE_RATE_H
+#define PULSE_RATE_H
+
+#include <Arduino.h>
+#include <MemoryBudget.h>
+
+#ifndef PULSE_RATE_RING_SIZE
+#define PULSE_RATE_RING_SIZE 32     // Pulse timestamps waiting for loop(). Power of 2
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* PulseRate                                                                          */
+/*------------------------------------------------------------------------------------*/
+// Flow rate from the time between flow meter pulses instead of the pulses counted per
+// interval. At drip flow rates the meter gives a few pulses a second, so a count per
+// second is off by up to a whole pulse; the period between two pulses, timed with the
+// CPU cycle counter, is not.
+//
+// The interrupt handler only stores the cycle counter in a lock-free single producer,
+// single consumer ring: the handler writes the head, loop() the tail. A pulse that finds
+// the ring full is left out of the rate (the sensor still counts it) and counted as an
+// overflow; no period is measured across it. loop() drains the ring, drops periods
+// shorter than the glitch limit (noise, contact bounce) and averages the periods over at
+// least a second of pulses, which is a single period at low flow. Without pulses the
+// rate falls as the time since the last one grows, and drops to 0 past the timeout.
+class PulseRate {
+  public:
+    // The timeout must stay below 2^31 cycles
+    PulseRate(uint32_t cyclesPerSecond, uint32_t minPeriodCycles, uint32_t timeoutCycles);
+    ~PulseRate() {};
+
+    // Interrupt handler side: cycle counter at a pulse
+    void ICACHE_RAM_ATTR push(uint32_t cycles);
+
+    // loop() side: drain the ring and update the rate
+    void run(uint32_t nowCycles);
+    // Pulses per second as of nowCycles, 0 without flow
+    float getPulsesPerSecond(uint32_t nowCycles);
+
+    uint32_t getOverflows(void) { return _overflows; }
+    uint32_t getGlitches(void) { return _glitches; }
+
+  private:
+    static const uint8_t MASK = PULSE_RATE_RING_SIZE - 1;
+
+    void restart(void);
+
+    volatile uint32_t _stamps[PULSE_RATE_RING_SIZE];
+    volatile uint8_t _head;         // Next slot to write. Changed by the handler only
+    volatile uint8_t _tail;         // Next slot to read. Changed by loop() only
+    volatile uint32_t _overflows;
+
+    uint32_t _cyclesPerSecond;
+    uint32_t _minPeriod;
+    uint32_t _timeout;
+    uint32_t _seenOverflows;        // Overflows already accounted for by loop()
+    uint32_t _lastStamp;            // Last pulse accepted
+    bool _started;                  // _lastStamp is valid
+    bool _chained;                  // The next pulse ends a period that starts at _lastStamp
+    uint32_t _windowCycles;         // Periods summed since the last rate update
+    uint16_t _windowPeriods;
+    float _rate;                    // Pulses per second over the last window
+    uint32_t _glitches;
+};
+
+static_assert(PULSE_RATE_RING_SIZE <= 256 && (PULSE_RATE_RING_SIZE & (PULSE_RATE_RING_SIZE - 1)) == 0,
+  "PULSE_RATE_RING_SIZE must be a power of 2 up to 256");
+
+#endif // PULSE_RATE_H
@@ -0,0 +1,244 @@
+#include "TimeZone.h"
+#include <ctype.h>
+#include <string.h>
+
+static const int32_t SECONDS_PER_DAY = 86400;
+
+static int32_t floorDiv(int64_t value, int32_t divisor) {
+  return (int32_t) (value >= 0 ? value / divisor : (value - divisor + 1) / divisor);
+}
+
+TimeZone::TimeZone():
+  _stdOffset(0),
+  _dstOffset(0),
+  _hasDst(false),
+  _yearStart(0),
+  _yearEnd(0),
+  _dstStart(0),
+  _dstEnd(0) {
+  strcpy(_posix, "UTC0");
+  memset(&_start, 0, sizeof(_start));
+  memset(&_end, 0, sizeof(_end));
+}
+
+bool TimeZone::set(const char *posix) {
+  if (strlen(posix) >= MAX_LENGTH) {
+    return false;
+  }
+  const char *p = posix;
+  int32_t stdWest;
+  if (!parseName(p) || !parseOffset(p, stdWest)) {
+    return false;
+  }
+  int32_t dstWest = stdWest - 3600;
+  bool hasDst = *p != 0;
+  Rule start = { RuleType::monthWeekDay, 3, 2, 0, 0, 7200 };   // US rules
+  Rule end = { RuleType::monthWeekDay, 11, 1, 0, 0, 7200 };
+  if (hasDst) {
+    if (!parseName(p)) {
+      return false;
+    }
+    if (*p && *p != ',' && !parseOffset(p, dstWest)) {
+      return false;
+    }
+    if (*p == ',') {
+      p++;
+      if (!parseRule(p, start) || *p++ != ',' || !parseRule(p, end)) {
+        return false;
+      }
+    }
+    if (*p) {
+      return false;
+    }
+  }
+  strcpy(_posix, posix);
+  _stdOffset = -stdWest;
+  _dstOffset = -dstWest;
+  _hasDst = hasDst;
+  _start = start;
+  _end = end;
+  _yearStart = _yearEnd = 0;   // Recompute the cached year
+  return true;
+}
+
+int32_t TimeZone::getOffset(time_t utc) {
+  if (!_hasDst) {
+    return _stdOffset;
+  }
+  if (utc < _yearStart || utc >= _yearEnd) {
+    cacheYear(yearOf(floorDiv((int64_t) utc + _stdOffset, SECONDS_PER_DAY)));
+  }
+  bool dst = _dstStart < _dstEnd ?
+    _dstStart <= utc && utc < _dstEnd :
+    !(_dstEnd <= utc && utc < _dstStart);   // Southern hemisphere: across the new year
+  return dst ? _dstOffset : _stdOffset;
+}
+
+int32_t TimeZone::getLocalDay(time_t utc) {
+  return floorDiv((int64_t) utc + getOffset(utc), SECONDS_PER_DAY);
+}
+
+uint32_t TimeZone::getSecondOfDay(time_t utc) {
+  int64_t local = (int64_t) utc + getOffset(utc);
+  return (uint32_t) (local - (int64_t) floorDiv(local, SECONDS_PER_DAY) * SECONDS_PER_DAY);
+}
+
+time_t TimeZone::toUtc(int32_t localDay, uint32_t secondOfDay) {
+  int64_t local = (int64_t) localDay * SECONDS_PER_DAY + secondOfDay;
+  time_t asStd = (time_t) (local - _stdOffset);
+  if (!_hasDst) {
+    return asStd;
+  }
+  time_t asDst = (time_t) (local - _dstOffset);
+  bool stdValid = getOffset(asStd) == _stdOffset;
+  bool dstValid = getOffset(asDst) == _dstOffset;
+  if (stdValid && dstValid) {
+    return asStd < asDst ? asStd : asDst;   // Repeated: the first one
+  }
+  return dstValid ? asDst : asStd;          // Skipped: as standard time
+}
+
+void TimeZone::cacheYear(int year) {
+  _yearStart = (time_t) ((int64_t) dayNumber(year, 1, 1) * SECONDS_PER_DAY - _stdOffset);
+  _yearEnd = (time_t) ((int64_t) dayNumber(year + 1, 1, 1) * SECONDS_PER_DAY - _stdOffset);
+  _dstStart = (time_t) ((int64_t) ruleDay(_start, year) * SECONDS_PER_DAY + _start.second - _stdOffset);
+  _dstEnd = (time_t) ((int64_t) ruleDay(_end, year) * SECONDS_PER_DAY + _end.second - _dstOffset);
+}
+
+// Alphabetic name of 3 or more characters, or any name between < and >
+bool TimeZone::parseName(const char *&p) {
+  const char *start = p;
+  if (*p == '<') {
+    while (*++p && *p != '>') {
+      if (!isalnum((unsigned char) *p) && *p != '+' && *p != '-') {
+        return false;
+      }
+    }
+    if (*p != '>' || p - start < 4) {
+      return false;
+    }
+    p++;
+    return true;
+  }
+  while (isalpha((unsigned char) *p)) {
+    p++;
+  }
+  return p - start >= 3;
+}
+
+// [+-]hh[:mm[:ss]] in seconds. Positive is west of Greenwich for offsets, and after
+// midnight for rule times.
+bool TimeZone::parseOffset(const char *&p, int32_t &seconds) {
+  int32_t sign = 1;
+  if (*p == '+' || *p == '-') {
+    sign = *p++ == '-' ? -1 : 1;
+  }
+  int32_t parts[3] = { 0, 0, 0 };
+  for (uint8_t i = 0; i < 3; i++) {
+    if (i > 0) {
+      if (*p != ':') {
+        break;
+      }
+      p++;
+    }
+    if (!isdigit((unsigned char) *p)) {
+      return false;
+    }
+    for (uint8_t digits = 0; isdigit((unsigned char) *p); digits++) {
+      if (digits == 3) {
+        return false;
+      }
+      parts[i] = parts[i] * 10 + (*p++ - '0');
+    }
+  }
+  if (parts[0] > 167 || parts[1] > 59 || parts[2] > 59) {
+    return false;
+  }
+  seconds = sign * (parts[0] * 3600 + parts[1] * 60 + parts[2]);
+  return true;
+}
+
+static bool parseNumber(const char *&p, uint16_t &value) {
+  if (!isdigit((unsigned char) *p)) {
+    return false;
+  }
+  value = 0;
+  while (isdigit((unsigned char) *p) && value < 1000) {
+    value = value * 10 + (*p++ - '0');
+  }
+  return true;
+}
+
+// Mm.w.d, Jn or n, then an optional /time
+bool TimeZone::parseRule(const char *&p, Rule &rule) {
+  uint16_t month, week, weekday;
+  memset(&rule, 0, sizeof(rule));
+  if (*p == 'M') {
+    p++;
+    if (!parseNumber(p, month) || *p++ != '.' || !parseNumber(p, week) || *p++ != '.' ||
+        !parseNumber(p, weekday) || month < 1 || month > 12 || week < 1 || week > 5 || weekday > 6) {
+      return false;
+    }
+    rule.type = RuleType::monthWeekDay;
+    rule.month = month;
+    rule.week = week;
+    rule.weekday = weekday;
+  } else if (*p == 'J') {
+    p++;
+    if (!parseNumber(p, rule.day) || rule.day < 1 || rule.day > 365) {
+      return false;
+    }
+    rule.type = RuleType::julian;
+  } else {
+    if (!parseNumber(p, rule.day) || rule.day > 365) {
+      return false;
+    }
+    rule.type = RuleType::zeroBased;
+  }
+  rule.second = 7200;
+  if (*p == '/') {
+    p++;
+    return parseOffset(p, rule.second);
+  }
+  return true;
+}
+
+// Local day number the rule falls on in a year
+int32_t TimeZone::ruleDay(const Rule &rule, int year) {
+  int32_t january1 = dayNumber(year, 1, 1);
+  if (rule.type == RuleType::julian) {
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    return january1 + rule.day - 1 + (leap && rule.day >= 60 ? 1 : 0);
+  }
+  if (rule.type == RuleType::zeroBased) {
+    return january1 + rule.day;
+  }
+  int32_t first = dayNumber(year, rule.month, 1);
+  int32_t next = rule.month == 12 ? dayNumber(year + 1, 1, 1) : dayNumber(year, rule.month + 1, 1);
+  uint8_t firstWeekday = (uint8_t) ((first % 7 + 11) % 7);   // 1970-01-01 was a Thursday
+  int32_t day = first + (rule.weekday + 7 - firstWeekday) % 7 + (rule.week - 1) * 7;
+  while (day >= next) {
+    day -= 7;   // Week 5: the last one in the month
+  }
+  return day;
+}
+
+// Days since 1970-01-01 of a civil date
+int32_t TimeZone::dayNumber(int year, int month, int day) {
+  year -= month <= 2;
+  int32_t era = (year >= 0 ? year : year - 399) / 400;
+  uint32_t yoe = (uint32_t) (year - era * 400);
+  uint32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int32_t) doe - 719468;
+}
+
+int TimeZone::yearOf(int32_t dayNumber) {
+  dayNumber += 719468;
+  int32_t era = (dayNumber >= 0 ? dayNumber : dayNumber - 146096) / 146097;
+  uint32_t doe = (uint32_t) (dayNumber - era * 146097);
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  return (int) yoe + era * 400 + (mp >= 10);
+}
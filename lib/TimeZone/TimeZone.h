@@ -0,0 +1,79 @@
+#ifndef TIME_ZONE_H
+#define TIME_ZONE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <MemoryBudget.h>
+
+#ifndef TIME_ZONE_MAX_LENGTH
+#define TIME_ZONE_MAX_LENGTH 48    // Longest rule, terminator included
+#endif
+
+/*------------------------------------------------------------------------------------*/
+/* TimeZone                                                                           */
+/*------------------------------------------------------------------------------------*/
+// Local time from a POSIX TZ rule (e.g. "EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00").
+// The rule is parsed once. The UTC instants the year's daylight saving time starts and
+// ends are cached and recomputed lazily when a conversion falls in another year, so
+// converting between UTC and local time is an add and a compare instead of a call to
+// localtime() or mktime().
+//
+// Supported: std and dst names (alphabetic or <quoted>), offsets [+-]hh[:mm[:ss]], and
+// rules in the Mm.w.d, Jn and n forms with an optional /time, which may be negative or
+// past 24 hours. A dst name without rules uses the US rules.
+class TimeZone {
+  public:
+    static const uint8_t MAX_LENGTH = TIME_ZONE_MAX_LENGTH;
+
+    TimeZone();
+    ~TimeZone() {};
+
+    // Returns false, keeping the rule in effect, when posix does not parse
+    bool set(const char *posix);
+    const char *get(void) { return _posix; }
+
+    // Seconds east of UTC in effect at utc
+    int32_t getOffset(time_t utc);
+    bool isDst(time_t utc) { return _hasDst && getOffset(utc) == _dstOffset; }
+    // Local day number (days since 1970-01-01) and seconds after local midnight
+    int32_t getLocalDay(time_t utc);
+    uint32_t getSecondOfDay(time_t utc);
+
+    // UTC of a local day and time of day. A time repeated when the clocks go back maps
+    // to its first occurrence. A time skipped when they go forward is read as standard
+    // time, which falls that much after the jump (02:30 becomes 03:30).
+    time_t toUtc(int32_t localDay, uint32_t secondOfDay);
+
+  private:
+    enum class RuleType : uint8_t { monthWeekDay, julian, zeroBased };
+    struct Rule {
+      RuleType type;
+      uint8_t month;
+      uint8_t week;        // 5 is the last week of the month
+      uint8_t weekday;     // 0 Sunday
+      uint16_t day;        // Jn: 1 to 365, February 29 not counted. n: 0 to 365
+      int32_t second;      // Local time of the change
+    };
+
+    static bool parseName(const char *&p);
+    static bool parseOffset(const char *&p, int32_t &seconds);
+    static bool parseRule(const char *&p, Rule &rule);
+    static int32_t ruleDay(const Rule &rule, int year);
+    static int32_t dayNumber(int year, int month, int day);
+    static int yearOf(int32_t dayNumber);
+    void cacheYear(int year);
+
+    char _posix[MAX_LENGTH];
+    int32_t _stdOffset;          // Seconds east of UTC
+    int32_t _dstOffset;
+    bool _hasDst;
+    Rule _start;                 // Local standard time
+    Rule _end;                   // Local daylight saving time
+    // Cached year
+    time_t _yearStart;           // UTC of January 1st 00:00 standard time
+    time_t _yearEnd;
+    time_t _dstStart;
+    time_t _dstEnd;
+};
+
+#endif // TIME_ZONE_H
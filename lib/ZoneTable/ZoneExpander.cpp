@@ -0,0 +1,48 @@
+#include "ZoneExpander.h"
+#include <Wire.h>
+#include <LogRing.h>
+
+ZoneExpander::ZoneExpander(uint8_t address, bool activeLow):
+  _address(address),
+  _activeLow(activeLow),
+  _state(0),
+  _written(0),
+  _dirty(true) {
+}
+
+void ZoneExpander::begin(void) {
+  // All outputs off. The LCD library has already initialized the bus.
+  _state = 0;
+  _dirty = true;
+  flush();
+}
+
+void ZoneExpander::set(uint8_t pin, bool on) {
+  if (pin > 7) {
+    return;
+  }
+  uint8_t state = on ? _state | (1 << pin) : _state & ~(1 << pin);
+  if (state != _state) {
+    _state = state;
+    _dirty = true;
+  }
+}
+
+bool ZoneExpander::isOn(uint8_t pin) {
+  return pin <= 7 && (_state & (1 << pin));
+}
+
+bool ZoneExpander::flush(void) {
+  if (!_dirty && _state == _written) {
+    return true;
+  }
+  Wire.beginTransmission(_address);
+  Wire.write(_activeLow ? (uint8_t)~_state : _state);
+  if (Wire.endTransmission() != 0) {
+    LOG_WARN("[ZONES]: Expander 0x%02x write failed", _address);
+    return false;
+  }
+  _written = _state;
+  _dirty = false;
+  return true;
+}
@@ -0,0 +1,31 @@
+#ifndef ZONE_EXPANDER_H
+#define ZONE_EXPANDER_H
+
+#include <Arduino.h>
+
+/*------------------------------------------------------------------------------------*/
+/* ZoneExpander                                                                       */
+/*------------------------------------------------------------------------------------*/
+// Zone outputs on a PCF8574 I2C GPIO expander sharing the bus with the LCD backpack.
+// Output changes are staged in a shadow byte and written in a single I2C transaction,
+// so one scheduling pass costs at most one bus write whatever the number of zones.
+class ZoneExpander {
+  public:
+    ZoneExpander(uint8_t address, bool activeLow);
+    ~ZoneExpander() {};
+
+    void begin(void);
+    void set(uint8_t pin, bool on);
+    bool isOn(uint8_t pin);
+    // Write the shadow byte if it changed. Returns false on I2C error.
+    bool flush(void);
+
+  private:
+    uint8_t _address;
+    bool _activeLow;
+    uint8_t _state;     // Bit set means output on
+    uint8_t _written;   // Last state written to the device
+    bool _dirty;
+};
+
+#endif // ZONE_EXPANDER_H
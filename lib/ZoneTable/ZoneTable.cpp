@@ -0,0 +1,301 @@
+#include "ZoneTable.h"
+#include <string.h>
+
+const time_t NO_TIME = 0x7FFFFFFF;
+
+ZoneTable::ZoneTable(uint8_t count, const uint8_t *outputs, DripSchedule &schedule):
+  unattributedLiters(0),
+  _schedule(schedule),
+  _count(count > MAX_ZONES ? MAX_ZONES : count),
+  _maxConcurrent(1),
+  _faultMask(0),
+  _cursor(0),
+  _lastRun(0),
+  _holdUntil(0),
+  _inRainDelay(false) {
+  for (uint8_t z = 0; z < MAX_ZONES; z++) {
+    output[z] = z < _count ? outputs[z] : ONBOARD_VALVE;
+    state[z] = State::idle;
+    runUntil[z] = 0;
+    runSeconds[z] = 0;
+    liters[z] = 0;
+    pulses[z] = 0;
+    targetLiters[z] = 0;
+    lastWindow[z] = 0;
+  }
+}
+
+void ZoneTable::setMaxConcurrent(uint8_t maxConcurrent) {
+  _maxConcurrent = maxConcurrent == 0 ? 1 : maxConcurrent;
+}
+
+void ZoneTable::reschedule(time_t now) {
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] == State::pending) {
+      // run() queues it again if the new schedule still has the window
+      state[z] = State::idle;
+      lastWindow[z]--;
+    }
+  }
+  // Windows that started up to the longest duration ago may still be in progress.
+  // run() skips the ones already over and the ones their zone already queued.
+  _cursor = _schedule.upperBound(now - _schedule.getMaxDurationMinutes() * 60 - 1);
+}
+
+void ZoneTable::resync(void) {
+  _cursor = _schedule.upperBound(_lastRun);
+}
+
+void ZoneTable::save(Snapshot &snapshot) {
+  memset(&snapshot, 0, sizeof(snapshot));
+  snapshot.lastRun = _lastRun;
+  snapshot.faultMask = _faultMask;
+  snapshot.inRainDelay = _inRainDelay;
+  for (uint8_t z = 0; z < _count; z++) {
+    snapshot.state[z] = state[z];
+    snapshot.runUntil[z] = runUntil[z];
+    snapshot.runSeconds[z] = runSeconds[z];
+    snapshot.liters[z] = liters[z];
+    snapshot.pulses[z] = pulses[z];
+    snapshot.targetLiters[z] = targetLiters[z];
+    snapshot.lastWindow[z] = lastWindow[z];
+  }
+}
+
+void ZoneTable::restore(const Snapshot &snapshot) {
+  _lastRun = snapshot.lastRun;
+  _faultMask = snapshot.faultMask;
+  _inRainDelay = snapshot.inRainDelay;
+  for (uint8_t z = 0; z < _count; z++) {
+    state[z] = snapshot.state[z];
+    runUntil[z] = snapshot.runUntil[z];
+    runSeconds[z] = snapshot.runSeconds[z];
+    liters[z] = snapshot.liters[z];
+    pulses[z] = snapshot.pulses[z];
+    targetLiters[z] = snapshot.targetLiters[z];
+    lastWindow[z] = snapshot.lastWindow[z];
+  }
+  // Windows that became due during the reset are picked up by the next pass
+  resync();
+}
+
+time_t ZoneTable::run(time_t now, time_t rainDelayUntil, uint8_t &opened, uint8_t &closed) {
+  opened = 0;
+  closed = 0;
+  bool inRainDelay = now < rainDelayUntil;
+  if (_inRainDelay && !inRainDelay) {
+    // Rain delay just ended (or was cancelled). Pick up windows in progress.
+    reschedule(now);
+  }
+  _inRainDelay = inRainDelay;
+  _lastRun = now;
+
+  // Close finished zones
+  uint8_t running = 0;
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] == State::running) {
+      if (now >= runUntil[z]) {
+        state[z] = State::idle;
+        closed |= 1 << z;
+      } else {
+        running++;
+      }
+    }
+  }
+  // Queue due windows
+  const DripSchedule::Table &table = _schedule.table();
+  while (_cursor < table.count && table.events[_cursor].start <= now) {
+    const DripSchedule::Event &event = table.events[_cursor++];
+    time_t windowEnd = event.start + event.durationMinutes * 60;
+    uint8_t z = event.zone;
+    bool faulted = _faultMask & (1 << z);
+    if (!inRainDelay && !faulted && z < _count && state[z] == State::idle && now < windowEnd &&
+        event.start > lastWindow[z]) {
+      lastWindow[z] = event.start;
+      state[z] = State::pending;
+      runSeconds[z] = windowEnd - now;
+      targetLiters[z] = event.liters;
+    }
+  }
+  // Open pending zones in zone order while the run mode allows it
+  for (uint8_t z = 0; z < _count && running < _maxConcurrent && now >= _holdUntil; z++) {
+    if (state[z] == State::pending) {
+      state[z] = State::running;
+      runUntil[z] = now + runSeconds[z];
+      liters[z] = 0;
+      pulses[z] = 0;
+      opened |= 1 << z;
+      running++;
+    }
+  }
+  // Next deadline: earliest close, window start, end of the hold, rain delay end or table
+  // recompile
+  time_t next = getNextStop();
+  if (next == 0) {
+    next = NO_TIME;
+  }
+  if (_cursor < table.count && table.events[_cursor].start < next) {
+    next = table.events[_cursor].start;
+  }
+  if (now < _holdUntil && _holdUntil < next && getPendingMask()) {
+    next = _holdUntil;
+  }
+  if (inRainDelay && rainDelayUntil < next) {
+    next = rainDelayUntil;
+  }
+  if (table.validUntil && table.validUntil < next) {
+    next = table.validUntil;
+  }
+  return next;
+}
+
+void ZoneTable::start(uint8_t zone, time_t now, uint32_t seconds, uint16_t volume) {
+  if (zone >= _count) {
+    return;
+  }
+  if (state[zone] != State::running) {
+    liters[zone] = 0;
+    pulses[zone] = 0;
+  }
+  _faultMask &= ~(1 << zone);
+  state[zone] = State::running;
+  runUntil[zone] = now + seconds;
+  targetLiters[zone] = volume;
+}
+
+bool ZoneTable::stop(uint8_t zone) {
+  if (zone >= _count || state[zone] == State::idle) {
+    return false;
+  }
+  // The window was consumed when it became due (lastWindow). It will not restart.
+  state[zone] = State::idle;
+  return true;
+}
+
+uint8_t ZoneTable::stopAll(void) {
+  uint8_t stopped = 0;
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] == State::running) {
+      stopped |= 1 << z;
+    }
+    state[z] = State::idle;
+  }
+  return stopped;
+}
+
+void ZoneTable::attributeFlow(uint32_t measured) {
+  uint8_t running = getRunningCount();
+  if (running == 0) {
+    unattributedLiters += measured;
+    return;
+  }
+  uint32_t share = measured / running;
+  uint32_t remainder = measured % running;
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] == State::running) {
+      liters[z] += share + remainder;
+      remainder = 0;
+    }
+  }
+}
+
+uint32_t ZoneTable::takeLiters(uint8_t zone) {
+  if (zone >= _count) {
+    return 0;
+  }
+  uint32_t value = liters[zone];
+  liters[zone] = 0;
+  return value;
+}
+
+void ZoneTable::attributePulses(uint32_t measured) {
+  uint8_t running = getRunningCount();
+  if (running == 0) {
+    return;
+  }
+  uint32_t share = measured / running;
+  uint32_t remainder = measured % running;
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] == State::running) {
+      pulses[z] += share + remainder;
+      remainder = 0;
+    }
+  }
+}
+
+bool ZoneTable::isTargetReached(uint8_t zone, uint16_t pulsesPerLiter) {
+  return zone < _count && targetLiters[zone] && pulses[zone] >= (uint32_t) targetLiters[zone] * pulsesPerLiter;
+}
+
+bool ZoneTable::getPulsesToTarget(uint16_t pulsesPerLiter, uint32_t &meterPulses) {
+  uint32_t fewest = 0xFFFFFFFF;
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] != State::running || targetLiters[z] == 0) {
+      continue;
+    }
+    uint32_t target = (uint32_t) targetLiters[z] * pulsesPerLiter;
+    uint32_t missing = pulses[z] < target ? target - pulses[z] : 0;
+    if (missing < fewest) {
+      fewest = missing;
+    }
+  }
+  if (fewest == 0xFFFFFFFF) {
+    return false;
+  }
+  meterPulses = fewest * getRunningCount();
+  return true;
+}
+
+uint8_t ZoneTable::closeReachedTargets(uint16_t pulsesPerLiter) {
+  uint8_t closed = 0;
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] == State::running && isTargetReached(z, pulsesPerLiter)) {
+      state[z] = State::idle;
+      closed |= 1 << z;
+    }
+  }
+  return closed;
+}
+
+uint8_t ZoneTable::getRunningMask(void) {
+  uint8_t mask = 0;
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] == State::running) {
+      mask |= 1 << z;
+    }
+  }
+  return mask;
+}
+
+uint8_t ZoneTable::getPendingMask(void) {
+  uint8_t mask = 0;
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] == State::pending) {
+      mask |= 1 << z;
+    }
+  }
+  return mask;
+}
+
+uint8_t ZoneTable::getRunningCount(void) {
+  uint8_t running = 0;
+  for (uint8_t z = 0; z < _count; z++) {
+    running += state[z] == State::running;
+  }
+  return running;
+}
+
+time_t ZoneTable::getNextStart(void) {
+  const DripSchedule::Table &table = _schedule.table();
+  return _cursor < table.count ? table.events[_cursor].start : 0;
+}
+
+time_t ZoneTable::getNextStop(void) {
+  time_t next = NO_TIME;
+  for (uint8_t z = 0; z < _count; z++) {
+    if (state[z] == State::running && runUntil[z] < next) {
+      next = runUntil[z];
+    }
+  }
+  return next == NO_TIME ? 0 : next;
+}
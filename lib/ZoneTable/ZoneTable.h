@@ -0,0 +1,133 @@
+#ifndef ZONE_TABLE_H
+#define ZONE_TABLE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <DripSchedule.h>
+
+/*------------------------------------------------------------------------------------*/
+/* ZoneTable                                                                          */
+/*------------------------------------------------------------------------------------*/
+// Run state of the irrigation zones stored as contiguous per-field arrays (one entry
+// per zone) so the scheduler can evaluate every zone in a single pass over a few small
+// arrays instead of keeping one timer per zone. Drip windows come from the compiled
+// DripSchedule table, walked with a cursor. The table knows nothing about hardware:
+// run() reports which zones opened and closed as bitmasks and the caller drives the
+// outputs.
+//
+// A due window makes its zone pending. Pending zones open as soon as the run mode allows
+// it: with maxConcurrent = 1 zones run sequentially, otherwise up to maxConcurrent at once.
+// Each zone remembers the start of the last window it queued and never queues that one
+// or an earlier one again, however the cursor is moved back.
+//
+// A window with a volume closes once its zone got that many liters, counted in flow
+// meter pulses. The window duration is then only a cap. The table tells how many meter
+// pulses away the first target is, so the caller can arm the meter to catch it.
+class ZoneTable {
+  public:
+    enum class State : uint8_t {
+      idle,     // Waiting for next window
+      pending,  // Window is due. Waiting for a free slot
+      running   // Output open until runUntil
+    };
+    static const uint8_t ONBOARD_VALVE = 0xFF;   // Output value for the on-board valve
+
+    ZoneTable(uint8_t count, const uint8_t *outputs, DripSchedule &schedule);
+    ~ZoneTable() {};
+
+    void setMaxConcurrent(uint8_t maxConcurrent);
+    uint8_t getMaxConcurrent(void) { return _maxConcurrent; }
+    uint8_t getCount(void) { return _count; }
+
+    // Position the cursor after the schedule was committed. A window already in
+    // progress is picked up and runs for its remaining time, unless its zone already
+    // queued it.
+    void reschedule(time_t now);
+    // Position the cursor after the daily recompile. Windows already handled by a
+    // previous pass are not picked up again.
+    void resync(void);
+
+    // Run state kept across a reset, e.g. in RTC memory. Restoring it instead of
+    // reschedule() resumes the zones where they were, and windows handled before the
+    // reset are not picked up again.
+    struct Snapshot {
+      time_t lastRun;
+      uint8_t faultMask;
+      bool inRainDelay;
+      State state[MAX_ZONES];
+      time_t runUntil[MAX_ZONES];
+      uint32_t runSeconds[MAX_ZONES];
+      uint32_t liters[MAX_ZONES];
+      uint32_t pulses[MAX_ZONES];
+      uint16_t targetLiters[MAX_ZONES];
+      time_t lastWindow[MAX_ZONES];
+    };
+    void save(Snapshot &snapshot);
+    // After the schedule the snapshot was taken with is compiled again
+    void restore(const Snapshot &snapshot);
+
+    // Single pass over all zones: close finished zones, queue due windows (skipped while
+    // a rain delay is in effect) and open pending zones as the run mode allows.
+    // Returns the next time run() must be called.
+    time_t run(time_t now, time_t rainDelayUntil, uint8_t &opened, uint8_t &closed);
+
+    // Pending zones wait until then, e.g. for their slot on a shared water main
+    void hold(time_t until) { _holdUntil = until; }
+    time_t getHold(void) { return _holdUntil; }
+
+    // Manual control. A volume in liters closes the zone before the time is over.
+    void start(uint8_t zone, time_t now, uint32_t seconds, uint16_t volume = 0);
+    bool stop(uint8_t zone);
+    uint8_t stopAll(void);
+
+    // Faulted zones (e.g. burst line) skip their windows until the fault is cleared.
+    // Starting a zone by hand clears its fault.
+    void setFault(uint8_t zone) { if (zone < _count) _faultMask |= 1 << zone; }
+    void clearFaults(void) { _faultMask = 0; }
+    uint8_t getFaultMask(void) { return _faultMask; }
+
+    // Split liters measured by the shared flow meter among the zones that are running.
+    // Water measured with every zone closed is accumulated as unattributed.
+    void attributeFlow(uint32_t liters);
+    uint32_t takeLiters(uint8_t zone);
+
+    // Volume targets. Meter pulses are split among the running zones like liters.
+    void attributePulses(uint32_t measured);
+    bool isTargetReached(uint8_t zone, uint16_t pulsesPerLiter);
+    // Meter pulses until the first running zone reaches its target, split evenly among
+    // the running zones. Returns false if no running zone has a target.
+    bool getPulsesToTarget(uint16_t pulsesPerLiter, uint32_t &meterPulses);
+    // Close the running zones that reached their target. Returns them as a bitmask.
+    uint8_t closeReachedTargets(uint16_t pulsesPerLiter);
+
+    bool isRunning(uint8_t zone) { return zone < _count && state[zone] == State::running; }
+    uint8_t getRunningMask(void);
+    uint8_t getPendingMask(void);
+    uint8_t getRunningCount(void);
+    bool isAnyRunning(void) { return getRunningMask() != 0; }
+    time_t getNextStart(void);
+    time_t getNextStop(void);
+
+    // Per-zone fields. Public for read access, change them through the methods above.
+    uint8_t output[MAX_ZONES];           // Expander pin or ONBOARD_VALVE
+    State state[MAX_ZONES];
+    time_t runUntil[MAX_ZONES];          // Close time while running
+    uint32_t runSeconds[MAX_ZONES];      // Run time of a pending zone
+    uint32_t liters[MAX_ZONES];          // Liters attributed during the current run
+    uint32_t pulses[MAX_ZONES];          // Meter pulses attributed during the current run
+    uint16_t targetLiters[MAX_ZONES];    // Volume of the current or pending run, 0 none
+    time_t lastWindow[MAX_ZONES];        // Start of the last window queued, 0 none
+    uint32_t unattributedLiters;
+
+  private:
+    DripSchedule &_schedule;
+    uint8_t _count;
+    uint8_t _maxConcurrent;
+    uint8_t _faultMask;
+    uint8_t _cursor;          // Next window in the compiled table
+    time_t _lastRun;          // Time of the last pass
+    time_t _holdUntil;
+    bool _inRainDelay;
+};
+
+#endif // ZONE_TABLE_H
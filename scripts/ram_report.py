@@ -0,0 +1,77 @@
+# Static RAM report. PlatformIO runs it after linking (extra_scripts in platformio.ini)
+# and prints the .data, .rodata and .bss bytes of every global defined in src and the
+# total of each library, then the whole image. A buffer that grows shows up in the
+# build output. The sizes themselves are set in include/MemoryBudget.h.
+#
+# Outside PlatformIO: python scripts/ram_report.py BUILD_DIR ELF [NM]
+
+import glob
+import os
+import subprocess
+import sys
+
+RAM_TYPES = "bBdDrR"                        # nm symbol types of .bss, .data and .rodata
+RAM_SECTIONS = (".data", ".rodata", ".bss")  # dram0 on the ESP8266
+MIN_LISTED = 32                             # Smaller globals are summed up
+
+
+def run(*command):
+    return subprocess.run(command, stdout=subprocess.PIPE, universal_newlines=True).stdout
+
+
+def ram_symbols(nm, path):
+    for line in run(nm, "-S", "-C", path).splitlines():
+        fields = line.split(None, 3)
+        if len(fields) == 4 and fields[2] in RAM_TYPES:
+            yield fields[3], int(fields[1], 16)
+
+
+def image_bytes(size, elf):
+    total = 0
+    for line in run(size, "-A", elf).splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0] in RAM_SECTIONS:
+            total += int(fields[1])
+    return total
+
+
+def report(build_dir, elf, nm, size):
+    print("Static RAM (bytes of .data, .rodata and .bss)")
+    listed = 0
+    # Globals of the firmware, one line each: every subsystem is one object
+    for path in sorted(glob.glob(os.path.join(build_dir, "src", "**", "*.o"), recursive=True)):
+        symbols = sorted(ram_symbols(nm, path), key=lambda symbol: -symbol[1])
+        print("  %s" % os.path.relpath(path, build_dir))
+        for name, length in symbols:
+            if length >= MIN_LISTED:
+                print("  %8u  %s" % (length, name))
+        print("  %8u  smaller globals" % sum(length for name, length in symbols if length < MIN_LISTED))
+        listed += sum(length for name, length in symbols)
+    # Libraries, one line each. PlatformIO builds them in lib<hash>/<name>
+    print("  libraries")
+    for library in sorted(glob.glob(os.path.join(build_dir, "lib*", "*", ""))):
+        length = sum(length for path in glob.glob(os.path.join(library, "**", "*.o"), recursive=True)
+                     for name, length in ram_symbols(nm, path))
+        if length:
+            print("  %8u  %s" % (length, os.path.basename(os.path.dirname(library))))
+            listed += length
+    total = image_bytes(size, elf)
+    print("  %8u  framework, SDK and string literals" % max(total - listed, 0))
+    print("  %8u  total" % total)
+
+
+def tool(cc, name):
+    # xtensa-lx106-elf-gcc -> xtensa-lx106-elf-nm, gcc -> nm
+    return cc[:-3] + name if cc.endswith("gcc") else name
+
+
+if __name__ == "__main__":
+    report(sys.argv[1], sys.argv[2], sys.argv[3] if len(sys.argv) > 3 else "nm", "size")
+else:
+    Import("env")  # noqa: F821, provided by PlatformIO
+
+    def after_link(source, target, env):
+        cc = env.subst("$CC")
+        report(env.subst("$BUILD_DIR"), str(target[0]), tool(cc, "nm"), tool(cc, "size"))
+
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}${PROGSUFFIX}", after_link)
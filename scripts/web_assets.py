@@ -0,0 +1,83 @@
+# Web assets. PlatformIO runs it before every build (extra_scripts in platformio.ini):
+# every file in web/ is gzipped and written to include/WebAssets.h as a byte array in
+# flash, with its path, content type and ETag, for HttpServer to send as is. The header
+# is only rewritten when an asset changed, so unchanged builds stay incremental.
+#
+# Outside PlatformIO: python scripts/web_assets.py [PROJECT_DIR]
+
+import gzip
+import hashlib
+import os
+import sys
+
+TYPES = {
+    ".html": "text/html",
+    ".js": "application/javascript",
+    ".css": "text/css",
+    ".svg": "image/svg+xml",
+    ".ico": "image/x-icon",
+    ".json": "application/json",
+}
+INDEX = "index.html"                        # Served as /
+BYTES_PER_LINE = 16
+
+
+def compress(data):
+    # mtime 0: the same source gives the same bytes, and the same ETag
+    return gzip.compress(data, compresslevel=9, mtime=0)
+
+
+def header(assets):
+    lines = [
+        "// Generated by scripts/web_assets.py from web/. Do not edit.",
+        "#ifndef WEB_ASSETS_H",
+        "#define WEB_ASSETS_H",
+        "",
+        "#include <HttpServer.h>",
+        "",
+    ]
+    for index, (path, kind, data, etag) in enumerate(assets):
+        lines.append("// %s, %u bytes gzipped" % (path, len(data)))
+        lines.append("static const uint8_t WEB_ASSET_%u[] PROGMEM = {" % index)
+        for start in range(0, len(data), BYTES_PER_LINE):
+            lines.append("  " + " ".join("0x%02x," % byte for byte in data[start:start + BYTES_PER_LINE]))
+        lines.append("};")
+    lines.append("")
+    lines.append("const HttpServer::Asset WEB_ASSETS[] = {")
+    for index, (path, kind, data, etag) in enumerate(assets):
+        lines.append('  { "%s", "%s", WEB_ASSET_%u, %u, "\\"%s\\"" },' % (path, kind, index, len(data), etag))
+    lines.append("};")
+    lines.append("const uint8_t WEB_ASSET_COUNT = %u;" % len(assets))
+    lines.append("")
+    lines.append("#endif // WEB_ASSETS_H")
+    return "\n".join(lines) + "\n"
+
+
+def generate(project_dir):
+    source = os.path.join(project_dir, "web")
+    target = os.path.join(project_dir, "include", "WebAssets.h")
+    assets = []
+    for name in sorted(os.listdir(source)):
+        kind = TYPES.get(os.path.splitext(name)[1])
+        if not kind:
+            continue
+        with open(os.path.join(source, name), "rb") as file:
+            data = compress(file.read())
+        etag = hashlib.sha1(data).hexdigest()[:8]
+        assets.append(("/" if name == INDEX else "/" + name, kind, data, etag))
+    text = header(assets)
+    if os.path.exists(target):
+        with open(target) as file:
+            if file.read() == text:
+                return
+    with open(target, "w") as file:
+        file.write(text)
+    print("Web assets: %s" % ", ".join("%s %u bytes" % (path, len(data)) for path, kind, data, etag in assets))
+
+
+if __name__ == "__main__":
+    generate(sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+else:
+    Import("env")  # noqa: F821, provided by PlatformIO
+
+    generate(env.subst("$PROJECT_DIR"))  # noqa: F821
@@ -1,16 +1,50 @@
 #include <Arduino.h>
+#include <MemoryBudget.h>
 #include <EEPROM.h>
+#include <LittleFS.h>
 #include <WiFiManager.h>
 #include <ArduinoOTA.h>
 #include <PubSubClient.h>
 #include <TimeUtils.h>
+#include <coredecls.h>
+#include <sys/time.h>
 #include <StatusLED.h>
 #include <Valves.h>
-#include <FlowMeter.h>
+#include <FlowSensor.h>
+#include <PulseRate.h>
+#include <FlowSeries.h>
+#include <FlowMonitor.h>
+#include <FlowHistory.h>
+#include <CommandParser.h>
 #include <time.h>
-#include <LongTicker.h>
 #include <PushButton.h>
 #include <LiquidCrystal_I2C.h>
+#include <LcdFrame.h>
+#include <LogRing.h>
+#include <LoopMetrics.h>
+#include <DripState.h>
+#include <MqttOutbox.h>
+#include <PowerManager.h>
+#include <TimeZone.h>
+#include <MqttReconnect.h>
+#include <MqttTopics.h>
+#include <MqttTls.h>
+#if MQTT_TLS
+#include <WiFiClientSecure.h>
+#include <StackThunk.h>
+#endif
+#include <FleetSlots.h>
+#include <BootClock.h>
+#include <InputTrace.h>
+#include <HttpServer.h>
+#include <WebAssets.h>
+#include <HeapCheck.h>
+#include <EventScheduler.h>
+#include <DripSchedule.h>
+#include <ZoneTable.h>
+#include <ZoneExpander.h>
+#include <ConfigJournal.h>
+#include <EspFlashBackend.h>
 #include "secret.h"
 
 /*------------------------------------------------------------------------------------*/
@@ -26,33 +60,162 @@ const StatusLED::Status ANY_ERROR = StatusLED::Status::custom_2;
 
 // MQTT Constants
 const char * MQTT_CLIENT_PREFIX = "DripCtrl-";
-const char * MQTT_IN_TOPIC = "/home-assistant/drip/request";
-
-// MQTT Commands
+const char * MQTT_ROOT = "/home-assistant/drip";   // Topics are <root>/request, ... See MqttTopics
+const uint32_t MQTT_RECONNECT_BASE_MS = 1000;       // First retry delay after a failure
+const uint32_t MQTT_RECONNECT_MAX_MS = 60000;       // Backoff ceiling
+const uint16_t MQTT_CONNECT_TIMEOUT_MS = 1500;      // Bounds the TCP connect of a single attempt
+const uint16_t MQTT_SOCKET_TIMEOUT_SECONDS = 2;     // Bounds the wait for CONNACK
+const uint16_t MQTT_PORT = MQTT_TLS ? 8883 : 1883;
+
+// MQTT Commands. Several commands may be sent in one message separated by ';'
 const char MQTT_CMD_CONFIG_DRIP = 'c';   // Configure dripping parameters
 const char MQTT_CMD_START_DRIP = 's';    // Start manual dripping
 const char MQTT_CMD_STOP_DRIP = 't';     // Stop manual dripping
 const char MQTT_CMD_RAIN_DELAY = 'r';    // Set rain delay
 const char MQTT_CMD_RESET = 'x';         // Restart system
 const char MQTT_CMD_RESET_METER = 'a';   //TODO: restart the flow meter
+const char MQTT_CMD_RUN_MODE = 'm';      // Maximum number of zones dripping at once
+const char MQTT_CMD_WINDOWS = 'w';       // Configure weekdays, interval and start times
+const char MQTT_CMD_FLOW_FORMAT = 'f';   // Flow series format: 0 binary, 1 JSON (debug)
+const char MQTT_CMD_CLEAR_ALARM = 'k';   // Clear flow alarms. Faulted zones drip again
+const char MQTT_CMD_HISTORY = 'h';       // Flow history totals over a time range
+const char MQTT_CMD_LOG = 'l';           // Log ring: 0 stop streaming, 1 fetch, 2 fetch and stream
+const char MQTT_CMD_POWER = 'p';         // Power mode: 0 awake, 1 modem sleep, 2 light sleep
+const char MQTT_CMD_TIME_ZONE = 'u';     // Time zone as a POSIX TZ rule
+const char MQTT_CMD_VOLUME = 'v';        // Liters per scheduled drip, 0 drips for the duration
+const char MQTT_CMD_START_VOLUME = 'q';  // Start manual dripping of a volume, with a time cap
+const char MQTT_CMD_NAMESPACE = 'n';     // Topics: 0 shared, 1 per device with group and broadcast commands
+const char MQTT_CMD_GROUP = 'g';         // Fleet group of the controller
+const char MQTT_CMD_BUDGET = 'b';        // Flow budget of the group in liters per minute, 0 no coordination
+const char MQTT_CMD_TRACE = 'y';         // Input trace: 0 stop, 1 restart, 2 save to flash, 3 save and publish
+const uint8_t MQTT_MAX_COMMANDS = 8;     // Commands accepted in one message
+
+// MQTT Command Syntax. See CommandParser for the pattern tokens. zN prefixes address zone N.
+const CommandParser::Syntax MQTT_COMMANDS[] = {
+  // Code                 Arguments   Repeated group   Zones
+  { MQTT_CMD_CONFIG_DRIP, "TDDDD",    NULL, 0,         true  },  // HH:MM:SSMMHH start, duration, period
+  { MQTT_CMD_WINDOWS,     "XXDDDDD",  "T",  4,         true  },  // WWNNMMM weekdays, every NN days, duration, start times
+  { MQTT_CMD_START_DRIP,  "Ddd",      NULL, 0,         true  },  // MM minutes
+  { MQTT_CMD_START_VOLUME, "DDDDDdd", NULL, 0,         true  },  // LLLLMM liters, minutes cap
+  { MQTT_CMD_STOP_DRIP,   "",         NULL, 0,         true  },
+  { MQTT_CMD_RAIN_DELAY,  "Dd",       NULL, 0,         false },  // HH hours, 0 cancels
+  { MQTT_CMD_RESET,       "",         NULL, 0,         false },
+  { MQTT_CMD_RUN_MODE,    "D",        NULL, 0,         false },  // N zones at once
+  { MQTT_CMD_FLOW_FORMAT, "D",        NULL, 0,         false },  // 0 binary, 1 JSON
+  { MQTT_CMD_CLEAR_ALARM, "",         NULL, 0,         false },
+  { MQTT_CMD_HISTORY,     "DDDDDDDDDDDDDDDDDDDD", NULL, 0, false },  // From and to, 10 digit epoch seconds each
+  { MQTT_CMD_LOG,         "D",        NULL, 0,         false },  // 0 stop, 1 fetch, 2 fetch and stream
+  { MQTT_CMD_POWER,       "D",        NULL, 0,         false },  // 0 awake, 1 modem sleep, 2 light sleep
+  { MQTT_CMD_TIME_ZONE,   "S",        NULL, 0,         false },  // e.g. CET-1CEST,M3.5.0,M10.5.0/3
+  { MQTT_CMD_VOLUME,      "DDDD",     NULL, 0,         true  },  // LLLL liters, 0 time only
+  { MQTT_CMD_NAMESPACE,   "D",        NULL, 0,         false },  // 0 shared, 1 per device
+  { MQTT_CMD_GROUP,       "S",        NULL, 0,         false },  // e.g. garden
+  { MQTT_CMD_BUDGET,      "Ddd",      NULL, 0,         false },  // Liters per minute
+  { MQTT_CMD_TRACE,       "D",        NULL, 0,         false },  // 0 stop, 1 restart, 2 save, 3 save and publish
+};
 
-// MQTT Events
-const char * MQTT_REPORT_FLOW = "/home-assistant/drip/flow";
-const char * MQTT_DRIP_STARTED = "/home-assistant/drip/started";
-const char * MQTT_DRIP_STOPPED = "/home-assistant/drip/stopped";
-const char * MQTT_DRIP_SCHEDULE = "/home-assistant/drip/schedule";
-const char * MQTT_DRIP_RAIN_DELAY_ENDED = "/home-assistant/drip/raindelayended";
-const char * MQTT_DRIP_RAIN_DELAY_SET = "/home-assistant/drip/raindelayset";
+// Outbox. Events that must reach the broker are queued and delivered after an outage.
+const uint8_t OUTBOX_TOPIC_DRIP = 0;                // Index into OUTBOX_TOPICS
+const uint8_t OUTBOX_TOPIC_ALARM = 1;
+const MqttTopics::Topic OUTBOX_TOPICS[] = { MqttTopics::drip, MqttTopics::alarm };
+const char *OUTBOX_DIR = "/outbox";                 // Spilled messages in LittleFS
+const uint8_t OUTBOX_BATCH = 4;                     // Messages published per batch
+const uint16_t OUTBOX_PACE_MS = 200;                // Time between batches
+const uint8_t OUTBOX_HEADER_SIZE = 64;              // MQTT header and topic room in the TCP buffer
 
 // Default Drip Values
 const char *START_IRRIGATION_TIME = "07:00:00"; // HH:MM:SS
 const uint8_t IRRIGATION_PERIOD_HOURS = 12;         // Minimum 12 hours
 const uint8_t IRRIGATION_LONG_MINUTES = 45;         // Maximum 120 minutes
 const uint8_t RAIN_DELAY_HOURS = 24;                // Minimum 24 hours
+const char *TIME_ZONE_DEFAULT = "EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00";
+
+// Zones. Zone 0 is the on-board valve, the others are outputs of an I2C GPIO expander.
+// Zones other than 0 have no schedule until configured over MQTT.
+const uint8_t ZONE_OUTPUTS[] = { ZoneTable::ONBOARD_VALVE, 0, 1, 2 };
+const uint8_t ZONE_COUNT = sizeof(ZONE_OUTPUTS) / sizeof(ZONE_OUTPUTS[0]);
+const uint8_t ZONE_EXPANDER_ADDRESS = 0x20;         // PCF8574 with A0-A2 low
+const bool ZONE_EXPANDER_ACTIVE_LOW = true;         // Relay boards are usually active low
+const uint8_t ZONE_MAX_CONCURRENT = 1;              // Default: zones drip one after another
+
+// Flow Meter
+const uint16_t FLOW_METER_PULSES_PER_LITER = 450;   // YF-S201: F(Hz) = 7.5 * Q(L/min)
+const uint8_t FLOW_SERIES_PUBLISH_SECONDS = 30;     // Batch of per-second pulse counts
+const uint32_t FLOW_GLITCH_CYCLES = F_CPU / 1000;   // Pulses closer than 1 ms are noise. The meter tops at 225 Hz
+const uint32_t FLOW_RATE_TIMEOUT_CYCLES = 5 * F_CPU; // No pulse for 5 seconds: no flow
+const char *FLOW_HISTORY_DIR = "/flow";             // Flow history chunks and index in LittleFS
+
+// Configuration journal. Its sectors end with the EEPROM sector, the one before it is
+// the unused sector between the file system area and the EEPROM.
+const uint8_t CONFIG_JOURNAL_SECTORS = 2;
+const uint8_t CONFIG_RUN_MODE = 0;          // Maximum zones dripping at once
+const uint8_t CONFIG_RAIN_DELAY = 1;        // Rain delay hours and resume time
+const uint8_t CONFIG_LIFETIME_LITERS = 2;   // Liters measured since the first boot
+const uint8_t CONFIG_LAST_DRIP = 3;         // Outcome of the last drip of any zone
+const uint8_t CONFIG_POWER_MODE = 4;        // Sleep between timed events
+const uint8_t CONFIG_TIME_ZONE = 5;         // POSIX TZ rule
+const uint8_t CONFIG_FLEET = 6;             // Topic namespace, group and flow budget
+const uint8_t CONFIG_CLOCK = 7;             // Last known wall-clock time
+const uint8_t CONFIG_ZONE_SCHEDULE = 8;     // Plus zone number: schedule of the zone
+
+// Log. LOG_LEVEL selects the levels compiled in.
+const uint8_t LOG_MQTT_OFF = 0;
+const uint8_t LOG_MQTT_FETCH = 1;                   // Publish the ring once
+const uint8_t LOG_MQTT_STREAM = 2;                  // ... then every new record
+
+// Input trace. Recorded from reset, for replay on the host (see InputTrace).
+const uint8_t TRACE_STOP = 0;
+const uint8_t TRACE_START = 1;                      // Clear the ring and record again
+const uint8_t TRACE_SAVE = 2;                       // Ring to TRACE_FILE
+const uint8_t TRACE_PUBLISH = 3;                    // ... and publish the file, a chunk per loop() pass
+const char *TRACE_FILE = "/trace.bin";
+
+// Web server
+const uint16_t HTTP_PORT = 80;
+const uint32_t HTTP_HISTORY_SECONDS = 86400;        // Range of /api/history without from and to
+
+// Loop metrics. Stages of loop() in the order they run. LOOP_METRICS 0 compiles them out.
+const uint8_t LOOP_STAGE_OTA = 0;
+const uint8_t LOOP_STAGE_FLOW = 1;
+const uint8_t LOOP_STAGE_EVENTS = 2;                // Due timer callbacks
+const uint8_t LOOP_STAGE_MQTT = 3;                  // Reconnect, client loop and commands
+const uint8_t LOOP_STAGE_HTTP = 4;                  // A step of the open web connection
+const uint8_t LOOP_STAGE_BUTTON = 5;
+const uint8_t LOOP_STAGE_VALVE = 6;
+const uint8_t LOOP_STAGE_LCD = 7;
+const uint8_t LOOP_STAGE_LOG = 8;
+const uint8_t LOOP_STAGE_STATE = 9;
+const uint8_t LOOP_STAGE_COUNT = 10;
+const char *LOOP_STAGE_NAMES[] = { "ota", "flow", "events", "mqtt", "http", "button", "valve", "lcd", "log", "state", "pass",
+  "idle" };
+const uint8_t METRICS_PUBLISH_SECONDS = 60;
+
+// Power. Sleeping ends at the next timed event or after POWER_MAX_SLEEP_MS, whichever
+// comes first. The flow meter wakes the chip from light sleep, the push button cannot
+// (GPIO16), so it is polled. Both limits are well inside the MQTT keepalive.
+const uint16_t POWER_MAX_SLEEP_MS = 250;
+const uint8_t POWER_MIN_SLEEP_MS = 5;               // Shorter waits are not worth a wake-up
+const uint8_t POWER_LISTEN_INTERVAL = 3;            // DTIM beacons slept through in light sleep
+
+// Fleet. Controllers of a group on one water main claim slots for their drips, so their
+// flow together stays within the budget of the group (see FleetSlots).
+const char *FLEET_DEFAULT_GROUP = "default";
+const uint8_t FLEET_SETTLE_SECONDS = 10;            // From a claim to its slot. Colliding claims arrive meanwhile
+const uint16_t FLEET_DEFAULT_ZONE_FLOW = 60;        // Deciliters per minute of a zone whose flow is not learned yet
+const time_t FLEET_NO_SLOT = 0x7FFFFFFF;            // Hold of zones waiting for a claim
+
+// Boot. The clock and the zones are checkpointed so irrigation resumes right after a
+// reset, before Wi-Fi and NTP are up (see BootClock).
+const uint8_t BOOT_RTC_CHECKPOINT_SECONDS = 5;      // Time and zones to RTC memory
+const uint16_t BOOT_FLASH_CHECKPOINT_SECONDS = 3600; // Time to the config journal
+const uint32_t BOOT_RTC_BLOCK = 32;                 // In 4 byte blocks. The first 128 bytes of RTC user memory belong to OTA
+const uint8_t WIFI_CONNECT_WAIT_SECONDS = 30;       // For the saved network before the config portal opens
 
 // Other Constants
-const uint8_t LCD_DISPLAY_INTERVAL_SECONDS = 60;    // Update the LCD display
-const uint8_t WIFI_CONFIG_WAIT_TIME_MINUTES = 5;    // Time waits for WiFi config before resetting
+const uint8_t LCD_DISPLAY_INTERVAL_SECONDS = 60;    // Update and publish the display status
+const uint8_t LCD_TICK_SECONDS = 1;                 // Update the clock and countdown
+const uint8_t LCD_CELLS_PER_PASS = 4;               // Changed LCD cells written per loop() pass
+const uint8_t WIFI_CONFIG_WAIT_TIME_MINUTES = 5;    // Time waits for WiFi config before trying the saved network again
 
 /*------------------------------------------------------------------------------------*/
 /* GPIO Definitions                                                                   */
@@ -77,147 +240,270 @@ const uint8_t GPIO_PUSH_BUTTON = 16;       // ESP8266 NodeMCU D0 (INPUT)
 /*------------------------------------------------------------------------------------*/
 /* Helper Classes                                                                     */
 /*------------------------------------------------------------------------------------*/
+// Local time rules. The year's DST changes are cached, so the conversions below are
+// an add and a compare.
+TimeZone timeZone;
+
+// Converts a local day number and time of day to UTC. Used to compile the schedule.
+time_t localToUtc(int32_t localDay, uint32_t secondOfDay) {
+  return timeZone.toUtc(localDay, secondOfDay);
+}
+
 class DripParams {
   public:
-    DripParams(const char *startDripTime, uint8_t dripPeriodHours, uint8_t dripTimeMinutes):
-    _period(dripPeriodHours),
-    _duration(dripTimeMinutes) {
-      strcpy(_startTime, startDripTime);
-      strptime(startDripTime, "%T", &_start);
-      _rainDelayHours = 0;
-      _rainDelayResumeTime = TimeUtils::getCurrentTimeRaw() - 1; // No rain delay 
+    enum class Outcome : uint8_t {
+      completed,  // Ran for its whole time
+      stopped,    // Stopped by hand
+      alarm,      // Closed by a flow alarm
+      capped      // Volume drip closed by its time cap before the volume went through
+    };
+    struct DripRecord {
+      time_t start;
+      uint32_t seconds;
+      uint32_t liters;
+      uint8_t zone;
+      Outcome outcome;
+    };
+
+    DripParams(DripSchedule &schedule, ZoneTable &zones, ConfigJournal &journal, const char *startDripTime, uint8_t dripPeriodHours, uint8_t dripTimeMinutes):
+    _schedule(schedule),
+    _zones(zones),
+    _journal(journal) {
+      setZoneSchedule(0, parseStartTime(startDripTime), dripPeriodHours, dripTimeMinutes);
+      _rainDelay.hours = 0;
+      _rainDelay.resumeTime = TimeUtils::getCurrentTimeRaw() - 1; // No rain delay 
+      _lifetimeLiters = 0;
     }
     ~DripParams() {};
 
-    struct tm getStartTime(void) {
-      return _start;
-    };
+    // Start time should be in the format HH:MM:SS. Returns seconds after midnight.
+    static uint32_t parseStartTime(const char *startTime) {
+      struct tm start;
+      memset(&start, 0, sizeof(start));
+      strptime(startTime, "%T", &start);
+      return start.tm_hour * 3600UL + start.tm_min * 60 + start.tm_sec;
+    }
 
-    time_t getTodayStartTime(void) {
-      struct tm *currentTime = TimeUtils::getCurrentTime();
-      currentTime->tm_hour = _start.tm_hour; 
-      currentTime->tm_min = _start.tm_min; 
-      currentTime->tm_sec = _start.tm_sec;
-      return mktime(currentTime); 
+    // Local day number (days since 1970-01-01) of today
+    int32_t getLocalDay(void) {
+      return timeZone.getLocalDay(TimeUtils::getCurrentTimeRaw());
     }
 
-    uint32_t getDripPeriodSeconds(void) {
-        return _period * 3600;
+    // Daily schedule: drip at start time and, if period is set, period hours later the
+    // same day. Staged until commit().
+    void setZoneSchedule(uint8_t zone, uint32_t start, uint8_t periodHours, uint8_t durationMinutes) {
+      ZoneSchedule &spec = _schedule.edit(zone);
+      spec.clear();
+      spec.addStartTime(start);
+      if (periodHours > 0 && start + periodHours * 3600UL < 24 * 3600UL) {
+        spec.addStartTime(start + periodHours * 3600UL);
+      }
+      spec.durationMinutes = durationMinutes;
     }
 
-    uint16_t getDripTimeSeconds(void) {
-      return _duration * 60;
+    // Schedule of start times on some weekdays, every N days. Staged until commit().
+    ZoneSchedule &editZoneSchedule(uint8_t zone) {
+      return _schedule.edit(zone);
     }
 
-    uint8_t getDripTimeMinutes(void) {
-      return _duration;
+    // Apply staged schedule changes of every zone at once
+    void commit(void) {
+      _schedule.commit(getLocalDay());
     }
 
-    uint8_t getDripPeriodHours(void) {
-      return _period;
+    // Rain delay is saved right away and survives reboot
+    void setRainDelay(uint8_t hours) {
+      _rainDelay.hours = hours;
+      _rainDelay.resumeTime = TimeUtils::getCurrentTimeRaw() + hours * 3600; 
+      _journal.write(CONFIG_RAIN_DELAY, _rainDelay);
     }
-    
-    void setStartDripTime(char *startTime) {
-        //Start time should be in the format HH:MM:SS
-        strcpy(_startTime, startTime);
-        strptime(startTime, "%T", &_start);
+
+    void resetRainDelay() {
+      _rainDelay.hours = 0;
+      _rainDelay.resumeTime = TimeUtils::getCurrentTimeRaw() - 1; // No rain delay 
+      _journal.write(CONFIG_RAIN_DELAY, _rainDelay);
     }
 
-    void setDripPeriodHours(uint8_t hours) {
-      _period = hours;
+    bool isRainDelaySet() {
+      return _rainDelay.hours > 0 && TimeUtils::getCurrentTimeRaw() < _rainDelay.resumeTime;  
     }
 
-    void setDripTimeMinutes(uint8_t minutes) {
-      _duration = minutes;
+    time_t getRainDelayResumeTime(void) {
+      return _rainDelay.resumeTime;
     }
 
-    void setRainDelay(uint8_t hours) {
-      _rainDelayHours = hours;
-      _rainDelayResumeTime = TimeUtils::getCurrentTimeRaw() + hours * 3600; 
+    // Save the outcome of a drip and the lifetime meter reading. meterLiters is the
+    // reading of the flow meter since boot.
+    void recordDrip(const DripRecord &drip, uint32_t meterLiters) {
+      _journal.write(CONFIG_LAST_DRIP, drip);
+      _journal.write(CONFIG_LIFETIME_LITERS, getLifetimeLiters(meterLiters));
     }
 
-    void resetRainDelay() {
-      _rainDelayHours = 0;
-      _rainDelayResumeTime = TimeUtils::getCurrentTimeRaw() - 1; // No rain delay 
+    uint32_t getLifetimeLiters(uint32_t meterLiters) {
+      return _lifetimeLiters + meterLiters;
     }
 
-    bool isRainDelaySet() {
-      return _rainDelayHours > 0;  
+    // Save schedules and run mode. Only fields that changed since the last save are
+    // appended to the journal.
+    void save() {
+      LOG_INFO("[DRIPCTR]: Saving Scheduling Data");
+      bool saved = _journal.write(CONFIG_RUN_MODE, _zones.getMaxConcurrent());
+      for (uint8_t zone = 0; zone < _zones.getCount(); zone++) {
+        saved = _journal.write(CONFIG_ZONE_SCHEDULE + zone, _schedule.get(zone)) && saved;
+      }
+      if (saved) {
+        LOG_INFO("[DRIPCTR]: Finished Saving Scheduling Data. %u bytes free in journal", _journal.getFreeBytes());
+      } else {
+        LOG_WARN("[DRIPCTR]: Failed Saving Scheduling Data. %u bytes free in journal", _journal.getFreeBytes());
+      }
+    }
+    // Restored schedules are staged. Call commit() to apply them. The first boot after
+    // an upgrade migrates the EEPROM image to the journal.
+    void restore() {
+      LOG_INFO("[DRIPCTR]: Restoring Scheduling Data");
+      if (!_journal.begin()) {
+        LOG_INFO("[DRIPCTR]: No configuration journal. Migrating EEPROM image");
+        EEPROM.begin(512);
+        restoreFromEEPROM();
+        EEPROM.end();
+        commit();
+        save();
+        return;
+      }
+      uint8_t maxConcurrent;
+      if (_journal.read(CONFIG_RUN_MODE, maxConcurrent)) {
+        restoreMaxConcurrent(maxConcurrent);
+      }
+      for (uint8_t zone = 0; zone < _zones.getCount(); zone++) {
+        // Schedules saved before volume drips end before the liters field
+        ZoneSchedule spec;
+        memset(&spec, 0, sizeof(spec));
+        size_t length = _journal.read(CONFIG_ZONE_SCHEDULE + zone, &spec, sizeof(spec));
+        if (length != sizeof(spec) && length != offsetof(ZoneSchedule, liters)) {
+          continue;
+        }
+        if (isValid(spec)) {
+          _schedule.edit(zone) = spec;
+          LOG_INFO("[DRIPCTR]: Zone %d scheduling data restored", zone);
+        } else {
+          LOG_WARN("[DRIPCTR]: Journal contains invalid schedule for zone %d", zone);
+        }
+      }
+      _journal.read(CONFIG_RAIN_DELAY, _rainDelay);
+      _journal.read(CONFIG_LIFETIME_LITERS, _lifetimeLiters);
+      DripRecord drip;
+      if (_journal.read(CONFIG_LAST_DRIP, drip)) {
+        LOG_INFO("[DRIPCTR]: Last drip: zone %d at %ld for %u seconds, %u liters, outcome %d",
+          drip.zone, drip.start, drip.seconds, drip.liters, (int) drip.outcome);
+      }
     }
+  private:
+    static const uint8_t EEPROM_LAYOUT = 0x01;
+    struct RainDelay {
+      time_t resumeTime;
+      uint8_t hours;
+    };
 
-    time_t getRainDelayResumeTime(void) {
-      return _rainDelayResumeTime;
-    }
-
-    const char * toString() {
-      sprintf(_auxBuffer, "Start Time: %s, Duration: %d minutes, period: %d hours, Rain Delay: %d hours", 
-        _startTime, _duration, _period, _rainDelayHours);
-      return _auxBuffer;
-    }
-
-    void saveToEEPROM() {
-      Serial.println("[DRIPCTR]: Saving Scheduling Data to EEPROM");
-      // EPROM Struct
-      // Byte 0: Valid Data 00, Invalid Data FF
-      // Byte 1: Start time hour 0-23
-      // Byte 2: Start time minute 0-59
-      // Byte 3: Start time second 0-59
-      // Byte 4: Drip Period 0,6,12,24
-      // Byte 5: Dripping Duration Minutes 0-255
-      // Rain delay will not be save and will not survive reboot.
-      uint8_t addr = 0;
-      EEPROM.write(addr, 0x00); addr++;
-      EEPROM.write(addr, _start.tm_hour); addr++;
-      EEPROM.write(addr, _start.tm_min); addr++;
-      EEPROM.write(addr, _start.tm_sec); addr++;
-      EEPROM.write(addr, _period); addr++;
-      EEPROM.write(addr, _duration); addr++;
-      EEPROM.commit();
-      Serial.println("[DRIPCTR]: Finished Saving Scheduling Data to EEPROM");
+    static bool isValid(const ZoneSchedule &spec) {
+      if (spec.startCount > MAX_START_TIMES || spec.everyDays == 0 || spec.weekdays > ZoneSchedule::ALL_WEEKDAYS) {
+        return false;
+      }
+      for (uint8_t i = 0; i < spec.startCount; i++) {
+        if (spec.startSecond[i] >= 24 * 3600UL || (i > 0 && spec.startSecond[i] <= spec.startSecond[i - 1])) {
+          return false;
+        }
+      }
+      return true;
     }
+
+    // Image written by the EEPROM versions:
+    // Byte 0: Layout. 01 current, 00 single daily schedule per zone, FF never saved
+    // Byte 1: Maximum zones dripping at once
+    // Then for each zone:
+    //   Byte 0: Weekday mask. Bit 0 Sunday ... bit 6 Saturday
+    //   Byte 1: Drip every N days
+    //   Byte 2: Dripping Duration Minutes 0-255
+    //   Byte 3: Number of start times
+    //   Byte 4-5: Local day number every N days counts from
+    //   Byte 6 onwards: Start times (hour, minute, second) 
     void restoreFromEEPROM() {
-      Serial.println("[DRIPCTR]: Restoring Scheduling Data from EEPROM");
-      uint8_t addr = 0;
+      uint16_t addr = 0;
       byte value = EEPROM.read(addr); addr++;
       if (value == 0x00) {
-        // Valid data on EEPROM
+        restoreSingleScheduleFromEEPROM();
+        return;
+      }
+      if (value != EEPROM_LAYOUT) {
+        LOG_WARN("[DRIPCTR]: Scheduling Data on EEPROM is not valid. May be has never been saved");
+        return;
+      }
+      restoreMaxConcurrent(EEPROM.read(addr)); addr++;
+      for (uint8_t zone = 0; zone < _zones.getCount(); zone++) {
+        uint8_t weekdays = EEPROM.read(addr); addr++;
+        uint8_t everyDays = EEPROM.read(addr); addr++;
+        uint8_t duration = EEPROM.read(addr); addr++;
+        uint8_t count = EEPROM.read(addr); addr++;
+        uint16_t anchorDay = EEPROM.read(addr); addr++;
+        anchorDay |= EEPROM.read(addr) << 8; addr++;
+        ZoneSchedule spec;
+        spec.clear();
+        spec.weekdays = weekdays & ZoneSchedule::ALL_WEEKDAYS;
+        spec.everyDays = everyDays ? everyDays : 1;
+        spec.durationMinutes = duration;
+        spec.anchorDay = anchorDay;
+        bool valid = count <= MAX_START_TIMES;
+        for (uint8_t i = 0; i < MAX_START_TIMES; i++) {
+          uint8_t hour = EEPROM.read(addr); addr++;
+          uint8_t min = EEPROM.read(addr); addr++;
+          uint8_t sec = EEPROM.read(addr); addr++;
+          if (i < count) {
+            valid = valid && hour <= 23 && min <= 59 && sec <= 59 && spec.addStartTime(hour * 3600UL + min * 60 + sec);
+          }
+        }
+        if (valid) {
+          _schedule.edit(zone) = spec;
+          LOG_INFO("[DRIPCTR]: Zone %d scheduling data restored from EEPROM", zone);
+        } else {
+          LOG_WARN("[DRIPCTR]: EEPROM contains invalid schedule for zone %d", zone);
+        }
+      }
+    }
+
+    // Image written before schedules had several start times: bytes 1-5 hold start time,
+    // period and duration of zone 0, byte 6 the run mode, and bytes 1-5 of other zones follow
+    void restoreSingleScheduleFromEEPROM() {
+      uint16_t addr = 1;
+      for (uint8_t zone = 0; zone < _zones.getCount(); zone++) {
         uint8_t hour = EEPROM.read(addr); addr++;
         uint8_t min = EEPROM.read(addr); addr++;
         uint8_t sec = EEPROM.read(addr); addr++;
         uint8_t period = EEPROM.read(addr); addr++;
-        uint8_t duration = EEPROM.read(addr);
+        uint8_t duration = EEPROM.read(addr); addr++;
+        if (zone == 0) {
+          restoreMaxConcurrent(EEPROM.read(addr)); addr++;
+        }
         // Validate values
-        if (hour >= 0 && hour <= 23 && min >= 0 && min <= 59 && sec >= 0 && sec <= 59) {
-          // Valid start time
-          sprintf(_startTime, "%02u:%02u:%02u", hour, min, sec);
-          _start.tm_hour = hour;
-          _start.tm_min = min;
-          _start.tm_sec = sec;
-
-          if (period % 6 == 0 && period <= 24) {
-            // Valid period time
-            _period = period; 
-            _duration = duration;
-            Serial.println("[DRIPCTR]: Scheduling data restored from EEPROM");
-            Serial.printf("[DRIPCTR]: Schedule: %s\n", toString());
-          } else {
-            Serial.printf("[DRIPCTR]: EEPROM contains invalid period %02d\n", period);
-          }
+        if (hour <= 23 && min <= 59 && sec <= 59 && period % 6 == 0 && period <= 24) {
+          setZoneSchedule(zone, hour * 3600UL + min * 60 + sec, period, duration);
+          LOG_INFO("[DRIPCTR]: Zone %d scheduling data restored from EEPROM", zone);
         } else {
-          Serial.printf("[DRIPCTR]: EEPROM contains invalid start time %02d:%02d:%02d\n", hour, min, sec);
+          LOG_WARN("[DRIPCTR]: EEPROM contains invalid schedule %02d:%02d:%02d/%02d for zone %d", hour, min, sec, period, zone);
         }
-      } else {
-        Serial.println("[DRIPCTR]: Scheduling Data on EEPROM is not valid. May be has never been saved");
       }
     }
-  private:
-    char _auxBuffer[200];
-    char _startTime[100];
-    struct tm _start;
-    uint8_t _period;
-    uint8_t _duration;
-    uint8_t _rainDelayHours;
-    time_t _rainDelayResumeTime;
+
+    void restoreMaxConcurrent(uint8_t maxConcurrent) {
+      // Images written before zones existed have an erased byte here
+      if (maxConcurrent > 0 && maxConcurrent <= _zones.getCount()) {
+        _zones.setMaxConcurrent(maxConcurrent);
+      }
+    }
+
+    DripSchedule &_schedule;
+    ZoneTable &_zones;
+    ConfigJournal &_journal;
+    RainDelay _rainDelay;
+    uint32_t _lifetimeLiters;   // Lifetime meter reading at boot
 };
 
 
@@ -227,367 +513,1621 @@ class DripParams {
 // WiFi Manager
 WiFiManager wifiManager;
 
-// Intervals
-LongTicker dripTicker("DRIPTICK");   // Dripping Scheduling
-LongTicker wiFiConfig("WIFICONFIG"); // Wait for WiFi Configuration before resetting system
-Ticker lcdDisplayUpdate; // Update LCD text
+// Network bring-up, stepped from loop()
+enum class NetworkStage : uint8_t {
+  station,    // Waiting for the saved network
+  portal,     // Config portal open
+  up          // Connected, NTP and OTA started
+};
+NetworkStage networkStage = NetworkStage::station;
+uint32_t networkStageMs = 0;   // Start of the stage
+
+// Clock until NTP answers, and the state resumed after a reset
+struct BootState {
+  ZoneTable::Snapshot zones;
+  time_t zoneStart[MAX_ZONES];
+};
+// BootClock::encode() writes nothing when the record (a 12 byte header) does not fit
+static_assert(sizeof(BootState) + 12 <= BOOT_CHECKPOINT_SIZE, "Boot state larger than the RTC checkpoint");
+BootClock bootClock;
+volatile bool clockSynced = false;   // Set from the SNTP callback
+bool settingClock = false;           // The clock set by the firmware itself
+bool bootReported = false;
+
+// Timed events. Callbacks run from loop(), never from timer context
+EventScheduler events(TimeUtils::getCurrentTimeRaw);
+EventScheduler::Handle dripEvent = EventScheduler::NO_EVENT;  // Next start, stop or re-schedule
 
 // MQTT
+#if MQTT_TLS
+// TLS to the broker. The session of the last connection is kept, so reconnects resume it
+BearSSL::WiFiClientSecure espClient;
+BearSSL::Session tlsSession;
+MqttTls mqttTls;
+#ifdef MQTT_TLS_CA_CERT
+BearSSL::X509List tlsTrust(MQTT_TLS_CA_CERT);
+#endif
+#else
 WiFiClient espClient;
+#endif
 PubSubClient mqttClient(espClient);
+uint32_t mqttConnectMs = 0;   // Duration of the last attempt that connected
+MqttReconnect mqttReconnect(MQTT_RECONNECT_BASE_MS, MQTT_RECONNECT_MAX_MS, ESP.getChipId());
+
+// Topic names and fleet coordination
+struct FleetConfig {
+  uint16_t budget;                  // Deciliters per minute, 0 no coordination
+  uint8_t perDevice;                // Per-device topics
+  char group[FLEET_GROUP_SIZE];
+};
+FleetConfig fleetConfig;
+MqttTopics topics(MQTT_ROOT);
+FleetSlots fleet(ESP.getChipId(), FLEET_SETTLE_SECONDS);
 
 // Drip Valve and Flow Meter
 SolenoidValve solenoidValve(GPIO_VALVE_ENABLE, GPIO_VALVE_SIGNAL);
-FlowMeter flowMeter(GPIO_FLOW_METER_SIGNAL);
+FlowSensor flowMeter(GPIO_FLOW_METER_SIGNAL, FLOW_METER_PULSES_PER_LITER);
+// Flow rate from the time between pulses, accurate at drip flow rates
+PulseRate pulseRate(F_CPU, FLOW_GLITCH_CYCLES, FLOW_RATE_TIMEOUT_CYCLES);
+uint32_t pulseRateOverflows = 0;   // Dropped timestamps already logged
+uint32_t pulseRateGlitches = 0;    // Glitches already logged
+uint32_t flowMeterLiters = 0;   // Meter reading already attributed to zones
+uint32_t flowMeterPulses = 0;   // Pulse count already attributed to zones
+time_t zoneStartTime[ZONE_COUNT];  // Start of the current or last drip of each zone
+
+// Per-second flow profile, published in batches
+FlowSeries flowSeries;
+bool flowSeriesJson = false;
+uint32_t flowSeriesDropped = 0;   // Dropped samples already logged
+
+// MQTT command parser
+CommandParser commandParser(MQTT_COMMANDS, sizeof(MQTT_COMMANDS) / sizeof(MQTT_COMMANDS[0]), ZONE_COUNT);
+
+// Per-minute flow and drip sessions kept on flash
+FlowHistory flowHistory(LittleFS, FLOW_HISTORY_DIR);
+
+// What the controller is doing, published when it changes
+DripState dripState(ZONE_COUNT);
+
+// Sleep between timed events
+PowerManager powerManager(POWER_MAX_SLEEP_MS, POWER_MIN_SLEEP_MS);
+
+// Drip and alarm events waiting for the broker
+MqttOutbox outbox(LittleFS, OUTBOX_DIR, sizeof(OUTBOX_TOPICS) / sizeof(OUTBOX_TOPICS[0]));
+uint32_t outboxBatchMillis = 0;   // Start of the last batch
+bool outboxBacklog = false;       // More than a batch was waiting
+
+// Time spent in each stage of loop()
+uint32_t cycleCount(void) {
+  return ESP.getCycleCount();
+}
+LoopMetrics loopMetrics(LOOP_STAGE_COUNT, cycleCount, F_CPU / 1000000);
+time_t metricsSince = 0;
+
+// Log readers. The serial port gets every record, MQTT on request.
+LogRing::Cursor serialLog;
+char serialLine[LOG_LINE_SIZE];
+size_t serialLineLength = 0;
+size_t serialLineSent = 0;
+LogRing::Cursor mqttLog;
+uint8_t mqttLogMode = LOG_MQTT_OFF;
+
+// Inputs and outputs of the control logic
+InputTrace trace(ESP.getChipId());
+bool traceUploading = false;
+uint32_t traceUploadOffset = 0;   // Next chunk of TRACE_FILE to publish
+
+// Status page and JSON API on the local network
+HttpServer webServer(HTTP_PORT);
+time_t webHistoryFrom = 0;        // Range of the /api/history answer being sent
+time_t webHistoryTo = 0;
+
+// Leak, dry supply and burst line detection
+FlowMonitor flowMonitor(ZONE_COUNT);
+uint32_t flowSamplePulses = 0;  // Pulse count at the last per-second sample
+
+// Irrigation zones and their compiled schedule
+DripSchedule dripSchedule(ZONE_COUNT, localToUtc);
+ZoneTable zones(ZONE_COUNT, ZONE_OUTPUTS, dripSchedule);
+ZoneExpander zoneExpander(ZONE_EXPANDER_ADDRESS, ZONE_EXPANDER_ACTIVE_LOW);
 
 // Status LED
 StatusLED statusLed(GPIO_STATUS_LED); 
 
+// Persistent configuration
+EspFlashBackend configFlash(CONFIG_JOURNAL_SECTORS);
+ConfigJournal configJournal(configFlash);
+
 // Default Drip Parameters.
-DripParams dripParams(START_IRRIGATION_TIME, IRRIGATION_PERIOD_HOURS, IRRIGATION_LONG_MINUTES);
+DripParams dripParams(dripSchedule, zones, configJournal, START_IRRIGATION_TIME, IRRIGATION_PERIOD_HOURS, IRRIGATION_LONG_MINUTES);
 
 // Push Button
 PushButton pushButton(GPIO_PUSH_BUTTON, 2, 8);
 
 // Liquid Crystal Display
 LiquidCrystal_I2C lcd(0x27,16,2);
+LcdFrame lcdFrame;
 
 // First Line LCD
-char lcdLine[17] = "\0";
+char lcdLine[LCD_LINE_SIZE] = "\0";
 
 // Next Drip, dripping remaining, rain delay ramaining
 time_t toDisplay;
+// The first line shows the countdown to toDisplay
+bool lcdCountdown = false;
 
 /*------------------------------------------------------------------------------------*/
 /* WiFi Manager Global Functions                                                      */
 /*------------------------------------------------------------------------------------*/
-void reset() {
-  ESP.reset();
-}
 // WiFiManager Configuration CallBack
 void configModeCallback (WiFiManager *myWiFiManager) {
-  lcd.clear();
-  lcd.setCursor(0,0);
-  lcd.print("Config WiFi");
-  lcd.setCursor(0,1);
-  lcd.print(WiFi.softAPIP());
+  lcdFrame.print(0, "Config WiFi");
+  lcdFrame.print(1, WiFi.softAPIP().toString().c_str());
+  lcdFrame.flush(lcd);
   statusLed.setStatus(ANY_ERROR);
-  Serial.println("[WIFI]: Entered config mode");
-  Serial.print("[WIFI]:"); Serial.println(WiFi.softAPIP());
-  Serial.printf("[WIFI]: %s", (myWiFiManager->getConfigPortalSSID()).c_str());
-  // Sometimes the WiFiManager incorrectly enters config mode.
-  // Wait a couple of minutes and then reset ESP and try connected to WiFi again
-  wiFiConfig.once(WIFI_CONFIG_WAIT_TIME_MINUTES, reset);
+  LOG_INFO("[WIFI]: Entered config mode, portal %s at %s", myWiFiManager->getConfigPortalSSID().c_str(),
+    WiFi.softAPIP().toString().c_str());
+  // Sometimes the WiFiManager incorrectly enters config mode. The portal times out
+  // after WIFI_CONFIG_WAIT_TIME_MINUTES and bringUpNetwork() tries the saved network
+  // again. Irrigation runs meanwhile.
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Log Global Functions                                                               */
+/*------------------------------------------------------------------------------------*/
+// Write log records to the serial port, only as much as the UART FIFO takes right now
+void drainLog(void) {
+  while (true) {
+    if (serialLineSent == serialLineLength) {
+      serialLineLength = logRing.read(serialLog, serialLine, sizeof(serialLine));
+      serialLineSent = 0;
+      if (serialLineLength == 0) {
+        return;
+      }
+    }
+    size_t room = Serial.availableForWrite();
+    if (room == 0) {
+      return;
+    }
+    size_t count = serialLineLength - serialLineSent;
+    count = count < room ? count : room;
+    Serial.write((const uint8_t *) serialLine + serialLineSent, count);
+    serialLineSent += count;
+  }
+}
+
+// Write out every pending record, blocking. Used before a reset.
+void flushLog(void) {
+  Serial.write((const uint8_t *) serialLine + serialLineSent, serialLineLength - serialLineSent);
+  while ((serialLineLength = logRing.read(serialLog, serialLine, sizeof(serialLine))) > 0) {
+    Serial.write((const uint8_t *) serialLine, serialLineLength);
+  }
+  serialLineSent = serialLineLength = 0;
+  Serial.flush();
+}
+
+// Publish pending log records on request, as many lines as fit in one message
+void publishLog(void) {
+  if (mqttLogMode == LOG_MQTT_OFF || !mqttClient.connected()) {
+    return;
+  }
+  if (!logRing.available(mqttLog)) {
+    if (mqttLogMode == LOG_MQTT_FETCH) {
+      mqttLogMode = LOG_MQTT_OFF;
+    }
+    return;
+  }
+  char payload[LOG_MESSAGE_SIZE];
+  size_t len = 0;
+  size_t n;
+  // Lines are shorter than LOG_LINE_SIZE, so a line read always fits
+  while (sizeof(payload) - len >= LOG_LINE_SIZE && (n = logRing.read(mqttLog, payload + len, LOG_LINE_SIZE)) > 0) {
+    len += n;
+  }
+  HeapCheck::Scope io(true);
+  mqttClient.publish(topics.get(MqttTopics::log), (const uint8_t *) payload, len);
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Input Trace Global Functions                                                       */
+/*------------------------------------------------------------------------------------*/
+// Ring to TRACE_FILE through a small buffer, e.g. before an intentional reset
+bool saveTrace(void) {
+  uint8_t chunk[64];
+  size_t size = trace.size();
+  size_t offset = 0;
+  size_t n;
+  HeapCheck::Scope io(true);
+  File file = LittleFS.open(TRACE_FILE, "w");
+  if (!file) {
+    LOG_WARN("[TRACE]: Cannot write %s", TRACE_FILE);
+    return false;
+  }
+  while (offset < size && (n = trace.read(offset, chunk, sizeof(chunk))) > 0 && file.write(chunk, n) == n) {
+    offset += n;
+  }
+  file.close();
+  LOG_INFO("[TRACE]: Saved %u of %u bytes, %u records dropped so far", (unsigned) offset, (unsigned) size, trace.getDropped());
+  return offset == size;
+}
+
+// Publish TRACE_FILE on request, one chunk per loop() pass: the offset (4 bytes, little
+// endian), then the bytes. A chunk with no bytes ends the file.
+void publishTrace(void) {
+  if (!traceUploading || !mqttClient.connected()) {
+    return;
+  }
+  uint8_t payload[TRACE_MESSAGE_SIZE];
+  size_t len = 0;
+  memcpy(payload, &traceUploadOffset, sizeof(traceUploadOffset));
+  HeapCheck::Scope io(true);
+  File file = LittleFS.open(TRACE_FILE, "r");
+  if (file) {
+    if (file.seek(traceUploadOffset, SeekSet)) {
+      len = file.read(payload + sizeof(traceUploadOffset), sizeof(payload) - sizeof(traceUploadOffset));
+    }
+    file.close();
+  }
+  if (mqttClient.publish(topics.get(MqttTopics::trace), payload, sizeof(traceUploadOffset) + len)) {
+    traceUploadOffset += len;
+    traceUploading = len > 0;
+  }
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Time Zone                                                                          */
+/*------------------------------------------------------------------------------------*/
+// Rules for the schedule, and for the libc clock shown on the LCD
+bool setTimeZone(const char *posix) {
+  if (!timeZone.set(posix)) {
+    return false;
+  }
+  setenv("TZ", timeZone.get(), 1);
+  tzset();
+  return true;
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Power                                                                              */
+/*------------------------------------------------------------------------------------*/
+// Wi-Fi sleep type and LCD backlight of a power mode
+void setPowerMode(PowerManager::Mode mode) {
+  powerManager.setMode(mode);
+  if (mode == PowerManager::Mode::lightSleep) {
+    WiFi.setSleepMode(WIFI_LIGHT_SLEEP, POWER_LISTEN_INTERVAL);
+    lcd.noBacklight();   // The backlight alone draws more than the sleeping chip
+  } else {
+    WiFi.setSleepMode(mode == PowerManager::Mode::modemSleep ? WIFI_MODEM_SLEEP : WIFI_NONE_SLEEP);
+    lcd.backlight();
+  }
+}
+
+// End of a loop() pass: sleep until the next timed event if nothing waits to go out.
+// With auto light sleep the SDK halts the CPU while delay() idles.
+void powerIdle(void) {
+  bool connected = mqttClient.connected();
+  bool pending = lcdFrame.isDirty() || serialLineSent != serialLineLength || logRing.available(serialLog) ||
+    webServer.isBusy() || (connected && (outbox.size() || dripState.isChanged() || traceUploading ||
+      (mqttLogMode != LOG_MQTT_OFF && logRing.available(mqttLog))));
+  // A volume target is caught by the pulse interrupt, which must not wait for a wakeup
+  pending = pending || flowMeter.isThresholdArmed();
+  bool flowing = flowMeter.isFlowing() || zones.isAnyRunning();
+  uint32_t sleepMs = powerManager.plan(millis(), TimeUtils::getCurrentTimeRaw(), events.nextDeadline(), pending, flowing);
+  if (sleepMs == 0) {
+    return;
+  }
+  if (powerManager.getMode() == PowerManager::Mode::lightSleep) {
+    Serial.flush();   // The UART stops with the CPU
+    flowMeter.enableWakeup();
+    delay(sleepMs);
+    flowMeter.disableWakeup();
+  } else {
+    delay(sleepMs);
+  }
 }
 
 /*------------------------------------------------------------------------------------*/
 /* Other Global Functions                                                             */
 /*------------------------------------------------------------------------------------*/
-void scheduleDrip(bool manualStop);
 void scheduleDrip(void);
 
-void reportFlow() {
-  char payload[20];
-  sprintf(payload, "%d", flowMeter.getCountedLiters(true));
-  Serial.printf("[DRIPCTRL]: Reporting flow. Liters: %s\n", payload);
-  mqttClient.publish(MQTT_REPORT_FLOW, payload);
+// Publish an output of the control logic. Recorded in the trace, replay checks it.
+bool publishOutput(MqttTopics::Topic topic, const uint8_t *payload, size_t length, bool retained = false) {
+  const char *name = topics.get(topic);
+  if (!mqttClient.publish(name, payload, length, retained)) {
+    return false;
+  }
+  trace.publish(name, payload, length, retained);
+  return true;
 }
 
-void updateLcd(bool noTimeDisplay) {
-  char aux[50];
+bool publishOutput(MqttTopics::Topic topic, const char *payload, bool retained = false) {
+  return publishOutput(topic, (const uint8_t *) payload, strlen(payload), retained);
+}
+
+// Replace the pending drip event (if any) with a new one
+void setDripEvent(time_t when, EventScheduler::Callback callback) {
+  events.cancel(dripEvent);
+  dripEvent = events.at(when, callback);
+}
+
+// Queue an event for the broker. Delivered by flushOutbox() in order, also after an outage.
+void queueEvent(uint8_t topic, const char *payload) {
+  HeapCheck::Scope io(true);
+  if (!outbox.push(topic, TimeUtils::getCurrentTimeRaw(), payload)) {
+    LOG_WARN("[OUTBOX]: Dropped event on %s. Queued %u, dropped %u", topics.get(OUTBOX_TOPICS[topic]), outbox.size(),
+      outbox.getDropped());
+  }
+}
+
+// Deliver queued events: a batch every OUTBOX_PACE_MS, and only while the TCP send
+// buffer has room, so a backlog does not stall the loop or the connection.
+void flushOutbox(void) {
+  if (!outbox.size() || !mqttClient.connected() || millis() - outboxBatchMillis < OUTBOX_PACE_MS) {
+    return;
+  }
+  outboxBatchMillis = millis();
+  HeapCheck::Scope io(true);
+  outboxBacklog = outboxBacklog || outbox.size() > OUTBOX_BATCH;
+  for (uint8_t i = 0; i < OUTBOX_BATCH; i++) {
+    const MqttOutbox::Message *message = outbox.peek();
+    if (!message) {
+      break;
+    }
+    if (espClient.availableForWrite() < (size_t) message->length + OUTBOX_HEADER_SIZE ||
+        !publishOutput(OUTBOX_TOPICS[message->topic], (const uint8_t *) message->payload, message->length)) {
+      return;   // Retried with the next batch
+    }
+    outbox.pop();
+    if (!outbox.size() && outboxBacklog) {
+      outboxBacklog = false;
+      LOG_INFO("[OUTBOX]: Backlog delivered. Sent %u, spilled %u, dropped %u", outbox.getSent(), outbox.getSpilled(),
+        outbox.getDropped());
+    }
+  }
+}
+
+// Publish the state snapshot if it changed, once per loop() pass at most. Retained, so
+// consumers get it when they subscribe.
+void publishState(void) {
+  if (!dripState.isChanged() || !mqttClient.connected()) {
+    return;
+  }
+  char payload[STATE_MESSAGE_SIZE];
+  size_t len = dripState.encode(payload, sizeof(payload));
+  HeapCheck::Scope io(true);
+  if (len && !publishOutput(MqttTopics::state, (const uint8_t *) payload, len, true)) {
+    dripState.invalidate();
+  }
+}
+
+// Totals of a flow history range, as JSON. Flow is in liters, min and max are liters per
+// minute over the minutes with flow. Returns the length, 0 for a bad range.
+size_t writeFlowHistory(char *buffer, size_t size, time_t from, time_t to) {
+  FlowHistory::Totals totals;
+  HeapCheck::Scope io(true);
+  if (!flowHistory.query(from, to, totals)) {
+    return 0;
+  }
+  float pulsesPerLiter = flowMeter.getPulsesPerLiter();
+  int n = snprintf(buffer, size,
+    "{\"from\":%ld,\"to\":%ld,\"first\":%u,\"last\":%u,\"liters\":%.1f,\"minutes\":%u,\"min\":%.2f,\"max\":%.2f,"
+    "\"drips\":%u,\"dripSeconds\":%u,\"dripLiters\":%u}",
+    (long) from, (long) to, totals.first, totals.last, totals.pulses / pulsesPerLiter, totals.minutes,
+    totals.minPulses / pulsesPerLiter, totals.maxPulses / pulsesPerLiter,
+    totals.drips, totals.dripSeconds, totals.dripLiters);
+  return n > 0 && (size_t) n < size ? n : 0;
+}
+
+// Answer a flow history query with the totals of the range
+void publishFlowHistory(time_t from, time_t to) {
+  char payload[FLOW_HISTORY_MESSAGE_SIZE];
+  HeapCheck::Scope io(true);
+  if (!writeFlowHistory(payload, sizeof(payload), from, to)) {
+    publishOutput(MqttTopics::error, "bad range");
+    return;
+  }
+  publishOutput(MqttTopics::history, payload);
+}
+
+// Attribute water measured by the shared flow meter to the zones dripping now
+void accountFlow() {
+  uint32_t liters = flowMeter.getCountedLiters(false);
+  if (liters != flowMeterLiters) {
+    zones.attributeFlow(liters - flowMeterLiters);
+    flowMeterLiters = liters;
+  }
+  uint32_t pulses = flowMeter.getPulseCount();
+  if (pulses != flowMeterPulses) {
+    zones.attributePulses(pulses - flowMeterPulses);
+    flowMeterPulses = pulses;
+  }
+}
+
+// Arm the flow meter for the pulse count at which the first volume drip is complete
+void armVolumeTarget(void) {
+  uint32_t meterPulses;
+  if (zones.getPulsesToTarget(flowMeter.getPulsesPerLiter(), meterPulses)) {
+    flowMeter.setThreshold(flowMeterPulses + meterPulses);
+  } else {
+    flowMeter.clearThreshold();
+  }
+}
+
+void handleFlowAlarm(FlowMonitor::Alarm alarm);
+
+// Per-second flow sample
+void sampleFlow(void) {
+  uint32_t pulses = flowMeter.getPulseCount();
+  uint32_t delta = pulses - flowSamplePulses;
+  flowSamplePulses = pulses;
+  // Samples are stamped with the wall clock: none until it is set
+  if (bootClock.isSet()) {
+    flowSeries.sample(TimeUtils::getCurrentTimeRaw(), pulses);
+    HeapCheck::Scope io(true);
+    flowHistory.sample(TimeUtils::getCurrentTimeRaw(), delta);
+  }
+  FlowMonitor::Alarm alarm = flowMonitor.sample(delta > 0xFFFF ? 0xFFFF : delta, zones.getRunningMask());
+  if (alarm != FlowMonitor::Alarm::none) {
+    handleFlowAlarm(alarm);
+  }
+}
+
+// Publish the samples gathered since the last batch as one message. Batches with no
+// flow at all are dropped: consumers read missing seconds as zero. Samples stay in the
+// ring while the broker is unreachable.
+void publishFlowSeries(void) {
+  if (flowSeries.isIdle()) {
+    flowSeries.consume(flowSeries.size());
+    return;
+  }
+  uint8_t message[FLOW_SERIES_MESSAGE_SIZE];
+  uint16_t samples;
+  HeapCheck::Scope io(true);
+  while (flowSeries.size() && mqttClient.connected()) {
+    size_t len = flowSeries.encode(message, sizeof(message), flowSeriesJson, samples);
+    if (samples == 0 || !publishOutput(MqttTopics::flowSeries, message, len)) {
+      break;
+    }
+    flowSeries.consume(samples);
+  }
+  if (flowSeries.getDroppedSamples() != flowSeriesDropped) {
+    flowSeriesDropped = flowSeries.getDroppedSamples();
+    LOG_WARN("[FLOW]: %u flow samples dropped so far", flowSeriesDropped);
+  }
+  if (pulseRate.getOverflows() != pulseRateOverflows || pulseRate.getGlitches() != pulseRateGlitches) {
+    pulseRateOverflows = pulseRate.getOverflows();
+    pulseRateGlitches = pulseRate.getGlitches();
+    LOG_WARN("[FLOW]: %u pulse timestamps dropped, %u glitches so far", pulseRateOverflows, pulseRateGlitches);
+  }
+}
+
+// Publish the loop metrics gathered since the last call, and log a summary
+void publishMetrics(void) {
+  time_t now = TimeUtils::getCurrentTimeRaw();
+  uint32_t seconds = now - metricsSince;
+  metricsSince = now;
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint8_t fragmentation = ESP.getHeapFragmentation();
+  // Before encode(), which starts a new period
+  LOG_INFO("[METRICS]: %u passes/s, longest pass %u us (%s), heap %u free, %u%% fragmented",
+    loopMetrics.getPasses() / (seconds ? seconds : 1), loopMetrics.getStallMicros(),
+    LOOP_STAGE_NAMES[loopMetrics.getStallStage()], freeHeap, fragmentation);
+  uint8_t message[METRICS_MESSAGE_SIZE];
+  size_t len = loopMetrics.encode(message, sizeof(message), seconds, freeHeap, ESP.getMaxFreeBlockSize(), fragmentation);
+  if (len && mqttClient.connected()) {
+    HeapCheck::Scope io(true);
+    mqttClient.publish(topics.get(MqttTopics::metrics), message, len);
+  }
+  if (powerManager.getMode() != PowerManager::Mode::awake) {
+    LOG_INFO("[POWER]: Awake %u, modem sleep %u, light sleep %u per mille, about %u uA",
+      powerManager.getShare(PowerManager::Mode::awake), powerManager.getShare(PowerManager::Mode::modemSleep),
+      powerManager.getShare(PowerManager::Mode::lightSleep), powerManager.getAverageMicroamps());
+  }
+  powerManager.resetStats();
+  uint32_t allocations = HeapCheck::takeCount();
+  if (allocations) {
+    LOG_WARN("[HEAP]: %u allocations after setup, the last one %u bytes", allocations, (unsigned) HeapCheck::getLastSize());
+  }
+}
+
+uint32_t reportFlow(uint8_t zone) {
+  accountFlow();
+  uint32_t liters = zones.takeLiters(zone);
+  LOG_INFO("[DRIPCTRL]: Reporting flow. Zone %d liters: %u", zone, liters);
+  dripState.setLiters(zone, liters);
+  return liters;
+}
+
+// Save how the drip of a zone that just closed ended
+void recordDrip(uint8_t zone, uint32_t liters) {
+  time_t now = TimeUtils::getCurrentTimeRaw();
+  DripParams::DripRecord drip;
+  memset(&drip, 0, sizeof(drip));
+  drip.start = zoneStartTime[zone];
+  drip.seconds = now - zoneStartTime[zone];
+  drip.liters = liters;
+  drip.zone = zone;
+  if (zones.getFaultMask() & (1 << zone)) {
+    drip.outcome = DripParams::Outcome::alarm;
+  } else if (zones.isTargetReached(zone, flowMeter.getPulsesPerLiter())) {
+    drip.outcome = DripParams::Outcome::completed;
+  } else if (now >= zones.runUntil[zone]) {
+    drip.outcome = zones.targetLiters[zone] ? DripParams::Outcome::capped : DripParams::Outcome::completed;
+  } else {
+    drip.outcome = DripParams::Outcome::stopped;
+  }
+  dripParams.recordDrip(drip, flowMeterLiters);
+  HeapCheck::Scope io(true);
+  flowHistory.logDrip(now, zone, (uint8_t) drip.outcome, drip.seconds, liters);
+  char payload[MQTT_OUTBOX_PAYLOAD + 1];
+  const char *outcomes[] = { "completed", "stopped", "alarm", "capped" };
+  snprintf(payload, sizeof(payload), "{\"zone\":%u,\"start\":%ld,\"seconds\":%u,\"liters\":%u,\"outcome\":\"%s\"}",
+    zone, (long) drip.start, drip.seconds, liters, outcomes[(uint8_t) drip.outcome]);
+  queueEvent(OUTBOX_TOPIC_DRIP, payload);
+}
+
+// Compose the display in the frame. loop() writes the cells that changed.
+void renderLcd(void) {
+  char aux[LCD_LINE_SIZE];
   time_t now = TimeUtils::getCurrentTimeRaw();
-  Serial.printf("[DEBUG]: toDisplay: %ld\n", toDisplay);
   uint32_t remaining = toDisplay - now;
-  uint16_t minutes = remaining / 60;
-  uint8_t hours = 0;
-  Serial.printf("[DEBUG]: remaining: %d\n", remaining);
-  if (minutes > 59) {
-     hours = minutes / 60;
-     minutes = minutes % 60;
-  }
-  Serial.printf("[DEBUG]: hours: %02d, minutes: %02d\n", hours, minutes);
-  sprintf(aux, "%s %02d:%02d", lcdLine, hours, minutes);
-  lcd.clear();
-  lcd.setCursor(0,0);
-  lcd.print(noTimeDisplay ? lcdLine : aux);
-  lcd.setCursor(0,1);
-  lcd.print(TimeUtils::getTimeStr(now).c_str());
-  mqttClient.publish(MQTT_DRIP_SCHEDULE, noTimeDisplay ? lcdLine : aux);
-}
-
-void stopScheduledDrip(void) {
-  solenoidValve.closeValve();
-  mqttClient.publish(MQTT_DRIP_STOPPED, "");
-  reportFlow();
-  statusLed.setStatus(StatusLED::Status::stable);
-  scheduleDrip();
+  uint32_t hours = remaining / 3600;
+  uint32_t minutes = (remaining / 60) % 60;
+  // Cut at the display width
+  size_t len = snprintf(aux, sizeof(aux), "%s", lcdLine);
+  if (len < sizeof(aux) - 1) {
+    snprintf(aux + len, sizeof(aux) - len, " %02u:%02u", hours, minutes);
+  }
+  lcdFrame.print(0, lcdCountdown && bootClock.isSet() ? aux : lcdLine);
+  // Clock, and the flow rate while water flows
+  uint32_t second = timeZone.getSecondOfDay(now);
+  len = snprintf(aux, sizeof(aux), "%02u:%02u:%02u", second / 3600, (second / 60) % 60, second % 60);
+  float litersPerMinute = flowMeter.isFlowing() ? pulseRate.getPulsesPerSecond(cycleCount()) * 60 / flowMeter.getPulsesPerLiter() : 0;
+  if (litersPerMinute > 0 && len < sizeof(aux) - 1) {
+    snprintf(aux + len, sizeof(aux) - len, litersPerMinute < 10 ? " %4.2fL/m" : " %4.1fL/m", litersPerMinute);
+  }
+  lcdFrame.print(1, aux);
 }
 
-void startScheduledDrip(void) {
-  solenoidValve.openValve();
-  mqttClient.publish(MQTT_DRIP_STARTED, "");
-  statusLed.setStatus(IRRIGATING);
-  sprintf(lcdLine,"Dripping");
-  // Current Time
-  time_t nowRaw = TimeUtils::getCurrentTimeRaw();
-  // Dripping duration
-  uint16_t duration = dripParams.getDripTimeSeconds();
-  toDisplay = nowRaw + duration;
-  dripTicker.once(duration / 60, stopScheduledDrip);
+void updateLcd(bool noTimeDisplay) {
+  lcdCountdown = !noTimeDisplay;
+  renderLcd();
+}
+
+// Periodic LCD refresh
+void refreshLcd(void) {
   updateLcd(false);
 }
 
-void scheduleDrip() {
-  scheduleDrip(false);
+// Clock and countdown. Only a few cells change each second.
+void tickLcd(void) {
+  renderLcd();
 }
 
-void scheduleDrip(bool manualStop) {
+// Open or close the output of a zone. Expander outputs change on zoneExpander.flush().
+void driveZone(uint8_t zone, bool open) {
+  if (ZONE_OUTPUTS[zone] == ZoneTable::ONBOARD_VALVE) {
+    if (open) {
+      solenoidValve.openValve();
+    } else {
+      solenoidValve.closeValve();
+    }
+  } else {
+    zoneExpander.set(ZONE_OUTPUTS[zone], open);
+  }
+  trace.valve(zone, open);
+}
+
+// Drive zone outputs after the zone table changed state. Closing first keeps the number
+// of open valves within the run mode limit at all times.
+void applyZoneTransitions(uint8_t opened, uint8_t closed) {
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (closed & (1 << zone)) {
+      LOG_INFO("[DRIPCTRL]: Stop drip on zone %d", zone);
+      driveZone(zone, false);
+      recordDrip(zone, reportFlow(zone));
+    }
+  }
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (opened & (1 << zone)) {
+      LOG_INFO("[DRIPCTRL]: Start drip on zone %d until %ld, %u liters", zone, zones.runUntil[zone], zones.targetLiters[zone]);
+      driveZone(zone, true);
+      zoneStartTime[zone] = TimeUtils::getCurrentTimeRaw();
+    }
+  }
+  zoneExpander.flush();
+  armVolumeTarget();
+  dripState.setValves(zones.getRunningMask());
+  if (zones.getFaultMask()) {
+    statusLed.setStatus(ANY_ERROR);
+  } else {
+    statusLed.setStatus(zones.isAnyRunning() ? IRRIGATING : StatusLED::Status::stable);
+  }
+}
+
+// Flow alarm: close the valves involved and report it. Zones with no flow or a burst
+// line skip their windows until the alarm is cleared.
+void handleFlowAlarm(FlowMonitor::Alarm alarm) {
+  char payload[ALARM_MESSAGE_SIZE];
+  uint8_t alarmZones = flowMonitor.getAlarmZones();
+  snprintf(payload, sizeof(payload), "%s:%02x", FlowMonitor::toString(alarm), alarmZones);
+  LOG_WARN("[FLOW]: Alarm %s", payload);
+  queueEvent(OUTBOX_TOPIC_ALARM, payload);
+  dripState.setAlarm(FlowMonitor::toString(alarm));
+  if (alarm == FlowMonitor::Alarm::leak) {
+    // Every valve should be closed already. Drive them closed again in case one is stuck.
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+      driveZone(zone, false);
+    }
+    zoneExpander.flush();
+    statusLed.setStatus(ANY_ERROR);
+    snprintf(lcdLine, sizeof(lcdLine), "Leak!");
+    updateLcd(true);
+    return;
+  }
+  accountFlow();
+  uint8_t stopped = 0;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (alarmZones & (1 << zone)) {
+      zones.setFault(zone);
+      if (zones.stop(zone)) {
+        stopped |= 1 << zone;
+      }
+    }
+  }
+  applyZoneTransitions(0, stopped);
+  scheduleDrip();
+  snprintf(lcdLine, sizeof(lcdLine), alarm == FlowMonitor::Alarm::burst ? "Burst!" : "No Flow!");
+  updateLcd(true);
+}
+
+// A volume drip got its water: close the zones done and open the ones waiting
+void closeFilledZones(void) {
+  accountFlow();
+  applyZoneTransitions(0, zones.closeReachedTargets(flowMeter.getPulsesPerLiter()));
+  scheduleDrip();
+}
+
+// Manual zone control. Call scheduleDrip() afterwards to re-arm the drip event.
+void startZone(uint8_t zone, uint32_t seconds, uint16_t liters) {
+  accountFlow();
+  zones.start(zone, TimeUtils::getCurrentTimeRaw(), seconds, liters);
+  applyZoneTransitions(1 << zone, 0);
+}
+
+void stopZone(uint8_t zone) {
+  accountFlow();
+  if (zones.stop(zone)) {
+    applyZoneTransitions(0, 1 << zone);
+  }
+}
+
+bool isFleetCoordinated(void) {
+  return topics.isPerDevice() && fleet.isEnabled();
+}
+
+// Publish the claim of this controller, or clear it. Retained, so controllers that
+// connect later see it.
+void publishClaim(void) {
+  if (!topics.isPerDevice() || !mqttClient.connected()) {
+    return;
+  }
+  char payload[FLEET_CLAIM_MESSAGE_SIZE];
+  size_t len = fleet.hasClaim() ? FleetSlots::encode(fleet.getClaim(), payload, sizeof(payload)) : 0;
+  HeapCheck::Scope io(true);
+  publishOutput(MqttTopics::claim, (const uint8_t *) payload, len, true);
+}
+
+// Compose the topics and set up coordination from the fleet settings. Reconnecting
+// resubscribes to the command topics.
+void applyFleetConfig(bool resubscribe) {
+  if (fleet.hasClaim()) {
+    fleet.release();
+    publishClaim();   // On the old topic
+  }
+  topics.begin(ESP.getChipId(), fleetConfig.perDevice, fleetConfig.group);
+  fleet.clear();
+  fleet.setBudget(fleetConfig.budget);
+  if (resubscribe && mqttClient.connected()) {
+    mqttClient.disconnect();
+  }
+}
+
+// Learned flow of a zone in deciliters per minute
+uint16_t getZoneFlow(uint8_t zone) {
+  if (flowMonitor.getBaselineSamples(zone) < FlowMonitor::DEFAULT_CONFIG.minSamples) {
+    return FLEET_DEFAULT_ZONE_FLOW;
+  }
+  return flowMonitor.getBaselineMean(zone) * 600 / flowMeter.getPulsesPerLiter() + 0.5f;
+}
+
+// Pending zones open once the slot of this controller started. Without a claim they
+// wait for coordinateFleet() to make one.
+time_t getFleetHold(void) {
+  if (!isFleetCoordinated()) {
+    return 0;
+  }
+  return fleet.hasClaim() ? fleet.getClaim().start : FLEET_NO_SLOT;
+}
+
+// Claim a slot for the zones waiting to drip, and give it back once they are done.
+// Returns the next time the zone pass must run.
+time_t coordinateFleet(time_t now, time_t next) {
+  uint8_t pending = zones.getPendingMask();
+  if (fleet.hasClaim() && (!isFleetCoordinated() || (!pending && !zones.isAnyRunning()))) {
+    LOG_INFO("[FLEET]: Slot released");
+    fleet.release();
+    publishClaim();
+  }
+  if (!pending || !isFleetCoordinated() || fleet.hasClaim()) {
+    return next;
+  }
+  // The zones waiting open up to maxConcurrent at once. Count each at the largest flow.
+  uint8_t count = 0;
+  uint32_t seconds = 0;
+  uint16_t flow = 0;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (pending & (1 << zone)) {
+      count++;
+      seconds += zones.runSeconds[zone];
+      uint16_t zoneFlow = getZoneFlow(zone);
+      flow = zoneFlow > flow ? zoneFlow : flow;
+    }
+  }
+  uint8_t atOnce = count < zones.getMaxConcurrent() ? count : zones.getMaxConcurrent();
+  const FleetSlots::Claim &claim = fleet.plan(now, (seconds + atOnce - 1) / atOnce, flow * atOnce);
+  LOG_INFO("[FLEET]: Slot claimed from %ld to %ld, %u dl/min", (long) claim.start, (long) claim.end, claim.flow);
+  publishClaim();
+  zones.hold(claim.start);
+  return claim.start < next ? claim.start : next;
+}
+
+// Claim of another controller of the group. An empty payload withdraws it.
+void handleClaim(uint32_t device, const byte *payload, unsigned int length) {
+  time_t now = TimeUtils::getCurrentTimeRaw();
+  FleetSlots::Claim claim;
+  memset(&claim, 0, sizeof(claim));
+  if (length && !FleetSlots::decode((const char *) payload, length, claim)) {
+    LOG_WARN("[FLEET]: Bad claim of %06x", device);
+    return;
+  }
+  claim.device = device;
+  if (!fleet.update(claim, now)) {
+    LOG_WARN("[FLEET]: More than %u controllers in the group", FLEET_MAX_PEERS);
+  }
+  if (isFleetCoordinated() && fleet.check(now)) {
+    LOG_INFO("[FLEET]: Slot moved to %ld for %06x", (long) fleet.getClaim().start, device);
+    publishClaim();
+    scheduleDrip();
+  }
+}
+
+// Apply staged schedule changes and recompute every zone's next window
+void rescheduleDrip() {
+  // Committed even without a clock, so the next save() writes the new schedules. The
+  // table compiled for a wrong day is compiled again by syncClock().
+  dripParams.commit();
+  if (!bootClock.isSchedulable()) {
+    return;   // syncClock() reschedules once NTP answers
+  }
+  zones.reschedule(TimeUtils::getCurrentTimeRaw());
+  scheduleDrip();
+}
+
+void scheduleDrip() {
   // Scheduler: 
-  //           Depending on the parameters, the result of the scheduling could be:
-  //           1. Start dripping. Schedule to stop
-  //              The current time is in between dripping scheduled periods
-  //           2. Schedule to start dripping
-  //              The current time is outside dripping scheduled periods but there is a dripping schedule for today
-  //           3. Schedule to reschedule
-  //              The current time is later than any schedule period for today, or there is a rain delay
-
-  Serial.printf("[DRIPCTRL] Scheduling: %s\n", dripParams.toString());
-  
+  //           Single pass over every zone. Depending on the zone schedules, the pass may:
+  //           1. Stop dripping on zones whose run time is over
+  //           2. Queue zones whose window is due in the compiled schedule (skipped while
+  //              a rain delay is in effect)
+  //           3. Start dripping on queued zones, as many as the run mode allows
+  //           The pass is then scheduled again for the earliest next start, stop or rain
+  //           delay end across all zones, or for local midnight to compile the new day.
+
+  if (!bootClock.isSchedulable()) {
+    return;
+  }
   // Current Time
   time_t nowRaw = TimeUtils::getCurrentTimeRaw();
-  // First schedule dripping for today
-  time_t dripStart = dripParams.getTodayStartTime();
-  // Dripping duration
-  uint16_t duration = dripParams.getDripTimeSeconds();
-  // Dripping time in seconds. If set to greatet than 0, then the result was #1. See above.
-  uint16_t dripTimeSeconds = 0;
-  // Time to next dripping in seconds. If set to greater than 0, then the result was #2. See above.
-  uint32_t timeToNextDripSeconds = 0;
-  // Time to next scheduling in minutes. If set to greater that 0, the the result was #3. See above.
-  uint16_t rescheduleTimeMinutes = 0;
-  // Second dripping of the day
-  time_t secondTime = dripStart + dripParams.getDripPeriodSeconds();
   // Rain delay: resume time
   time_t rainDelayResumeTime = dripParams.getRainDelayResumeTime();
-  
-  // Is there a rain delay in effect?
-  if (nowRaw < rainDelayResumeTime - 60) {
-    // Reschedule at rainDelayResumeTime
-    rescheduleTimeMinutes = (rainDelayResumeTime - nowRaw) / 60;
+  uint8_t opened, closed;
+
+  // Compile the schedule once per day
+  if (nowRaw >= dripSchedule.table().validUntil && dripSchedule.refresh(dripParams.getLocalDay())) {
+    zones.resync();
+  }
+  accountFlow();
+  zones.hold(getFleetHold());
+  time_t next = zones.run(nowRaw, rainDelayResumeTime, opened, closed);
+  applyZoneTransitions(opened, closed);
+  next = coordinateFleet(nowRaw, next);
+  setDripEvent(next, scheduleDrip);
+
+  uint8_t running = zones.getRunningMask();
+  DripState::Mode mode;
+  if (running) {
+    mode = DripState::Mode::dripping;
+    toDisplay = zones.getNextStop();
+    if (ZONE_COUNT > 1) {
+      uint8_t zone = 0;
+      while (!(running & (1 << zone))) {
+        zone++;
+      }
+      snprintf(lcdLine, sizeof(lcdLine), "Drip Z%d", zone);
+    } else {
+      snprintf(lcdLine, sizeof(lcdLine), "Dripping");
+    }
+  } else if (zones.getPendingMask()) {
+    // Waiting for the slot of this controller on the water main
+    mode = DripState::Mode::scheduled;
+    toDisplay = zones.getHold();
+    snprintf(lcdLine, sizeof(lcdLine), "Wait slot");
+  } else if (dripParams.isRainDelaySet()) {
+    LOG_DEBUG("[DRIPCTRL]: Within rain delay. Reschedule in %ld seconds", rainDelayResumeTime - nowRaw);
+    mode = DripState::Mode::rainDelay;
     toDisplay = rainDelayResumeTime;
-    Serial.printf("[DRIPCTRL]: Within rain delay. Reschedule in %d minutes\n", rescheduleTimeMinutes);
-  } else if (nowRaw < dripStart) {
-    // Too early to start dripping today
-    timeToNextDripSeconds = dripStart - nowRaw;
-    Serial.println("[DRIPCTRL]: Too early for first dripping");
-    toDisplay = dripStart;
-  } else if (nowRaw >= dripStart && nowRaw < (dripStart + duration) && !manualStop) {
-    // Within first dripping of the day
-    dripTimeSeconds = dripStart + duration - nowRaw + 1;  
-    toDisplay = dripStart + duration;
-  } else if ( nowRaw >= secondTime && nowRaw < (secondTime + duration) && !manualStop) {
-    // Within second dripping of the day
-    dripTimeSeconds = secondTime + duration - nowRaw + 1;
-    toDisplay = secondTime + duration;
-  } else if ( nowRaw < secondTime) {
-    // Too late for first dripping. Too early for next
-    Serial.println("[DRIPCTRL]: Too late for first, too early for second");
-    timeToNextDripSeconds = secondTime - nowRaw + 1;
-    toDisplay = secondTime;
-  } else {
-    // Too late for dripping today
-    Serial.println("[DRIPCTRL]: Not more dripping today. Reschedule at midnight");
-    rescheduleTimeMinutes = TimeUtils::minutesTillMidnight();
-    toDisplay = dripStart + 24 * 3600;
-  }
-  if (dripTimeSeconds > 0) {
-    // #1 Start dripping. Schedule to stop
-    dripTimeSeconds = dripTimeSeconds < 60 ? 60 : dripTimeSeconds;
-    Serial.printf("[DRIPCTRL]: Start Drip for %d seconds\n", dripTimeSeconds);
-    statusLed.setStatus(IRRIGATING);
-    solenoidValve.openValve();
-    mqttClient.publish(MQTT_DRIP_STARTED, "");
-    dripTicker.once((dripTimeSeconds / 60) + 1, stopScheduledDrip);
-    sprintf(lcdLine, "Dripping");
-  } else if (rescheduleTimeMinutes > 0) {
-    // #3 Too late for dripping today, or rain delay. Schedule to re-schedule
-    dripTicker.once(rescheduleTimeMinutes + 1, scheduleDrip);
-    sprintf(lcdLine, dripParams.isRainDelaySet() ? "Rain Delay" : "Done today");
+    snprintf(lcdLine, sizeof(lcdLine), "Rain Delay");
   } else {
-    // #2 Schedule to start dripping
-    Serial.printf("[DRIPCTRL]: Not time for dripping. %d seconds to next dripping.\n", timeToNextDripSeconds);
-    timeToNextDripSeconds = timeToNextDripSeconds < 60 ? 60 : timeToNextDripSeconds;
-    dripTicker.once((timeToNextDripSeconds / 60) + 1, startScheduledDrip);
-    sprintf(lcdLine, dripParams.isRainDelaySet() ? "Rain Delay" : "Scheduled");
+    toDisplay = zones.getNextStart();
+    LOG_DEBUG("[DRIPCTRL]: Not time for dripping. %ld seconds to next dripping.", toDisplay - nowRaw);
+    bool done = toDisplay == 0 || toDisplay >= dripSchedule.table().validUntil;
+    mode = done ? DripState::Mode::done : DripState::Mode::scheduled;
+    snprintf(lcdLine, sizeof(lcdLine), done ? "Done today" : "Scheduled");
   }
   updateLcd(false);
-  if (!dripParams.isRainDelaySet()) {
-    mqttClient.publish(MQTT_DRIP_RAIN_DELAY_ENDED, "");
-  }
+  dripState.setMode(mode);
+  dripState.setNextEvent(toDisplay);
+  dripState.setRainDelayUntil(dripParams.isRainDelaySet() ? rainDelayResumeTime : 0);
+  dripState.setFaults(zones.getFaultMask());
+  bootClock.markScheduled(millis());
 }
 
 /*------------------------------------------------------------------------------------*/
 /* MQTT Global Functions                                                              */
 /*------------------------------------------------------------------------------------*/
-// MQTT Subscribe Callback
-void callback(char* topic, byte* payload, uint8_t length) {
-  bool noTimeDisplay = false;
-  Serial.printf("[MQTT]: Message arrived [%s]\n", topic);
-  Serial.print("[MQTT]: Payload (");
-  for (uint8_t i=0; i < length; i++) {
-    Serial.print((char)payload[i]);
-  }
-  Serial.println(")");
-  char aux[40];
-  uint8_t rainDelay;
-  switch((char) payload[0]) {
+// Effects of applying a command, so a batch reschedules and saves at most once
+const uint8_t CHANGE_NONE = 0x00;
+const uint8_t CHANGE_STATE = 0x01;      // Zone or rain delay state changed: run the zone pass
+const uint8_t CHANGE_SCHEDULE = 0x02;   // Schedule staged: commit and reschedule
+const uint8_t CHANGE_SAVE = 0x04;       // Persistent settings changed
+const uint8_t CHANGE_RESET = 0x08;      // Restart once everything else is done
+const uint8_t CHANGE_FLEET = 0x10;      // Fleet settings changed: save and apply them
+const uint8_t CHANGE_TOPICS = 0x20;     // ... and resubscribe to the new command topics
+
+// Checks the values of a parsed command that its syntax cannot. Returns why it is
+// rejected, NULL if it can be applied.
+const char *checkCommand(const Command &command) {
+  switch (command.code) {
+    case MQTT_CMD_RUN_MODE:
+      return command.number(0, 1) == 0 || command.number(0, 1) > ZONE_COUNT ? "bad run mode" : NULL;
+    case MQTT_CMD_POWER:
+      return command.number(0, 1) >= PowerManager::MODE_COUNT ? "bad power mode" : NULL;
+    case MQTT_CMD_NAMESPACE:
+      return command.number(0, 1) > 1 ? "bad namespace" : NULL;
+    case MQTT_CMD_LOG:
+      return command.number(0, 1) > LOG_MQTT_STREAM ? "bad log mode" : NULL;
+    case MQTT_CMD_TRACE:
+      return command.number(0, 1) > TRACE_PUBLISH ? "bad trace mode" : NULL;
+    case MQTT_CMD_START_VOLUME:
+      return command.number(0, 4) == 0 ? "no volume" : NULL;
+    case MQTT_CMD_WINDOWS:
+      if (command.hex(0, 2) > ZoneSchedule::ALL_WEEKDAYS) {
+        return "bad weekdays";
+      }
+      return command.number(4, 3) > ZoneSchedule::MAX_DURATION ? "duration too long" : NULL;
+    case MQTT_CMD_FLOW_FORMAT:
+      return command.number(0, 1) > 1 ? "bad flow format" : NULL;
+    case MQTT_CMD_HISTORY:
+      // Ten digits go past 32 bits, where number() wraps. Same length, so compare the text.
+      if (memcmp(command.args, "4294967295", 10) > 0 || memcmp(command.args + 10, "4294967295", 10) > 0) {
+        return "time out of range";
+      }
+      return command.number(0, 10) > command.number(10, 10) ? "bad time range" : NULL;
+    case MQTT_CMD_TIME_ZONE:
+      {
+        char posix[TimeZone::MAX_LENGTH];
+        if (command.length >= sizeof(posix)) {
+          return "time zone too long";
+        }
+        memcpy(posix, command.args, command.length);
+        posix[command.length] = 0;
+        TimeZone parsed;
+        return parsed.set(posix) ? NULL : "bad time zone";
+      }
+    case MQTT_CMD_GROUP:
+      {
+        char group[FLEET_GROUP_SIZE];
+        if (command.length >= sizeof(group)) {
+          return "group too long";
+        }
+        memcpy(group, command.args, command.length);
+        group[command.length] = 0;
+        return MqttTopics::isValidGroup(group) ? NULL : "bad group";
+      }
+  }
+  return NULL;
+}
+
+// Applies a command that passed checkCommand()
+uint8_t applyCommand(const Command &command) {
+  uint8_t zone = command.zone;
+  uint8_t value;
+  switch (command.code) {
     case MQTT_CMD_CONFIG_DRIP: // Configutation in the format of HH:MM:SSMMHH where HH:MM:SS is start time, MM duration, and HH period
-      sprintf(aux, "%c%c", payload[9], payload[10]);
-      dripParams.setDripTimeMinutes(atoi(aux));
-      sprintf(aux, "%c%c", payload[11], payload[12]);
-      dripParams.setDripPeriodHours(atoi(aux));
-      sprintf(aux,"%c%c:%c%c:%c%c", payload[1], payload[2], payload[4], payload[5], payload[7], payload[8]);
-      dripParams.setStartDripTime(aux);
-      Serial.printf("[DRIPCTRL]: New Drip Configuration: StartTime(%s), Duration(%d minutes), Period(%d hours)\n", 
-        aux, dripParams.getDripTimeMinutes(), dripParams.getDripPeriodHours());
-
-      if (!solenoidValve.isValveOpen()) {
-          dripTicker.detach();
-          scheduleDrip();
-      }
-      dripParams.saveToEEPROM();
-      break;
-    case MQTT_CMD_RAIN_DELAY: // Rain delay in the format of HH which is hours to not drip
-      sprintf(aux, "%c%c", payload[1], (length <= 2 ? 0 : payload[2]));
-      rainDelay = atoi(aux);
-      if (rainDelay > 0) {
-        dripParams.setRainDelay(atoi(aux));
-        Serial.printf("[DRIPCTRL]: Rain delay set for %s hours\n", aux);
-        if (!solenoidValve.isValveOpen()) {
-            dripTicker.detach();
-            scheduleDrip();
+      dripParams.setZoneSchedule(zone, command.timeOfDay(0), command.number(10, 2), command.number(8, 2));
+      LOG_INFO("[DRIPCTRL]: New Drip Configuration: Zone(%d), Duration(%d minutes), Period(%d hours)", 
+        zone, command.number(8, 2), command.number(10, 2));
+      return CHANGE_SCHEDULE | CHANGE_SAVE;
+    case MQTT_CMD_WINDOWS: // Windows in the format of WWNNMMMHH:MM:SS[HH:MM:SS...] where WW is the weekday mask (hex),
+                           // NN drip every NN days, MMM duration and HH:MM:SS are up to MAX_START_TIMES start times
+      {
+        ZoneSchedule &spec = dripParams.editZoneSchedule(zone);
+        spec.clear();
+        spec.weekdays = command.hex(0, 2);
+        spec.everyDays = command.number(2, 2) ? command.number(2, 2) : 1;
+        spec.anchorDay = dripParams.getLocalDay();
+        spec.durationMinutes = command.number(4, 3);
+        for (uint8_t pos = 7; pos < command.length; pos += 8) {
+          spec.addStartTime(command.timeOfDay(pos));
         }
-        sprintf(lcdLine, "Rain Delay");
+      }
+      LOG_INFO("[DRIPCTRL]: New Drip Windows for zone %d", zone);
+      return CHANGE_SCHEDULE | CHANGE_SAVE;
+    case MQTT_CMD_VOLUME: // Volume per drip in the format of LLLL liters. The duration becomes a cap, 0 drips for the duration
+      dripParams.editZoneSchedule(zone).liters = command.number(0, 4);
+      LOG_INFO("[DRIPCTRL]: Zone %d drips %d liters", zone, command.number(0, 4));
+      return CHANGE_SCHEDULE | CHANGE_SAVE;
+    case MQTT_CMD_RUN_MODE: // Maximum number of zones dripping at once in the format of N
+      value = command.number(0, 1);
+      zones.setMaxConcurrent(value);
+      LOG_INFO("[DRIPCTRL]: Up to %d zones dripping at once", value);
+      return CHANGE_STATE | CHANGE_SAVE;
+    case MQTT_CMD_POWER: // Power mode in the format of N: 0 awake, 1 modem sleep, 2 light sleep
+      value = command.number(0, 1);
+      setPowerMode((PowerManager::Mode) value);
+      configJournal.write(CONFIG_POWER_MODE, (uint8_t) value);
+      LOG_INFO("[POWER]: Power mode %d", value);
+      return CHANGE_NONE;
+    case MQTT_CMD_TIME_ZONE: // Time zone in the format of a POSIX TZ rule (e.g. CET-1CEST,M3.5.0,M10.5.0/3)
+      {
+        char posix[TimeZone::MAX_LENGTH];
+        memcpy(posix, command.args, command.length);
+        posix[command.length] = 0;
+        setTimeZone(posix);
+        configJournal.write(CONFIG_TIME_ZONE, posix);
+        LOG_INFO("[DRIPCTRL]: Time zone %s", posix);
+      }
+      return CHANGE_SCHEDULE;
+    case MQTT_CMD_NAMESPACE: // Topic namespace in the format of N: 0 shared, 1 per device
+      value = command.number(0, 1);
+      fleetConfig.perDevice = value;
+      LOG_INFO("[FLEET]: %s topics", value ? "Per-device" : "Shared");
+      return CHANGE_FLEET | CHANGE_TOPICS | CHANGE_STATE;
+    case MQTT_CMD_GROUP: // Fleet group in the format of a name of letters, digits, '-' and '_'
+      {
+        char group[FLEET_GROUP_SIZE];
+        memcpy(group, command.args, command.length);
+        group[command.length] = 0;
+        memcpy(fleetConfig.group, group, sizeof(group));
+        LOG_INFO("[FLEET]: Group %s", group);
+      }
+      return CHANGE_FLEET | CHANGE_TOPICS | CHANGE_STATE;
+    case MQTT_CMD_BUDGET: // Flow budget of the group in the format of LLL liters per minute, 0 turns coordination off
+      fleetConfig.budget = command.number(0) * 10;
+      LOG_INFO("[FLEET]: Flow budget %d liters per minute", command.number(0));
+      return CHANGE_FLEET | CHANGE_STATE;
+    case MQTT_CMD_FLOW_FORMAT: // Flow series format in the format of N: 0 binary, 1 JSON
+      flowSeriesJson = command.number(0, 1) == 1;
+      LOG_INFO("[DRIPCTRL]: Flow series format: %s", flowSeriesJson ? "JSON" : "binary");
+      return CHANGE_NONE;
+    case MQTT_CMD_HISTORY: // Flow history totals in the format of FFFFFFFFFFTTTTTTTTTT, from and to in epoch seconds
+      publishFlowHistory(command.number(0, 10), command.number(10, 10));
+      return CHANGE_NONE;
+    case MQTT_CMD_LOG: // Log ring in the format of N: 0 stop streaming, 1 fetch, 2 fetch and stream
+      value = command.number(0, 1);
+      mqttLogMode = value;
+      logRing.oldest(mqttLog);
+      return CHANGE_NONE;
+    case MQTT_CMD_TRACE: // Input trace in the format of N: 0 stop, 1 restart, 2 save to flash, 3 save and publish
+      value = command.number(0, 1);
+      if (value == TRACE_STOP) {
+        LOG_INFO("[TRACE]: Recording stopped");
+        trace.stop();
+      } else if (value == TRACE_START) {
+        LOG_INFO("[TRACE]: Recording restarted");
+        trace.start();
+      } else {
+        traceUploading = saveTrace() && value == TRACE_PUBLISH;
+        traceUploadOffset = 0;
+      }
+      return CHANGE_NONE;
+    case MQTT_CMD_CLEAR_ALARM: // Clear flow alarms
+      LOG_INFO("[DRIPCTRL]: Clear flow alarms. Faulted zones %02x", zones.getFaultMask());
+      zones.clearFaults();
+      queueEvent(OUTBOX_TOPIC_ALARM, "none");
+      dripState.setAlarm("none");
+      return CHANGE_STATE;
+    case MQTT_CMD_RAIN_DELAY: // Rain delay in the format of HH which is hours to not drip
+      value = command.number(0);
+      if (value > 0) {
+        dripParams.setRainDelay(value);
+        LOG_INFO("[DRIPCTRL]: Rain delay set for %d hours", value);
       } else {
-        Serial.println("[DRIPCTRL]: Cancel rain delay");
-        dripTicker.detach();
+        LOG_INFO("[DRIPCTRL]: Cancel rain delay");
         dripParams.setRainDelay(0);
-        scheduleDrip();
       }
-      break;
+      return CHANGE_STATE;
     case MQTT_CMD_START_DRIP: // Start dripping in the format of MM which is the drip time in minutes
-      sprintf(aux, "%c%c", payload[1], payload[2]);
-      Serial.printf("[DRIPCTRL]: Start manual dripping for %s minutes\n", aux);
-      if (solenoidValve.isValveOpen()) {
-        Serial.println("[DRIPCTRL]: Already dripping. Ignore Command");
-        return;
+      LOG_INFO("[DRIPCTRL]: Start manual dripping on zone %d for %d minutes", zone, command.number(0));
+      if (zones.isRunning(zone)) {
+        LOG_INFO("[DRIPCTRL]: Already dripping. Ignore Command");
+        return CHANGE_NONE;
       }
-      dripTicker.detach();
-      solenoidValve.openValve();
-      mqttClient.publish(MQTT_DRIP_STARTED, "");
-      statusLed.setStatus(IRRIGATING);
-      dripTicker.once(atoi(aux), stopScheduledDrip);
-      toDisplay = TimeUtils::getCurrentTimeRaw() + atoi(aux) * 60;
-      sprintf(lcdLine, "Driping");
-      break;
+      startZone(zone, command.number(0) * 60UL, 0);
+      return CHANGE_STATE;
+    case MQTT_CMD_START_VOLUME: // Start dripping in the format of LLLLMM which is the volume in liters and the time cap in minutes
+      LOG_INFO("[DRIPCTRL]: Start manual dripping on zone %d of %d liters, at most %d minutes", zone, command.number(0, 4), command.number(4));
+      if (zones.isRunning(zone)) {
+        LOG_INFO("[DRIPCTRL]: Already dripping. Ignore Command");
+        return CHANGE_NONE;
+      }
+      startZone(zone, command.number(4) * 60UL, command.number(0, 4));
+      return CHANGE_STATE;
     case MQTT_CMD_STOP_DRIP: // Stop dripping
-      Serial.println("[DRIPCTRL]: Stop manual dripping");
-      if (!solenoidValve.isValveOpen()) {
-        Serial.println("[DRIPCTRL]: Not dripping now. Ignore Command");
-        return;
+      LOG_INFO("[DRIPCTRL]: Stop manual dripping on zone %d", zone);
+      if (!zones.isRunning(zone)) {
+        LOG_INFO("[DRIPCTRL]: Not dripping now. Ignore Command");
+        return CHANGE_NONE;
       }
-      dripTicker.detach();
-      solenoidValve.closeValve();
-      mqttClient.publish(MQTT_DRIP_STOPPED, "");
-      reportFlow();
-      statusLed.setStatus(StatusLED::Status::stable);
-      scheduleDrip(true);
-      break;
+      stopZone(zone);
+      return CHANGE_STATE;
     case MQTT_CMD_RESET: // Reset system
-      sprintf(lcdLine, "Reseting");
-      updateLcd(true);
-      Serial.println("[DRIPCTRL]: Reseting system...");
-      delay(5);
-      ESP.reset();
-      break;
-    default: 
-      Serial.printf("[MQTT]: Unknown MQTT Command: %c\n", (char) payload[0]);
-      break;
+      return CHANGE_RESET;
   }
-  updateLcd(noTimeDisplay);
+  return CHANGE_NONE;
 }
 
-// MQTT Client reconnection
+// Apply a command message, from the request topics or the web server. Returns false with
+// the reason in reply if it does not parse or a value is out of range: then nothing is
+// applied.
+bool runCommands(const byte *payload, unsigned int length, char *reply, size_t size) {
+  Command commands[MQTT_MAX_COMMANDS];
+  uint8_t count;
+  uint16_t errorOffset;
+  CommandParser::Error error = commandParser.parse(payload, length, commands, MQTT_MAX_COMMANDS, count, errorOffset);
+  if (error != CommandParser::Error::none) {
+    snprintf(reply, size, "%s at %u", CommandParser::toString(error), errorOffset);
+    return false;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    const char *reason = checkCommand(commands[i]);
+    if (reason) {
+      snprintf(reply, size, "%s in command %u", reason, i + 1);
+      return false;
+    }
+  }
+  // Apply every command, then reschedule and save once for the whole batch
+  uint8_t changes = CHANGE_NONE;
+  for (uint8_t i = 0; i < count; i++) {
+    changes |= applyCommand(commands[i]);
+  }
+  if (changes & CHANGE_FLEET) {
+    configJournal.write(CONFIG_FLEET, fleetConfig);
+    applyFleetConfig(changes & CHANGE_TOPICS);
+  }
+  if (changes & CHANGE_SCHEDULE) {
+    rescheduleDrip();
+  } else if (changes & CHANGE_STATE) {
+    scheduleDrip();
+  }
+  if (changes & CHANGE_SAVE) {
+    dripParams.save();
+  }
+  if (changes & CHANGE_RESET) {
+    snprintf(lcdLine, sizeof(lcdLine), "Reseting");
+    updateLcd(true);
+    lcdFrame.flush(lcd);
+    LOG_INFO("[DRIPCTRL]: Reseting system...");
+    saveTrace();
+    outbox.persist();
+    flushLog();
+    delay(5);
+    ESP.reset();
+  }
+  updateLcd(false);
+  return true;
+}
+
+// MQTT Subscribe Callback
+void callback(char* topic, byte* payload, unsigned int length) {
+  // Called from the MQTT client, back in firmware code
+  HeapCheck::Scope checked(false);
+  LOG_DEBUG("[MQTT]: Message arrived [%s] (%s)", topic, LogRing::Chars{(const char *) payload, length});
+  trace.message(topic, payload, length);
+  uint32_t device;
+  if (topics.parseClaim(topic, device)) {
+    handleClaim(device, payload, length);
+    return;
+  }
+  char reply[ERROR_MESSAGE_SIZE];
+  if (!runCommands(payload, length, reply, sizeof(reply))) {
+    LOG_WARN("[MQTT]: Rejected command: %s", reply);
+    HeapCheck::Scope io(true);
+    publishOutput(MqttTopics::error, reply);
+  }
+}
+
+#if MQTT_TLS
+// Pin the broker, by the CA that signed its certificate or by the certificate's SHA-1
+// fingerprint, from secret.h. A CA check needs the clock, which the boot checkpoint sets
+// before NTP answers. A fingerprint does not, but changes with every new certificate.
+void setupTls(void) {
+#if defined(MQTT_TLS_CA_CERT)
+  espClient.setTrustAnchors(&tlsTrust);
+#elif defined(MQTT_TLS_FINGERPRINT)
+  espClient.setFingerprint(MQTT_TLS_FINGERPRINT);
+#else
+#error "MQTT_TLS needs MQTT_TLS_CA_CERT or MQTT_TLS_FINGERPRINT in secret.h"
+#endif
+  espClient.setSession(&tlsSession);
+  // BearSSL runs on a stack of its own, taken from the heap while a connection is open.
+  // Holding it for good spares every reconnect the allocation.
+  stack_thunk_add_ref();
+}
+#endif
+
+// One connection attempt: TCP, the TLS handshake when enabled, then MQTT CONNECT
+bool connectBroker(const char *clientId) {
+#if MQTT_TLS
+  if (mqttTls.isProbeDue()) {
+    // Costs a connection of its own, so only until the broker answered
+    bool negotiated = BearSSL::WiFiClientSecure::probeMaxFragmentLength(MQTT_BROKER_ADDRESS, MQTT_PORT,
+      MQTT_TLS_FRAGMENT_SIZE);
+    mqttTls.probed(negotiated);
+    LOG_INFO("[MQTT]: TLS records of %u bytes %s", MQTT_TLS_FRAGMENT_SIZE, negotiated ? "negotiated" : "refused");
+  }
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (!mqttTls.fits(freeHeap, ESP.getMaxFreeBlockSize())) {
+    LOG_WARN("[MQTT]: TLS needs %lu bytes of heap, %lu free, largest block %lu", (unsigned long) mqttTls.getHeapNeeded(),
+      (unsigned long) freeHeap, (unsigned long) ESP.getMaxFreeBlockSize());
+    return false;
+  }
+  espClient.setBufferSizes(mqttTls.getReceiveSize(), mqttTls.getSendSize());
+  // A resumed handshake leaves the session as it was, a full one replaces it
+  BearSSL::Session previous = tlsSession;
+  bool hadSession = mqttTls.hasSession();
+  mqttTls.attemptStarted(millis(), freeHeap);
+  bool connected = mqttClient.connect(clientId, MQTT_USERNAME, MQTT_PASSWORD);
+  bool resumed = connected && hadSession && !memcmp(&previous, &tlsSession, sizeof(previous));
+  // Failed unless connected
+  if (mqttTls.attemptEnded(millis(), ESP.getFreeHeap(), connected, resumed) != MqttTls::Handshake::failed) {
+    LOG_INFO("[MQTT]: TLS %s handshake, %lu bytes of heap held", resumed ? "resumed" : "full",
+      (unsigned long) mqttTls.getLastHeap());
+  }
+  return connected;
+#else
+  return mqttClient.connect(clientId, MQTT_USERNAME, MQTT_PASSWORD);
+#endif
+}
+
+// MQTT Client reconnection. Called on every loop() pass, makes at most one bounded
+// connection attempt and returns, so valve, button and flow handling keep running
+// while the broker is unreachable.
 void reconnect() {
-  // Loop until we're reconnected
-  while (!mqttClient.connected()) {
-    Serial.println("[MQTT]: Attempting MQTT connection...");
-    // Create a random client ID
-    String clientId = MQTT_CLIENT_PREFIX;
-    clientId += String(random(0xffff), HEX);
-    // Attempt to connect
-    if (mqttClient.connect(clientId.c_str(), MQTT_USERNAME, MQTT_PASSWORD)) {
-      Serial.println("[MQTT]: Connected");
-      // ... and resubscribe
-      mqttClient.subscribe(MQTT_IN_TOPIC);
-    } else {
-      Serial.printf("[MQTT]: Failed, rc= %d, try again in 5 seconds\n", mqttClient.state());
-      // Visual Indication
-      sprintf(lcdLine, "MQTT Error: %d",mqttClient.state());
-      updateLcd(true);
-      statusLed.setStatus(ANY_ERROR);
-      // Wait 5 seconds before retrying
-      delay(5000);
+  if (!mqttReconnect.run(millis(), mqttClient.connected())) {
+    return;
+  }
+  if (WiFi.status() != WL_CONNECTED) {
+    // No point in trying while the station is down. Back off like a failed attempt.
+    mqttReconnect.attemptFailed(millis());
+    return;
+  }
+  LOG_INFO("[MQTT]: Attempting MQTT connection (attempt %d)...", mqttReconnect.getFailedAttempts() + 1);
+  // Client ID from the chip id. The broker drops the session a restarted controller left.
+  char clientId[MQTT_CLIENT_ID_SIZE];
+  snprintf(clientId, sizeof(clientId), "%s%06lx", MQTT_CLIENT_PREFIX, (unsigned long) ESP.getChipId());
+  // Attempt to connect
+  HeapCheck::Scope io(true);
+  uint32_t startMs = millis();
+  bool connected = connectBroker(clientId);
+  trace.link(InputTrace::Kind::broker, connected);
+  if (connected) {
+    mqttConnectMs = millis() - startMs;
+    LOG_INFO("[MQTT]: Connected in %lu ms", (unsigned long) mqttConnectMs);
+    mqttReconnect.attemptSucceeded();
+    // ... and resubscribe
+    mqttClient.subscribe(topics.get(MqttTopics::request));
+    if (topics.isPerDevice()) {
+      mqttClient.subscribe(topics.get(MqttTopics::groupRequest));
+      mqttClient.subscribe(topics.get(MqttTopics::allRequest));
+      mqttClient.subscribe(topics.get(MqttTopics::claims));
+      publishClaim();   // Replaces the claim of an earlier session
+    }
+    dripState.invalidate();
+    statusLed.setStatus(zones.isAnyRunning() ? IRRIGATING : StatusLED::Status::stable);
+  } else {
+    mqttReconnect.attemptFailed(millis());
+    LOG_WARN("[MQTT]: Failed, rc= %d, try again in %u ms", mqttClient.state(), mqttReconnect.getCurrentDelayMs());
+    // Visual Indication
+    snprintf(lcdLine, sizeof(lcdLine), "MQTT Error: %d", mqttClient.state());
+    updateLcd(true);
+    statusLed.setStatus(ANY_ERROR);
+  }
+}
+
+/*------------------------------------------------------------------------------------*/
+/* Web Server Global Functions                                                        */
+/*------------------------------------------------------------------------------------*/
+// Bodies of the JSON API, a part per call (see HttpServer::Writer). They run from
+// webServer.run(), back in firmware code.
+
+// GET /api/state: the snapshot published on the state topic
+size_t writeState(char *buffer, size_t size, uint16_t part) {
+  HeapCheck::Scope checked(false);
+  return part ? 0 : dripState.write(buffer, size);
+}
+
+// GET /api/schedule: the schedule and state of a zone per part
+size_t writeSchedule(char *buffer, size_t size, uint16_t part) {
+  static const char *STATES[] = { "idle", "pending", "running" };
+  HeapCheck::Scope checked(false);
+  if (part >= ZONE_COUNT) {
+    return part == ZONE_COUNT ? snprintf(buffer, size, "]}") : 0;
+  }
+  const ZoneSchedule &schedule = dripSchedule.get(part);
+  bool running = zones.isRunning(part);
+  int n = part ? snprintf(buffer, size, ",") : snprintf(buffer, size, "{\"maxConcurrent\":%u,\"zones\":[",
+    zones.getMaxConcurrent());
+  if (n < 0 || (size_t) n >= size) {
+    return 0;
+  }
+  size_t len = n;
+  n = snprintf(buffer + len, size - len,
+    "{\"zone\":%u,\"state\":\"%s\",\"until\":%ld,\"weekdays\":%u,\"every\":%u,\"minutes\":%u,\"liters\":%u,\"starts\":[",
+    part, STATES[(uint8_t) zones.state[part]], running ? (long) zones.runUntil[part] : 0L, schedule.weekdays,
+    schedule.everyDays, schedule.durationMinutes, schedule.liters);
+  if (n < 0 || len + n >= size) {
+    return 0;
+  }
+  len += n;
+  for (uint8_t i = 0; i < schedule.startCount; i++) {
+    uint32_t second = schedule.startSecond[i];
+    n = snprintf(buffer + len, size - len, i ? ",\"%02u:%02u:%02u\"" : "\"%02u:%02u:%02u\"", second / 3600,
+      second / 60 % 60, second % 60);
+    if (n < 0 || len + n >= size) {
+      return 0;
+    }
+    len += n;
+  }
+  n = snprintf(buffer + len, size - len, "]}");
+  if (n < 0 || len + n >= size) {
+    return 0;
+  }
+  return len + n;
+}
+
+// GET /api/history: totals of the range of the request
+size_t writeHistory(char *buffer, size_t size, uint16_t part) {
+  HeapCheck::Scope checked(false);
+  return part ? 0 : writeFlowHistory(buffer, size, webHistoryFrom, webHistoryTo);
+}
+
+// GET /api/metrics: loop figures since the last metrics message, then heap and links,
+// then the TLS figures
+size_t writeMetrics(char *buffer, size_t size, uint16_t part) {
+  HeapCheck::Scope checked(false);
+  int n;
+  if (part == 0) {
+    uint32_t seconds = TimeUtils::getCurrentTimeRaw() - metricsSince;
+    n = snprintf(buffer, size,
+      "{\"uptime\":%lu,\"clock\":\"%s\",\"mqtt\":%s,\"passesPerSecond\":%u,\"stallMicros\":%u,\"stallStage\":\"%s\"",
+      (unsigned long) (millis() / 1000), BootClock::toString(bootClock.getSource()),
+      mqttClient.connected() ? "true" : "false", loopMetrics.getPasses() / (seconds ? seconds : 1),
+      loopMetrics.getStallMicros(), LOOP_STAGE_NAMES[loopMetrics.getStallStage()]);
+  } else if (part == 1) {
+    n = snprintf(buffer, size,
+      ",\"connectMs\":%lu,\"heap\":%u,\"maxBlock\":%u,\"fragmentation\":%u,\"outbox\":%u,\"requests\":%u",
+      (unsigned long) mqttConnectMs, ESP.getFreeHeap(), ESP.getMaxFreeBlockSize(), ESP.getHeapFragmentation(),
+      outbox.size(), webServer.getRequests());
+  } else if (part == 2) {
+#if MQTT_TLS
+    n = snprintf(buffer, size, ",\"tls\":");
+    size_t length = mqttTls.write(buffer + n, size - n - 1);
+    if (!length) {
+      return 0;
     }
+    n += length;
+    buffer[n++] = '}';
+#else
+    n = snprintf(buffer, size, "}");
+#endif
+  } else {
+    return 0;
   }
+  return n > 0 && (size_t) n < size ? n : 0;
+}
+
+void handleState(HttpServer &server, const HttpServer::Request &request) {
+  server.sendJson(writeState);
+}
+
+void handleSchedule(HttpServer &server, const HttpServer::Request &request) {
+  server.sendJson(writeSchedule);
+}
+
+// from and to in epoch seconds, by default the last HTTP_HISTORY_SECONDS
+void handleHistory(HttpServer &server, const HttpServer::Request &request) {
+  long from, to;
+  webHistoryTo = HttpServer::getParam(request.query, "to", to) ? to : TimeUtils::getCurrentTimeRaw();
+  webHistoryFrom = HttpServer::getParam(request.query, "from", from) ? from : webHistoryTo - HTTP_HISTORY_SECONDS;
+  if (webHistoryTo < webHistoryFrom) {
+    server.sendText(400, "bad range");
+    return;
+  }
+  server.sendJson(writeHistory);
+}
+
+void handleMetrics(HttpServer &server, const HttpServer::Request &request) {
+  server.sendJson(writeMetrics);
+}
+
+// POST /api/command: a command message as on the request topic. Answers ok, or 400 with
+// the reason it was rejected, as published on the error topic.
+void handleCommand(HttpServer &server, const HttpServer::Request &request) {
+  HeapCheck::Scope checked(false);
+  LOG_DEBUG("[HTTP]: Command (%s)", LogRing::Chars{request.body, request.bodyLength});
+  trace.command((const uint8_t *) request.body, request.bodyLength);
+  char reply[ERROR_MESSAGE_SIZE];
+  if (!runCommands((const byte *) request.body, request.bodyLength, reply, sizeof(reply))) {
+    LOG_WARN("[HTTP]: Rejected command: %s", reply);
+    server.sendText(400, reply);
+    return;
+  }
+  server.sendText(200, "ok");
+}
+
+// The status page and its files are served from WEB_ASSETS (web/)
+const HttpServer::Route WEB_ROUTES[] = {
+  { HttpServer::Method::get,  "/api/state",    handleState },
+  { HttpServer::Method::get,  "/api/schedule", handleSchedule },
+  { HttpServer::Method::get,  "/api/history",  handleHistory },
+  { HttpServer::Method::get,  "/api/metrics",  handleMetrics },
+  { HttpServer::Method::post, "/api/command",  handleCommand },
+};
+
+/*------------------------------------------------------------------------------------*/
+/* Boot Global Functions                                                              */
+/*------------------------------------------------------------------------------------*/
+// Called by the core whenever the clock is set, from the SNTP context. Only take note.
+void onClockSet(void) {
+  if (!settingClock) {
+    clockSynced = true;
+  }
+}
+
+void setClock(time_t time) {
+  struct timeval tv = { time, 0 };
+  settingClock = true;
+  settimeofday(&tv, NULL);
+  settingClock = false;
+}
+
+// Time and zones to RTC memory. Kept through a reset or brownout, lost with the power.
+void checkpointRtc(void) {
+  // Not from a flash estimate: the next boot would resume the zones on it
+  if (!bootClock.isSchedulable()) {
+    return;
+  }
+  BootState state;
+  zones.save(state.zones);
+  memset(state.zoneStart, 0, sizeof(state.zoneStart));
+  memcpy(state.zoneStart, zoneStartTime, sizeof(zoneStartTime));
+  uint32_t words[BOOT_CHECKPOINT_SIZE / 4];
+  size_t count = BootClock::encode(TimeUtils::getCurrentTimeRaw(), &state, sizeof(state), words, BOOT_CHECKPOINT_SIZE / 4);
+  if (count) {
+    ESP.rtcUserMemoryWrite(BOOT_RTC_BLOCK, words, count * 4);
+  }
+}
+
+// Time to flash, for the boot after a power loss
+void checkpointFlash(void) {
+  if (bootClock.isSet()) {
+    configJournal.write(CONFIG_CLOCK, (uint32_t) TimeUtils::getCurrentTimeRaw());
+  }
+}
+
+// Set the clock from the newest checkpoint that survived and resume the zones, before
+// the network is up. Returns false if there is none: the schedule waits for NTP. So it
+// does after a power loss, when only the flash checkpoint survived: that estimate is
+// behind by the time the power was off and would open windows that are long over.
+bool resumeFromCheckpoint(void) {
+  uint32_t words[BOOT_CHECKPOINT_SIZE / 4];
+  BootState state;
+  time_t rtcTime = 0;
+  uint32_t flashTime = 0;
+  if (!ESP.rtcUserMemoryRead(BOOT_RTC_BLOCK, words, sizeof(words)) ||
+      !BootClock::decode(words, BOOT_CHECKPOINT_SIZE / 4, rtcTime, &state, sizeof(state))) {
+    rtcTime = 0;
+  }
+  configJournal.read(CONFIG_CLOCK, flashTime);
+  time_t estimate = bootClock.restore(rtcTime, flashTime, millis());
+  if (!estimate) {
+    LOG_INFO("[BOOT]: No clock checkpoint, waiting for NTP");
+    return false;
+  }
+  setClock(estimate);
+  LOG_INFO("[BOOT]: Clock set to %ld from the %s checkpoint", (long) estimate, BootClock::toString(bootClock.getSource()));
+  dripParams.commit();
+  if (bootClock.getSource() == BootClock::Source::rtc) {
+    // Zones open at the reset open again and keep what they measured
+    zones.restore(state.zones);
+    uint8_t running = zones.getRunningMask();
+    if (running) {
+      LOG_INFO("[BOOT]: Resuming zones %02x", running);
+      applyZoneTransitions(running, 0);
+    }
+    memcpy(zoneStartTime, state.zoneStart, sizeof(zoneStartTime));
+  } else {
+    LOG_INFO("[BOOT]: Power was lost, zones wait for NTP");
+    return false;
+  }
+  scheduleDrip();
+  return true;
+}
+
+// NTP answered. Timers move along with the clock and the zone pass runs on the right
+// time. Without an estimate close enough to schedule on, the schedule starts now.
+void syncClock(void) {
+  clockSynced = false;
+  time_t now = TimeUtils::getCurrentTimeRaw();
+  trace.clock(now);
+  bool wasSet = bootClock.isSet();
+  bool wasSchedulable = bootClock.isSchedulable();
+  bool first = !bootClock.isSynced();
+  int32_t step = bootClock.sync(now, millis());
+  if (step) {
+    events.shift(step);
+    metricsSince += step;
+    // Drips opened since the reset were stamped with the estimate
+    time_t resetTime = now - step - millis() / 1000;
+    for (uint8_t zone = 0; wasSet && zone < ZONE_COUNT; zone++) {
+      if (zoneStartTime[zone] >= resetTime) {
+        zoneStartTime[zone] += step;
+      }
+    }
+  }
+  if (!wasSet) {
+    LOG_INFO("[BOOT]: Clock set by NTP after %lu ms", (unsigned long) millis());
+  } else if (first) {
+    LOG_INFO("[BOOT]: NTP after %lu ms, the %s estimate was off by %ld s", (unsigned long) millis(),
+      BootClock::toString(bootClock.getBootSource()), (long) step);
+  } else if (step) {
+    LOG_INFO("[BOOT]: NTP stepped the clock by %ld s", (long) step);
+  }
+  if (!wasSchedulable) {
+    rescheduleDrip();
+  } else {
+    scheduleDrip();
+  }
+  if (first) {
+    checkpointFlash();
+  }
+}
+
+// Wi-Fi, then the services that need it. Nothing here blocks: irrigation runs from the
+// restored clock meanwhile.
+void startNetworkServices(void) {
+  HeapCheck::Scope io(true);
+  LOG_INFO("[WIFI]: Connected as %s after %lu ms", WiFi.localIP().toString().c_str(), (unsigned long) millis());
+  configTime(0, 0, "pool.ntp.org");
+  setTimeZone(timeZone.get());   // configTime() may have replaced the rule
+  ArduinoOTA.begin();
+  LOG_INFO("[OTA]: Ready");
+  webServer.begin(WEB_ROUTES, sizeof(WEB_ROUTES) / sizeof(WEB_ROUTES[0]), WEB_ASSETS, WEB_ASSET_COUNT);
+  LOG_INFO("[HTTP]: Listening on port %u", HTTP_PORT);
+  bootClock.markNetwork(millis());
+  networkStage = NetworkStage::up;
+}
+
+void bringUpNetwork(void) {
+  switch (networkStage) {
+    case NetworkStage::station:
+      if (WiFi.status() == WL_CONNECTED) {
+        startNetworkServices();
+      } else if (millis() - networkStageMs >= WIFI_CONNECT_WAIT_SECONDS * 1000UL) {
+        LOG_WARN("[WIFI]: Not connected after %u s, opening the config portal", WIFI_CONNECT_WAIT_SECONDS);
+        HeapCheck::Scope io(true);
+        wifiManager.startConfigPortal(ACCESS_POINT_NAME, ACCESS_POINT_PASS);
+        networkStage = NetworkStage::portal;
+        networkStageMs = millis();
+      }
+      break;
+    case NetworkStage::portal:
+      {
+        HeapCheck::Scope io(true);
+        if (wifiManager.process()) {
+          startNetworkServices();
+        } else if (!wifiManager.getConfigPortalActive()) {
+          LOG_WARN("[WIFI]: Config portal timed out, trying the saved network again");
+          networkStage = NetworkStage::station;
+          networkStageMs = millis();
+        }
+      }
+      break;
+    case NetworkStage::up:
+      break;
+  }
+}
+
+// Once per boot, retained: where the clock came from, how far off it was, and when the
+// schedule, the network and NTP were up
+void publishBootReport(void) {
+  if (bootReported || !bootClock.isSynced() || !mqttClient.connected()) {
+    return;
+  }
+  char payload[BOOT_MESSAGE_SIZE];
+  HeapCheck::Scope io(true);
+  snprintf(payload, sizeof(payload),
+    "{\"reason\":\"%s\",\"clock\":\"%s\",\"step\":%ld,\"scheduleMs\":%lu,\"networkMs\":%lu,\"ntpMs\":%lu}",
+    ESP.getResetReason().c_str(), BootClock::toString(bootClock.getBootSource()), (long) bootClock.getBootStep(),
+    (unsigned long) bootClock.getScheduledMs(), (unsigned long) bootClock.getNetworkMs(),
+    (unsigned long) bootClock.getSyncedMs());
+  bootReported = mqttClient.publish(topics.get(MqttTopics::boot), payload, true);
 }
 
 /*------------------------------------------------------------------------------------*/
 /* Other Helpers                                                                      */
 /*------------------------------------------------------------------------------------*/
 void onPushButtonPressedOnStart() {
-  Serial.println("[DRIPCTRL]: Button Pressed on Start. Delete Wi-Fi credentials and reset");
+  LOG_INFO("[DRIPCTRL]: Button Pressed on Start. Delete Wi-Fi credentials and reset");
   wifiManager.resetSettings();
+  outbox.persist();
+  flushLog();
   delay(10);
   ESP.reset();
 }
 void onPushButtonVeryShortlyPressed() {
-  bool noTimeDisplay = true;
-  Serial.println("[DRIPCTRL]: Button Pressed very shortly. Switch Solenoid Valve");
-  if (solenoidValve.isValveOpen()) {
-    statusLed.setStatus(StatusLED::Status::stable);
-    solenoidValve.closeValve();
-    mqttClient.publish(MQTT_DRIP_STOPPED, "");
-    reportFlow();
-    scheduleDrip(true);
-    noTimeDisplay = false;
+  LOG_INFO("[DRIPCTRL]: Button Pressed very shortly. Switch Solenoid Valve");
+  trace.button(1);
+  if (zones.isAnyRunning()) {
+    // Stop every zone dripping now
+    accountFlow();
+    applyZoneTransitions(0, zones.stopAll());
+    scheduleDrip();
   } else {
-    statusLed.setStatus(IRRIGATING);
-    solenoidValve.openValve();
-    mqttClient.publish(MQTT_DRIP_STARTED, "");
-    sprintf(lcdLine,"Dripping");
+    // Manual drip on the first zone for its configured duration and volume
+    uint8_t minutes = dripSchedule.get(0).durationMinutes;
+    minutes = minutes ? minutes : IRRIGATION_LONG_MINUTES;
+    startZone(0, minutes * 60, dripSchedule.get(0).liters);
+    scheduleDrip();
   }
-  updateLcd(noTimeDisplay);
 }
 void onPushButtonShortlyPressed() {
-  Serial.println("[DRIPCTRL]: Button Pressed shortly");
+  LOG_INFO("[DRIPCTRL]: Button Pressed shortly");
+  trace.button(2);
   if (dripParams.isRainDelaySet()) {
-    Serial.println("[DRIPCTRL]: Rain delay was set. Reset it.");
+    LOG_INFO("[DRIPCTRL]: Rain delay was set. Reset it.");
     dripParams.resetRainDelay();
     scheduleDrip();
   } else {
-    Serial.println("[DRIPCTRL]: Rain was not set. Set rain delay for 24hs");
+    LOG_INFO("[DRIPCTRL]: Rain was not set. Set rain delay for 24hs");
     dripParams.setRainDelay(24);
-    mqttClient.publish(MQTT_DRIP_RAIN_DELAY_SET, "24");
-    sprintf(lcdLine,"Rain Delay");
+    snprintf(lcdLine, sizeof(lcdLine), "Rain Delay");
     scheduleDrip();
   }
 }
 
 void onPushButtonLongPressed() {
-  Serial.println("[DRIPCTRL]: Button Pressed on Start. Reseting...");
-  sprintf(lcdLine, "Resetting");
+  LOG_INFO("[DRIPCTRL]: Button Pressed on Start. Reseting...");
+  trace.button(3);
+  snprintf(lcdLine, sizeof(lcdLine), "Resetting");
   updateLcd(true);
+  lcdFrame.flush(lcd);
+  saveTrace();
+  outbox.persist();
+  flushLog();
   delay(10);
   ESP.reset();
 }
@@ -598,102 +2138,200 @@ void onPushButtonLongPressed() {
 void setup() {
   // put your setup code here, to run once:
   Serial.begin(115200);
-  EEPROM.begin(512);
+  logRing.setClock(millis);
   lcd.init();
   lcd.backlight();
-  lcd.print("  Initializing");
-  lcd.setCursor(0,1);
-  lcd.print("  Drip Control");
+  lcdFrame.print(0, "  Initializing");
+  lcdFrame.print(1, "  Drip Control");
+  lcdFrame.flush(lcd);
 
   // Push button setup
   pushButton.setup(onPushButtonPressedOnStart, onPushButtonVeryShortlyPressed, onPushButtonShortlyPressed, onPushButtonLongPressed);
   
   // Start flow metering
+  flowMeter.setPulseRate(&pulseRate);
   flowMeter.start();
 
-  // Allow valve to know whether fluid is flowing
-  solenoidValve.setFlowMeter(&flowMeter);
-
-  // Allow flow meter to record potential flowing
-  lcd.setCursor(0,0);
-  lcd.print("   Checking   ");
-  lcd.setCursor(0,1);
-  lcd.print("     Valve    ");
-
-  delay(1000);
-
   // Initialize the system with the valve closed
   solenoidValve.run();
   solenoidValve.closeValve();
+  zoneExpander.begin();
+
+  // Flow history. The file system is formatted if it does not mount.
+  if (!LittleFS.begin() || !flowHistory.begin()) {
+    LOG_WARN("[FLOW]: Flow history not available");
+  }
+  // Events queued before the last reset go out first
+  outbox.begin();
+  if (outbox.size()) {
+    LOG_INFO("[OUTBOX]: %u events from before the reset", outbox.size());
+  }
 
   // Instantiate and setup WiFiManager
   // wifiManager.resetSettings(); Uncomment to reset wifi settings
+  // The connection is brought up by bringUpNetwork() from loop(), without blocking
   wifiManager.setAPCallback(configModeCallback);
-  if (!wifiManager.autoConnect(ACCESS_POINT_NAME, ACCESS_POINT_PASS)) {
-    Serial.println("Failed to connect and hit timeout");
-    ESP.reset();
-    delay(1000);  
-  }
+  wifiManager.setConfigPortalTimeout(WIFI_CONFIG_WAIT_TIME_MINUTES * 60);
+  wifiManager.setConfigPortalBlocking(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.begin();
+  networkStageMs = millis();
 
-  // Config time
-  setenv("TZ", "EST5EDT,M3.2.0/02:00:00,M11.1.0/02:00:00", 1);
-  configTime(0, 0, "pool.ntp.org");
+  // Config time. NTP is started once the network is up.
+  setTimeZone(TIME_ZONE_DEFAULT);
 
   // Initialize OTA (Over the air) update
   ArduinoOTA.setHostname(ACCESS_POINT_NAME);
   ArduinoOTA.setPassword(ACCESS_POINT_PASS);
 
   ArduinoOTA.onStart([]() {
-    Serial.println("[OTA]: Start");
+    LOG_INFO("[OTA]: Start");
   });
   ArduinoOTA.onEnd([]() {
-    Serial.println("[OTA]: End");
+    LOG_INFO("[OTA]: End");
   });
   ArduinoOTA.onProgress([](uint32_t progress, uint32_t total) {
-    Serial.printf("[OTA]: Progress: %u%%\r", (progress / (total / 100)));
+    // Every quarter, the ring would not hold a record per packet
+    static uint8_t logged = 0;
+    uint8_t quarter = total ? (uint64_t) progress * 4 / total : 0;
+    if (quarter != logged) {
+      logged = quarter;
+      LOG_INFO("[OTA]: Progress: %u%%", quarter * 25);
+    }
   });
   ArduinoOTA.onError([](ota_error_t error) {
-    Serial.printf("[OTA]: Error[%u]: ", error);
-    if (error == OTA_AUTH_ERROR) Serial.println("[OTA]: Auth Failed");
-    else if (error == OTA_BEGIN_ERROR) Serial.println("[OTA]: Begin Failed");
-    else if (error == OTA_CONNECT_ERROR) Serial.println("[OTA]: Connect Failed");
-    else if (error == OTA_RECEIVE_ERROR) Serial.println("[OTA]: Receive Failed");
-    else if (error == OTA_END_ERROR) Serial.println("[OTA]: End Failed");
+    LOG_ERROR("[OTA]: Error[%u]: %s Failed", (unsigned int) error, error == OTA_AUTH_ERROR ? "Auth" :
+      error == OTA_BEGIN_ERROR ? "Begin" : error == OTA_CONNECT_ERROR ? "Connect" :
+      error == OTA_RECEIVE_ERROR ? "Receive" : error == OTA_END_ERROR ? "End" : "Unknown");
   });
-  ArduinoOTA.begin();
-  Serial.println("[OTA]: Ready");
 
-  mqttClient.setServer(MQTT_BROKER_ADDRESS, 1883);
+  espClient.setTimeout(MQTT_CONNECT_TIMEOUT_MS);
+#if MQTT_TLS
+  setupTls();
+#endif
+  mqttClient.setServer(MQTT_BROKER_ADDRESS, MQTT_PORT);
+  mqttClient.setSocketTimeout(MQTT_SOCKET_TIMEOUT_SECONDS);
   mqttClient.setCallback(callback);
 
   statusLed.setStatus(StatusLED::Status::stable);
-  lcd.clear();
   updateLcd(true);
-  lcdDisplayUpdate.attach(LCD_DISPLAY_INTERVAL_SECONDS, updateLcd, false); 
-  dripParams.restoreFromEEPROM();
-  scheduleDrip();
+  events.every(LCD_DISPLAY_INTERVAL_SECONDS, refreshLcd);
+  events.every(LCD_TICK_SECONDS, tickLcd);
+  events.every(1, sampleFlow);
+  events.every(FLOW_SERIES_PUBLISH_SECONDS, publishFlowSeries);
+  events.every(METRICS_PUBLISH_SECONDS, publishMetrics);
+  events.every(BOOT_RTC_CHECKPOINT_SECONDS, checkpointRtc);
+  events.every(BOOT_FLASH_CHECKPOINT_SECONDS, checkpointFlash);
+  metricsSince = TimeUtils::getCurrentTimeRaw();
+  dripParams.restore();
+  uint8_t powerMode;
+  if (configJournal.read(CONFIG_POWER_MODE, powerMode) && powerMode < PowerManager::MODE_COUNT) {
+    setPowerMode((PowerManager::Mode) powerMode);
+  }
+  char posix[TimeZone::MAX_LENGTH];
+  if (configJournal.read(CONFIG_TIME_ZONE, posix)) {
+    posix[sizeof(posix) - 1] = 0;
+    if (!setTimeZone(posix)) {
+      LOG_WARN("[DRIPCTRL]: Journal contains invalid time zone");
+    }
+  }
+  memset(&fleetConfig, 0, sizeof(fleetConfig));
+  if (configJournal.read(CONFIG_FLEET, fleetConfig)) {
+    fleetConfig.group[sizeof(fleetConfig.group) - 1] = 0;
+  }
+  if (!MqttTopics::isValidGroup(fleetConfig.group)) {
+    strcpy(fleetConfig.group, FLEET_DEFAULT_GROUP);
+  }
+  applyFleetConfig(false);
+  settimeofday_cb(onClockSet);
+  if (!resumeFromCheckpoint()) {
+    snprintf(lcdLine, sizeof(lcdLine), "Waiting for NTP");
+    updateLcd(true);
+  }
+  // From here on the heap is left to the file system and the network stack
+  HeapCheck::arm();
 }
 
 /*------------------------------------------------------------------------------------*/
 /* Loop                                                                               */
 /*------------------------------------------------------------------------------------*/
 void loop() {
+  loopMetrics.beginPass();
+
   // OTA
-  ArduinoOTA.handle();
+  {
+    HeapCheck::Scope io(true);
+    ArduinoOTA.handle();
+  }
+  loopMetrics.mark(LOOP_STAGE_OTA);
   
   // Flow Meter
   flowMeter.run();
+  pulseRate.run(cycleCount());
+  trace.beginPass(millis(), flowMeter.getPulseCount());
+  trace.link(InputTrace::Kind::wifi, WiFi.status() == WL_CONNECTED);
+  trace.link(InputTrace::Kind::broker, mqttClient.connected());
+  accountFlow();
+  if (flowMeter.takeThresholdReached()) {
+    trace.syncPulses();
+    closeFilledZones();
+  }
+  loopMetrics.mark(LOOP_STAGE_FLOW);
 
-  // MQTT
-  if (!mqttClient.connected()) {
-    reconnect();
+  // Due timed events (drip start/stop, re-scheduling, LCD refresh). NTP first, it
+  // moves them.
+  if (clockSynced) {
+    syncClock();
+  }
+  time_t due = events.nextDeadline();
+  if (due && due <= events.now()) {
+    trace.syncPulses();   // Timed events look at the flow
+  }
+  events.run();
+  loopMetrics.mark(LOOP_STAGE_EVENTS);
+
+  // Network and MQTT. Non-blocking: at most one bounded connection attempt per pass
+  bringUpNetwork();
+  reconnect();
+  if (mqttClient.connected()) {
+    HeapCheck::Scope io(true);
+    mqttClient.loop();
   }
-  mqttClient.loop();
+  loopMetrics.mark(LOOP_STAGE_MQTT);
+
+  // Web server. Reads what arrived of a request, or writes what fits of a response
+  if (networkStage == NetworkStage::up) {
+    HeapCheck::Scope io(true);
+    webServer.run(millis());
+  }
+  loopMetrics.mark(LOOP_STAGE_HTTP);
 
   // Push Button
   pushButton.run();
+  loopMetrics.mark(LOOP_STAGE_BUTTON);
 
   // Solenoid Valve
   solenoidValve.run();
+  loopMetrics.mark(LOOP_STAGE_VALVE);
+
+  // LCD. A bounded number of changed cells per pass
+  lcdFrame.flush(lcd, LCD_CELLS_PER_PASS);
+  loopMetrics.mark(LOOP_STAGE_LCD);
+
+  // Log and trace. What the UART takes without blocking, one MQTT message each on request
+  drainLog();
+  publishLog();
+  publishTrace();
+  loopMetrics.mark(LOOP_STAGE_LOG);
+
+  // State. Transitions of the whole pass go out as one message. Then queued events.
+  publishState();
+  publishBootReport();
+  flushOutbox();
+  loopMetrics.mark(LOOP_STAGE_STATE);
+
+  loopMetrics.endPass();
 
+  // Sleep until the next timed event. Not part of the pass.
+  powerIdle();
 }
@@ -0,0 +1,275 @@
+// CommandParser on the host: pio test -e test -f test_command_parser
+//
+// Fuzzing feeds random and mutated payloads, each in a buffer of its exact length so
+// an address sanitizer build catches any read past it, and checks what the parser
+// promises: a rejected message yields no commands, an accepted one only commands of the
+// table whose arguments lie inside the payload and match their pattern.
+#include <unity.h>
+#include <CommandParser.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const uint8_t ZONES = 4;
+static const uint8_t MAX_COMMANDS = 8;
+
+// A copy of the firmware's table, enough of it to cover every token
+static const CommandParser::Syntax SYNTAX[] = {
+  { 'c', "TDDDD",   NULL, 0, true  },
+  { 'w', "XXDDDDD", "T",  4, true  },
+  { 's', "Ddd",     NULL, 0, true  },
+  { 'q', "DDDDDdd", NULL, 0, true  },
+  { 't', "",        NULL, 0, true  },
+  { 'r', "Dd",      NULL, 0, false },
+  { 'u', "S",       NULL, 0, false },
+  { 'h', "DDDDDDDDDDDDDDDDDDDD", NULL, 0, false },
+};
+static const uint8_t SYNTAX_COUNT = sizeof(SYNTAX) / sizeof(SYNTAX[0]);
+
+static const char *VALID[] = {
+  "c07:00:004512",
+  "c07:00:004512;r24",
+  "z1w7F0104506:00:0018:30:00",
+  "z3s10;z2q001520;t;r0",
+  "uCET-1CEST,M3.5.0,M10.5.0/3",
+  "h17672256001767312000",
+  "r24;",
+};
+
+static CommandParser parser(SYNTAX, SYNTAX_COUNT, ZONES);
+static uint32_t rng = 1;
+
+static uint32_t nextRandom(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+static const CommandParser::Syntax *findSyntax(char code) {
+  for (uint8_t i = 0; i < SYNTAX_COUNT; i++) {
+    if (SYNTAX[i].code == code) {
+      return &SYNTAX[i];
+    }
+  }
+  return NULL;
+}
+
+// Parse a copy of the payload held in a buffer of exactly its length
+static CommandParser::Error parseExact(const uint8_t *data, unsigned int length, Command *commands, uint8_t &count,
+  uint16_t &errorOffset, uint8_t **copy) {
+  *copy = (uint8_t *) malloc(length ? length : 1);
+  memcpy(*copy, data, length);
+  return parser.parse(*copy, length, commands, MAX_COMMANDS, count, errorOffset);
+}
+
+// What every answer of the parser must satisfy
+static bool checkResult(CommandParser::Error error, const uint8_t *payload, unsigned int length,
+  const Command *commands, uint8_t count, uint16_t errorOffset) {
+  if (error != CommandParser::Error::none) {
+    return count == 0 && errorOffset <= length;
+  }
+  if (count == 0 || count > MAX_COMMANDS) {
+    return false;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    const Command &command = commands[i];
+    const CommandParser::Syntax *syntax = findSyntax(command.code);
+    if (!syntax || command.zone >= ZONES || (command.zone && !syntax->zoned)) {
+      return false;
+    }
+    if (command.args < payload || command.args + command.length > payload + length) {
+      return false;
+    }
+    for (uint8_t j = 0; j < command.length; j++) {
+      uint8_t c = command.args[j];
+      if (c == CommandParser::SEPARATOR || c < ' ' || c > '~') {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void setUp(void) {
+  rng = 1;
+}
+
+void tearDown(void) {
+}
+
+void test_valid_batch(void) {
+  const char *payload = "c07:00:004512;z2s10;r24";
+  Command commands[MAX_COMMANDS];
+  uint8_t count;
+  uint16_t errorOffset;
+  CommandParser::Error error = parser.parse((const uint8_t *) payload, strlen(payload), commands, MAX_COMMANDS, count,
+    errorOffset);
+  TEST_ASSERT_TRUE(error == CommandParser::Error::none);
+  TEST_ASSERT_EQUAL_UINT8(3, count);
+  TEST_ASSERT_EQUAL_CHAR('c', commands[0].code);
+  TEST_ASSERT_EQUAL_UINT32(7 * 3600UL, commands[0].timeOfDay(0));
+  TEST_ASSERT_EQUAL_UINT32(45, commands[0].number(8, 2));
+  TEST_ASSERT_EQUAL_UINT32(12, commands[0].number(10, 2));
+  TEST_ASSERT_EQUAL_CHAR('s', commands[1].code);
+  TEST_ASSERT_EQUAL_UINT8(2, commands[1].zone);
+  TEST_ASSERT_EQUAL_UINT32(10, commands[1].number(0));
+  TEST_ASSERT_EQUAL_CHAR('r', commands[2].code);
+  TEST_ASSERT_EQUAL_UINT32(24, commands[2].number(0));
+}
+
+void test_rejects(void) {
+  struct Case {
+    const char *payload;
+    CommandParser::Error error;
+    uint16_t offset;
+  };
+  static const Case CASES[] = {
+    { "c07:00:0045",         CommandParser::Error::badLength,      11 },  // Short, the old fixed indices read past it
+    { "c07:60:004512",       CommandParser::Error::badFormat,      1 },   // Out of range: the whole time
+    { "k",                   CommandParser::Error::unknownCommand, 0 },
+    { "r2;k",                CommandParser::Error::unknownCommand, 3 },
+    { "z9s10",               CommandParser::Error::badZone,        1 },
+    { "z1r24",               CommandParser::Error::badZone,        0 },
+    { "r24;;r1",             CommandParser::Error::empty,          4 },
+    { "r24;sAB",             CommandParser::Error::badFormat,      5 },
+    { "t;t;t;t;t;t;t;t;t",   CommandParser::Error::tooMany,        16 },
+  };
+  for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+    const Case &test = CASES[i];
+    Command commands[MAX_COMMANDS];
+    uint8_t count = 0xFF;
+    uint16_t errorOffset;
+    CommandParser::Error error = parser.parse((const uint8_t *) test.payload, strlen(test.payload), commands,
+      MAX_COMMANDS, count, errorOffset);
+    TEST_ASSERT_TRUE_MESSAGE(error == test.error, test.payload);
+    TEST_ASSERT_EQUAL_MESSAGE(test.offset, errorOffset, test.payload);
+    TEST_ASSERT_EQUAL_MESSAGE(0, count, test.payload);
+  }
+}
+
+// Every prefix of a valid message: the parser must never look past length
+void test_truncated(void) {
+  for (size_t i = 0; i < sizeof(VALID) / sizeof(VALID[0]); i++) {
+    size_t full = strlen(VALID[i]);
+    for (size_t length = 0; length <= full; length++) {
+      Command commands[MAX_COMMANDS];
+      uint8_t count;
+      uint16_t errorOffset;
+      uint8_t *copy;
+      CommandParser::Error error = parseExact((const uint8_t *) VALID[i], length, commands, count, errorOffset, &copy);
+      bool ok = checkResult(error, copy, length, commands, count, errorOffset);
+      free(copy);
+      TEST_ASSERT_TRUE_MESSAGE(ok, VALID[i]);
+    }
+  }
+}
+
+// Random bytes, biased towards the characters the patterns look at
+void test_fuzz_random(void) {
+  static const char ALPHABET[] = "cwsqtruhzk0123456789:;AFfx ";
+  uint8_t payload[300];
+  for (uint32_t round = 0; round < 200000; round++) {
+    unsigned int length = nextRandom() % (round % 10 ? 40 : sizeof(payload));
+    for (unsigned int i = 0; i < length; i++) {
+      uint32_t r = nextRandom();
+      payload[i] = r & 0x100 ? (uint8_t) r : ALPHABET[r % (sizeof(ALPHABET) - 1)];
+    }
+    Command commands[MAX_COMMANDS];
+    uint8_t count;
+    uint16_t errorOffset;
+    uint8_t *copy;
+    CommandParser::Error error = parseExact(payload, length, commands, count, errorOffset, &copy);
+    bool ok = checkResult(error, copy, length, commands, count, errorOffset);
+    free(copy);
+    if (!ok) {
+      char message[64];
+      snprintf(message, sizeof(message), "round %u", (unsigned int) round);
+      TEST_ASSERT_TRUE_MESSAGE(false, message);
+    }
+  }
+}
+
+// Valid messages with a few bytes changed, inserted or removed
+void test_fuzz_mutations(void) {
+  uint8_t payload[64];
+  for (uint32_t round = 0; round < 200000; round++) {
+    const char *valid = VALID[nextRandom() % (sizeof(VALID) / sizeof(VALID[0]))];
+    unsigned int length = strlen(valid);
+    memcpy(payload, valid, length);
+    for (uint8_t edits = 1 + nextRandom() % 3; edits; edits--) {
+      uint32_t r = nextRandom();
+      unsigned int at = length ? r % length : 0;
+      switch ((r >> 16) % 3) {
+        case 0:
+          if (length) {
+            payload[at] = (uint8_t) (r >> 8);
+          }
+          break;
+        case 1:
+          if (length < sizeof(payload)) {
+            memmove(payload + at + 1, payload + at, length - at);
+            payload[at] = "0:;z9"[(r >> 8) % 5];
+            length++;
+          }
+          break;
+        default:
+          if (length) {
+            memmove(payload + at, payload + at + 1, length - at - 1);
+            length--;
+          }
+          break;
+      }
+    }
+    Command commands[MAX_COMMANDS];
+    uint8_t count;
+    uint16_t errorOffset;
+    uint8_t *copy;
+    CommandParser::Error error = parseExact(payload, length, commands, count, errorOffset, &copy);
+    bool ok = checkResult(error, copy, length, commands, count, errorOffset);
+    free(copy);
+    if (!ok) {
+      char message[64];
+      snprintf(message, sizeof(message), "round %u", (unsigned int) round);
+      TEST_ASSERT_TRUE_MESSAGE(false, message);
+    }
+  }
+}
+
+// Messages per second on the host. The floor only catches a gross regression, e.g. a
+// parser that became quadratic in the payload length.
+void test_throughput(void) {
+  const char *payload = "z1w7F0104506:00:0018:30:00;c07:00:004512;z2s10;r24;uCET-1CEST,M3.5.0,M10.5.0/3";
+  unsigned int length = strlen(payload);
+  const uint32_t ROUNDS = 500000;
+  uint32_t accepted = 0;
+  clock_t start = clock();
+  for (uint32_t i = 0; i < ROUNDS; i++) {
+    Command commands[MAX_COMMANDS];
+    uint8_t count;
+    uint16_t errorOffset;
+    if (parser.parse((const uint8_t *) payload, length, commands, MAX_COMMANDS, count, errorOffset) ==
+      CommandParser::Error::none) {
+      accepted += count;
+    }
+  }
+  double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+  double rate = seconds > 0 ? ROUNDS / seconds : 1e12;
+  char message[96];
+  snprintf(message, sizeof(message), "%.0f messages of %u bytes per second", rate, length);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_EQUAL_UINT32(ROUNDS * 5, accepted);
+  TEST_ASSERT_GREATER_THAN(100000, rate);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_valid_batch);
+  RUN_TEST(test_rejects);
+  RUN_TEST(test_truncated);
+  RUN_TEST(test_fuzz_random);
+  RUN_TEST(test_fuzz_mutations);
+  RUN_TEST(test_throughput);
+  return UNITY_END();
+}
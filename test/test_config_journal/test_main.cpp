@@ -0,0 +1,202 @@
+// ConfigJournal on the host: pio test -e test -f test_config_journal
+//
+// Power loss: a sequence of writes, some appending a record and some compacting into the
+// next sector, is replayed with the flash failing after every possible number of written
+// words. After each failure the journal is begun again on the same flash, as at the next
+// boot, and must hold the old or the new value of the field being written, every other
+// field unchanged, and take the next write.
+#include <unity.h>
+#include <ConfigJournal.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint32_t SECTOR_SIZE = 256;   // A compaction every few writes
+static const uint8_t SECTOR_COUNT = 3;
+static const uint8_t FIELDS = 5;
+static const uint16_t WRITES = 60;
+
+static uint8_t memory[SECTOR_SIZE * SECTOR_COUNT];
+static uint8_t committed[sizeof(memory)];     // Flash after the last complete write
+
+// What the journal should hold
+struct Model {
+  uint8_t length[FIELDS];                     // 0 never written
+  uint8_t value[FIELDS][CONFIG_JOURNAL_MAX_LENGTH];
+};
+
+struct Write {
+  uint8_t field;
+  uint8_t length;
+  uint8_t value[CONFIG_JOURNAL_MAX_LENGTH];
+};
+
+// Values of varying length, each different from the previous one of its field
+static Write makeWrite(uint16_t index) {
+  Write write;
+  write.field = index % FIELDS;
+  write.length = 1 + (index * 7) % 24;
+  for (uint8_t i = 0; i < write.length; i++) {
+    write.value[i] = (uint8_t) (index * 31 + i);
+  }
+  return write;
+}
+
+static void apply(Model &model, const Write &write) {
+  model.length[write.field] = write.length;
+  memcpy(model.value[write.field], write.value, write.length);
+}
+
+static bool holds(ConfigJournal &journal, uint8_t field, const Model &model) {
+  uint8_t value[CONFIG_JOURNAL_MAX_LENGTH];
+  size_t length = journal.read(field, value, sizeof(value));
+  return length == model.length[field] && memcmp(value, model.value[field], length) == 0;
+}
+
+static bool holdsAll(ConfigJournal &journal, const Model &model) {
+  for (uint8_t field = 0; field < FIELDS; field++) {
+    if (!holds(journal, field, model)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+void test_empty(void) {
+  RamFlashBackend flash(memory, SECTOR_SIZE, SECTOR_COUNT);
+  ConfigJournal journal(flash);
+  TEST_ASSERT_FALSE(journal.begin());
+  TEST_ASSERT_FALSE(journal.contains(0));
+  uint32_t value = 42;
+  TEST_ASSERT_TRUE(journal.write(0, value));
+  TEST_ASSERT_EQUAL_UINT32(1, journal.getCompactions());   // Formats the first sector
+
+  ConfigJournal rebooted(flash);
+  TEST_ASSERT_TRUE(rebooted.begin());
+  value = 0;
+  TEST_ASSERT_TRUE(rebooted.read(0, value));
+  TEST_ASSERT_EQUAL_UINT32(42, value);
+  // Unchanged values are not appended
+  TEST_ASSERT_TRUE(rebooted.write(0, value));
+  TEST_ASSERT_EQUAL_UINT32(0, rebooted.getAppends());
+}
+
+void test_power_loss(void) {
+  RamFlashBackend flash(memory, SECTOR_SIZE, SECTOR_COUNT);
+  Model model;
+  memset(&model, 0, sizeof(model));
+  memcpy(committed, memory, sizeof(memory));
+  uint32_t interruptedAppends = 0;
+  uint32_t interruptedCompactions = 0;
+  for (uint16_t index = 0; index < WRITES; index++) {
+    Write write = makeWrite(index);
+    Model written = model;
+    apply(written, write);
+    for (int32_t words = 0; ; words++) {
+      char message[64];
+      snprintf(message, sizeof(message), "write %u, power lost after %ld words", index, (long) words);
+      memcpy(memory, committed, sizeof(memory));
+      flash.failAfterWords(-1);
+      ConfigJournal journal(flash);
+      journal.begin();
+      TEST_ASSERT_TRUE_MESSAGE(holdsAll(journal, model), message);
+
+      flash.failAfterWords(words);
+      bool done = journal.write(write.field, write.value, write.length);
+      if (!flash.isPowerLost()) {
+        // Every word of the write went through
+        TEST_ASSERT_TRUE_MESSAGE(done, message);
+        TEST_ASSERT_TRUE_MESSAGE(holdsAll(journal, written), message);
+        if (journal.getCompactions()) {
+          interruptedCompactions += words;
+        } else {
+          interruptedAppends += words;
+        }
+        break;
+      }
+
+      // Next boot
+      flash.failAfterWords(-1);
+      ConfigJournal rebooted(flash);
+      rebooted.begin();
+      bool old = holds(rebooted, write.field, model);
+      TEST_ASSERT_TRUE_MESSAGE(old || holds(rebooted, write.field, written), message);
+      Model recovered = old ? model : written;
+      TEST_ASSERT_TRUE_MESSAGE(holdsAll(rebooted, recovered), message);
+
+      // Still writable, and what it wrote survives the boot after
+      Write next = makeWrite(index + 1);
+      TEST_ASSERT_TRUE_MESSAGE(rebooted.write(next.field, next.value, next.length), message);
+      apply(recovered, next);
+      TEST_ASSERT_TRUE_MESSAGE(holdsAll(rebooted, recovered), message);
+      ConfigJournal again(flash);
+      TEST_ASSERT_TRUE_MESSAGE(again.begin(), message);
+      TEST_ASSERT_TRUE_MESSAGE(holdsAll(again, recovered), message);
+    }
+    memcpy(committed, memory, sizeof(memory));
+    model = written;
+  }
+  // Both paths were cut at every word
+  TEST_ASSERT_GREATER_THAN(0, interruptedAppends);
+  TEST_ASSERT_GREATER_THAN(0, interruptedCompactions);
+  char message[96];
+  snprintf(message, sizeof(message), "Power lost at %lu words of appends and %lu of compactions",
+    (unsigned long) interruptedAppends, (unsigned long) interruptedCompactions);
+  TEST_MESSAGE(message);
+}
+
+// Power lost during the compaction that a torn record forces at the next write
+void test_power_loss_after_torn_record(void) {
+  RamFlashBackend flash(memory, SECTOR_SIZE, SECTOR_COUNT);
+  Model model;
+  memset(&model, 0, sizeof(model));
+  {
+    ConfigJournal journal(flash);
+    for (uint16_t index = 0; index < 3; index++) {
+      Write write = makeWrite(index);
+      TEST_ASSERT_TRUE(journal.write(write.field, write.value, write.length));
+      apply(model, write);
+    }
+    Write torn = makeWrite(3);
+    flash.failAfterWords(2);
+    TEST_ASSERT_FALSE(journal.write(torn.field, torn.value, torn.length));
+  }
+  flash.failAfterWords(-1);
+  memcpy(committed, memory, sizeof(memory));
+  Write write = makeWrite(4);
+  Model written = model;
+  apply(written, write);
+  for (int32_t words = 0; ; words++) {
+    char message[64];
+    snprintf(message, sizeof(message), "power lost after %ld words", (long) words);
+    memcpy(memory, committed, sizeof(memory));
+    flash.failAfterWords(-1);
+    ConfigJournal journal(flash);
+    TEST_ASSERT_TRUE_MESSAGE(journal.begin(), message);
+    TEST_ASSERT_EQUAL_MESSAGE(0, journal.getFreeBytes(), message);   // Torn: the next write compacts
+    flash.failAfterWords(words);
+    bool done = journal.write(write.field, write.value, write.length);
+    if (!flash.isPowerLost()) {
+      TEST_ASSERT_TRUE_MESSAGE(done, message);
+      TEST_ASSERT_EQUAL_UINT32(1, journal.getCompactions());
+      break;
+    }
+    flash.failAfterWords(-1);
+    ConfigJournal rebooted(flash);
+    TEST_ASSERT_TRUE_MESSAGE(rebooted.begin(), message);
+    TEST_ASSERT_TRUE_MESSAGE(holdsAll(rebooted, model), message);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty);
+  RUN_TEST(test_power_loss);
+  RUN_TEST(test_power_loss_after_torn_record);
+  return UNITY_END();
+}
@@ -0,0 +1,236 @@
+// EventScheduler on the host: pio test -e test -f test_event_scheduler
+//
+// Driven by a fake clock. Callbacks append their number to a log, and the order of the
+// log is checked against the deadlines. A random schedule and cancel sequence is
+// compared with a plain sorted list to cover every path of the heap.
+#include <unity.h>
+#include <EventScheduler.h>
+#include <stdio.h>
+#include <string.h>
+
+static time_t fakeNow = 0;
+static uint8_t ran[256];
+static uint16_t ranCount = 0;
+
+static time_t fakeClock(void) {
+  return fakeNow;
+}
+
+template <uint8_t N> static void record(void) {
+  if (ranCount < sizeof(ran)) {
+    ran[ranCount] = N;
+  }
+  ranCount++;
+}
+
+// One callback per event number, so the log tells which event ran
+static const EventScheduler::Callback RECORD[] = {
+  record<0>, record<1>, record<2>, record<3>, record<4>, record<5>, record<6>, record<7>,
+  record<8>, record<9>, record<10>, record<11>, record<12>, record<13>, record<14>, record<15>,
+};
+
+static uint32_t rng = 1;
+
+static uint32_t nextRandom(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+static uint8_t runAll(EventScheduler &scheduler) {
+  uint8_t executed = 0;
+  uint8_t count;
+  while ((count = scheduler.run(EVENT_SCHEDULER_CAPACITY)) != 0) {
+    executed += count;
+  }
+  return executed;
+}
+
+void setUp(void) {
+  fakeNow = 1000;
+  ranCount = 0;
+  rng = 1;
+}
+
+void tearDown(void) {
+}
+
+void test_deadline_order(void) {
+  EventScheduler scheduler(fakeClock);
+  // Equal deadlines run in the order they were scheduled
+  scheduler.at(1030, RECORD[0]);
+  scheduler.at(1010, RECORD[1]);
+  scheduler.at(1020, RECORD[2]);
+  scheduler.at(1010, RECORD[3]);
+  scheduler.in(10, RECORD[4]);
+  scheduler.at(1005, RECORD[5]);
+  TEST_ASSERT_EQUAL_UINT32(1005, scheduler.nextDeadline());
+  TEST_ASSERT_EQUAL_UINT8(0, scheduler.run());   // Nothing due yet
+  fakeNow = 1100;
+  TEST_ASSERT_EQUAL_UINT8(6, runAll(scheduler));
+  static const uint8_t EXPECTED[] = { 5, 1, 3, 4, 2, 0 };
+  TEST_ASSERT_EQUAL_INT(sizeof(EXPECTED), ranCount);
+  TEST_ASSERT_EQUAL_MEMORY(EXPECTED, ran, sizeof(EXPECTED));
+  TEST_ASSERT_EQUAL_UINT8(0, scheduler.size());
+  TEST_ASSERT_EQUAL_UINT32(0, scheduler.nextDeadline());
+}
+
+// Random schedules and cancels against a reference list kept in run order. Cancelling
+// from the middle of the heap needs a sift down or a sift up of the moved element.
+void test_cancel_random(void) {
+  for (uint16_t round = 0; round < 2000; round++) {
+    EventScheduler scheduler(fakeClock);
+    EventScheduler::Handle handles[EVENT_SCHEDULER_CAPACITY];
+    time_t deadlines[EVENT_SCHEDULER_CAPACITY];
+    bool pending[EVENT_SCHEDULER_CAPACITY];
+    fakeNow = 1000;
+    ranCount = 0;
+    for (uint8_t i = 0; i < EVENT_SCHEDULER_CAPACITY; i++) {
+      deadlines[i] = 1000 + nextRandom() % 20;   // Many equal deadlines
+      handles[i] = scheduler.at(deadlines[i], RECORD[i]);
+      pending[i] = true;
+      TEST_ASSERT_TRUE(handles[i] != EventScheduler::NO_EVENT);
+    }
+    // A full queue takes nothing more
+    TEST_ASSERT_TRUE(scheduler.at(1000, RECORD[0]) == EventScheduler::NO_EVENT);
+    for (uint8_t cancels = nextRandom() % EVENT_SCHEDULER_CAPACITY; cancels; cancels--) {
+      uint8_t i = nextRandom() % EVENT_SCHEDULER_CAPACITY;
+      TEST_ASSERT_EQUAL(pending[i], scheduler.cancel(handles[i]));
+      TEST_ASSERT_TRUE(handles[i] == EventScheduler::NO_EVENT);
+      pending[i] = false;
+    }
+    // Expected order: deadline, then scheduling order (the event number)
+    uint8_t expected[EVENT_SCHEDULER_CAPACITY];
+    uint8_t count = 0;
+    for (time_t deadline = 1000; deadline < 1020; deadline++) {
+      for (uint8_t i = 0; i < EVENT_SCHEDULER_CAPACITY; i++) {
+        if (pending[i] && deadlines[i] == deadline) {
+          expected[count++] = i;
+        }
+      }
+    }
+    TEST_ASSERT_EQUAL_UINT8(count, scheduler.size());
+    fakeNow = 1020;
+    TEST_ASSERT_EQUAL_UINT8(count, runAll(scheduler));
+    char message[32];
+    snprintf(message, sizeof(message), "round %u", round);
+    TEST_ASSERT_EQUAL_MESSAGE(count, ranCount, message);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, ran, count, message);
+  }
+}
+
+void test_stale_handle(void) {
+  EventScheduler scheduler(fakeClock);
+  EventScheduler::Handle old = scheduler.in(10, RECORD[0]);
+  EventScheduler::Handle copy = old;
+  TEST_ASSERT_TRUE(scheduler.cancel(copy));
+  // The new event reuses the slot, the old handle must not reach it
+  EventScheduler::Handle reused = scheduler.in(20, RECORD[1]);
+  TEST_ASSERT_EQUAL_UINT8(old & 0xFF, reused & 0xFF);
+  TEST_ASSERT_TRUE(old != reused);
+  TEST_ASSERT_FALSE(scheduler.isPending(old));
+  TEST_ASSERT_EQUAL_UINT32(0, scheduler.getDeadline(old));
+  TEST_ASSERT_FALSE(scheduler.cancel(old));
+  TEST_ASSERT_TRUE(scheduler.isPending(reused));
+  TEST_ASSERT_EQUAL_UINT32(1020, scheduler.getDeadline(reused));
+  // A one-shot that ran leaves its handle stale too
+  fakeNow = 1020;
+  TEST_ASSERT_EQUAL_UINT8(1, scheduler.run());
+  TEST_ASSERT_FALSE(scheduler.isPending(reused));
+  TEST_ASSERT_FALSE(scheduler.cancel(reused));
+}
+
+// The generation of a slot wraps from 0xFF to 1: no handle is ever NO_EVENT, and the
+// handle from before the wrap stays stale
+void test_generation_wrap(void) {
+  EventScheduler scheduler(fakeClock);
+  EventScheduler::Handle first = scheduler.in(10, RECORD[0]);
+  EventScheduler::Handle handle = first;
+  TEST_ASSERT_EQUAL_UINT8(1, handle >> 8);
+  for (uint16_t i = 1; i <= 600; i++) {
+    EventScheduler::Handle cancelled = handle;
+    TEST_ASSERT_TRUE(scheduler.cancel(cancelled));
+    handle = scheduler.in(10, RECORD[0]);
+    TEST_ASSERT_TRUE(handle != EventScheduler::NO_EVENT);
+    TEST_ASSERT_EQUAL_UINT8(0, handle & 0xFF);
+    TEST_ASSERT_EQUAL_UINT8(1 + i % 255, handle >> 8);
+  }
+  TEST_ASSERT_FALSE(scheduler.isPending(first));   // Generation 91 now
+}
+
+static EventScheduler *periodicScheduler;
+static EventScheduler::Handle periodicHandle;
+static uint8_t periodicRuns;
+
+static void periodicCallback(void) {
+  periodicRuns++;
+  if (periodicRuns == 3) {
+    periodicScheduler->cancel(periodicHandle);
+  }
+}
+
+void test_cancel_from_periodic_callback(void) {
+  EventScheduler scheduler(fakeClock);
+  periodicScheduler = &scheduler;
+  periodicRuns = 0;
+  periodicHandle = scheduler.every(10, periodicCallback);
+  scheduler.every(15, RECORD[1]);
+  for (fakeNow = 1000; fakeNow <= 1100; fakeNow++) {
+    scheduler.run();
+  }
+  TEST_ASSERT_EQUAL_UINT8(3, periodicRuns);
+  TEST_ASSERT_TRUE(periodicHandle == EventScheduler::NO_EVENT);
+  TEST_ASSERT_EQUAL_UINT8(1, scheduler.size());   // The other periodic event goes on
+  TEST_ASSERT_EQUAL_INT(6, ranCount);             // 1015 ... 1090
+  TEST_ASSERT_EQUAL_UINT32(1105, scheduler.nextDeadline());
+}
+
+void test_shift(void) {
+  EventScheduler scheduler(fakeClock);
+  EventScheduler::Handle once = scheduler.at(1100, RECORD[0]);
+  EventScheduler::Handle periodic = scheduler.every(60, RECORD[1]);
+  scheduler.shift(50);
+  TEST_ASSERT_EQUAL_UINT32(1150, scheduler.getDeadline(once));
+  TEST_ASSERT_EQUAL_UINT32(1110, scheduler.getDeadline(periodic));
+  scheduler.shift(-30);
+  TEST_ASSERT_EQUAL_UINT32(1120, scheduler.getDeadline(once));
+  TEST_ASSERT_EQUAL_UINT32(1080, scheduler.getDeadline(periodic));
+  TEST_ASSERT_EQUAL_UINT32(1080, scheduler.nextDeadline());
+  // The periodic event keeps its pace from the shifted deadline
+  fakeNow = 1080;
+  TEST_ASSERT_EQUAL_UINT8(1, scheduler.run());
+  TEST_ASSERT_EQUAL_UINT32(1140, scheduler.getDeadline(periodic));
+}
+
+// After a stall, run() takes at most maxEvents per call, and a periodic event runs once
+// and resumes from now instead of firing every missed interval
+void test_run_catch_up(void) {
+  EventScheduler scheduler(fakeClock);
+  EventScheduler::Handle periodic = scheduler.every(10, RECORD[0]);
+  for (uint8_t i = 1; i <= 9; i++) {
+    scheduler.at(1000 + i, RECORD[i]);
+  }
+  fakeNow = 2000;
+  TEST_ASSERT_EQUAL_UINT8(4, scheduler.run(4));
+  TEST_ASSERT_EQUAL_UINT8(4, scheduler.run(4));
+  TEST_ASSERT_EQUAL_UINT8(2, scheduler.run(4));
+  TEST_ASSERT_EQUAL_UINT8(0, scheduler.run(4));
+  static const uint8_t EXPECTED[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 0 };
+  TEST_ASSERT_EQUAL_INT(sizeof(EXPECTED), ranCount);
+  TEST_ASSERT_EQUAL_MEMORY(EXPECTED, ran, sizeof(EXPECTED));
+  TEST_ASSERT_EQUAL_UINT32(2010, scheduler.getDeadline(periodic));
+  TEST_ASSERT_EQUAL_UINT8(1, scheduler.size());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_deadline_order);
+  RUN_TEST(test_cancel_random);
+  RUN_TEST(test_stale_handle);
+  RUN_TEST(test_generation_wrap);
+  RUN_TEST(test_cancel_from_periodic_callback);
+  RUN_TEST(test_shift);
+  RUN_TEST(test_run_catch_up);
+  return UNITY_END();
+}
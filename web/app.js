@@ -0,0 +1,80 @@
+// Status page of the controller. Reads the JSON API every few seconds and sends the
+// buttons as command payloads, the same ones the MQTT request topic takes.
+"use strict";
+
+const REFRESH_MS = 5000;
+
+function $(id) { return document.getElementById(id); }
+
+function time(epoch) {
+  return epoch ? new Date(epoch * 1000).toLocaleString() : "-";
+}
+
+function list(element, rows) {
+  element.replaceChildren(...rows.flatMap(([name, value]) => {
+    const dt = document.createElement("dt");
+    const dd = document.createElement("dd");
+    dt.textContent = name;
+    dd.textContent = value;
+    return [dt, dd];
+  }));
+}
+
+async function get(path) {
+  const response = await fetch(path);
+  if (!response.ok) throw new Error(path + ": " + response.status);
+  return response.json();
+}
+
+async function command(payload) {
+  const response = await fetch("/api/command", { method: "POST", body: payload });
+  $("reply").textContent = response.ok ? "" : await response.text();
+  refresh();
+}
+
+function zoneRow(zone, liters) {
+  const row = document.createElement("tr");
+  const cells = [zone.zone, zone.state, zone.weekdays.toString(16) + " every " + zone.every,
+    zone.starts.join(" "), zone.minutes, zone.liters || "-", liters];
+  for (const text of cells) {
+    const cell = document.createElement("td");
+    cell.textContent = text;
+    row.appendChild(cell);
+  }
+  row.cells[1].className = zone.state;
+  if (zone.state == "running") row.cells[1].textContent += " until " + new Date(zone.until * 1000).toLocaleTimeString();
+  const button = document.createElement("button");
+  const running = zone.state == "running";
+  button.textContent = running ? "Stop" : "Start";
+  button.onclick = () => command("z" + zone.zone + (running ? "t" : "s" + (zone.minutes || 10)));
+  row.appendChild(document.createElement("td")).appendChild(button);
+  return row;
+}
+
+async function refresh() {
+  try {
+    const [state, schedule, history, metrics] = await Promise.all([get("/api/state"), get("/api/schedule"),
+      get("/api/history"), get("/api/metrics")]);
+    list($("state"), [["Mode", state.mode], ["Next", time(state.next)], ["Rain delay until", time(state.rainDelay)],
+      ["Alarm", state.alarm], ["Faults", state.faults.toString(16)]]);
+    $("zones").replaceChildren(...schedule.zones.map(zone => zoneRow(zone, state.liters[zone.zone])));
+    list($("history"), [["Liters", history.liters], ["Minutes with flow", history.minutes],
+      ["Liters per minute", history.min + " - " + history.max], ["Drips", history.drips]]);
+    const rows = [["Up", Math.round(metrics.uptime / 3600) + " h"], ["Clock", metrics.clock],
+      ["MQTT", metrics.mqtt ? "connected in " + metrics.connectMs + " ms" : "down"], ["Loop", metrics.passesPerSecond +
+      " passes/s, longest " + metrics.stallMicros + " us (" + metrics.stallStage + ")"], ["Heap", metrics.heap +
+      " free, " + metrics.fragmentation + "% fragmented"]];
+    const tls = metrics.tls;
+    if (tls) rows.push(["TLS", tls.full + " full (last " + tls.fullMs + " ms), " + tls.resumed + " resumed (last " +
+      tls.resumedMs + " ms), " + tls.heap + " bytes held"]);
+    list($("metrics"), rows);
+  } catch (error) {
+    $("reply").textContent = error.message;
+  }
+}
+
+for (const button of document.querySelectorAll("button[data-command]")) {
+  button.onclick = () => command(button.dataset.command);
+}
+refresh();
+setInterval(refresh, REFRESH_MS);